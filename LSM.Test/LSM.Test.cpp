@@ -6,10 +6,13 @@
 
 #include <Windows.h>
 #include <string>       // std::string
+#include <cstdio>       // fopen
 #include <iostream>     // std::cout
 #include <sstream>      // std::stringstream
 #include <iomanip>
 #include <thread>
+#include <vector>       // std::vector
+#include <atomic>       // std::atomic
 
 using namespace std;
 
@@ -105,11 +108,1793 @@ void readerThread(lsm_db *db, int id) {
   }
 }
 
+/*
+** Helpers used by the regression tests below.
+*/
+static bool testResult(const char *zTest, bool bOk) {
+  cout << zTest << (bOk ? " ok" : " FAILED") << endl;
+  return bOk;
+}
+
+static void deleteDb(const char *zDb) {
+  const char *azExt[] = { "", "-log", "-shm", "-vlog", "-tree" };
+  for (int i = 0; i < 5; i++) {
+    remove((string(zDb) + azExt[i]).c_str());
+  }
+}
+
+static void copyFile(const string &zFrom, const string &zTo) {
+  FILE *pFrom = fopen(zFrom.c_str(), "rb");
+  FILE *pTo = (pFrom ? fopen(zTo.c_str(), "wb") : 0);
+  if (pTo) {
+    char aBuf[4096];
+    size_t n;
+    while ((n = fread(aBuf, 1, sizeof(aBuf), pFrom)) > 0) {
+      fwrite(aBuf, 1, n, pTo);
+    }
+    fclose(pTo);
+  }
+  if (pFrom) fclose(pFrom);
+}
+
+/*
+** Copy the database, log and value log files of open database zFrom to
+** zTo. Database zTo is then in the state zFrom would be in if the process
+** crashed at this point.
+*/
+static void crashCopyDb(const char *zFrom, const char *zTo) {
+  deleteDb(zTo);
+  copyFile(string(zFrom), string(zTo));
+  copyFile(string(zFrom) + "-log", string(zTo) + "-log");
+  copyFile(string(zFrom) + "-vlog", string(zTo) + "-vlog");
+}
+
+/*
+** Open database zDb. Before it is opened, each (LSM_CONFIG_*, value) pair
+** in array aConfig[], which is terminated by a 0, is passed to lsm_config().
+*/
+static lsm_db *openDb(
+  const char *zDb, const int *aConfig = 0, lsm_env *pEnv = 0
+) {
+  lsm_db *db = 0;
+  if (lsm_new(pEnv, &db) != LSM_OK) {
+    return 0;
+  }
+  for (int i = 0; aConfig && aConfig[i]; i += 2) {
+    int iVal = aConfig[i + 1];
+    lsm_config(db, aConfig[i], &iVal);
+  }
+  if (lsm_open(db, zDb) != LSM_OK) {
+    lsm_close(db);
+    return 0;
+  }
+  return db;
+}
+
+static int insertKey(lsm_db *db, const string &sKey, const string &sVal) {
+  return lsm_insert(db, sKey.c_str(), sKey.length(), sVal.c_str(), sVal.length());
+}
+
+/* Return true if the database contains key sKey with value sVal. */
+static bool hasKey(lsm_db *db, const string &sKey, const string &sVal) {
+  lsm_cursor *csr;
+  bool bFound = false;
+  if (lsm_csr_open(db, &csr) != LSM_OK) {
+    return false;
+  }
+  if (lsm_csr_seek(csr, sKey.c_str(), sKey.length(), LSM_SEEK_EQ) == LSM_OK
+   && lsm_csr_valid(csr)
+  ) {
+    const void *pVal;
+    int nVal;
+    bFound = (lsm_csr_value(csr, &pVal, &nVal) == LSM_OK
+      && nVal == (int)sVal.length()
+      && (nVal == 0 || (pVal && memcmp(pVal, sVal.c_str(), nVal) == 0))
+    );
+  }
+  lsm_csr_close(csr);
+  return bFound;
+}
+
+/*
+** An lsm_env that wraps the default environment. It counts the number of
+** times a log file is synced and the number of bytes released by xPunch().
+** And, if bMoveMaps is set, it moves the mapping of a database file each 
+** time it is extended.
+*/
+struct TestFile {
+  lsm_file *pReal;                /* File opened by the default env */
+  bool bLog;                      /* True if this is a log file */
+  string sName;                   /* Name the file was opened with */
+  int flags;                      /* Flags the file was opened with */
+  lsm_file *pAlt;                 /* Second handle used if bMoveMaps */
+  bool bAltMap;                   /* True if pAlt holds the mapping */
+};
+
+static lsm_env testEnv;
+static atomic<int> nLogSync(0);
+static atomic<lsm_i64> nPunch(0);
+static bool bMoveMaps = false;
+
+static lsm_file *realFile(lsm_file *pFile) {
+  return ((TestFile *)pFile)->pReal;
+}
+
+static int testFullpath(lsm_env *pEnv, const char *zFile, char *zOut, int *pnOut) {
+  return lsm_default_env()->xFullpath(lsm_default_env(), zFile, zOut, pnOut);
+}
+
+static int testOpen(lsm_env *pEnv, const char *zFile, int flags, lsm_file **ppFile) {
+  lsm_env *pReal = lsm_default_env();
+  TestFile *p = new TestFile();
+  int rc = pReal->xOpen(pReal, zFile, flags, &p->pReal);
+  if (rc != LSM_OK) {
+    delete p;
+    p = 0;
+  } else {
+    size_t nFile = strlen(zFile);
+    p->bLog = (nFile > 4 && strcmp(&zFile[nFile - 4], "-log") == 0);
+    p->sName = zFile;
+    p->flags = flags;
+  }
+  *ppFile = (lsm_file *)p;
+  return rc;
+}
+
+static int testRead(lsm_file *pFile, lsm_i64 iOff, void *pData, int nData) {
+  return lsm_default_env()->xRead(realFile(pFile), iOff, pData, nData);
+}
+
+static int testWrite(lsm_file *pFile, lsm_i64 iOff, void *pData, int nData) {
+  return lsm_default_env()->xWrite(realFile(pFile), iOff, pData, nData);
+}
+
+static int testTruncate(lsm_file *pFile, lsm_i64 nSize) {
+  return lsm_default_env()->xTruncate(realFile(pFile), nSize);
+}
+
+static int testPunch(lsm_file *pFile, lsm_i64 iOff, lsm_i64 nByte) {
+  nPunch += nByte;
+  return lsm_default_env()->xPunch(realFile(pFile), iOff, nByte);
+}
+
+static int testSync(lsm_file *pFile) {
+  if (((TestFile *)pFile)->bLog) nLogSync++;
+  return lsm_default_env()->xSync(realFile(pFile));
+}
+
+static int testSectorSize(lsm_file *pFile) {
+  return lsm_default_env()->xSectorSize(realFile(pFile));
+}
+
+/*
+** If bMoveMaps is set, the file is mapped using the other of its two 
+** handles each time the mapping is extended, so that the mapping always
+** moves. And only iMin bytes are reported as mapped, so that the mapping
+** is extended each time a page beyond it is read.
+*/
+static int testRemap(lsm_file *pFile, lsm_i64 iMin, void **ppOut, lsm_i64 *pnOut) {
+  TestFile *p = (TestFile *)pFile;
+  lsm_env *pReal = lsm_default_env();
+  lsm_file *pOld = (p->bAltMap ? p->pAlt : p->pReal);
+  int rc;
+
+  if (bMoveMaps == false || iMin < 0) {
+    return pReal->xRemap(pOld, iMin, ppOut, pnOut);
+  }
+  if (p->pAlt == 0) {
+    rc = pReal->xOpen(pReal, p->sName.c_str(), p->flags, &p->pAlt);
+    if (rc != LSM_OK) return rc;
+  }
+
+  rc = pReal->xRemap((p->bAltMap ? p->pReal : p->pAlt), iMin, ppOut, pnOut);
+  if (rc == LSM_OK) {
+    void *pDummy;
+    lsm_i64 nDummy;
+    pReal->xRemap(pOld, -1, &pDummy, &nDummy);
+    p->bAltMap = !p->bAltMap;
+    if (*pnOut > iMin) *pnOut = iMin;
+  }
+  return rc;
+}
+
+static int testFileid(lsm_file *pFile, void *pBuf, int *pnBuf) {
+  return lsm_default_env()->xFileid(realFile(pFile), pBuf, pnBuf);
+}
+
+static int testClose(lsm_file *pFile) {
+  TestFile *p = (TestFile *)pFile;
+  int rc = lsm_default_env()->xClose(p->pReal);
+  if (p->pAlt) lsm_default_env()->xClose(p->pAlt);
+  delete p;
+  return rc;
+}
+
+static int testUnlink(lsm_env *pEnv, const char *zFile) {
+  return lsm_default_env()->xUnlink(lsm_default_env(), zFile);
+}
+
+static int testLock(lsm_file *pFile, int iLock, int eType) {
+  return lsm_default_env()->xLock(realFile(pFile), iLock, eType);
+}
+
+static int testTestLock(lsm_file *pFile, int iLock, int nLock, int eType) {
+  return lsm_default_env()->xTestLock(realFile(pFile), iLock, nLock, eType);
+}
+
+static int testShmMap(lsm_file *pFile, int iChunk, int sz, void **ppShm) {
+  return lsm_default_env()->xShmMap(realFile(pFile), iChunk, sz, ppShm);
+}
+
+static int testShmUnmap(lsm_file *pFile, int bDelete) {
+  return lsm_default_env()->xShmUnmap(realFile(pFile), bDelete);
+}
+
+static lsm_env *getTestEnv() {
+  if (testEnv.xOpen == 0) {
+    memcpy(&testEnv, lsm_default_env(), sizeof(lsm_env));
+    testEnv.xFullpath = testFullpath;
+    testEnv.xOpen = testOpen;
+    testEnv.xRead = testRead;
+    testEnv.xWrite = testWrite;
+    testEnv.xTruncate = testTruncate;
+    testEnv.xSync = testSync;
+    testEnv.xSectorSize = testSectorSize;
+    testEnv.xRemap = testRemap;
+    testEnv.xFileid = testFileid;
+    testEnv.xClose = testClose;
+    testEnv.xUnlink = testUnlink;
+    testEnv.xLock = testLock;
+    testEnv.xTestLock = testTestLock;
+    testEnv.xShmMap = testShmMap;
+    testEnv.xShmUnmap = testShmUnmap;
+    testEnv.xPunch = testPunch;
+  }
+  return &testEnv;
+}
+
+/*
+** Write a batch of inserts, deletes and a range-delete. All of the batch
+** must be applied, or, if the transaction it is written in is rolled back,
+** none of it. And a committed batch must survive a crash.
+*/
+static bool testBatch() {
+  const char *zDb = "test-batch.lsmdb";
+  const char *zCopy = "test-batch-copy.lsmdb";
+  lsm_batch *pBatch = 0;
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb);
+  if (db && lsm_batch_new(db, &pBatch) == LSM_OK) {
+    for (int i = 0; i < 10; i++) {
+      insertKey(db, "old:" + to_string(i), "old");
+    }
+
+    for (int i = 0; i < 100; i++) {
+      string sKey = "key:" + to_string(100 + i);
+      lsm_batch_insert(pBatch, sKey.c_str(), sKey.length(), "value", 5);
+    }
+    lsm_batch_delete(pBatch, "old:0", 5);
+    lsm_batch_delete_range(pBatch, "old:2", 5, "old:6", 5);
+    lsm_batch_insert(pBatch, "old:4", 5, "new", 3);
+
+    /* Write the batch in a transaction that is rolled back. */
+    lsm_begin(db, 1);
+    bOk = (lsm_batch_write(db, pBatch) == LSM_OK) 
+      && hasKey(db, "key:100", "value");
+    lsm_rollback(db, 0);
+    bOk = bOk && !hasKey(db, "key:100", "value") && hasKey(db, "old:0", "old");
+
+    /* Write it again in its own transaction. */
+    bOk = bOk && lsm_batch_write(db, pBatch) == LSM_OK;
+    crashCopyDb(zDb, zCopy);
+    lsm_close(db);
+
+    /* An empty batch is a no-op. */
+    lsm_batch_reset(pBatch);
+    db = openDb(zCopy);
+    bOk = bOk && db && lsm_batch_write(db, pBatch) == LSM_OK;
+    for (int i = 0; bOk && i < 100; i++) {
+      bOk = hasKey(db, "key:" + to_string(100 + i), "value");
+    }
+    for (int i = 0; bOk && i < 10; i++) {
+      bool bDeleted = (i == 0 || i == 3 || i == 5);
+      if (i == 4) {
+        bOk = hasKey(db, "old:4", "new");
+      } else {
+        bOk = (hasKey(db, "old:" + to_string(i), "old") != bDeleted);
+      }
+    }
+    if (db) lsm_close(db);
+  }
+  lsm_batch_close(pBatch);
+  deleteDb(zDb);
+  deleteDb(zCopy);
+  return testResult("batch", bOk);
+}
+
+/*
+** xNext callback for lsm_bulk_load(). Returns the keys in a vector of
+** strings, each with a value that is a copy of the key.
+*/
+struct BulkSource {
+  vector<string> aKey;            /* Keys to load, in order */
+  size_t iNext;                   /* Index of next key to return */
+};
+
+static int bulkNext(void *pCtx, 
+  const void **ppKey, int *pnKey, const void **ppVal, int *pnVal
+) {
+  BulkSource *p = (BulkSource *)pCtx;
+  if (p->iNext < p->aKey.size()) {
+    const string &sKey = p->aKey[p->iNext++];
+    *ppKey = *ppVal = sKey.c_str();
+    *pnKey = *pnVal = sKey.length();
+  } else {
+    *ppKey = 0;
+  }
+  return LSM_OK;
+}
+
+/* Return the number of entries in the database. */
+static int countKeys(lsm_db *db) {
+  lsm_cursor *csr;
+  int nKey = 0;
+  if (lsm_csr_open(db, &csr) == LSM_OK) {
+    for (lsm_csr_first(csr); lsm_csr_valid(csr); lsm_csr_next(csr)) {
+      nKey++;
+    }
+    lsm_csr_close(csr);
+  }
+  return nKey;
+}
+
+/*
+** Bulk load sorted keys into an empty database. Loading keys that are out
+** of order, or loading into a database that is not empty, is an error
+** that leaves the database unchanged.
+*/
+static bool testBulkLoad() {
+  const char *zDb = "test-bulk.lsmdb";
+  const int nKey = 5000;
+  BulkSource src;
+  bool bOk = false;
+
+  for (int i = 0; i < nKey; i++) {
+    src.aKey.push_back("key:" + to_string(100000 + i));
+  }
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb);
+  if (db) {
+    /* Keys out of order. */
+    BulkSource bad;
+    bad.aKey.push_back("b");
+    bad.aKey.push_back("a");
+    bad.iNext = 0;
+    bOk = lsm_bulk_load(db, bulkNext, &bad) == LSM_MISUSE
+      && countKeys(db) == 0;
+
+    src.iNext = 0;
+    bOk = bOk && lsm_bulk_load(db, bulkNext, &src) == LSM_OK;
+
+    /* The database is no longer empty. */
+    src.iNext = 0;
+    bOk = bOk && lsm_bulk_load(db, bulkNext, &src) == LSM_MISUSE;
+    lsm_close(db);
+  }
+
+  db = openDb(zDb);
+  bOk = bOk && db && countKeys(db) == nKey;
+  for (int i = 0; bOk && i < nKey; i++) {
+    bOk = hasKey(db, src.aKey[i], src.aKey[i]);
+  }
+  if (db) lsm_close(db);
+  deleteDb(zDb);
+  return testResult("bulk-load", bOk);
+}
+
+/* Return the number of levels in the database. */
+static int countLevels(lsm_db *db) {
+  char *zStruct = 0;
+  int nLevel = 0;
+  if (lsm_info(db, LSM_INFO_DB_STRUCTURE, &zStruct) == LSM_OK && zStruct) {
+    for (char *z = zStruct; *z; z++) {
+      if (*z == '{') nLevel++;
+    }
+    lsm_free(lsm_get_env(db), zStruct);
+  }
+  return nLevel;
+}
+
+/*
+** Write enough data with background workers running that in-memory trees
+** must be flushed to disk. The workers flush them, and no data is lost.
+*/
+static bool testBackgroundWorkers() {
+  const char *zDb = "test-bgwork.lsmdb";
+  const int nKey = 20000;
+  const int aConfig[] = { 
+    LSM_CONFIG_BACKGROUND_WORKERS, 2, LSM_CONFIG_AUTOFLUSH, 64, 0 
+  };
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb, aConfig);
+  if (db) {
+    int nWorker = -1;
+    lsm_config(db, LSM_CONFIG_BACKGROUND_WORKERS, &nWorker);
+    bOk = (nWorker == 2);
+    for (int i = 0; bOk && i < nKey; i++) {
+      string sKey = "key:" + to_string(i);
+      bOk = insertKey(db, sKey, sKey + string(100, 'v')) == LSM_OK;
+    }
+
+    /* Wait for the workers to flush at least one tree to disk. */
+    for (int i = 0; bOk && i < 500 && countLevels(db) == 0; i++) {
+      Sleep(10);
+    }
+    bOk = bOk && countLevels(db) > 0;
+    for (int i = 0; bOk && i < nKey; i++) {
+      string sKey = "key:" + to_string(i);
+      bOk = hasKey(db, sKey, sKey + string(100, 'v'));
+    }
+    lsm_close(db);
+  }
+  deleteDb(zDb);
+  return testResult("background-workers", bOk);
+}
+
+/* Return the keys in the database, in the order a cursor visits them. */
+static vector<string> scanKeys(lsm_db *db, bool bReverse = false) {
+  vector<string> aKey;
+  lsm_cursor *csr;
+  if (lsm_csr_open(db, &csr) == LSM_OK) {
+    for (bReverse ? lsm_csr_last(csr) : lsm_csr_first(csr);
+         lsm_csr_valid(csr);
+         bReverse ? lsm_csr_prev(csr) : lsm_csr_next(csr)
+    ) {
+      const void *pKey;
+      int nKey;
+      lsm_csr_key(csr, &pKey, &nKey);
+      aKey.push_back(string((const char *)pKey, nKey));
+    }
+    lsm_csr_close(csr);
+  }
+  return aKey;
+}
+
+/*
+** Write to a database that stores its in-memory tree as a skiplist.
+** Inserts, deletes, range-deletes and rolled back writes must all be
+** visible (or not) in the right order, before and after the tree is
+** flushed, and after a tree is recovered from the log.
+*/
+static bool testSkiplist() {
+  const char *zDb = "test-skiplist.lsmdb";
+  const char *zCopy = "test-skiplist-copy.lsmdb";
+  const int nKey = 1000;
+  const int aConfig[] = {
+    LSM_CONFIG_MULTIPLE_PROCESSES, 0, LSM_CONFIG_SKIPLIST, 1, 0
+  };
+  vector<string> aExpect;
+  bool bOk = false;
+
+  /* Keys 0..nKey-1, less those that are multiples of 10 and those in the
+  ** range (500, 600). In the order that the database sorts them.  */
+  for (int i = 0; i < nKey; i++) {
+    if (i % 10 != 0 && (i <= 500 || i >= 600)) {
+      aExpect.push_back("key:" + to_string(10000 + i));
+    }
+  }
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb, aConfig);
+  if (db) {
+    int bSkiplist = 0;
+    lsm_config(db, LSM_CONFIG_SKIPLIST, &bSkiplist);
+    bOk = (bSkiplist == 1);
+
+    /* Insert the keys in a scrambled order. */
+    for (int i = 0; bOk && i < nKey; i++) {
+      string sKey = "key:" + to_string(10000 + (i * 7919) % nKey);
+      bOk = insertKey(db, sKey, "v") == LSM_OK;
+    }
+    for (int i = 0; bOk && i < nKey; i += 10) {
+      string sKey = "key:" + to_string(10000 + i);
+      bOk = lsm_delete(db, sKey.c_str(), sKey.length()) == LSM_OK;
+    }
+
+    /* lsm_delete_range() does not write to the log, so use a batch. */
+    lsm_batch *pBatch = 0;
+    bOk = bOk && lsm_batch_new(db, &pBatch) == LSM_OK;
+    if (pBatch) {
+      lsm_batch_delete_range(pBatch, "key:10500", 9, "key:10600", 9);
+      bOk = bOk && lsm_batch_write(db, pBatch) == LSM_OK;
+    }
+    lsm_batch_close(pBatch);
+    bOk = bOk && scanKeys(db) == aExpect;
+    bOk = bOk && lsm_flush(db) == LSM_OK && scanKeys(db) == aExpect;
+
+    /* A nested transaction that is partly rolled back. */
+    lsm_begin(db, 1);
+    insertKey(db, "key:10550", "v");
+    lsm_begin(db, 2);
+    lsm_delete(db, "key:10001", 9);
+    insertKey(db, "key:99999", "v");
+    lsm_rollback(db, 2);
+    lsm_commit(db, 0);
+    aExpect.insert(aExpect.begin() + 450, "key:10550");
+
+    vector<string> aReverse(aExpect.rbegin(), aExpect.rend());
+    bOk = bOk && scanKeys(db) == aExpect && scanKeys(db, true) == aReverse;
+    crashCopyDb(zDb, zCopy);
+    lsm_close(db);
+  }
+
+  /* Open the copy, recovering its in-memory tree from the log. */
+  if (bOk) {
+    db = openDb(zCopy, aConfig);
+    bOk = db && scanKeys(db) == aExpect;
+    if (db) lsm_close(db);
+  }
+  deleteDb(zDb);
+  deleteDb(zCopy);
+  return testResult("skiplist", bOk);
+}
+
+/* Return the size of file zFile in bytes, or -1 if it does not exist. */
+static long fileSize(const string &zFile) {
+  long nByte = -1;
+  FILE *pFile = fopen(zFile.c_str(), "rb");
+  if (pFile) {
+    fseek(pFile, 0, SEEK_END);
+    nByte = ftell(pFile);
+    fclose(pFile);
+  }
+  return nByte;
+}
+
+/*
+** Write keys in a random order, each in its own transaction, to an
+** in-memory tree large enough to hold them all. Every key must be found.
+** And, since each write copies tree nodes, check that the tree uses no
+** more than nMaxPerKey bytes of shared memory for each one. 
+*/
+static bool testTreeMemory() {
+  const char *zDb = "test-treemem.lsmdb";
+  const int nKey = 20000;
+  const int nMaxPerKey = 240;
+  const int aConfig[] = { LSM_CONFIG_AUTOFLUSH, 64 * 1024, 0 };
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb, aConfig);
+  if (db) {
+    int nOld = 0, nNew = 0;
+    bOk = true;
+    for (int i = 0; bOk && i < nKey; i++) {
+      string sKey = "key:" + to_string(100000 + (i * 7919) % nKey);
+      bOk = insertKey(db, sKey, string(32, 'v')) == LSM_OK;
+    }
+    bOk = bOk && lsm_info(db, LSM_INFO_TREE_SIZE, &nOld, &nNew) == LSM_OK;
+    bOk = bOk && nOld == 0 && nNew > 0 && nNew * 1024 / nKey <= nMaxPerKey;
+    for (int i = 0; bOk && i < nKey; i++) {
+      bOk = hasKey(db, "key:" + to_string(100000 + i), string(32, 'v'));
+    }
+    lsm_close(db);
+  }
+  deleteDb(zDb);
+  return testResult("tree-memory", bOk);
+}
+
+/*
+** Store large values in the value log. They must be readable from the
+** in-memory tree, once flushed to disk and after a crash. Merging the
+** overwritten values must count them as dead.
+*/
+static bool testValueLog() {
+  const char *zDb = "test-vlog.lsmdb";
+  const char *zCopy = "test-vlog-copy.lsmdb";
+  const int nKey = 50;
+  int nValueLog = 1024;
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb);
+  if (db) {
+    lsm_i64 nVlog = 0, nDead = 0;
+    lsm_config(db, LSM_CONFIG_VALUE_LOG, &nValueLog);
+
+    /* Even keys have large values, odd keys small values. */
+    for (int i = 0; i < nKey; i++) {
+      string sKey = "key:" + to_string(100 + i);
+      insertKey(db, sKey, string(i % 2 ? 100 : 8000, 'a' + i % 26));
+    }
+    lsm_info(db, LSM_INFO_VALUE_LOG, &nVlog, &nDead);
+    bOk = (nVlog == (nKey / 2) * 8000 && nDead == 0);
+    bOk = bOk && fileSize(string(zDb) + "-vlog") >= nVlog;
+
+    for (int i = 0; bOk && i < nKey; i++) {
+      string sKey = "key:" + to_string(100 + i);
+      bOk = hasKey(db, sKey, string(i % 2 ? 100 : 8000, 'a' + i % 26));
+    }
+
+    /* Flush the tree, then overwrite half of the large values and merge 
+    ** the result with the flushed tree.  */
+    bOk = bOk && lsm_flush(db) == LSM_OK;
+    for (int i = 0; i < nKey; i += 4) {
+      string sKey = "key:" + to_string(100 + i);
+      insertKey(db, sKey, string(8000, 'A' + i % 26));
+    }
+    bOk = bOk && lsm_flush(db) == LSM_OK 
+      && lsm_work(db, 2, 1000000, 0) == LSM_OK;
+    lsm_info(db, LSM_INFO_VALUE_LOG, &nVlog, &nDead);
+    bOk = bOk && nDead == ((nKey + 3) / 4) * 8000;
+
+    crashCopyDb(zDb, zCopy);
+    lsm_close(db);
+  }
+
+  db = openDb(zCopy);
+  bOk = bOk && db;
+  for (int i = 0; bOk && i < nKey; i++) {
+    string sKey = "key:" + to_string(100 + i);
+    char c = (i % 4 == 0 ? 'A' : 'a') + i % 26;
+    bOk = hasKey(db, sKey, string(i % 2 ? 100 : 8000, c));
+  }
+  if (db) lsm_close(db);
+  deleteDb(zDb);
+  deleteDb(zCopy);
+  return testResult("value-log", bOk);
+}
+
+/*
+** Return true if the value the cursor points to is sVal, according to
+** both lsm_csr_value_size() and lsm_csr_value_iov().
+*/
+static bool csrValueIs(lsm_cursor *csr, const string &sVal) {
+  const lsm_iovec *aIov;
+  int nIov;
+  int nVal;
+  string sIov;
+
+  if (lsm_csr_value_size(csr, &nVal) != LSM_OK || nVal != (int)sVal.length()
+   || lsm_csr_value_iov(csr, &aIov, &nIov) != LSM_OK
+  ) {
+    return false;
+  }
+  for (int i = 0; i < nIov; i++) {
+    sIov.append((const char *)aIov[i].pData, aIov[i].nData);
+  }
+  return sIov == sVal;
+}
+
+/*
+** Read values using lsm_csr_value_size() and lsm_csr_value_iov(), both
+** from the in-memory tree and, once flushed, from values that span
+** several database pages.
+*/
+static bool testValueIov() {
+  const char *zDb = "test-iov.lsmdb";
+  const int nKey = 20;
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb);
+  for (int iPass = 0; db && iPass < 2; iPass++) {
+    lsm_cursor *csr;
+    if (iPass == 0) {
+      for (int i = 0; i < nKey; i++) {
+        insertKey(db, "key:" + to_string(100 + i), string(i * 1000, 'a' + i));
+      }
+    } else {
+      lsm_flush(db);
+    }
+
+    bOk = (lsm_csr_open(db, &csr) == LSM_OK);
+    if (bOk) {
+      int i = 0;
+      for (lsm_csr_first(csr); bOk && lsm_csr_valid(csr); lsm_csr_next(csr)) {
+        bOk = csrValueIs(csr, string(i * 1000, 'a' + i));
+        i++;
+      }
+      bOk = bOk && i == nKey;
+      lsm_csr_close(csr);
+    }
+    if (bOk == false) break;
+  }
+  if (db) lsm_close(db);
+  deleteDb(zDb);
+  return testResult("value-iov", bOk);
+}
+
+/*
+** Write a large value in chunks using a blob writer and read it back in
+** pieces using lsm_csr_value_read(). A blob writer that is closed without
+** committing writes nothing, and only one may be open at a time.
+*/
+static bool testBlob() {
+  const char *zDb = "test-blob.lsmdb";
+  const int nChunk = 1000;
+  const int nBlob = 200 * nChunk;
+  string sBlob;
+  bool bOk = false;
+
+  for (int i = 0; i < nBlob; i++) {
+    sBlob.push_back('a' + (i * 7) % 26);
+  }
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb);
+  if (db) {
+    lsm_blob *pBlob = 0;
+    lsm_blob *pBlob2 = 0;
+    bOk = lsm_blob_open(db, "blob", 4, &pBlob) == LSM_OK
+      && lsm_blob_open(db, "blob2", 5, &pBlob2) == LSM_MISUSE;
+    for (int i = 0; bOk && i < nBlob; i += nChunk) {
+      bOk = lsm_blob_write(pBlob, &sBlob[i], nChunk) == LSM_OK;
+    }
+    bOk = (lsm_blob_close(pBlob, 1) == LSM_OK) && bOk;
+
+    /* A blob writer that is abandoned. */
+    if (bOk && lsm_blob_open(db, "abandoned", 9, &pBlob) == LSM_OK) {
+      lsm_blob_write(pBlob, "xyz", 3);
+      lsm_blob_close(pBlob, 0);
+    }
+
+    /* A large value stored in the database file, not the value log. */
+    insertKey(db, "inline", sBlob.substr(0, 20000));
+    lsm_flush(db);
+
+    lsm_cursor *csr;
+    bOk = bOk && lsm_csr_open(db, &csr) == LSM_OK;
+    if (bOk) {
+      const char *azKey[] = { "blob", "inline" };
+      for (int iKey = 0; bOk && iKey < 2; iKey++) {
+        int nVal = (iKey == 0 ? nBlob : 20000);
+        bOk = lsm_csr_seek(csr, azKey[iKey], strlen(azKey[iKey]), LSM_SEEK_EQ) 
+          == LSM_OK && lsm_csr_valid(csr);
+
+        /* Read the value in pieces of an odd size, from the end. */
+        for (int iOff = nVal - 777; bOk && iOff > -777; iOff -= 777) {
+          char aBuf[777];
+          int iStart = (iOff < 0 ? 0 : iOff);
+          int nRead = -1;
+          bOk = lsm_csr_value_read(csr, iStart, aBuf, 777, &nRead) == LSM_OK
+            && nRead == (nVal - iStart < 777 ? nVal - iStart : 777)
+            && memcmp(aBuf, &sBlob[iStart], nRead) == 0;
+        }
+      }
+      lsm_csr_close(csr);
+    }
+    bOk = bOk && hasKey(db, "blob", sBlob) && !hasKey(db, "abandoned", "xyz");
+    lsm_close(db);
+  }
+  deleteDb(zDb);
+  return testResult("blob", bOk);
+}
+
+/* xGet callback for lsm_multi_get(). */
+static void multiGetCb(void *pCtx, int iKey, const void *pVal, int nVal) {
+  vector<string> *paVal = (vector<string> *)pCtx;
+  (*paVal)[iKey] = (nVal < 0 ? "<missing>" : string((const char *)pVal, nVal));
+}
+
+/*
+** Look up a batch of keys that are not sorted, including keys that are
+** missing and keys that appear more than once, spread across the 
+** in-memory tree and the database file.
+*/
+static bool testMultiGet() {
+  const char *zDb = "test-multiget.lsmdb";
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb);
+  if (db) {
+    vector<string> aKey;
+    vector<string> aExpect;
+    for (int i = 0; i < 1000; i += 2) {
+      insertKey(db, "key:" + to_string(1000 + i), "value:" + to_string(i));
+    }
+    lsm_flush(db);
+    for (int i = 0; i < 1000; i += 3) {
+      insertKey(db, "key:" + to_string(1000 + i), "new:" + to_string(i));
+    }
+
+    for (int i = 999; i >= 0; i -= 7) {
+      int iKey = (i * 13) % 1000;
+      aKey.push_back("key:" + to_string(1000 + iKey));
+      if (iKey % 3 == 0) {
+        aExpect.push_back("new:" + to_string(iKey));
+      } else if (iKey % 2 == 0) {
+        aExpect.push_back("value:" + to_string(iKey));
+      } else {
+        aExpect.push_back("<missing>");
+      }
+      if (i % 5 == 0) {
+        aKey.push_back(aKey.back());
+        aExpect.push_back(aExpect.back());
+      }
+    }
+
+    vector<const void *> apKey;
+    vector<int> anKey;
+    for (size_t i = 0; i < aKey.size(); i++) {
+      apKey.push_back(aKey[i].c_str());
+      anKey.push_back(aKey[i].length());
+    }
+    vector<string> aVal(aKey.size(), "<not called>");
+    int rc = lsm_multi_get(
+        db, &apKey[0], &anKey[0], aKey.size(), multiGetCb, &aVal
+    );
+    bOk = (rc == LSM_OK && aVal == aExpect);
+    lsm_close(db);
+  }
+  deleteDb(zDb);
+  return testResult("multi-get", bOk);
+}
+
+/*
+** Wrap the log, then recover the database in a new connection and flush
+** its in-memory tree using lsm_flush(). Transactions committed after the
+** flush is checkpointed must survive a crash.
+*/
+static bool testFlushAfterLogWrap() {
+  const char *zDb = "test-flush.lsmdb";
+  const char *zCopy = "test-flush-copy.lsmdb";
+  const char *zCopy2 = "test-flush-copy2.lsmdb";
+  const int aConfig[] = { 
+    LSM_CONFIG_AUTOFLUSH, 64, LSM_CONFIG_AUTOCHECKPOINT, 64, 0
+  };
+  const int aNoFlush[] = { LSM_CONFIG_AUTOFLUSH, 1024, 0 };
+  string sVal(4096, 'v');
+  bool bOk = false;
+
+  deleteDb(zDb);
+  deleteDb(zCopy);
+  lsm_db *db = openDb(zDb, aConfig);
+  if (db) {
+    /* Write enough that the log wraps around to the start of the file. */
+    for (int i = 0; i < 100; i++) {
+      insertKey(db, "key:" + to_string(100 + i), sVal);
+    }
+    crashCopyDb(zDb, zCopy);
+    lsm_close(db);
+  }
+
+  /* Recover the copy. The lsm_flush() call is the first flush made by the
+  ** new connection. Checkpoint it, then write another transaction.  */
+  db = openDb(zCopy, aNoFlush);
+  if (db) {
+    insertKey(db, "beforeflush", sVal);
+    bOk = lsm_flush(db) == LSM_OK && lsm_checkpoint(db, 0) == LSM_OK;
+    insertKey(db, "afterflush", sVal);
+    crashCopyDb(zCopy, zCopy2);
+    lsm_close(db);
+  }
+
+  if (bOk) {
+    db = openDb(zCopy2);
+    bOk = db && hasKey(db, "beforeflush", sVal)
+      && hasKey(db, "afterflush", sVal);
+    for (int i = 0; bOk && i < 100; i++) {
+      bOk = hasKey(db, "key:" + to_string(100 + i), sVal);
+    }
+    if (db) lsm_close(db);
+  }
+  deleteDb(zDb);
+  deleteDb(zCopy);
+  deleteDb(zCopy2);
+  return testResult("flush-after-log-wrap", bOk);
+}
+
+/*
+** Roll back to a savepoint taken before a transaction jumped over log
+** region 0, commit, then write enough that later transactions reach 
+** region 0 again. Region 0 is still required for recovery, so it must be
+** jumped over again rather than overwritten.
+*/
+static bool testRollbackLogJump() {
+  const char *zDb = "test-jump.lsmdb";
+  const char *zCopy = "test-jump-copy.lsmdb";
+  string sVal(4096, 'v');
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb);
+  if (db) {
+    /* Write more than 128KB to the log, flush and checkpoint. So that the
+    ** next transaction wraps around to the start of the log file and the
+    ** records that follow the checkpoint become region 0.  */
+    for (int i = 0; i < 40; i++) {
+      insertKey(db, "key:" + to_string(100 + i), sVal);
+    }
+    lsm_flush(db);
+    insertKey(db, "afterflush", sVal);
+    lsm_checkpoint(db, 0);
+    insertKey(db, "wrap", sVal);
+
+    /* Write enough in a nested transaction to jump over region 0, then 
+    ** roll it back.  */
+    lsm_begin(db, 1);
+    insertKey(db, "outer", sVal);
+    lsm_begin(db, 2);
+    for (int i = 0; i < 45; i++) {
+      insertKey(db, "inner:" + to_string(100 + i), sVal);
+    }
+    lsm_rollback(db, 2);
+    lsm_commit(db, 0);
+
+    for (int i = 0; i < 45; i++) {
+      insertKey(db, "after:" + to_string(100 + i), sVal);
+    }
+
+    crashCopyDb(zDb, zCopy);
+    lsm_close(db);
+
+    db = openDb(zCopy);
+    if (db) {
+      bOk = hasKey(db, "afterflush", sVal)
+        && hasKey(db, "wrap", sVal)
+        && hasKey(db, "outer", sVal)
+        && !hasKey(db, "inner:100", sVal);
+      for (int i = 0; bOk && i < 45; i++) {
+        bOk = hasKey(db, "after:" + to_string(100 + i), sVal);
+      }
+      lsm_close(db);
+    }
+  }
+  deleteDb(zDb);
+  deleteDb(zCopy);
+  return testResult("rollback-log-jump", bOk);
+}
+
+/*
+** Roll back a transaction that wraps the log around to the start of the
+** file, then commit another. The second transaction must survive a crash.
+*/
+static bool testRollbackAfterLogWrap() {
+  const char *zDb = "test-wrap.lsmdb";
+  const char *zCopy = "test-wrap-copy.lsmdb";
+  string sVal(4096, 'v');
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb);
+  if (db) {
+    /* Write more than 128KB to the log and flush it to the database. Then
+    ** commit one more transaction and checkpoint, so that the next
+    ** transaction wraps around to the start of the log file.  */
+    for (int i = 0; i < 64; i++) {
+      insertKey(db, "key:" + to_string(i), sVal);
+    }
+    lsm_flush(db);
+    insertKey(db, "afterflush", sVal);
+    lsm_checkpoint(db, 0);
+
+    lsm_begin(db, 1);
+    insertKey(db, "rolledback", sVal);
+    lsm_rollback(db, 0);
+    insertKey(db, "committed", sVal);
+
+    crashCopyDb(zDb, zCopy);
+    lsm_close(db);
+
+    db = openDb(zCopy);
+    if (db) {
+      bOk = hasKey(db, "afterflush", sVal) 
+        && hasKey(db, "committed", sVal) 
+        && !hasKey(db, "rolledback", sVal);
+      lsm_close(db);
+    }
+  }
+  deleteDb(zDb);
+  deleteDb(zCopy);
+  return testResult("rollback-after-log-wrap", bOk);
+}
+
+/*
+** With safety=FULL, a commit must sync the log exactly once, and must
+** survive a crash.
+*/
+static bool testFullSyncOnce() {
+  const char *zDb = "test-sync.lsmdb";
+  const char *zCopy = "test-sync-copy.lsmdb";
+  int eSafety = LSM_SAFETY_FULL;
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb, 0, getTestEnv());
+  if (db) {
+    lsm_config(db, LSM_CONFIG_SAFETY, &eSafety);
+    nLogSync = 0;
+    insertKey(db, "committed", "value");
+    bOk = (nLogSync == 1);
+
+    crashCopyDb(zDb, zCopy);
+    lsm_close(db);
+
+    db = openDb(zCopy);
+    bOk = bOk && db && hasKey(db, "committed", "value");
+    if (db) lsm_close(db);
+  }
+  deleteDb(zDb);
+  deleteDb(zCopy);
+  return testResult("full-sync-once", bOk);
+}
+
+/*
+** Insert nInsert keys using a new connection to database zDb, configured
+** as specified by aConfig[] and using the test environment.
+*/
+static void writerThread(
+  const char *zDb, const int *aConfig, int iThread, int nInsert, bool *pbOk
+) {
+  lsm_db *db = openDb(zDb, aConfig, getTestEnv());
+  bool bOk = (db != 0);
+  for (int i = 0; bOk && i < nInsert; i++) {
+    string sKey = "thread:" + to_string(iThread) + ":" + to_string(i);
+    int rc;
+    while ((rc = insertKey(db, sKey, sKey)) == LSM_BUSY) {
+      Sleep(1);
+    }
+    bOk = (rc == LSM_OK);
+  }
+  if (db && lsm_close(db) != LSM_OK) {
+    bOk = false;
+  }
+  *pbOk = bOk;
+}
+
+/*
+** Run nThread (at most 8) writerThread() threads at once. Then copy the
+** database as if the process crashed and check that the copy contains
+** every key that was written. The caller must keep a connection open on
+** zDb, so that the database is not closed when the writers finish.
+*/
+static bool runWriters(
+  const char *zDb, const int *aConfig, int nThread, int nInsert
+) {
+  const char *zCopy = "test-writers-copy.lsmdb";
+  bool abOk[8];
+  thread aThread[8];
+  bool bOk = true;
+
+  for (int i = 0; i < nThread; i++) {
+    aThread[i] = thread(writerThread, zDb, aConfig, i, nInsert, &abOk[i]);
+  }
+  for (int i = 0; i < nThread; i++) {
+    aThread[i].join();
+    bOk = bOk && abOk[i];
+  }
+  crashCopyDb(zDb, zCopy);
+
+  lsm_db *db2 = openDb(zCopy);
+  bOk = bOk && db2;
+  for (int i = 0; bOk && i < nThread; i++) {
+    for (int j = 0; bOk && j < nInsert; j++) {
+      string sKey = "thread:" + to_string(i) + ":" + to_string(j);
+      bOk = hasKey(db2, sKey, sKey);
+    }
+  }
+  if (db2) lsm_close(db2);
+  deleteDb(zCopy);
+  return bOk;
+}
+
+/*
+** With safety=window, a lone commit syncs the log once. Concurrent 
+** commits, made with group commit enabled, share syncs. All must survive
+** a crash. The log file is preallocated.
+*/
+static bool testSafetyWindow() {
+  const char *zDb = "test-window.lsmdb";
+  const int aConfig[] = { 
+    LSM_CONFIG_SAFETY, LSM_SAFETY_WINDOW, LSM_CONFIG_SYNC_WINDOW, 100, 
+    LSM_CONFIG_GROUP_COMMIT, 1, 0 
+  };
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb, aConfig, getTestEnv());
+  if (db) {
+    nLogSync = 0;
+    bOk = insertKey(db, "single", "value") == LSM_OK && nLogSync == 1
+      && fileSize(string(zDb) + "-log") >= 1024 * 1024;
+
+    nLogSync = 0;
+    bOk = bOk && runWriters(zDb, aConfig, 4, 250);
+    bOk = bOk && nLogSync > 0 && nLogSync <= 4 * 250;
+    lsm_close(db);
+  }
+  deleteDb(zDb);
+  return testResult("safety-window", bOk);
+}
+
+/*
+** Commit from several connections at once, each in its own thread, then
+** close them all. lsm_close() asserts that the connection no longer holds
+** any locks.
+*/
+static void commitThread(const char *zDb, int iThread, bool *pbOk) {
+  lsm_db *db = openDb(zDb);
+  bool bOk = (db != 0);
+  int nAutoflush = 16;
+
+  /* Flush the in-memory tree often, so that the snapshot each new read
+  ** transaction requires changes often too.  */
+  if (db) lsm_config(db, LSM_CONFIG_AUTOFLUSH, &nAutoflush);
+  for (int i = 0; bOk && i < 2000; i++) {
+    string sKey = "thread:" + to_string(iThread) + ":" + to_string(i);
+    int rc;
+    while ((rc = insertKey(db, sKey, sKey)) == LSM_BUSY) {
+      Sleep(1);
+    }
+    bOk = (rc == LSM_OK) && hasKey(db, sKey, sKey);
+  }
+  if (db && lsm_close(db) != LSM_OK) {
+    bOk = false;
+  }
+  *pbOk = bOk;
+}
+
+static bool testConcurrentCommit() {
+  const char *zDb = "test-concurrent.lsmdb";
+  const int nThread = 8;
+  bool abOk[nThread];
+  thread aThread[nThread];
+  bool bOk = true;
+
+  deleteDb(zDb);
+  for (int i = 0; i < nThread; i++) {
+    aThread[i] = thread(commitThread, zDb, i, &abOk[i]);
+  }
+  for (int i = 0; i < nThread; i++) {
+    aThread[i].join();
+    bOk = bOk && abOk[i];
+  }
+
+  lsm_db *db = openDb(zDb);
+  bOk = bOk && db;
+  for (int i = 0; bOk && i < nThread; i++) {
+    for (int j = 0; bOk && j < 2000; j++) {
+      string sKey = "thread:" + to_string(i) + ":" + to_string(j);
+      bOk = hasKey(db, sKey, sKey);
+    }
+  }
+  if (db) lsm_close(db);
+  deleteDb(zDb);
+  return testResult("concurrent-commit", bOk);
+}
+
+/*
+** Group commit auto-commit writes from connections that store values in
+** the value log and connections that do not. Each value must be stored
+** the way its own connection is configured, not the group leader's.
+*/
+static bool testGroupCommitConfig() {
+  const char *zDb = "test-groupcfg.lsmdb";
+  const int nThread = 4;
+  const int nInsert = 500;
+  const int aVlog[] = { 
+    LSM_CONFIG_GROUP_COMMIT, 1, LSM_CONFIG_VALUE_LOG, 1, 0 
+  };
+  const int aTree[] = { 
+    LSM_CONFIG_GROUP_COMMIT, 1, LSM_CONFIG_VALUE_LOG, 0, 0 
+  };
+  bool abOk[nThread];
+  thread aThread[nThread];
+  lsm_i64 nExpect = 0, nVlog = 0, nDead = 0;
+  bool bOk = false;
+
+  /* Threads with even numbers write their values to the value log. */
+  for (int i = 0; i < nThread; i += 2) {
+    for (int j = 0; j < nInsert; j++) {
+      nExpect += ("thread:" + to_string(i) + ":" + to_string(j)).length();
+    }
+  }
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb, 0, getTestEnv());
+  if (db) {
+    bOk = true;
+    for (int i = 0; i < nThread; i++) {
+      const int *aConfig = (i % 2 ? aTree : aVlog);
+      aThread[i] = thread(writerThread, zDb, aConfig, i, nInsert, &abOk[i]);
+    }
+    for (int i = 0; i < nThread; i++) {
+      aThread[i].join();
+      bOk = bOk && abOk[i];
+    }
+    bOk = bOk && lsm_flush(db) == LSM_OK && lsm_checkpoint(db, 0) == LSM_OK;
+    lsm_info(db, LSM_INFO_VALUE_LOG, &nVlog, &nDead);
+    bOk = bOk && nVlog == nExpect;
+    for (int i = 0; bOk && i < nThread; i++) {
+      for (int j = 0; bOk && j < nInsert; j++) {
+        string sKey = "thread:" + to_string(i) + ":" + to_string(j);
+        bOk = hasKey(db, sKey, sKey);
+      }
+    }
+    lsm_close(db);
+  }
+  deleteDb(zDb);
+  return testResult("group-commit-config", bOk);
+}
+
+/*
+** Write a value larger than 32KB to the log in a nested transaction, roll
+** the nested transaction back and then commit. The transaction, and the
+** one that follows it, must survive a crash.
+*/
+static bool testNestedRollbackLargeValue() {
+  const char *zDb = "test-nested.lsmdb";
+  const char *zCopy = "test-nested-copy.lsmdb";
+  string sOuter(30 * 1024, 'o');
+  string sLarge(40 * 1024, 'l');
+  string sInner(4 * 1024, 'i');
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb);
+  if (db) {
+    lsm_begin(db, 1);
+    insertKey(db, "outer", sOuter);
+    lsm_begin(db, 2);
+    insertKey(db, "large", sLarge);
+    lsm_rollback(db, 2);
+    insertKey(db, "inner", sInner);
+    lsm_commit(db, 0);
+    insertKey(db, "after", "value");
+
+    crashCopyDb(zDb, zCopy);
+    lsm_close(db);
+
+    db = openDb(zCopy);
+    if (db) {
+      bOk = hasKey(db, "outer", sOuter)
+        && hasKey(db, "inner", sInner)
+        && hasKey(db, "after", "value")
+        && !hasKey(db, "large", sLarge);
+      lsm_close(db);
+    }
+  }
+  deleteDb(zDb);
+  deleteDb(zCopy);
+  return testResult("nested-rollback-large-value", bOk);
+}
+
+/*
+** Commit from several connections at once with the log buffers in use.
+** Every commit must have been written to the log file by the time it 
+** returns, and so survive a crash.
+*/
+static bool testLogBuffer() {
+  const char *zDb = "test-logbuf.lsmdb";
+  const int aConfig[] = { 
+    LSM_CONFIG_MULTIPLE_PROCESSES, 0, LSM_CONFIG_LOG_BUFFER, 1, 0 
+  };
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb, aConfig, getTestEnv());
+  if (db) {
+    int bLogBuffer = -1;
+    lsm_config(db, LSM_CONFIG_LOG_BUFFER, &bLogBuffer);
+    bOk = (bLogBuffer == 1) && runWriters(zDb, aConfig, 8, 250);
+    lsm_close(db);
+  }
+  deleteDb(zDb);
+  return testResult("log-buffer", bOk);
+}
+
+/*
+** Scan a database while the mapping of the database file moves each time
+** a page that has not yet been read is loaded.
+*/
+static bool testRemapDuringScan() {
+  const char *zDb = "test-remap-scan.lsmdb";
+  const int nKey = 2000;
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb);
+  if (db) {
+    for (int i = 0; i < nKey; i++) {
+      string sKey = "key:" + to_string(10000 + i);
+      insertKey(db, sKey, sKey + string(100, 'v'));
+    }
+    lsm_flush(db);
+    lsm_close(db);
+  }
+
+  bMoveMaps = true;
+  db = openDb(zDb, 0, getTestEnv());
+  lsm_cursor *csr;
+  if (db && lsm_csr_open(db, &csr) == LSM_OK) {
+    int i = 0;
+    bOk = true;
+    for (lsm_csr_first(csr); bOk && lsm_csr_valid(csr); lsm_csr_next(csr)) {
+      const void *pKey;
+      int nKey;
+      string sKey = "key:" + to_string(10000 + i++);
+      bOk = (lsm_csr_key(csr, &pKey, &nKey) == LSM_OK
+        && nKey == (int)sKey.length()
+        && memcmp(pKey, sKey.c_str(), nKey) == 0
+      );
+    }
+    bOk = bOk && i == nKey;
+    lsm_csr_close(csr);
+  }
+  if (db) lsm_close(db);
+  bMoveMaps = false;
+  deleteDb(zDb);
+  return testResult("remap-during-scan", bOk);
+}
+
+/*
+** Read values that span several pages while the mapping of the database
+** file moves each time a page that has not yet been read is loaded.
+*/
+static bool testRemapDuringValueRead() {
+  const char *zDb = "test-remap.lsmdb";
+  const int nKey = 20;
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb);
+  if (db) {
+    for (int i = 0; i < nKey; i++) {
+      insertKey(db, "key:" + to_string(100 + i), string(10 * 1024, 'a' + i));
+    }
+    lsm_flush(db);
+    lsm_close(db);
+  }
+
+  bMoveMaps = true;
+  db = openDb(zDb, 0, getTestEnv());
+  lsm_cursor *csr;
+  if (db && lsm_csr_open(db, &csr) == LSM_OK) {
+    int i = 0;
+    bOk = true;
+    for (lsm_csr_first(csr); bOk && lsm_csr_valid(csr); lsm_csr_next(csr)) {
+      const void *pVal;
+      int nVal;
+      string sVal(10 * 1024, 'a' + i++);
+      bOk = (lsm_csr_value(csr, &pVal, &nVal) == LSM_OK
+        && nVal == (int)sVal.length()
+        && pVal && memcmp(pVal, sVal.c_str(), nVal) == 0
+      );
+    }
+    bOk = bOk && i == nKey;
+    lsm_csr_close(csr);
+  }
+  if (db) lsm_close(db);
+  bMoveMaps = false;
+  deleteDb(zDb);
+  return testResult("remap-during-value-read", bOk);
+}
+
+/*
+** Append a record that cannot be decoded to the log after the last commit,
+** as if the process crashed while writing it. Recovery must treat it as
+** the end of the log.
+*/
+static bool testGarbageAfterCommit() {
+  const char *zDb = "test-garbage.lsmdb";
+  const char *zCopy = "test-garbage-copy.lsmdb";
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb);
+  if (db) {
+    for (int i = 0; i < 10; i++) {
+      insertKey(db, "key:" + to_string(i), "value");
+    }
+    crashCopyDb(zDb, zCopy);
+    lsm_close(db);
+
+    /* A value log pointer record (type 0x0C) with a 1 byte key and a 1
+    ** byte value. A value log pointer is never less than 2 bytes in size. */
+    FILE *pLog = fopen((string(zCopy) + "-log").c_str(), "ab");
+    if (pLog) {
+      const unsigned char aRec[] = { 0x0C, 0x01, 0x01, 'k', 0x00 };
+      fwrite(aRec, 1, sizeof(aRec), pLog);
+      fclose(pLog);
+    }
+
+    db = openDb(zCopy);
+    if (db) {
+      bOk = true;
+      for (int i = 0; bOk && i < 10; i++) {
+        bOk = hasKey(db, "key:" + to_string(i), "value");
+      }
+      lsm_close(db);
+    }
+  }
+  deleteDb(zDb);
+  deleteDb(zCopy);
+  return testResult("garbage-after-commit", bOk);
+}
+
+/*
+** Overwrite every large value in the value log. Once merges have counted
+** enough of the value log as dead, the live values must be rewritten and
+** the space used by the old ones released. But not while a reader might 
+** still read an old value. The values must read back correctly, including
+** after a crash.
+*/
+static bool testValueLogGc() {
+  const char *zDb = "test-vloggc.lsmdb";
+  const char *zCopy = "test-vloggc-copy.lsmdb";
+  const int nKey = 40;
+  const int nVal = 8000;
+  const int aConfig[] = {
+    LSM_CONFIG_VALUE_LOG, 1024, LSM_CONFIG_VALUE_LOG_GC, 40, 0
+  };
+  lsm_i64 nVlog = 0, nDead = 0;
+  bool bOk = false;
+
+  deleteDb(zDb);
+  lsm_db *db = openDb(zDb, aConfig, getTestEnv());
+  lsm_db *db2 = openDb(zDb, aConfig, getTestEnv());
+  if (db && db2) {
+    lsm_cursor *csr = 0;
+    bOk = true;
+    for (int i = 0; i < nKey; i++) {
+      insertKey(db, "key:" + to_string(100 + i), string(nVal, 'a'));
+    }
+    bOk = lsm_flush(db) == LSM_OK;
+    for (int i = 0; i < nKey; i++) {
+      insertKey(db, "key:" + to_string(100 + i), string(nVal, 'A' + i % 26));
+    }
+    bOk = bOk && lsm_flush(db) == LSM_OK;
+
+    /* While db2 has a cursor open, the values it might read must not be
+    ** released. Then, once it is closed, they must be.  */
+    nPunch = 0;
+    bOk = bOk && lsm_csr_open(db2, &csr) == LSM_OK
+      && lsm_csr_first(csr) == LSM_OK;
+    bOk = bOk && lsm_work(db, 2, 1000000, 0) == LSM_OK;
+    lsm_info(db, LSM_INFO_VALUE_LOG, &nVlog, &nDead);
+    bOk = bOk && nDead == nKey * nVal;
+    for (int i = 0; bOk && i < 4; i++) {
+      bOk = lsm_work(db, 2, 1000000, 0) == LSM_OK && lsm_flush(db) == LSM_OK
+        && lsm_checkpoint(db, 0) == LSM_OK;
+    }
+
+    bOk = bOk && nPunch == 0 && lsm_csr_valid(csr);
+    if (bOk) {
+      const void *pVal;
+      int n;
+      bOk = lsm_csr_value(csr, &pVal, &n) == LSM_OK && n == nVal
+        && memcmp(pVal, string(nVal, 'A').c_str(), nVal) == 0;
+    }
+    lsm_csr_close(csr);
+    for (int i = 0; bOk && i < 4 && nPunch == 0; i++) {
+      bOk = lsm_work(db, 2, 1000000, 0) == LSM_OK;
+    }
+    lsm_info(db, LSM_INFO_VALUE_LOG, &nVlog, &nDead);
+    bOk = bOk && nPunch == 2 * nKey * nVal && nVlog == nKey * nVal;
+
+    for (int i = 0; bOk && i < nKey; i++) {
+      string sKey = "key:" + to_string(100 + i);
+      bOk = hasKey(db, sKey, string(nVal, 'A' + i % 26));
+    }
+
+    /* Start another pass while db2 holds the WRITER lock, so that lsm_work()
+    ** cannot rewrite any values. Then committing a write on db2 does.  */
+    for (int i = 0; bOk && i < nKey; i++) {
+      insertKey(db, "key:" + to_string(100 + i), string(nVal, 'A' + i % 26));
+    }
+    bOk = bOk && lsm_flush(db) == LSM_OK && lsm_begin(db2, 1) == LSM_OK;
+    bOk = bOk && lsm_work(db, 2, 1000000, 0) == LSM_OK 
+      && lsm_checkpoint(db, 0) == LSM_OK;
+    bOk = bOk && insertKey(db2, "key:999", "v") == LSM_OK 
+      && lsm_commit(db2, 0) == LSM_OK;
+    for (int i = 0; bOk && i < nKey; i++) {
+      string sKey = "key:" + to_string(100 + i);
+      bOk = hasKey(db2, sKey, string(nVal, 'A' + i % 26));
+    }
+    crashCopyDb(zDb, zCopy);
+  }
+  if (db2) lsm_close(db2);
+  if (db) lsm_close(db);
+
+  db = (bOk ? openDb(zCopy) : 0);
+  bOk = bOk && db;
+  for (int i = 0; bOk && i < nKey; i++) {
+    string sKey = "key:" + to_string(100 + i);
+    bOk = hasKey(db, sKey, string(nVal, 'A' + i % 26));
+  }
+  if (db) lsm_close(db);
+  deleteDb(zDb);
+  deleteDb(zCopy);
+  return testResult("value-log-gc", bOk);
+}
+
+/* A JSON-like record for key i, as stored by the compression test. */
+static string jsonRecord(int i) {
+  return "{\"id\": " + to_string(i) + ", \"name\": \"user" + to_string(i % 97)
+    + "\", \"email\": \"user" + to_string(i % 97) + "@example.com\", "
+    + "\"active\": " + (i % 3 ? "true" : "false") + ", \"score\": "
+    + to_string((i * 7919) % 1000) + "}";
+}
+
+/*
+** Write nKey JSON-like records to a new database zDb with page size nPgsz,
+** compressed using the built-in codec if bCompress is true, and flush
+** them to disk. The block size is 64KB, the smallest allowed, as the file
+** grows a block at a time. Return the size of the database file, or -1 
+** on error.
+*/
+static long writeJsonDb(const char *zDb, int nKey, int nPgsz, bool bCompress) {
+  lsm_compress lz;
+  lsm_db *db = 0;
+  long nByte = -1;
+  int nBlkKB = 64;
+
+  memset(&lz, 0, sizeof(lz));
+  lz.iId = LSM_COMPRESSION_LZ;
+  deleteDb(zDb);
+  if (lsm_new(0, &db) == LSM_OK) {
+    bool bOk = lsm_config(db, LSM_CONFIG_PAGE_SIZE, &nPgsz) == LSM_OK
+      && lsm_config(db, LSM_CONFIG_BLOCK_SIZE, &nBlkKB) == LSM_OK
+      && (!bCompress || lsm_config(db, LSM_CONFIG_SET_COMPRESSION, &lz) == LSM_OK)
+      && lsm_open(db, zDb) == LSM_OK;
+    for (int i = 0; bOk && i < nKey; i++) {
+      bOk = insertKey(db, "key:" + to_string(100000 + i), jsonRecord(i)) == LSM_OK;
+    }
+    bOk = bOk && lsm_flush(db) == LSM_OK && lsm_checkpoint(db, 0) == LSM_OK;
+    if (lsm_close(db) == LSM_OK && bOk) nByte = fileSize(zDb);
+  }
+  return nByte;
+}
+
+/*
+** Compress a database using the built-in LZ codec. The codec compresses
+** each page on its own, so the database must be smaller than an 
+** uncompressed one with the same page size, and every record must be 
+** readable by a connection that does not configure compression at all.
+*/
+static bool testLzCompression() {
+  const char *zDb = "test-lz.lsmdb";
+  const int nKey = 20000;
+  long nPlain = writeJsonDb(zDb, nKey, 4096, false);
+  long nLz = writeJsonDb(zDb, nKey, 4096, true);
+  bool bOk = (nPlain > 0 && nLz > 0 && nLz * 2 < nPlain);
+
+  lsm_db *db = (bOk ? openDb(zDb) : 0);
+  bOk = bOk && db;
+  if (db) {
+    unsigned int iId = 0;
+    bOk = lsm_info(db, LSM_INFO_COMPRESSION_ID, &iId) == LSM_OK
+      && iId == LSM_COMPRESSION_LZ;
+    for (int i = 0; bOk && i < nKey; i += 7) {
+      bOk = hasKey(db, "key:" + to_string(100000 + i), jsonRecord(i));
+    }
+    lsm_close(db);
+  }
+  deleteDb(zDb);
+  return testResult("lz-compression", bOk);
+}
+
+/*
+** Return true if the database contains a single segment, and its last page
+** is a bloom filter header page (starts with the "LSMF" magic number).
+*/
+static bool hasFilter(lsm_db *db, const char *zDb) {
+  char *zStruct = 0;
+  int iAge = 0, nChar = 0;
+  long long iFirst = 0, iLast = 0, iRoot = 0, nSize = 0;
+  int nPgsz = -1;
+  char aMagic[4] = {0, 0, 0, 0};
+
+  /* The structure of a database with one segment is "{AGE {FIRST LAST ROOT
+  ** SIZE}}".  */
+  lsm_config(db, LSM_CONFIG_PAGE_SIZE, &nPgsz);
+  if (lsm_info(db, LSM_INFO_DB_STRUCTURE, &zStruct) != LSM_OK) return false;
+  int n = sscanf(zStruct, "{%d {%lld %lld %lld %lld}}%n", 
+      &iAge, &iFirst, &iLast, &iRoot, &nSize, &nChar
+  );
+  bool bSingle = (n == 5 && nChar > 0 && zStruct[nChar] == '\0');
+  lsm_free(lsm_get_env(db), zStruct);
+
+  FILE *pFile = (bSingle ? fopen(zDb, "rb") : 0);
+  if (pFile) {
+    fseek(pFile, (long)((iLast - 1) * nPgsz), SEEK_SET);
+    if (fread(aMagic, 1, 4, pFile) != 4) aMagic[0] = 0;
+    fclose(pFile);
+  }
+  return memcmp(aMagic, "LSMF", 4) == 0;
+}
+
+/*
+** Merge four segments together in many small steps, alternating between
+** two connections. A bloom filter must be built for the output from the
+** keys written by every step, so that each key is still found. Then do
+** the same, but close and reopen the database part way through the merge.
+*/
+static bool testBloomFilter() {
+  const char *zDb = "test-bloom.lsmdb";
+  const int nKey = 20000;
+  const int nSeg = 4;
+  const int aConfig[] = {
+    LSM_CONFIG_MULTIPLE_PROCESSES, 0, LSM_CONFIG_AUTOWORK, 0, 0
+  };
+  bool bOk = true;
+
+  for (int bReopen = 0; bOk && bReopen < 2; bReopen++) {
+    int nStep = 0;
+    deleteDb(zDb);
+    lsm_db *db = openDb(zDb, aConfig);
+    lsm_db *db2 = openDb(zDb, aConfig);
+    bOk = db && db2;
+
+    for (int iSeg = 0; bOk && iSeg < nSeg; iSeg++) {
+      for (int i = iSeg; bOk && i < nKey; i += nSeg) {
+        bOk = insertKey(db, "key:" + to_string(100000 + i), "v") == LSM_OK;
+      }
+      bOk = bOk && lsm_flush(db) == LSM_OK;
+    }
+
+    while (bOk) {
+      int nWrite = 0;
+      if (bReopen && nStep == 10) {
+        lsm_close(db);
+        lsm_close(db2);
+        db = openDb(zDb, aConfig);
+        db2 = openDb(zDb, aConfig);
+        bOk = db && db2;
+        if (!bOk) break;
+      }
+      bOk = lsm_work((nStep % 2) ? db2 : db, nSeg, 8, &nWrite) == LSM_OK;
+      if (nWrite == 0) break;
+      nStep++;
+    }
+    bOk = bOk && nStep > 20;
+    if (bOk && bReopen == 0) bOk = hasFilter(db, zDb);
+
+    for (int i = 0; bOk && i < nKey; i++) {
+      bOk = hasKey(db2, "key:" + to_string(100000 + i), "v")
+        && !hasKey(db2, "key:" + to_string(200000 + i), "v");
+    }
+    if (db2) lsm_close(db2);
+    if (db) lsm_close(db);
+  }
+  deleteDb(zDb);
+  return testResult("bloom-filter", bOk);
+}
+
+/*
+** Open a database file written by the original file format, before the
+** checkpoint recorded the value log and log checksum fields. It was made
+** with a 1KB page size and a 64KB block size by inserting key:000 to
+** key:019, flushing, deleting every fifth key and closing the database.
+** Only its non-zero bytes are stored here, as hex strings.
+*/
+static bool testOldFormat() {
+  const char *zDb = "test-oldformat.lsmdb";
+  const struct { long iOff; const char *zHex; } aRun[] = {
+    { 7,
+      "0c0000002d0000000100000001000100000000000200000400000000"
+      "0200000000000004611f71a2029bbce6fc000000000000000b" },
+    { 99,
+      "0a000000000000000a" },
+    { 123,
+      "01" },
+    { 139,
+      "090000000000000009" },
+    { 163,
+      "01" },
+    { 172,
+      "fe9e0314c911d14a" },
+    { 8195,
+      "01480007096b65793a30303076616c75653a303030480007096b6579"
+      "3a30303176616c75653a303031480007096b65793a30303276616c75"
+      "653a303032480007096b65793a30303376616c75653a303033480007"
+      "096b65793a30303476616c75653a303034480007096b65793a303035"
+      "76616c75653a303035480007096b65793a30303676616c75653a3030"
+      "36480007096b65793a30303776616c75653a303037480007096b6579"
+      "3a30303876616c75653a303038480007096b65793a30303976616c75"
+      "653a303039480007096b65793a30313076616c75653a303130480007"
+      "096b65793a30313176616c75653a303131480007096b65793a303132"
+      "76616c75653a303132480007096b65793a30313376616c75653a3031"
+      "33480007096b65793a30313476616c75653a303134480007096b6579"
+      "3a30313576616c75653a303135480007096b65793a30313676616c75"
+      "653a303136480007096b65793a30313776616c75653a303137480007"
+      "096b65793a30313876616c75653a303138480007096b65793a303139"
+      "76616c75653a303139" },
+    { 9164,
+      "017c016801540140012c0118010400f000dc00c800b400a0008c0078"
+      "00640050003c00280014" },
+    { 9215,
+      "144400076b65793a3030304400076b65793a3030354400076b65793a"
+      "3031304400076b65793a303135" },
+    { 10221,
+      "1e0014000a" },
+    { 10239,
+      "04" },
+  };
+  bool bOk = false;
+
+  deleteDb(zDb);
+  FILE *pFile = fopen(zDb, "wb");
+  if (pFile) {
+    for (size_t i = 0; i < sizeof(aRun) / sizeof(aRun[0]); i++) {
+      fseek(pFile, aRun[i].iOff, SEEK_SET);
+      for (const char *z = aRun[i].zHex; z[0] && z[1]; z += 2) {
+        fputc(stoi(string(z, 2), 0, 16), pFile);
+      }
+    }
+    fseek(pFile, 65535, SEEK_SET);
+    fputc(0, pFile);
+    fclose(pFile);
+  }
+
+  /* Read the old file, write to it, and read it again after reopening. */
+  for (int iPass = 0; iPass < 2; iPass++) {
+    lsm_db *db = openDb(zDb);
+    bOk = (db != 0);
+    for (int i = 0; bOk && i < 20; i++) {
+      char zKey[16], zVal[16];
+      snprintf(zKey, sizeof(zKey), "key:%03d", i);
+      snprintf(zVal, sizeof(zVal), "value:%03d", i);
+      bOk = hasKey(db, zKey, zVal) == (i % 5 != 0);
+    }
+    if (bOk && iPass == 0) {
+      bOk = insertKey(db, "new", "value") == LSM_OK && lsm_flush(db) == LSM_OK;
+    }
+    bOk = bOk && hasKey(db, "new", "value");
+    if (db) lsm_close(db);
+    if (!bOk) break;
+  }
+  deleteDb(zDb);
+  return testResult("old-format", bOk);
+}
+
+int runRegressionTests() {
+  int nFail = 0;
+  nFail += !testBatch();
+  nFail += !testBulkLoad();
+  nFail += !testBackgroundWorkers();
+  nFail += !testSkiplist();
+  nFail += !testTreeMemory();
+  nFail += !testValueLog();
+  nFail += !testValueIov();
+  nFail += !testBlob();
+  nFail += !testMultiGet();
+  nFail += !testFlushAfterLogWrap();
+  nFail += !testRollbackLogJump();
+  nFail += !testRollbackAfterLogWrap();
+  nFail += !testFullSyncOnce();
+  nFail += !testSafetyWindow();
+  nFail += !testConcurrentCommit();
+  nFail += !testGroupCommitConfig();
+  nFail += !testNestedRollbackLargeValue();
+  nFail += !testLogBuffer();
+  nFail += !testRemapDuringScan();
+  nFail += !testRemapDuringValueRead();
+  nFail += !testGarbageAfterCommit();
+  nFail += !testOldFormat();
+  nFail += !testValueLogGc();
+  nFail += !testBloomFilter();
+  nFail += !testLzCompression();
+  return nFail;
+}
+
 int main()
 {
   int rc;
   lsm_db *db, *db2;
 
+  /* Run the regression tests first */
+  if (runRegressionTests() != 0) {
+    exit(1);
+  }
+
   /* Allocate a new database handle */
   rc = lsm_new(0, &db);
   if (rc != LSM_OK) {
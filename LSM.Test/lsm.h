@@ -25,13 +25,18 @@ typedef size_t sqlite4_size_t;
 /*
 ** Opaque handle types.
 */
+typedef struct lsm_batch lsm_batch;         /* Write batch handle */
+typedef struct lsm_blob lsm_blob;           /* Blob writer handle */
 typedef struct lsm_compress lsm_compress;   /* Compression library functions */
 typedef struct lsm_compress_factory lsm_compress_factory;
 typedef struct lsm_cursor lsm_cursor;       /* Database cursor handle */
 typedef struct lsm_db lsm_db;               /* Database connection handle */
 typedef struct lsm_env lsm_env;             /* Runtime environment */
 typedef struct lsm_file lsm_file;           /* OS file handle */
+typedef struct lsm_iovec lsm_iovec;         /* Slice of a database value */
 typedef struct lsm_mutex lsm_mutex;         /* Mutex handle */
+typedef struct lsm_thread lsm_thread;       /* Thread handle */
+typedef struct lsm_cond lsm_cond;           /* Condition variable handle */
 
 /* 64-bit integer type used for file offsets. */
 typedef long long int lsm_i64;              /* 64-bit signed integer type */
@@ -51,7 +56,7 @@ typedef long long int lsm_i64;              /* 64-bit signed integer type */
 */
 struct lsm_env {
   int nByte;                 /* Size of this structure in bytes */
-  int iVersion;              /* Version number of this structure (1) */
+  int iVersion;              /* Version number of this structure (4) */
   /****** file i/o ***********************************************/
   void *pVfsCtx;
   int (*xFullpath)(lsm_env*, const char *, char *, int *);
@@ -88,6 +93,16 @@ struct lsm_env {
   int (*xMutexNotHeld)(lsm_mutex *);        /* Return true if mutex not held */
   /****** other ****************************************************/
   int (*xSleep)(lsm_env*, int microseconds);
+  /****** threads (iVersion>=2) **************************************/
+  int (*xThreadNew)(lsm_env*, void (*)(void *), void *, lsm_thread **);
+  void (*xThreadJoin)(lsm_thread *);        /* Wait for thread and free it */
+  /****** file i/o (iVersion>=3) *************************************/
+  int (*xPunch)(lsm_file *, lsm_i64 iOff, lsm_i64 nByte);
+  /****** condition variables (iVersion>=4) **************************/
+  int (*xCondNew)(lsm_env*, lsm_cond **);   /* Get a new condition variable */
+  void (*xCondDel)(lsm_cond *);             /* Delete a condition variable */
+  void (*xCondWait)(lsm_cond *, lsm_mutex *); /* Leave mutex, wait, enter */
+  void (*xCondBroadcast)(lsm_cond *);       /* Wake all waiting threads */
 
   /* New fields may be added in future releases, in which case the
   ** iVersion value will increase. */
@@ -193,8 +208,8 @@ int lsm_config(lsm_db *, int, ...);
 **   The default value is 1024 (1MB blocks).
 **
 ** LSM_CONFIG_SAFETY:
-**   A read/write integer parameter. Valid values are 0, 1 (the default) 
-**   and 2. This parameter determines how robust the database is in the
+**   A read/write integer parameter. Valid values are 0, 1 (the default),
+**   2 and 3. This parameter determines how robust the database is in the
 **   face of a system crash (e.g. a power failure or operating system 
 **   crash). As follows:
 **
@@ -208,6 +223,18 @@ int lsm_config(lsm_db *, int, ...);
 **                 database file. Following recovery the database file
 **                 contains all successfully committed transactions.
 **
+**     3 (window): As for full. Except that the log file is synced after
+**                 the transaction has been committed, once the writer
+**                 lock has been released, so that a single sync may
+**                 cover transactions committed by several connections 
+**                 within the same process (see LSM_CONFIG_SYNC_WINDOW).
+**                 lsm_commit() does not return until the sync is done,
+**                 but other connections may read the transaction before
+**                 then. If the sync fails, lsm_commit() returns an error
+**                 even though the transaction has been committed. The
+**                 log file is also preallocated, so that appending to 
+**                 it does not usually change the size of the file.
+**
 ** LSM_CONFIG_AUTOWORK:
 **   A read/write integer parameter.
 **
@@ -269,6 +296,12 @@ int lsm_config(lsm_db *, int, ...);
 **   of type lsm_compress. The lsm_config() method takes a copy of the 
 **   structures contents.
 **
+**   To use a codec built into the library, set the iId field of the 
+**   structure to the compression id of the codec (e.g. LSM_COMPRESSION_LZ)
+**   and all other fields to zero. A connection that has no compression
+**   configured automatically uses the matching built-in codec when it
+**   opens a database created with one.
+**
 **   This option may only be used before lsm_open() is called. Invoking it
 **   after lsm_open() has been called results in an LSM_MISUSE error.
 **
@@ -283,6 +316,194 @@ int lsm_config(lsm_db *, int, ...);
 ** LSM_CONFIG_READONLY:
 **   A read/write boolean parameter. This parameter may only be set before
 **   lsm_open() is called.
+**
+** LSM_CONFIG_CACHE_SIZE:
+**   A read/write integer parameter. The size in KB of the page cache shared
+**   by all connections to the same database within a process. Only pages
+**   read using ordinary read IO (not those accessed via a memory mapping,
+**   see LSM_CONFIG_MMAP) are stored in this cache. Setting this parameter 
+**   to 0 disables the shared cache.
+**
+**   The cache is created by the first connection to open the database, 
+**   using the value configured for that connection. Subsequent connections
+**   use the existing cache. Once lsm_open() has been called, setting this
+**   parameter resizes the cache for all connections to the database.
+**
+**   The default value is 16384 (16MB).
+**
+** LSM_CONFIG_BLOOM_BITS:
+**   A read/write integer parameter. The number of bits per key used by the
+**   bloom filters built for each sorted run when a merge completes. These
+**   filters allow lsm_csr_seek(LSM_SEEK_EQ) to skip sorted runs that cannot
+**   contain the requested key. Larger values use more space in the database
+**   file but produce fewer false positives. Setting this parameter to 0 
+**   disables the building of new filters (existing filters are still used).
+**
+**   The default value is 10 (a false positive rate of roughly 1%).
+**
+** LSM_CONFIG_PREFIX_KEYS:
+**   A read/write boolean parameter. If true, sorted run pages written by
+**   this connection store each key as a suffix following the prefix it 
+**   shares with the nearest preceding restart key on the same page. This 
+**   makes pages considerably denser when keys share long common prefixes.
+**   Pages written using either format may be read regardless of the 
+**   current setting, but databases containing prefix-compressed pages
+**   cannot be read by versions of the library that predate this option.
+**
+**   The default value is 0.
+**
+** LSM_CONFIG_GROUP_COMMIT:
+**   A read/write boolean parameter. If true, auto-commit writes (calls to
+**   lsm_insert(), lsm_delete() or lsm_delete_range() made while the 
+**   connection has no open transaction or cursors) are committed as part
+**   of a group. Concurrent auto-commit writes made using connections to 
+**   the same database within a process are queued, and one of the writing
+**   connections writes them all to the log and in-memory tree within a 
+**   single transaction, syncing the log at most once. Only writes made
+**   using connections with the same settings as the committing connection
+**   are grouped together (all parameters that affect writing, such as
+**   LSM_CONFIG_SAFETY, LSM_CONFIG_VALUE_LOG and LSM_CONFIG_AUTOWORK, must
+**   match). Each write succeeds or fails independently.
+**
+**   While a connection waits for another to commit its write, it blocks 
+**   on a condition variable if the lsm_env implements the iVersion 4 
+**   xCondNew(), xCondDel(), xCondWait() and xCondBroadcast() methods. 
+**   Otherwise it polls, sleeping for a few microseconds between checks.
+**   xCondWait() must release the mutex passed to it while it waits and
+**   enter it again before returning.
+**
+**   The default value is 0.
+**
+** LSM_CONFIG_BACKGROUND_WORKERS:
+**   A read/write integer parameter. This value may only be set before
+**   lsm_open() is called. If it is greater than zero, lsm_open() starts
+**   that many threads, each with its own connection to the database, that
+**   flush in-memory trees to disk, merge segments and run auto-checkpoints
+**   in the background until the connection is closed. Writes made using 
+**   this connection then do no auto-work (see LSM_CONFIG_AUTOWORK) unless
+**   the background threads fall behind - see LSM_CONFIG_THROTTLE_LEVELS.
+**
+**   Background workers require an lsm_env with iVersion 2 or greater that
+**   implements xThreadNew and xThreadJoin. If the environment does not
+**   support threads, this parameter is always 0. After lsm_open() has 
+**   been called, the value returned is the number of threads running.
+**   Workers are not started for read-only connections. The maximum value
+**   is 8 and the default value is 0.
+**
+**   If there are two or more workers and the connection is in single
+**   process mode (see LSM_CONFIG_MULTIPLE_PROCESSES), merges of unrelated
+**   levels are run concurrently, each by a different worker thread. A
+**   large merge into the oldest level of an uncompressed database may also
+**   be split into key ranges, each merged by a different worker thread.
+**
+** LSM_CONFIG_THROTTLE_LEVELS:
+**   A read/write integer parameter. If background workers are running
+**   (see LSM_CONFIG_BACKGROUND_WORKERS), a writer only performs auto-work
+**   itself, and so is slowed down to the rate at which data can be merged,
+**   if either the database contains more than this many levels, or the
+**   in-memory tree has been filled again before the previous one has been
+**   flushed to disk. The default value is 24.
+**
+** LSM_CONFIG_SKIPLIST:
+**   A read/write boolean parameter. This value may only be set before
+**   lsm_open() is called. If it is true and the connection is in single
+**   process mode (see LSM_CONFIG_MULTIPLE_PROCESSES), in-memory trees of
+**   the database are stored as skiplists instead of b-trees. The setting
+**   of the first connection to open the database within the process is
+**   used - after lsm_open() has been called the value returned indicates
+**   whether or not the database is using skiplists. The default value
+**   is 0.
+**
+**   Skiplist readers do not contend with the writer any more than b-tree
+**   readers do - both may read the tree while it is being written. But
+**   inserting into a skiplist modifies fewer shared-memory locations than
+**   inserting into a copy-on-write b-tree. The skiplist is a little 
+**   larger, and transactions that are rolled back do not release the
+**   space they used until the tree is flushed to disk.
+**
+** LSM_CONFIG_VALUE_LOG:
+**   A read/write integer parameter. If it is greater than zero, values
+**   written by lsm_insert() that are this many bytes in size or larger are
+**   appended to a separate value log file (the database file name with
+**   "-vlog" appended) instead of being stored in the in-memory tree, the
+**   log file and the database file. Only a small pointer to each such value
+**   is stored in the database, so that flushing and merging segments does
+**   not copy large values. The value is read from the value log when it is
+**   requested using lsm_csr_value(). The default value is 0, which means
+**   all values are stored in the database.
+**
+**   Space in the value log is reclaimed when a large enough proportion of
+**   it belongs to values that have been overwritten or deleted. See 
+**   LSM_CONFIG_VALUE_LOG_GC and LSM_INFO_VALUE_LOG.
+**
+** LSM_CONFIG_LOG_CHECKSUM:
+**   A read/write integer parameter. Selects the algorithm used to checksum
+**   records written to the log file. It must be set to one of the following
+**   values:
+**
+**     LSM_LOG_CKSUM_FLETCHER: A Fletcher-style checksum computed 32-bits
+**                             at a time. This is the default.
+**
+**     LSM_LOG_CKSUM_CRC32C:   A CRC32C based checksum. It is computed using
+**                             the SSE4.2 or ARMv8 CRC32 instructions where
+**                             available, which is considerably faster than
+**                             the Fletcher checksum.
+**
+**   The algorithm is recorded in the database when it is created. Once
+**   lsm_open() has been called, this is a read-only parameter that reports
+**   the algorithm used by the database, which may not be the one that was
+**   configured.
+**
+** LSM_CONFIG_TREE_IMAGE:
+**   A read/write boolean parameter. If this option is set when the last
+**   connection to a database is closed, the in-memory tree is not flushed
+**   to the database file. Instead, it is written to a tree image file (the
+**   database file name with "-tree" appended) and the log file is retained.
+**   If it is set when the database is opened by its first connection and
+**   a tree image file is present, the in-memory tree is loaded from the
+**   image instead of being rebuilt from the log file. An image is ignored
+**   (and the log used instead) if it is damaged or does not match the 
+**   checkpoint stored in the database file. The default value is 0.
+**
+** LSM_CONFIG_SYNC_WINDOW:
+**   A read/write integer parameter. This option is only used if the 
+**   LSM_CONFIG_SAFETY parameter is set to 3 (window). It is the number of
+**   microseconds that a connection about to sync the log file waits, so
+**   that transactions committed by other connections in the meantime are
+**   covered by the same sync. The wait is skipped unless the previous sync
+**   covered transactions committed by more than one connection, so that a
+**   lone writer is not delayed. The default value is 0, in which case 
+**   transactions are only covered by a single sync if they are committed
+**   while another sync is in progress.
+**
+** LSM_CONFIG_LOG_BUFFER:
+**   A read/write boolean parameter. If this option is set, a connection
+**   committing a transaction does not write its log records to the log
+**   file while it holds the WRITER lock. Instead, they are appended to a 
+**   pair of in-memory buffers shared by all connections to the database
+**   within the process. While one buffer is being written to the log file,
+**   the next writer appends to the other. lsm_commit() does not return
+**   until the log records for the transaction have been written to the 
+**   log file (and, if LSM_CONFIG_SAFETY is set to 3, synced), so the 
+**   durability guarantees of each safety level are unchanged.
+**
+**   This option is ignored in multi-process mode, and for transactions
+**   committed with LSM_CONFIG_SAFETY set to 2 (full), which must sync the
+**   log file while holding the WRITER lock anyway. The default value is 0.
+**
+** LSM_CONFIG_VALUE_LOG_GC:
+**   A read/write integer parameter. When merges have found that this 
+**   percentage (or more) of the value log (see LSM_CONFIG_VALUE_LOG) 
+**   belongs to values that have been overwritten or deleted, the space it
+**   uses is reclaimed. The live values in the value log are rewritten to
+**   its end, after which the part of the file that they were read from is
+**   released using the xPunch() method of the lsm_env (if it has one). 
+**   Values are rewritten a little at a time by write transactions committed
+**   by connections with LSM_CONFIG_AUTOWORK set, and by calls to lsm_work().
+**   Space is released by lsm_work() or auto-work once the rewritten values
+**   have been flushed to the database file, checkpointed, and no reader
+**   is using an older version of the database. Setting this parameter to 0
+**   disables reclaiming space. The default value is 50.
 */
 #define LSM_CONFIG_AUTOFLUSH                1
 #define LSM_CONFIG_PAGE_SIZE                2
@@ -299,10 +520,27 @@ int lsm_config(lsm_db *, int, ...);
 #define LSM_CONFIG_GET_COMPRESSION         14
 #define LSM_CONFIG_SET_COMPRESSION_FACTORY 15
 #define LSM_CONFIG_READONLY                16
+#define LSM_CONFIG_CACHE_SIZE              17
+#define LSM_CONFIG_BLOOM_BITS              18
+#define LSM_CONFIG_PREFIX_KEYS             19
+#define LSM_CONFIG_GROUP_COMMIT            20
+#define LSM_CONFIG_BACKGROUND_WORKERS      21
+#define LSM_CONFIG_THROTTLE_LEVELS         22
+#define LSM_CONFIG_SKIPLIST                23
+#define LSM_CONFIG_VALUE_LOG               24
+#define LSM_CONFIG_LOG_CHECKSUM            25
+#define LSM_CONFIG_TREE_IMAGE              26
+#define LSM_CONFIG_SYNC_WINDOW             27
+#define LSM_CONFIG_LOG_BUFFER              28
+#define LSM_CONFIG_VALUE_LOG_GC            29
 
 #define LSM_SAFETY_OFF    0
 #define LSM_SAFETY_NORMAL 1
 #define LSM_SAFETY_FULL   2
+#define LSM_SAFETY_WINDOW 3
+
+#define LSM_LOG_CKSUM_FLETCHER 0
+#define LSM_LOG_CKSUM_CRC32C   1
 
 /*
 ** CAPI: Compression and/or Encryption Hooks
@@ -322,8 +560,21 @@ struct lsm_compress_factory {
   void (*xFree)(void *pCtx);
 };
 
+/*
+** Compression ids used by the library. Ids 2 to 31, inclusive, are 
+** reserved for codecs built into the library. Application supplied 
+** compression methods should use other values.
+**
+** LSM_COMPRESSION_LZ:
+**   A fast LZ77-class codec. Each page is compressed independently - 
+**   pages are not grouped into larger compressed chunks - so matches are
+**   only found within a single page. Using a larger page size 
+**   (LSM_CONFIG_PAGE_SIZE) with this codec improves the compression ratio
+**   somewhat, at the cost of decompressing more data for each page read.
+*/
 #define LSM_COMPRESSION_EMPTY 0
 #define LSM_COMPRESSION_NONE  1
+#define LSM_COMPRESSION_LZ    2
 
 /*
 ** CAPI: Allocating and Freeing Memory
@@ -462,6 +713,15 @@ int lsm_set_user_version(lsm_db *, unsigned int);
 **   This value should be followed by a single argument of type 
 **   (unsigned int *). If successful, the location pointed to is populated 
 **   with the database compression id before returning.
+**
+** LSM_INFO_VALUE_LOG:
+**   This value should be followed by two arguments of type (lsm_i64 *). 
+**   The first is populated with the number of bytes of the value log file
+**   (see LSM_CONFIG_VALUE_LOG) that are in use - written to and not yet
+**   reclaimed (see LSM_CONFIG_VALUE_LOG_GC). The second with the number of
+**   those bytes that belong to values that merges have found to be 
+**   overwritten or deleted. As with LSM_INFO_TREE_SIZE, the values are
+**   read from shared memory without locking and so may be slightly stale.
 */
 #define LSM_INFO_NWRITE           1
 #define LSM_INFO_NREAD            2
@@ -476,6 +736,7 @@ int lsm_set_user_version(lsm_db *, unsigned int);
 #define LSM_INFO_TREE_SIZE       11
 #define LSM_INFO_FREELIST_SIZE   12
 #define LSM_INFO_COMPRESSION_ID  13
+#define LSM_INFO_VALUE_LOG       14
 
 
 /* 
@@ -533,6 +794,116 @@ int lsm_delete_range(lsm_db *,
     const void *pKey1, int nKey1, const void *pKey2, int nKey2
 );
 
+/*
+** CAPI: Write Batches
+**
+** A write batch accumulates a series of inserts, deletes and range-deletes
+** in memory so that they may be written to the database with a single call
+** to lsm_batch_write(). All operations in the batch are written to the log 
+** as a single record, and either all or none of them are applied.
+**
+** lsm_batch_new():
+**   Allocate a new, empty, write batch. The batch uses the same lsm_env as
+**   database connection pDb. It may only be written to database connections
+**   that also use this environment.
+**
+** lsm_batch_insert(), lsm_batch_delete(), lsm_batch_delete_range():
+**   Append an operation to the batch. The key and value data is copied into
+**   the batch, so the caller's buffers may be reused as soon as these 
+**   return. The semantics of each operation are the same as those of 
+**   lsm_insert(), lsm_delete() and lsm_delete_range(), respectively. 
+**   Operations are applied in the order in which they are added.
+**
+** lsm_batch_write():
+**   Write the contents of the batch to the database. If there is no write
+**   transaction open, the batch is written and committed as a single 
+**   transaction. Otherwise, it becomes part of the open transaction. The
+**   batch itself is not modified and may be written more than once.
+**
+** lsm_batch_reset():
+**   Remove all operations from the batch so that it may be reused.
+**
+** lsm_batch_close():
+**   Free the batch and all resources associated with it.
+*/
+int lsm_batch_new(lsm_db *pDb, lsm_batch **ppBatch);
+int lsm_batch_insert(lsm_batch *, 
+    const void *pKey, int nKey, const void *pVal, int nVal
+);
+int lsm_batch_delete(lsm_batch *, const void *pKey, int nKey);
+int lsm_batch_delete_range(lsm_batch *, 
+    const void *pKey1, int nKey1, const void *pKey2, int nKey2
+);
+int lsm_batch_write(lsm_db *pDb, lsm_batch *pBatch);
+void lsm_batch_reset(lsm_batch *pBatch);
+void lsm_batch_close(lsm_batch *pBatch);
+
+/*
+** CAPI: Blob Writers
+**
+** A blob writer is used to write a large value to the database in chunks,
+** without assembling the entire value in memory first. Values written 
+** using a blob writer are always stored in the value log (see 
+** LSM_CONFIG_VALUE_LOG), regardless of their size. They may be read 
+** incrementally using lsm_csr_value_read().
+**
+** lsm_blob_open():
+**   Open a blob writer to write a value for key pKey/nKey. A nested write
+**   transaction is opened (or a write transaction, if none is open) for the
+**   lifetime of the writer. While the writer is open, other writes may be
+**   made using the same connection, but writes of values large enough to 
+**   be stored in the value log fail with LSM_MISUSE. As do attempts to
+**   commit or roll back the transaction opened by the writer. At most one
+**   blob writer may be open on a connection at any time.
+**
+** lsm_blob_write():
+**   Append nData bytes from buffer pData to the value. The data is written
+**   to the value log immediately. The total size of a value may not exceed
+**   2^31-1 bytes.
+**
+** lsm_blob_close():
+**   If bCommit is true, write the key and value to the database, and close
+**   the nested transaction opened by lsm_blob_open() (committing it, if it
+**   is not nested within another). Otherwise, roll it back. The writer is 
+**   freed in either case. If there is an error writing the value to the 
+**   database, the nested transaction is rolled back and an error code
+**   returned.
+*/
+int lsm_blob_open(lsm_db *pDb, const void *pKey, int nKey, lsm_blob **ppBlob);
+int lsm_blob_write(lsm_blob *pBlob, const void *pData, int nData);
+int lsm_blob_close(lsm_blob *pBlob, int bCommit);
+
+/*
+** CAPI: Bulk Loading
+**
+** Load a large amount of sorted data into an empty database. Instead of
+** being written to the log and in-memory tree and then repeatedly merged,
+** the data is written directly to a single new segment on disk, which is
+** then made visible to other connections and checkpointed.
+**
+** The xNext callback is invoked repeatedly to obtain the entries to load.
+** Each call should either set the four output variables to the next key
+** and value and return LSM_OK, set *ppKey to NULL and return LSM_OK to 
+** indicate that there are no more entries, or return an LSM error code
+** to abandon the load. The buffers returned by xNext() need only remain
+** valid until the next call. Keys must be returned in strictly ascending
+** order according to the database comparison function. 
+**
+** LSM_MISUSE is returned if the keys are not in order, if the connection
+** has an open transaction or cursor, or if the database is not empty. 
+** If an error occurs, none of the data is loaded. While a bulk load is 
+** underway, other connections may read and write the database (the 
+** entries they write take precedence over those being loaded), but no 
+** merging or checkpointing can take place.
+*/
+int lsm_bulk_load(
+  lsm_db *pDb,
+  int (*xNext)(void *pCtx, 
+    const void **ppKey, int *pnKey, const void **ppVal, int *pnVal
+  ),
+  void *pCtx
+);
+
 /*
 ** CAPI: Explicit Database Work and Checkpointing
 **
@@ -563,6 +934,32 @@ int lsm_checkpoint(lsm_db *pDb, int *pnKB);
 int lsm_csr_open(lsm_db *pDb, lsm_cursor **ppCsr);
 int lsm_csr_close(lsm_cursor *pCsr);
 
+/*
+** CAPI: Batched Lookups
+**
+** Look up each of the nKey keys in arrays apKey[] and anKey[]. For each
+** key, the xGet callback is invoked with the index of the key in apKey[]
+** as its second argument. If the key is present in the database, the
+** third and fourth arguments are a pointer to and the size of its value. 
+** Otherwise, they are NULL and -1. The value buffer is only valid until
+** xGet returns. The callback must not use the database connection.
+**
+** This is equivalent to opening a cursor and calling lsm_csr_seek() with
+** LSM_SEEK_EQ for each key, but faster. The keys are looked up in sorted 
+** order (which is also the order in which xGet is invoked), database pages 
+** are reused between neighbouring keys where possible, and each distinct
+** key is looked up only once.
+**
+** If an error occurs, an LSM error code is returned and xGet may not have
+** been invoked for all keys. Otherwise, LSM_OK is returned.
+*/
+int lsm_multi_get(
+  lsm_db *pDb,
+  const void **apKey, const int *anKey, int nKey,
+  void (*xGet)(void *pCtx, int iKey, const void *pVal, int nVal),
+  void *pCtx
+);
+
 /* 
 ** CAPI: Positioning Database Cursors
 **
@@ -653,6 +1050,43 @@ int lsm_csr_valid(lsm_cursor *pCsr);
 int lsm_csr_key(lsm_cursor *pCsr, const void **ppKey, int *pnKey);
 int lsm_csr_value(lsm_cursor *pCsr, const void **ppVal, int *pnVal);
 
+/*
+** Set *pnVal to the size in bytes of the value that the cursor currently
+** points to. This is faster than lsm_csr_value() for values that span more
+** than one database page, as the value is not copied into a buffer.
+*/
+int lsm_csr_value_size(lsm_cursor *pCsr, int *pnVal);
+
+/*
+** Retrieve the value that the cursor currently points to without copying
+** it. If successful, *paIov is set to point to an array of *pnIov slices
+** that, concatenated in order, make up the value, and LSM_OK is returned.
+** A zero length value may be returned as zero slices.
+**
+** The slices usually point directly into database pages held in the page
+** cache or memory map. References to those pages are held until the
+** cursor is next moved (including by another call to lsm_csr_value_iov()),
+** reset or closed. Until then, the array and the data it points to remain
+** valid and must not be modified.
+*/
+struct lsm_iovec {
+  const void *pData;              /* Pointer to slice data */
+  int nData;                      /* Size of slice in bytes */
+};
+int lsm_csr_value_iov(lsm_cursor *pCsr, const lsm_iovec **paIov, int *pnIov);
+
+/*
+** Copy up to nBuf bytes of the value that the cursor currently points to,
+** starting at byte offset iOff of the value, into buffer pBuf. Set *pnRead
+** to the number of bytes copied, which is less than nBuf only if the end
+** of the value is reached. Only the database pages or the region of the 
+** value log that contain the requested bytes are read, so a large value 
+** may be read in pieces using a buffer of fixed size.
+*/
+int lsm_csr_value_read(
+  lsm_cursor *pCsr, int iOff, void *pBuf, int nBuf, int *pnRead
+);
+
 /*
 ** If no error occurs, this function compares the database key passed via
 ** the pKey/nKey arguments with the key that the cursor passed as the first
@@ -51,6 +51,19 @@
 #define LSM_DFLT_MMAP               (LSM_IS_64_BIT ? 1 : 32768)
 #define LSM_DFLT_MULTIPLE_PROCESSES 1
 #define LSM_DFLT_USE_LOG            1
+#define LSM_DFLT_CACHE_SIZE         (16 * 1024)
+#define LSM_DFLT_BLOOM_BITS         10
+#define LSM_DFLT_PREFIX_KEYS        0
+#define LSM_DFLT_GROUP_COMMIT       0
+#define LSM_DFLT_BACKGROUND_WORKERS 0
+#define LSM_DFLT_THROTTLE_LEVELS    24
+#define LSM_DFLT_SKIPLIST           0
+#define LSM_DFLT_VALUE_LOG          0
+#define LSM_DFLT_LOG_CHECKSUM       LSM_LOG_CKSUM_FLETCHER
+#define LSM_DFLT_TREE_IMAGE         0
+#define LSM_DFLT_SYNC_WINDOW        0
+#define LSM_DFLT_LOG_BUFFER         0
+#define LSM_DFLT_VALUE_LOG_GC       50
 
 /* Initial values for log file checksums. These are only used if the 
 ** database file does not contain a valid checkpoint.  */
@@ -68,6 +81,8 @@
 typedef struct Database Database;
 typedef struct DbLog DbLog;
 typedef struct FileSystem FileSystem;
+typedef struct FilterCache FilterCache;
+typedef struct GroupWrite GroupWrite;
 typedef struct Freelist Freelist;
 typedef struct FreelistEntry FreelistEntry;
 typedef struct Level Level;
@@ -79,6 +94,9 @@ typedef struct Mempool Mempool;
 typedef struct Merge Merge;
 typedef struct MergeInput MergeInput;
 typedef struct MetaPage MetaPage;
+typedef struct MergeJob MergeJob;
+typedef struct MergeRange MergeRange;
+typedef struct MergeFilter MergeFilter;
 typedef struct MultiCursor MultiCursor;
 typedef struct Page Page;
 typedef struct Redirect Redirect;
@@ -87,6 +105,7 @@ typedef struct SegmentMerger SegmentMerger;
 typedef struct ShmChunk ShmChunk;
 typedef struct ShmHeader ShmHeader;
 typedef struct ShmReader ShmReader;
+typedef struct BgWork BgWork;
 typedef struct Snapshot Snapshot;
 typedef struct TransMark TransMark;
 typedef struct Tree Tree;
@@ -155,6 +174,76 @@ int lsmErrorBkpt(int);
 
 #define LSM_MAX_BLOCK_REDIRECTS 16
 
+/*
+** Upper limit on the value that may be configured using 
+** LSM_CONFIG_BLOOM_BITS.
+*/
+#define LSM_MAX_BLOOM_BITS 32
+
+/*
+** Number of microseconds a writer waiting for a group commit leader to
+** commit its write, or for another connection to sync or write the log,
+** sleeps for between checks if the lsm_env does not provide condition 
+** variables (see lsmCondWait()).
+*/
+#define LSM_GROUP_SLEEP_US 10
+
+/*
+** Upper limit on the value that may be configured using
+** LSM_CONFIG_SYNC_WINDOW (one second).
+*/
+#define LSM_MAX_SYNC_WINDOW 1000000
+
+/*
+** If LSM_CONFIG_SAFETY is set to 3 (window), the log file is preallocated
+** in multiples of this many bytes. See lsmFsAllocLog().
+*/
+#define LSM_LOG_PREALLOC (1024*1024)
+
+/*
+** If LSM_CONFIG_LOG_BUFFER is set, a log buffer is handed off to be 
+** written to the log file once it contains this many bytes. See
+** lsmDbLogWrite().
+*/
+#define LSM_LOG_BUFFER_SIZE (256*1024)
+
+/*
+** Upper limit on the value that may be configured using
+** LSM_CONFIG_BACKGROUND_WORKERS.
+*/
+#define LSM_MAX_BACKGROUND_WORKERS 8
+
+/*
+** A background worker thread performs work in chunks of up to 
+** LSM_BGWORK_KB KB, checking whether it has been asked to stop between
+** chunks. If there is no work to do, it sleeps for LSM_BGWORK_SLEEP_US
+** microseconds before checking again.
+*/
+#define LSM_BGWORK_KB       1024
+#define LSM_BGWORK_SLEEP_US 1000
+
+/*
+** A merge job (see lsmSortedMergeJob()) that needs the WORKER lock to
+** allocate a block or to commit its results while some other connection
+** holds it sleeps for LSM_MERGEJOB_SLEEP_US microseconds between attempts.
+*/
+#define LSM_MERGEJOB_SLEEP_US 100
+
+/*
+** While the value log is being garbage collected, each write transaction
+** committed by a connection with auto-work enabled also rewrites live 
+** values (see lsmVlogRelocate()). It visits keys and rewrites values 
+** totalling up to LSM_VLOG_GC_QUANT bytes before it stops.
+*/
+#define LSM_VLOG_GC_QUANT (64 * 1024)
+
+/*
+** A connection waiting for other connections to finish the key ranges of
+** a split merge job checks whether or not they are finished every 
+** LSM_MERGEJOB_WAIT_US microseconds.
+*/
+#define LSM_MERGEJOB_WAIT_US 1000
+
 #define LSM_ATTEMPTS_BEFORE_PROTOCOL 10000
 
 
@@ -170,6 +259,7 @@ int lsmErrorBkpt(int);
 #define LSM_SYSTEMKEY    0x20     /* True if entry is a system key (FREELIST) */
 
 #define LSM_CONTIGUOUS   0x40     /* Used in lsm_tree.c */
+#define LSM_VALUEPTR     0x80     /* Value is a pointer into the value log */
 
 /*
 ** A string that can grow by appending.
@@ -238,11 +328,68 @@ struct LogMark {
   u32 cksum1;                     /* Checksum 1 at offset (iOff-nBuf) */
 };
 
+/*
+** The log checksum algorithm stored in a checkpoint that was not read from
+** the database file (see ckptLoadEmpty()). In this case log recovery must
+** determine the algorithm used by the log file, if any.
+*/
+#define LSM_LOG_CKSUM_UNKNOWN 0xFFFFFFFF
+
 struct TransMark {
   TreeMark tree;
   LogMark log;
 };
 
+/*
+** An instance of this structure is used to pass a single auto-commit write
+** to the connection that commits it on behalf of a group of writers (see
+** lsmGroupJoin() in lsm_shared.c). The structure is allocated on the stack
+** of the writing thread.
+**
+** All fields except rc, bDone and pNext are set by the writer before it
+** joins the group and are read-only thereafter. Fields rc and bDone are 
+** set by the group leader. Fields bDone and pNext are protected by the 
+** Database group mutex.
+**
+** The leader only commits writes queued by connections configured the same
+** way as itself (see lsmGroupTake()). The writer's connection may not be
+** used by any other thread while the write is queued, so the leader may
+** read its configuration through pDb.
+*/
+struct GroupWrite {
+  lsm_db *pDb;                    /* Connection that queued the write */
+  int bDeleteRange;               /* True for lsm_delete_range() */
+  const void *pKey; int nKey;     /* Key to write or delete */
+  const void *pVal; int nVal;     /* Value to write (nVal<0 for delete) */
+  int rc;                         /* Result of write */
+  int bDone;                      /* Set once the write has been committed */
+  GroupWrite *pNext;              /* Next write in group */
+};
+
+/*
+** A write batch (see lsm_batch_new()). Operations are stored in buffer
+** buf using the format described in lsm_batch.c. The same format is used
+** for the payload of LOG_BATCH records in the log file.
+*/
+struct lsm_batch {
+  LsmString buf;                  /* Encoded operations */
+  int nOp;                        /* Number of operations in buf */
+};
+
+/*
+** A blob writer (see lsm_blob_open()). The value is streamed into the
+** value log as it is written, starting at offset iOff. The key is stored
+** in the same allocation as this structure, immediately following it.
+*/
+struct lsm_blob {
+  lsm_db *pDb;                    /* Connection blob is being written by */
+  int iLevel;                     /* Transaction level on open */
+  i64 iOff;                       /* Offset of value in value log */
+  int nVal;                       /* Bytes of value written so far */
+  u8 *pKey;                       /* Key to write value to */
+  int nKey;                       /* Size of pKey in bytes */
+};
+
 /*
 ** A structure that defines the start and end offsets of a region in the
 ** log file. The size of the region in bytes is (iEnd - iStart), so if
@@ -269,7 +416,14 @@ struct TreeRoot {
 
 /*
 ** Tree header structure. 
+**
+** The eTree field is set to one of the following values when the tree is
+** initialized during recovery. It determines the structure used for both
+** the current and old trees. See lsm_tree.c.
 */
+#define TREE_BTREE    0
+#define TREE_SKIPLIST 1
+
 struct TreeHeader {
   u32 iUsedShmid;                 /* Id of first shm chunk used by this tree */
   u32 iNextShmid;                 /* Shm-id of next chunk allocated */
@@ -280,7 +434,11 @@ struct TreeHeader {
   TreeRoot oldroot;               /* Root and height of the previous tree */
   u32 iOldShmid;                  /* Last shm-id used by previous tree */
   u32 iUsrVersion;                /* get/set_user_version() value */
+  u32 eTree;                      /* TREE_BTREE or TREE_SKIPLIST */
   i64 iOldLog;                    /* Log offset associated with old tree */
+  i64 iVlogOff;                   /* Append offset of value log file */
+  i64 iVlogGc;                    /* Value log GC pass rewritten by tree */
+  i64 iOldVlogGc;                 /* iVlogGc value for old tree */
   u32 oldcksum0;
   u32 oldcksum1;
   DbLog log;                      /* Current layout of log file */ 
@@ -334,6 +492,19 @@ struct lsm_db {
   int nDfltBlksz;                 /* Configured by LSM_CONFIG_BLOCK_SIZE */
   int nMaxFreelist;               /* Configured by LSM_CONFIG_MAX_FREELIST */
   int iMmap;                      /* Configured by LSM_CONFIG_MMAP */
+  int nCacheSize;                 /* Configured by LSM_CONFIG_CACHE_SIZE */
+  int nBloomBits;                 /* Configured by LSM_CONFIG_BLOOM_BITS */
+  int bPrefixKeys;                /* Configured by LSM_CONFIG_PREFIX_KEYS */
+  int bGroupCommit;               /* Configured by LSM_CONFIG_GROUP_COMMIT */
+  int nBgWorker;                  /* Configured by L_C_BACKGROUND_WORKERS */
+  int nThrottleLevels;            /* Configured by L_C_THROTTLE_LEVELS */
+  int bSkiplist;                  /* Configured by LSM_CONFIG_SKIPLIST */
+  int nValueLog;                  /* Configured by LSM_CONFIG_VALUE_LOG */
+  int eLogCksum;                  /* Configured by L_C_LOG_CHECKSUM */
+  int bTreeImage;                 /* Configured by LSM_CONFIG_TREE_IMAGE */
+  int nSyncWindow;                /* Configured by LSM_CONFIG_SYNC_WINDOW */
+  int bLogBuffer;                 /* Configured by LSM_CONFIG_LOG_BUFFER */
+  int nVlogGc;                    /* Configured by L_C_VALUE_LOG_GC */
   i64 nAutockpt;                  /* Configured by LSM_CONFIG_AUTOCHECKPOINT */
   int bMultiProc;                 /* Configured by L_C_MULTIPLE_PROCESSES */
   int bReadonly;                  /* Configured by LSM_CONFIG_READONLY */
@@ -357,8 +528,13 @@ struct lsm_db {
   TransMark *aTrans;              /* Array of marks for transaction rollback */
   IntArray rollback;              /* List of tree-nodes to roll back */
   int bDiscardOld;                /* True if lsmTreeDiscardOld() was called */
+  lsm_blob *pBlob;                /* Open blob writer (or NULL) */
+  int bInVlogGc;                  /* True while in lsmVlogRelocate() */
+  i64 iVlogGcPass;                /* GC pass that vlogGcKey belongs to */
+  LsmString vlogGcKey;            /* Key to resume value log GC from */
 
   MultiCursor *pCsrCache;         /* List of all closed cursors */
+  FilterCache *pFilterCache;      /* Cache of bloom filter header pages */
 
   /* Worker context */
   Snapshot *pWorker;              /* Worker snapshot (or NULL) */
@@ -367,6 +543,10 @@ struct lsm_db {
   int bIncrMerge;                 /* True if currently doing a merge */
 
   int bInFactory;                 /* True if within factory.xFactory() */
+  BgWork *pBgWork;                /* Background worker threads (or NULL) */
+  int bMergeJobs;                 /* True to run merges as merge jobs */
+  int nSplitMerge;                /* Max sub-ranges in a split merge job */
+  MergeJob *pMergeJob;            /* Merge job being run (or NULL) */
 
   /* Debugging message callback */
   void (*xLog)(void *, int, const char *);
@@ -439,6 +619,11 @@ struct Level {
 ** iOutputOff:
 **   The byte offset to write to next within the last page of the 
 **   output segment.
+**
+** pFilter:
+**   The bloom filter being built for the output segment. This is not 
+**   stored in checkpoints. The contents of the MergeFilter object are 
+**   private to lsm_sorted.c.
 */
 struct MergeInput {
   Pgno iPg;                       /* Page on which next input is stored */
@@ -451,6 +636,49 @@ struct Merge {
   int nSkip;                      /* Number of separators entries to skip */
   int iOutputOff;                 /* Write offset on output page */
   Pgno iCurrentPtr;               /* Current pointer value */
+  MergeFilter *pFilter;           /* Bloom filter for output (or NULL) */
+};
+
+/*
+** A merge being run by a background worker thread concurrently with other
+** work on the same database. See lsmSortedMergeJob() in lsm_sorted.c.
+**
+** aiClaim:
+**   The levels being merged are identified by the first page of their
+**   left-hand segments. While the job is running, these levels may not be
+**   merged or otherwise modified by any other connection.
+**
+** aBlk:
+**   Blocks allocated by the job. Other connections may not allocate these
+**   blocks until the job is finished. A block that was allocated and then
+**   refreed (see lsmBlockRefree()) is stored as a negative value.
+**
+** pLevel/nRange/aRange:
+**   If the job is a split merge, the level being written by the job and 
+**   the array of key ranges it has been split into. Each key range is 
+**   merged separately, possibly by some other connection. The contents of 
+**   the MergeRange objects are private to lsm_sorted.c.
+**
+** iNextRange/nRangeDone:
+**   The index of the next key range of a split merge that has not yet 
+**   been started, and the number of key ranges that have been finished.
+**
+** Except for aBlk[] entries that are refreed while the job is running, 
+** fields are only modified by the connection that started the job, or 
+** while holding the WORKER lock.
+*/
+struct MergeJob {
+  int nClaim;                     /* Number of entries in aiClaim[] */
+  Pgno *aiClaim;                  /* First page of each level being merged */
+  int nBlk;                       /* Number of entries in aBlk[] */
+  int nBlkAlloc;                  /* Allocated size of aBlk[] */
+  int *aBlk;                      /* Blocks allocated by this job */
+  Level *pLevel;                  /* Level written by split merge */
+  int nRange;                     /* Number of entries in aRange[] */
+  MergeRange *aRange;             /* Key ranges of split merge */
+  int iNextRange;                 /* Next key range to start */
+  int nRangeDone;                 /* Number of key ranges finished */
+  MergeJob *pNext;                /* Next job running on the same database */
 };
 
 /* 
@@ -484,6 +712,11 @@ struct ShmReader {
 **   value is set to 0. Otherwise, it is set to the meta-page number that
 **   contains the most recently written checkpoint (either 1 or 2).
 **
+** eLogCksum:
+**   The algorithm used to checksum log records (LSM_LOG_CKSUM_FLETCHER or
+**   LSM_LOG_CKSUM_CRC32C). Set by log recovery and copied into each
+**   checkpoint written to the database file. See lsm_log.c.
+**
 ** hdr1, hdr2:
 **   The two copies of the in-memory tree header. Two copies are required
 **   in case a writer fails while updating one of them.
@@ -493,6 +726,7 @@ struct ShmHeader {
   u32 aSnap2[LSM_META_PAGE_SIZE / 4];
   u32 bWriter;
   u32 iMetaPage;
+  u32 eLogCksum;
   TreeHeader hdr1;
   TreeHeader hdr2;
   ShmReader aReader[LSM_LOCK_NREADER];
@@ -568,6 +802,12 @@ struct Snapshot {
   Pgno aiAppend[LSM_APPLIST_SZ];  /* Append point list */
   Freelist freelist;              /* Free block list */
   u32 nWrite;                     /* Total number of pages written to disk */
+  i64 iVlogOff;                   /* Size of value log referenced by levels */
+  i64 nVlogDead;                  /* Value log bytes discarded by merges */
+  i64 iVlogFree;                  /* Value log bytes already reclaimed */
+  i64 iVlogGc;                    /* End of region being reclaimed (or 0) */
+  i64 nVlogGcDead;                /* Value of nVlogDead when iVlogGc was set */
+  i64 iVlogGcId;                  /* Snapshot that must be in use to punch */
 };
 #define LSM_INITIAL_SNAPSHOT_ID 11
 
@@ -592,9 +832,14 @@ u32 lsmCheckpointNBlock(u32 *);
 i64 lsmCheckpointId(u32 *, int);
 u32 lsmCheckpointNWrite(u32 *, int);
 i64 lsmCheckpointLogOffset(u32 *);
+i64 lsmCheckpointVlogOffset(u32 *);
+i64 lsmCheckpointVlogDead(u32 *);
+i64 lsmCheckpointVlogFree(u32 *);
+i64 lsmCheckpointVlogGc(u32 *);
 int lsmCheckpointPgsz(u32 *);
 int lsmCheckpointBlksz(u32 *);
 void lsmCheckpointLogoffset(u32 *aCkpt, DbLog *pLog);
+u32 lsmCheckpointLogCksum(u32 *aCkpt);
 void lsmCheckpointZeroLogoffset(lsm_db *);
 
 int lsmCheckpointSaveWorker(lsm_db *pDb, int);
@@ -619,10 +864,14 @@ int lsmTreeHasOld(lsm_db *pDb);
 
 int lsmTreeSize(lsm_db *);
 int lsmTreeEndTransaction(lsm_db *pDb, int bCommit);
+void lsmTreeRecoverCommit(lsm_db *pDb);
+int lsmTreeSaveImage(lsm_db *pDb);
+int lsmTreeLoadImage(lsm_db *pDb, int *pbLoaded);
 int lsmTreeLoadHeader(lsm_db *pDb, int *);
 int lsmTreeLoadHeaderOk(lsm_db *, int);
 
 int lsmTreeInsert(lsm_db *pDb, void *pKey, int nKey, void *pVal, int nVal);
+int lsmTreeInsertPtr(lsm_db *pDb, void *pKey, int nKey, void *pPtr, int nPtr);
 int lsmTreeDelete(lsm_db *db, void *pKey1, int nKey1, void *pKey2, int nKey2);
 void lsmTreeRollback(lsm_db *pDb, TreeMark *pMark);
 void lsmTreeMark(lsm_db *pDb, TreeMark *pMark);
@@ -673,12 +922,22 @@ int lsmMutexHeld(lsm_env *, lsm_mutex *);
 int lsmMutexNotHeld(lsm_env *, lsm_mutex *);
 #endif
 
+int lsmThreadSupported(lsm_env *);
+int lsmThreadNew(lsm_env*, void (*)(void *), void *, lsm_thread **);
+void lsmThreadJoin(lsm_env*, lsm_thread *);
+
+int lsmCondNew(lsm_env *, lsm_cond **);
+void lsmCondDel(lsm_env *, lsm_cond *);
+void lsmCondWait(lsm_env *, lsm_cond *, lsm_mutex *, int);
+void lsmCondBroadcast(lsm_env *, lsm_cond *);
+
 /**************************************************************************
 ** Start of functions from "lsm_file.c".
 */
 int lsmFsOpen(lsm_db *, const char *, int);
 int lsmFsOpenLog(lsm_db *, int *);
 void lsmFsCloseLog(lsm_db *);
+int lsmFsOpenVlog(lsm_db *);
 void lsmFsClose(FileSystem *);
 
 int lsmFsConfigure(lsm_db *db);
@@ -697,6 +956,7 @@ int lsmFsSortedDelete(FileSystem *, Snapshot *, int, Segment *);
 int lsmFsSortedFinish(FileSystem *, Segment *);
 int lsmFsSortedAppend(FileSystem *, Snapshot *, Level *, int, Page **);
 int lsmFsSortedPadding(FileSystem *, Snapshot *, Segment *);
+int lsmFsSortedJoin(FileSystem *, Segment *, Segment *);
 
 /* Functions to retrieve the lsm_env pointer from a FileSystem or Page object */
 lsm_env *lsmFsEnv(FileSystem *);
@@ -710,6 +970,7 @@ void lsmSortedSplitkey(lsm_db *, Level *, int *);
 /* Reading sorted run content. */
 int lsmFsDbPageLast(FileSystem *pFS, Segment *pSeg, Page **ppPg);
 int lsmFsDbPageGet(FileSystem *, Segment *, Pgno, Page **);
+void lsmFsPageProtect(Page *);
 int lsmFsDbPageNext(Segment *, Page *, int eDir, Page **);
 
 u8 *lsmFsPageData(Page *, int *);
@@ -737,6 +998,7 @@ int lsmFsPageWritable(Page *);
 /* Functions to read, write and sync the log file. */
 int lsmFsWriteLog(FileSystem *pFS, i64 iOff, LsmString *pStr);
 int lsmFsSyncLog(FileSystem *pFS);
+int lsmFsAllocLog(FileSystem *pFS, i64 iFree, i64 iEnd);
 int lsmFsReadLog(FileSystem *pFS, i64 iOff, int nRead, LsmString *pStr);
 int lsmFsTruncateLog(FileSystem *pFS, i64 nByte);
 int lsmFsTruncateDb(FileSystem *pFS, i64 nByte);
@@ -747,7 +1009,20 @@ LsmFile *lsmFsDeferClose(FileSystem *pFS);
 /* And to sync the db file */
 int lsmFsSyncDb(FileSystem *, int);
 
+/* Reading, writing and syncing the value log file */
+int lsmFsWriteVlog(FileSystem *, i64, const void *, int);
+int lsmFsReadVlog(FileSystem *, i64, void *, int);
+int lsmFsSyncVlog(FileSystem *);
+int lsmFsPunchVlog(FileSystem *, i64, i64);
+
+/* Reading, writing, syncing and deleting the tree image file */
+int lsmFsWriteTreeImage(FileSystem *, i64, const void *, int);
+int lsmFsReadTreeImage(FileSystem *, i64, void *, int);
+int lsmFsSyncTreeImage(FileSystem *);
+void lsmFsCloseAndDeleteTreeImage(FileSystem *);
+
 void lsmFsFlushWaiting(FileSystem *, int *);
+int lsmFsFlushWriteBuffer(FileSystem *);
 
 /* Used by lsm_info(ARRAY_STRUCTURE) and lsm_config(MMAP) */
 int lsmInfoArrayStructure(lsm_db *pDb, int bBlock, Pgno iFirst, char **pzOut);
@@ -780,7 +1055,10 @@ void lsmFsPurgeCache(FileSystem *);
 */
 int lsmInfoPageDump(lsm_db *, Pgno, int, char **);
 void lsmSortedCleanup(lsm_db *);
+void lsmSortedFreeFilterCache(lsm_db *);
+void lsmSortedFreeMergeFilters(lsm_env *, MergeFilter *);
 int lsmSortedAutoWork(lsm_db *, int nUnit);
+int lsmSortedMergeJob(lsm_db *, int (*)(void *), void *, int *);
 
 int lsmSortedWalkFreelist(lsm_db *, int, int (*)(void *, int, i64), void *);
 
@@ -808,9 +1086,14 @@ int lsmMCursorFirst(MultiCursor *);
 int lsmMCursorPrev(MultiCursor *);
 int lsmMCursorLast(MultiCursor *);
 int lsmMCursorValid(MultiCursor *);
+void lsmMCursorKeepLeaves(MultiCursor *);
 int lsmMCursorNext(MultiCursor *);
 int lsmMCursorKey(MultiCursor *, void **, int *);
 int lsmMCursorValue(MultiCursor *, void **, int *);
+int lsmMCursorValueSize(MultiCursor *, int *);
+int lsmMCursorVlogPtr(MultiCursor *, i64 *);
+int lsmMCursorValueIov(MultiCursor *, const lsm_iovec **, int *);
+int lsmMCursorValueRead(MultiCursor *, int, void *, int, int *);
 int lsmMCursorType(MultiCursor *, int *);
 lsm_db *lsmMCursorDb(MultiCursor *);
 void lsmMCursorFreeCache(lsm_db *);
@@ -838,6 +1121,29 @@ int lsmVarintGet64(const u8 *aData, i64 *piVal);
 int lsmVarintLen32(int);
 int lsmVarintSize(u8 c);
 
+/*
+** Functions from "lsm_codec.c".
+*/
+int lsmCodecBuiltin(u32 iId, lsm_compress *p);
+
+/*
+** Functions from "lsm_batch.c".
+*/
+int lsmBatchApply(lsm_db *pDb, const u8 *aBatch, int nBatch);
+
+/*
+** Functions from "lsm_vlog.c".
+*/
+#define LSM_VLOG_MAXPTR 14        /* Maximum size of an encoded pointer */
+int lsmVlogWrite(lsm_db *, const void *, int, u8 *, int *);
+int lsmVlogPtrDecode(const u8 *, int, i64 *, int *);
+int lsmVlogAppend(lsm_db *, const void *, int);
+int lsmVlogPtrEncode(u8 *, i64, int);
+int lsmVlogSync(lsm_db *, i64);
+int lsmInfoValueLog(lsm_db *, i64 *, i64 *);
+int lsmVlogWork(lsm_db *, int *);
+int lsmVlogRelocate(lsm_db *, int);
+
 /* 
 ** Functions from file "main.c".
 */
@@ -848,14 +1154,17 @@ int lsmInfoFreelist(lsm_db *pDb, char **pzOut);
 ** Functions from file "lsm_log.c".
 */
 int lsmLogBegin(lsm_db *pDb);
-int lsmLogWrite(lsm_db *, void *, int, void *, int);
+int lsmLogWrite(lsm_db *, int, void *, int, void *, int);
+int lsmLogWriteBatch(lsm_db *, const u8 *, int);
 int lsmLogCommit(lsm_db *);
 void lsmLogEnd(lsm_db *pDb, int bCommit);
+int lsmLogWait(lsm_db *);
 void lsmLogTell(lsm_db *, LogMark *);
 void lsmLogSeek(lsm_db *, LogMark *);
 void lsmLogClose(lsm_db *);
 
 int lsmLogRecover(lsm_db *);
+void lsmLogChecksum(u32 eCksum, const void *a, int n, u32 *aCksum);
 int lsmInfoLogStructure(lsm_db *pDb, char **pzVal);
 
 
@@ -871,6 +1180,7 @@ int lsmBeginWriteTrans(lsm_db *);
 int lsmBeginFlush(lsm_db *);
 
 int lsmDetectRoTrans(lsm_db *db, int *);
+int lsmSnapshotInUse(lsm_db *, i64 *);
 int lsmBeginRoTrans(lsm_db *db);
 
 int lsmBeginWork(lsm_db *);
@@ -897,12 +1207,40 @@ int lsmBlockAllocate(lsm_db *, int, int *);
 int lsmBlockFree(lsm_db *, int);
 int lsmBlockRefree(lsm_db *, int);
 
+void lsmMergeJobBegin(lsm_db *, MergeJob *);
+void lsmMergeJobEnd(lsm_db *, MergeJob *);
+int lsmMergeJobRunning(lsm_db *);
+int lsmMergeJobClaimed(lsm_db *, Level *);
+int lsmMergeJobLock(lsm_db *);
+int lsmMergeJobCommit(lsm_db *, MergeJob *);
+void lsmMergeJobSplit(lsm_db *, MergeJob *, Level *, int, MergeRange *);
+MergeJob *lsmMergeJobHelp(lsm_db *, int *);
+int lsmMergeJobRangeNext(lsm_db *, MergeJob *);
+void lsmMergeJobRangeDone(lsm_db *, MergeJob *);
+void lsmMergeJobRangeWait(lsm_db *, MergeJob *);
+MergeFilter **lsmDbMergeFilters(lsm_db *);
+
 void lsmFreelistDeltaBegin(lsm_db *);
 void lsmFreelistDeltaEnd(lsm_db *);
 int lsmFreelistDelta(lsm_db *pDb);
 
 DbLog *lsmDatabaseLog(lsm_db *pDb);
 
+int lsmDbCacheRead(lsm_db *, Pgno, u8 *, int);
+void lsmDbCacheWrite(lsm_db *, Pgno, const u8 *, int);
+void lsmDbCacheInvalidate(lsm_db *, Pgno, Pgno);
+void lsmDbCacheSnapshotLoaded(lsm_db *, i64);
+void lsmDbCacheSnapshotSaved(lsm_db *, i64);
+int lsmDbCacheConfigure(lsm_db *, int);
+
+int lsmGroupJoin(lsm_db *, GroupWrite *);
+GroupWrite *lsmGroupTake(lsm_db *);
+void lsmGroupDone(lsm_db *, GroupWrite *);
+i64 lsmGroupSyncQueue(lsm_db *);
+int lsmGroupSync(lsm_db *, i64);
+int lsmDbLogWrite(lsm_db *, i64, LsmString *, i64 *);
+int lsmDbLogFlush(lsm_db *, i64);
+
 #ifdef LSM_DEBUG
   int lsmHoldingClientMutex(lsm_db *pDb);
   int lsmShmAssertLock(lsm_db *db, int iLock, int eOp);
@@ -0,0 +1,210 @@
+/*
+** 2026-10-16
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+**
+** Write batches (lsm_batch objects).
+**
+** A write batch is a buffer containing a series of encoded operations.
+** The same encoding is used for the payload of the LOG_BATCH records
+** written to the log file by lsm_batch_write() (see lsm_log.c), so that
+** writing a batch to the log is a single copy. Each operation is one of:
+**
+**   BATCH_INSERT:       * A single 0x01 byte,
+**                       * The number of bytes in the key, as a varint,
+**                       * The number of bytes in the value, as a varint,
+**                       * The key data,
+**                       * The value data.
+**
+**   BATCH_DELETE:       * A single 0x02 byte,
+**                       * The number of bytes in the key, as a varint,
+**                       * The key data.
+**
+**   BATCH_DELETE_RANGE: * A single 0x03 byte,
+**                       * The number of bytes in the first key, as a varint,
+**                       * The number of bytes in the second key, as a varint,
+**                       * The first key,
+**                       * The second key.
+**
+** Varints are as described in lsm_varint.c (SQLite 4 format).
+*/
+#include "lsmInt.h"
+
+#define BATCH_INSERT       0x01
+#define BATCH_DELETE       0x02
+#define BATCH_DELETE_RANGE 0x03
+
+/*
+** Ensure there is space for at least nReq more bytes in the buffer of
+** batch p. Unlike lsmStringExtend(), the allocation grows geometrically,
+** as batches are typically built up from a large number of small
+** operations. If an OOM error occurs, the batch is left unmodified and
+** LSM_NOMEM is returned.
+*/
+static int batchExtend(lsm_batch *p, int nReq){
+  if( p->buf.n+nReq>p->buf.nAlloc ){
+    int nAlloc = LSM_MAX(p->buf.nAlloc*2, p->buf.n+nReq+256);
+    char *zNew = lsmRealloc(p->buf.pEnv, p->buf.z, nAlloc);
+    if( zNew==0 ) return LSM_NOMEM_BKPT;
+    p->buf.z = zNew;
+    p->buf.nAlloc = nAlloc;
+  }
+  return LSM_OK;
+}
+
+/*
+** Append an operation of type eOp to batch p. Blobs pA/nA and pB/nB are
+** the two keys for a BATCH_DELETE_RANGE, the key and value for a
+** BATCH_INSERT, or the key and nB==-1 for a BATCH_DELETE.
+*/
+static int batchAppend(
+  lsm_batch *p,
+  int eOp,
+  const void *pA, int nA,
+  const void *pB, int nB
+){
+  int nReq;
+  int rc;
+
+  if( nA<0 || (nB<0 && eOp!=BATCH_DELETE) ) return LSM_MISUSE_BKPT;
+
+  nReq = 1 + lsmVarintLen32(nA) + nA;
+  if( nB>=0 ) nReq += lsmVarintLen32(nB) + nB;
+  rc = batchExtend(p, nReq);
+  if( rc==LSM_OK ){
+    u8 *a = (u8 *)&p->buf.z[p->buf.n];
+    *(a++) = (u8)eOp;
+    a += lsmVarintPut32(a, nA);
+    if( nB>=0 ) a += lsmVarintPut32(a, nB);
+    memcpy(a, pA, nA);
+    a += nA;
+    if( nB>0 ){
+      memcpy(a, pB, nB);
+      a += nB;
+    }
+    p->buf.n = (a - (u8 *)p->buf.z);
+    p->nOp++;
+  }
+  return rc;
+}
+
+/*
+** Read a varint from offset *piOff of buffer a[] (size n bytes). If
+** successful, set *piVal to the value read, advance *piOff past the varint
+** and return LSM_OK. Or, if the varint or the value it contains would
+** extend past the end of the buffer, return LSM_CORRUPT.
+*/
+static int batchGetVarint(const u8 *a, int n, int *piOff, int *piVal){
+  u8 aVarint[9];
+  int nCopy = LSM_MIN(n - *piOff, (int)sizeof(aVarint));
+  int nVarint;
+
+  memset(aVarint, 0, sizeof(aVarint));
+  memcpy(aVarint, &a[*piOff], nCopy);
+  nVarint = lsmVarintGet32(aVarint, piVal);
+  if( nVarint>nCopy || *piVal<0 ) return LSM_CORRUPT_BKPT;
+  *piOff += nVarint;
+  return LSM_OK;
+}
+
+/*
+** Insert the contents of the encoded batch aBatch/nBatch into the
+** in-memory tree of the write transaction open on connection pDb. This is
+** used both by lsm_batch_write() and when recovering LOG_BATCH records
+** from the log file.
+**
+** LSM_CORRUPT is returned if the buffer is not a well-formed batch. In
+** that case some of the operations it contains may already have been
+** applied - it is the responsibility of the caller to roll them back.
+*/
+int lsmBatchApply(lsm_db *pDb, const u8 *aBatch, int nBatch){
+  int rc = LSM_OK;
+  int iOff = 0;
+
+  while( rc==LSM_OK && iOff<nBatch ){
+    int eOp = aBatch[iOff++];
+    int nA = 0;
+    int nB = -1;
+    u8 *pA;
+    u8 *pB;
+
+    rc = batchGetVarint(aBatch, nBatch, &iOff, &nA);
+    if( rc==LSM_OK && eOp!=BATCH_DELETE ){
+      rc = batchGetVarint(aBatch, nBatch, &iOff, &nB);
+    }
+    if( rc!=LSM_OK ) break;
+    if( (eOp!=BATCH_INSERT && eOp!=BATCH_DELETE && eOp!=BATCH_DELETE_RANGE)
+     || nA>(nBatch-iOff) || LSM_MAX(nB, 0)>(nBatch-iOff-nA)
+    ){
+      rc = LSM_CORRUPT_BKPT;
+      break;
+    }
+    pA = (u8 *)&aBatch[iOff];
+    pB = (nB>=0 ? (u8 *)&aBatch[iOff+nA] : 0);
+    iOff += nA + LSM_MAX(nB, 0);
+
+    if( eOp==BATCH_DELETE_RANGE ){
+      if( pDb->xCmp(pA, nA, pB, nB)<0 ){
+        rc = lsmTreeDelete(pDb, pA, nA, pB, nB);
+      }
+    }else{
+      rc = lsmTreeInsert(pDb, pA, nA, pB, nB);
+    }
+  }
+
+  return rc;
+}
+
+int lsm_batch_new(lsm_db *pDb, lsm_batch **ppBatch){
+  int rc = LSM_OK;
+  lsm_batch *p;
+
+  p = (lsm_batch *)lsmMallocZeroRc(pDb->pEnv, sizeof(lsm_batch), &rc);
+  if( p ){
+    lsmStringInit(&p->buf, pDb->pEnv);
+  }
+  *ppBatch = p;
+  return rc;
+}
+
+int lsm_batch_insert(
+  lsm_batch *p,
+  const void *pKey, int nKey,
+  const void *pVal, int nVal
+){
+  return batchAppend(p, BATCH_INSERT, pKey, nKey, pVal, nVal);
+}
+
+int lsm_batch_delete(lsm_batch *p, const void *pKey, int nKey){
+  return batchAppend(p, BATCH_DELETE, pKey, nKey, 0, -1);
+}
+
+int lsm_batch_delete_range(
+  lsm_batch *p,
+  const void *pKey1, int nKey1,
+  const void *pKey2, int nKey2
+){
+  return batchAppend(p, BATCH_DELETE_RANGE, pKey1, nKey1, pKey2, nKey2);
+}
+
+void lsm_batch_reset(lsm_batch *p){
+  if( p ){
+    p->buf.n = 0;
+    p->nOp = 0;
+  }
+}
+
+void lsm_batch_close(lsm_batch *p){
+  if( p ){
+    lsm_env *pEnv = p->buf.pEnv;
+    lsmStringClear(&p->buf);
+    lsmFree(pEnv, p);
+  }
+}
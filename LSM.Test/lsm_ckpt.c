@@ -94,6 +94,23 @@
 **        2b. A 64-bit integer (MSW followed by LSW). -1 for a delete entry,
 **            or the associated checkpoint id for an insert.
 **
+**   The tail (see the CKPT_TAIL_XXX #defines). Checkpoints written by
+**   earlier versions do not have one, or have only the first part of one.
+**   The tail is made up of whatever integers are left between the 
+**   free-list and the checksum. Fields that are not present are read as 0
+**   (or, for the log checksum algorithm, LSM_LOG_CKSUM_FLETCHER):
+**
+**     1. The size of the value log referenced by the database (64-bits).
+**     2. Value log bytes discarded by merges (64-bits).
+**     3. The log checksum algorithm (LSM_LOG_CKSUM_XXX).
+**     4. Value log bytes already reclaimed (64-bits).
+**     5. End of value log region being reclaimed, or 0 (64-bits).
+**     6. Value of field 2 when field 5 was set (64-bits).
+**     7. Id of the checkpoint that made the region at field 5 unused, 
+**        or 0 (64-bits).
+**
+**     See lsm_vlog.c for fields 4 to 7.
+**
 **   The checksum:
 **
 **     1. Checksum value 1.
@@ -201,6 +218,21 @@ static const int one = 1;
 #define CKPT_HDR_LO_CKSUM1 11
 #define CKPT_HDR_LO_CKSUM2 12
 
+/* Offsets of the integers in the checkpoint tail, relative to its start. */
+#define CKPT_TAIL_VLOG_MSW    0
+#define CKPT_TAIL_VLOG_LSW    1
+#define CKPT_TAIL_VDEAD_MSW   2
+#define CKPT_TAIL_VDEAD_LSW   3
+#define CKPT_TAIL_LOGCKSUM    4
+#define CKPT_TAIL_VFREE_MSW   5
+#define CKPT_TAIL_VFREE_LSW   6
+#define CKPT_TAIL_VGC_MSW     7
+#define CKPT_TAIL_VGC_LSW     8
+#define CKPT_TAIL_VGCDEAD_MSW 9
+#define CKPT_TAIL_VGCDEAD_LSW 10
+#define CKPT_TAIL_VGCID_MSW   11
+#define CKPT_TAIL_VGCID_LSW   12
+
 typedef struct CkptBuffer CkptBuffer;
 
 /*
@@ -299,6 +331,43 @@ static i64 ckptGobble64(u32 *a, int *piIn){
   return ckptRead64(&a[iIn]);
 }
 
+/*
+** Return the offset of the tail within checkpoint aCkpt[] and set *pnTail
+** to its size in integers. Or, if the checkpoint was written by an earlier
+** version and does not have a tail, return 0.
+*/
+static int ckptTailOffset(u32 *aCkpt, int *pnTail){
+  int nCkpt = (int)aCkpt[CKPT_HDR_NCKPT];
+  int nLevel = (int)aCkpt[CKPT_HDR_NLEVEL];
+  int iIn = CKPT_HDR_SIZE + CKPT_APPENDLIST_SIZE + CKPT_LOGPTR_SIZE;
+  int i;
+
+  /* Skip the level records, the block-redirect list and the free-list. */
+  for(i=0; i<nLevel && iIn<nCkpt; i++){
+    int nRight = (int)aCkpt[iIn+1];
+    iIn += 2 + 8 * (1 + nRight);
+    if( nRight>0 && iIn<nCkpt ){
+      iIn += 2 + 3 * (int)aCkpt[iIn] + 5;
+    }
+  }
+  if( iIn<nCkpt ) iIn += 1 + 2 * (int)aCkpt[iIn];
+  if( iIn<nCkpt ) iIn += 1 + 3 * (int)aCkpt[iIn];
+
+  if( iIn+2>=nCkpt ) return 0;
+  *pnTail = nCkpt - 2 - iIn;
+  return iIn;
+}
+
+/*
+** Return the 64-bit field that starts at offset iField of the tail of 
+** checkpoint aCkpt[]. Or 0 if the checkpoint does not have that field.
+*/
+static i64 ckptTail64(u32 *aCkpt, int iField){
+  int nTail = 0;
+  int iTail = ckptTailOffset(aCkpt, &nTail);
+  if( iTail==0 || iField+2>nTail ) return 0;
+  return ckptRead64(&aCkpt[iTail+iField]);
+}
 
 /*
 ** Append a 6-value segment record corresponding to pSeg to the checkpoint 
@@ -419,8 +488,22 @@ static int ckptExportSnapshot(
   ckpt.pEnv = pDb->pEnv;
   iOut = CKPT_HDR_SIZE;
 
-  /* Write the log offset into the checkpoint. */
+  /* Write the log offset into the checkpoint. If the in-memory tree has
+  ** just been flushed, the checkpoint must also cover any values it points
+  ** to in the value log.  */
   ckptExportLog(pDb, bLog, &ckpt, &iOut, &rc);
+  if( bLog ){
+    pSnap->iVlogOff = LSM_MAX(pSnap->iVlogOff, pDb->treehdr.iVlogOff);
+
+    /* If the tree just flushed rewrote all live values in the region of
+    ** the value log being reclaimed, the region is no longer used by 
+    ** this snapshot (see lsmVlogWork()).  */
+    if( pSnap->iVlogGc && pSnap->iVlogGcId==0 
+     && pDb->treehdr.iOldVlogGc==pSnap->iVlogGc 
+    ){
+      pSnap->iVlogGcId = iId;
+    }
+  }
 
   /* Write the append-point list */
   ckptExportAppendlist(pDb, &ckpt, &iOut, &rc);
@@ -455,6 +538,17 @@ static int ckptExportSnapshot(
     }
   }
 
+  /* Write the tail */
+  ckptSetValue(&ckpt, iOut++, (u32)(pSnap->iVlogOff>>32), &rc);
+  ckptSetValue(&ckpt, iOut++, (u32)(pSnap->iVlogOff), &rc);
+  ckptSetValue(&ckpt, iOut++, (u32)(pSnap->nVlogDead>>32), &rc);
+  ckptSetValue(&ckpt, iOut++, (u32)(pSnap->nVlogDead), &rc);
+  ckptSetValue(&ckpt, iOut++, pDb->pShmhdr->eLogCksum, &rc);
+  ckptAppend64(&ckpt, &iOut, pSnap->iVlogFree, &rc);
+  ckptAppend64(&ckpt, &iOut, pSnap->iVlogGc, &rc);
+  ckptAppend64(&ckpt, &iOut, pSnap->nVlogGcDead, &rc);
+  ckptAppend64(&ckpt, &iOut, pSnap->iVlogGcId, &rc);
+
   /* Write the checkpoint header */
   assert( iId>=0 );
   assert( pSnap->iCmpId==pDb->compress.iId
@@ -786,6 +880,9 @@ static void ckptLoadEmpty(lsm_db *pDb){
     0,0,0,0, 0,0,0,0,        /* The append list */
     0,                       /* The redirected block list */
     0,                       /* The free block list */
+    0, 0,                    /* CKPT_TAIL_VLOG_MSW, CKPT_TAIL_VLOG_LSW */
+    0, 0,                    /* CKPT_TAIL_VDEAD_MSW, CKPT_TAIL_VDEAD_LSW */
+    LSM_LOG_CKSUM_UNKNOWN,   /* CKPT_TAIL_LOGCKSUM */
     0, 0                     /* Space for checksum values */
   };
   u32 nCkpt = array_size(aCkpt);
@@ -975,8 +1072,15 @@ int lsmCheckpointDeserialize(
     int iIn = CKPT_HDR_SIZE + CKPT_APPENDLIST_SIZE + CKPT_LOGPTR_SIZE;
 
     pNew->iId = lsmCheckpointId(aCkpt, 0);
+    lsmDbCacheSnapshotLoaded(pDb, pNew->iId);
     pNew->nBlock = aCkpt[CKPT_HDR_NBLOCK];
     pNew->nWrite = aCkpt[CKPT_HDR_NWRITE];
+    pNew->iVlogOff = lsmCheckpointVlogOffset(aCkpt);
+    pNew->nVlogDead = lsmCheckpointVlogDead(aCkpt);
+    pNew->iVlogFree = lsmCheckpointVlogFree(aCkpt);
+    pNew->iVlogGc = ckptTail64(aCkpt, CKPT_TAIL_VGC_MSW);
+    pNew->nVlogGcDead = ckptTail64(aCkpt, CKPT_TAIL_VGCDEAD_MSW);
+    pNew->iVlogGcId = ckptTail64(aCkpt, CKPT_TAIL_VGCID_MSW);
     rc = ckptLoadLevels(pDb, aCkpt, &iIn, nLevel, &pNew->pLevel);
     pNew->iLogOff = lsmCheckpointLogOffset(aCkpt);
     pNew->iCmpId = aCkpt[CKPT_HDR_CMPID];
@@ -1080,10 +1184,17 @@ int lsmCheckpointSaveWorker(lsm_db *pDb, int bFlush){
   int n = 0;
   int rc;
 
+  /* Make sure any data written to the database file by this connection is 
+  ** visible to other connections before publishing a snapshot that may
+  ** refer to it.  */
+  rc = lsmFsFlushWriteBuffer(pDb->pFS);
+  if( rc!=LSM_OK ) return rc;
+
   pSnap->iId++;
   rc = ckptExportSnapshot(pDb, bFlush, pSnap->iId, 1, &p, &n);
   if( rc!=LSM_OK ) return rc;
   assert( ckptChecksumOk((u32 *)p) );
+  lsmDbCacheSnapshotSaved(pDb, pSnap->iId);
 
   assert( n<=LSM_META_PAGE_SIZE );
   memcpy(pShm->aSnap2, p, n);
@@ -1181,6 +1292,27 @@ i64 lsmCheckpointLogOffset(u32 *aCkpt){
   return ((i64)aCkpt[CKPT_HDR_LO_MSW] << 32) + (i64)aCkpt[CKPT_HDR_LO_LSW];
 }
 
+i64 lsmCheckpointVlogOffset(u32 *aCkpt){
+  return ckptTail64(aCkpt, CKPT_TAIL_VLOG_MSW);
+}
+
+i64 lsmCheckpointVlogDead(u32 *aCkpt){
+  return ckptTail64(aCkpt, CKPT_TAIL_VDEAD_MSW);
+}
+
+i64 lsmCheckpointVlogFree(u32 *aCkpt){
+  return ckptTail64(aCkpt, CKPT_TAIL_VFREE_MSW);
+}
+
+/*
+** Return the end of the region of the value log that live values must be
+** rewritten from (see lsmVlogRelocate()), or 0 if there is no such region.
+*/
+i64 lsmCheckpointVlogGc(u32 *aCkpt){
+  if( ckptTail64(aCkpt, CKPT_TAIL_VGCID_MSW) ) return 0;
+  return ckptTail64(aCkpt, CKPT_TAIL_VGC_MSW);
+}
+
 int lsmCheckpointPgsz(u32 *aCkpt){ return (int)aCkpt[CKPT_HDR_PGSZ]; }
 
 int lsmCheckpointBlksz(u32 *aCkpt){ return (int)aCkpt[CKPT_HDR_BLKSZ]; }
@@ -1196,6 +1328,19 @@ void lsmCheckpointLogoffset(
   pLog->iSnapshotId = lsmCheckpointId(aCkpt, 0);
 }
 
+/*
+** Return the log checksum algorithm recorded in the checkpoint, or
+** LSM_LOG_CKSUM_UNKNOWN if the checkpoint was not read from the database.
+** Checkpoints written before the algorithm was recorded always describe
+** a log that uses LSM_LOG_CKSUM_FLETCHER.
+*/
+u32 lsmCheckpointLogCksum(u32 *aCkpt){
+  int nTail = 0;
+  int iTail = ckptTailOffset(aCkpt, &nTail);
+  if( iTail==0 || nTail<=CKPT_TAIL_LOGCKSUM ) return LSM_LOG_CKSUM_FLETCHER;
+  return aCkpt[iTail+CKPT_TAIL_LOGCKSUM];
+}
+
 void lsmCheckpointZeroLogoffset(lsm_db *pDb){
   u32 nCkpt;
 
@@ -0,0 +1,228 @@
+/*
+** 2026-10-16
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+**
+** Compression codecs built into the library.
+**
+** A built-in codec is selected either by passing an lsm_compress structure
+** with the iId field set to the codec's compression id and all callbacks
+** set to NULL to LSM_CONFIG_SET_COMPRESSION, or automatically when a
+** connection that has no compression configured opens a database written
+** using a built-in codec (see lsmCheckCompressionId()).
+**
+** LSM_COMPRESSION_LZ:
+**
+**   A byte-oriented LZ77 codec similar to LZ4. The compressed data is a
+**   series of sequences, each of which consists of:
+**
+**     * A token byte. The upper 4 bits contain the number of literal bytes
+**       in the sequence, and the lower 4 bits the length of the match that
+**       follows them, minus LZ_MIN_MATCH. If either 4-bit value is 15,
+**       the value is extended by the sum of one or more bytes that follow
+**       (the literal length extension bytes immediately follow the token,
+**       the match length extension bytes follow the match offset). Each
+**       extension byte except the last is 255.
+**
+**     * The literal bytes.
+**
+**     * The match offset - the distance back from the current output
+**       position at which the match starts - stored as a 2 byte
+**       big-endian integer. The match may overlap the bytes it produces.
+**
+**   The final sequence contains literals only - the compressed data ends
+**   immediately after them.
+**
+**   The compression unit is a single page. The compressed database file
+**   format (see lsm_file.c) stores each page as a separate record located
+**   by its byte offset, and there is no support for compressing several
+**   pages as one chunk, or for an index of the pages within such a chunk.
+**   So a random read decompresses exactly one page, and the ratio achieved
+**   depends on the redundancy within each page. Larger pages (up to 64KB)
+**   improve it somewhat.
+*/
+#include "lsmInt.h"
+
+#define LZ_MIN_MATCH   4          /* Minimum match length */
+#define LZ_MAX_OFFSET  65535      /* Maximum match offset */
+#define LZ_HASH_BITS   12         /* Size of hash table (log2 of entries) */
+#define LZ_MAX_INPUT   65536      /* Matches are only used within this */
+
+/*
+** Return a hash of the LZ_MIN_MATCH bytes at a[].
+*/
+static u32 lzHash(const u8 *a){
+  u32 x = ((u32)a[0]<<24) | ((u32)a[1]<<16) | ((u32)a[2]<<8) | (u32)a[3];
+  return (x * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+** Write a length value n (which is at least 15) as a series of extension
+** bytes to aOut[]. Return the number of bytes written.
+*/
+static int lzPutLength(u8 *aOut, int n){
+  int i = 0;
+  n -= 15;
+  while( n>=255 ){
+    aOut[i++] = 255;
+    n -= 255;
+  }
+  aOut[i++] = (u8)n;
+  return i;
+}
+
+/*
+** Write a sequence consisting of nLit literal bytes from aLit[] and, if
+** nMatch is not zero, a match of nMatch bytes at offset iOff to aOut[].
+** Return the number of bytes written.
+*/
+static int lzPutSequence(
+  u8 *aOut,
+  const u8 *aLit, int nLit,
+  int iOff, int nMatch
+){
+  int i = 1;
+  int nCode = (nMatch ? nMatch - LZ_MIN_MATCH : 0);
+
+  aOut[0] = (u8)((LSM_MIN(nLit, 15) << 4) | LSM_MIN(nCode, 15));
+  if( nLit>=15 ) i += lzPutLength(&aOut[i], nLit);
+  memcpy(&aOut[i], aLit, nLit);
+  i += nLit;
+  if( nMatch ){
+    aOut[i++] = (u8)((iOff >> 8) & 0xFF);
+    aOut[i++] = (u8)(iOff & 0xFF);
+    if( nCode>=15 ) i += lzPutLength(&aOut[i], nCode);
+  }
+  return i;
+}
+
+/*
+** Read a length extension from aIn[], starting at offset *piIn. Return
+** the decoded value, or -1 if the input is truncated.
+*/
+static int lzGetLength(const u8 *aIn, int nIn, int *piIn){
+  int n = 15;
+  int i = *piIn;
+  while( 1 ){
+    if( i>=nIn ) return -1;
+    n += aIn[i];
+    if( aIn[i++]!=255 ) break;
+  }
+  *piIn = i;
+  return n;
+}
+
+static int lzBound(void *pCtx, int nIn){
+  return nIn + (nIn / 255) + 16;
+}
+
+static int lzCompress(
+  void *pCtx,
+  char *zOut, int *pnOut,
+  const char *zIn, int nIn
+){
+  const u8 *aIn = (const u8 *)zIn;
+  u8 *aOut = (u8 *)zOut;
+  u16 aHash[1 << LZ_HASH_BITS];   /* Most recent position for each hash */
+  int iLit = 0;                   /* Start of pending literals */
+  int iIn = 0;                    /* Current input position */
+  int iOut = 0;                   /* Current output position */
+  int iEnd;                       /* Last position a match may start at */
+
+  if( *pnOut<lzBound(pCtx, nIn) ) return LSM_ERROR;
+
+  memset(aHash, 0, sizeof(aHash));
+  iEnd = (nIn>LZ_MAX_INPUT ? 0 : nIn - LZ_MIN_MATCH);
+  while( iIn<iEnd ){
+    u32 h = lzHash(&aIn[iIn]);
+    int iCand = aHash[h];
+    aHash[h] = (u16)iIn;
+
+    if( iCand<iIn && (iIn - iCand)<=LZ_MAX_OFFSET
+     && memcmp(&aIn[iCand], &aIn[iIn], LZ_MIN_MATCH)==0
+    ){
+      int nMatch = LZ_MIN_MATCH;
+      while( iIn+nMatch<nIn && aIn[iCand+nMatch]==aIn[iIn+nMatch] ){
+        nMatch++;
+      }
+      iOut += lzPutSequence(
+          &aOut[iOut], &aIn[iLit], iIn-iLit, iIn-iCand, nMatch
+      );
+      iIn += nMatch;
+      iLit = iIn;
+    }else{
+      iIn++;
+    }
+  }
+
+  iOut += lzPutSequence(&aOut[iOut], &aIn[iLit], nIn-iLit, 0, 0);
+  *pnOut = iOut;
+  return LSM_OK;
+}
+
+static int lzUncompress(
+  void *pCtx,
+  char *zOut, int *pnOut,
+  const char *zIn, int nIn
+){
+  const u8 *aIn = (const u8 *)zIn;
+  u8 *aOut = (u8 *)zOut;
+  int nOut = *pnOut;              /* Size of output buffer */
+  int iIn = 0;                    /* Current input position */
+  int iOut = 0;                   /* Current output position */
+
+  while( iIn<nIn ){
+    int iToken = aIn[iIn++];
+    int nLit = (iToken >> 4);
+    int nMatch = (iToken & 0x0F);
+    int iOff;
+
+    if( nLit==15 ) nLit = lzGetLength(aIn, nIn, &iIn);
+    if( nLit<0 || nLit>nIn-iIn || nLit>nOut-iOut ) return LSM_CORRUPT;
+    memcpy(&aOut[iOut], &aIn[iIn], nLit);
+    iIn += nLit;
+    iOut += nLit;
+    if( iIn==nIn ) break;
+
+    if( iIn+2>nIn ) return LSM_CORRUPT;
+    iOff = ((int)aIn[iIn] << 8) + (int)aIn[iIn+1];
+    iIn += 2;
+    if( nMatch==15 ) nMatch = lzGetLength(aIn, nIn, &iIn);
+    if( nMatch<0 ) return LSM_CORRUPT;
+    nMatch += LZ_MIN_MATCH;
+    if( iOff==0 || iOff>iOut || nMatch>nOut-iOut ) return LSM_CORRUPT;
+
+    /* The match may overlap the output it produces, so copy byte by byte */
+    while( nMatch-- ){
+      aOut[iOut] = aOut[iOut-iOff];
+      iOut++;
+    }
+  }
+
+  *pnOut = iOut;
+  return LSM_OK;
+}
+
+/*
+** If iId is the compression id of a codec built into the library,
+** populate *p with the codec's methods and return non-zero. Otherwise,
+** return zero and leave *p unmodified.
+*/
+int lsmCodecBuiltin(u32 iId, lsm_compress *p){
+  if( iId==LSM_COMPRESSION_LZ ){
+    memset(p, 0, sizeof(lsm_compress));
+    p->iId = LSM_COMPRESSION_LZ;
+    p->xBound = lzBound;
+    p->xCompress = lzCompress;
+    p->xUncompress = lzUncompress;
+    return 1;
+  }
+  return 0;
+}
@@ -81,10 +81,30 @@
 **     lsmFsOpenLog
 **     lsmFsWriteLog
 **     lsmFsSyncLog
+**     lsmFsAllocLog
 **     lsmFsReadLog
 **     lsmFsTruncateLog
 **     lsmFsCloseAndDeleteLog
 **
+** THE VALUE LOG FILE
+**
+** Similarly, the value log file (see lsm_vlog.c) is opened by this file 
+** the first time it is accessed using one of the following:
+**
+**     lsmFsWriteVlog
+**     lsmFsReadVlog
+**     lsmFsSyncVlog
+**     lsmFsPunchVlog
+**
+** THE TREE IMAGE FILE
+**
+** And the tree image file (see lsmTreeSaveImage() in lsm_tree.c) by:
+**
+**     lsmFsWriteTreeImage
+**     lsmFsReadTreeImage
+**     lsmFsSyncTreeImage
+**     lsmFsCloseAndDeleteTreeImage
+**
 ** COMPRESSED DATABASE FILE FORMAT
 **
 ** The compressed database file format is very similar to the normal format.
@@ -153,6 +173,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+/*
+** Maximum size of the database file write buffer in bytes. The buffer is
+** never larger than a single block, as writes that span a block boundary
+** are not contiguous.
+*/
+#define LSM_WRITE_BUFFER_SIZE (1024*1024)
+
 /*
 ** File-system object. Each database connection allocates a single instance
 ** of the following structure. It is used for all access to the database and
@@ -194,6 +221,19 @@
 **   Function lsmFsFlushWaiting() is responsible for eventually writing 
 **   waiting pages to disk.
 **
+** aWBuf/nWBuf/iWBufOff:
+**   Data written to the database file using read()/write() calls is not 
+**   passed to the xWrite() method immediately. Instead, it is accumulated
+**   in buffer aWBuf[] for as long as each write is contiguous with the 
+**   previous one. This allows a run of pages appended to a segment to be
+**   written using a single xWrite() call instead of one per page (or, in
+**   compressed database mode, three per page). The buffer is flushed when
+**   a non-contiguous write is made, when it is full, before any read that
+**   overlaps its contents, and by lsmFsFlushWriteBuffer(). The latter is 
+**   called before the database file is synced or truncated, and before 
+**   any new worker snapshot that may refer to the buffered data is made
+**   visible to other connections.
+**
 ** apHash/nHash:
 **   Hash table used to store all Page objects that carry malloc'd arrays,
 **   except those b-tree pages that have not yet been assigned page numbers.
@@ -203,16 +243,35 @@
 **   Hash table overflow chains are connected using the Page.pHashNext
 **   pointers.
 **
-** pLruFirst, pLruLast:
-**   The first and last entries in a doubly-linked list of pages. This
-**   list contains all pages with malloc'd data that are present in the
-**   hash table and have a ref-count of zero.
+** pLruFirst, pLruLast, pProtFirst, pProtLast:
+**   The first and last entries in two doubly-linked lists of pages. 
+**   Between them, these lists contain all pages with malloc'd data that 
+**   are present in the hash table and have a ref-count of zero.
+**
+**   The cache is managed as a segmented LRU (a variant of 2Q). Pages enter
+**   the cache on the "probationary" list (pLruFirst/pLruLast). A page is
+**   moved to the "protected" list (pProtFirst/pProtLast) when it is
+**   released after being requested again while on the probationary list,
+**   or if it has been marked as a b-tree page using lsmFsPageProtect().
+**   Pages loaded by lsmFsDbPageNext(), which is used by both scans and 
+**   merges to iterate through sorted runs, are never promoted this way.
+**   If the protected list grows to more than 3/4 of nCacheMax pages, the 
+**   least recently used protected pages are moved back to the end of the 
+**   probationary list. Pages are always recycled from the head of the
+**   probationary list if it is not empty, so that a single pass through
+**   a large run cannot evict the pages used by point lookups.
+**
+**   Pages that belong to the protected list (or will be added to it when
+**   their ref-count next drops to zero) have the PAGE_PROTECTED flag set. 
+**   nProtected is the number of pages currently on the protected list.
 */
 struct FileSystem {
   lsm_db *pDb;                    /* Database handle that owns this object */
   lsm_env *pEnv;                  /* Environment pointer */
   char *zDb;                      /* Database file name */
-  char *zLog;                     /* Database file name */
+  char *zLog;                     /* Log file name */
+  char *zVlog;                    /* Value log file name */
+  char *zTimg;                    /* Tree image file name */
   int nMetasize;                  /* Size of meta pages in bytes */
   int nPagesize;                  /* Database page-size in bytes */
   int nBlocksize;                 /* Database block-size in bytes */
@@ -221,6 +280,9 @@ struct FileSystem {
   LsmFile *pLsmFile;              /* Used after lsm_close() to link into list */
   lsm_file *fdDb;                 /* Database file */
   lsm_file *fdLog;                /* Log file */
+  i64 iLogAlloc;                  /* Log file zero-filled up to this offset */
+  lsm_file *fdVlog;               /* Value log file (or NULL) */
+  lsm_file *fdTimg;               /* Tree image file (or NULL) */
   int szSector;                   /* Database file sector size */
 
   /* If this is a compressed database, a pointer to the compression methods.
@@ -240,12 +302,21 @@ struct FileSystem {
   /* Page cache parameters for non-mmap() pages */
   int nCacheMax;                  /* Configured cache size (in pages) */
   int nCacheAlloc;                /* Current cache size (in pages) */
-  Page *pLruFirst;                /* Head of the LRU list */
-  Page *pLruLast;                 /* Tail of the LRU list */
+  Page *pLruFirst;                /* Head of the probationary LRU list */
+  Page *pLruLast;                 /* Tail of the probationary LRU list */
+  Page *pProtFirst;               /* Head of the protected LRU list */
+  Page *pProtLast;                /* Tail of the protected LRU list */
+  int nProtected;                 /* Number of pages on protected list */
   int nHash;                      /* Number of hash slots in hash table */
   Page **apHash;                  /* nHash Hash slots */
   Page *pWaiting;                 /* b-tree pages waiting to be written */
 
+  /* Write buffer for the database file */
+  u8 *aWBuf;                      /* Buffered data not yet written */
+  int nWBuf;                      /* Bytes of data in aWBuf[] */
+  int nWBufAlloc;                 /* Allocated size of aWBuf[] in bytes */
+  i64 iWBufOff;                   /* Database file offset of aWBuf[0] */
+
   /* Statistics */
   int nOut;                       /* Number of outstanding pages */
   int nWrite;                     /* Total number of pages written */
@@ -304,6 +375,8 @@ struct MetaPage {
 #define PAGE_DIRTY   0x00000001   /* Set if page is dirty */
 #define PAGE_FREE    0x00000002   /* Set if Page.aData requires lsmFree() */
 #define PAGE_HASPREV 0x00000004   /* Set if page is first on uncomp. block */
+#define PAGE_PROTECTED 0x00000008 /* Set if page is on protected LRU list */
+#define PAGE_PROMOTE 0x00000010   /* Move to protected list when released */
 
 /*
 ** Number of pgsz byte pages omitted from the start of block 1. The start
@@ -328,6 +401,8 @@ static int IOERR_WRAPPER(int rc){
 # define IOERR_WRAPPER(rc) (rc)
 #endif
 
+static void fsPageDemoteAll(FileSystem *pFS);
+
 #ifdef NDEBUG
 # define assert_lists_are_ok(x)
 #else
@@ -364,6 +439,7 @@ static void assert_lists_are_ok(FileSystem *pFS){
 **     lsmEnvSectorSize()
 **     lsmEnvClose()
 **     lsmEnvTruncate()
+**     lsmEnvPunch()
 **     lsmEnvUnlink()
 **     lsmEnvRemap()
 */
@@ -407,6 +483,20 @@ static int lsmEnvTruncate(lsm_env *pEnv, lsm_file *pFile, lsm_i64 nByte){
   return IOERR_WRAPPER( pEnv->xTruncate(pFile, nByte) );
 }
 
+/*
+** The xPunch() method was added in version 3 of the lsm_env object. If the
+** environment does not have one, no storage is released.
+*/
+static int lsmEnvPunch(
+  lsm_env *pEnv, 
+  lsm_file *pFile, 
+  lsm_i64 iOff, 
+  lsm_i64 nByte
+){
+  if( pEnv->iVersion<3 || pEnv->xPunch==0 ) return LSM_OK;
+  return IOERR_WRAPPER( pEnv->xPunch(pFile, iOff, nByte) );
+}
+
 static int lsmEnvUnlink(lsm_env *pEnv, const char *zDel){
   return IOERR_WRAPPER( pEnv->xUnlink(pEnv, zDel) );
 }
@@ -458,6 +548,77 @@ void lsmEnvSleep(lsm_env *pEnv, int nUs){
   pEnv->xSleep(pEnv, nUs);
 }
 
+/*
+** Write any data accumulated in the database file write buffer to disk
+** (see the comment above the FileSystem.aWBuf field). Return LSM_OK if
+** successful, or an LSM error code otherwise.
+*/
+int lsmFsFlushWriteBuffer(FileSystem *pFS){
+  int rc = LSM_OK;
+  if( pFS->nWBuf>0 ){
+    i64 iOff = pFS->iWBufOff;
+    rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iOff, pFS->aWBuf, pFS->nWBuf);
+    pFS->nWBuf = 0;
+  }
+  return rc;
+}
+
+/*
+** Write nData bytes of data from buffer aData to offset iOff of the 
+** database file. The data may be held in the write buffer until a later
+** call to lsmFsFlushWriteBuffer().
+*/
+static int fsDbWrite(FileSystem *pFS, i64 iOff, const u8 *aData, int nData){
+  int rc = LSM_OK;
+
+  /* Flush the buffer if this write is not contiguous with its current 
+  ** contents or will not fit in the remaining space.  */
+  if( pFS->nWBuf>0 
+   && (iOff!=pFS->iWBufOff+pFS->nWBuf || nData>pFS->nWBufAlloc-pFS->nWBuf)
+  ){
+    rc = lsmFsFlushWriteBuffer(pFS);
+  }
+
+  /* Allocate the buffer if it has not already been allocated. If the 
+  ** allocation fails, fall back to writing directly to the file.  */
+  if( rc==LSM_OK && pFS->aWBuf==0 ){
+    int nAlloc = LSM_MIN(pFS->nBlocksize, LSM_WRITE_BUFFER_SIZE);
+    pFS->aWBuf = (u8 *)lsmMalloc(pFS->pEnv, nAlloc);
+    if( pFS->aWBuf ) pFS->nWBufAlloc = nAlloc;
+  }
+
+  if( rc==LSM_OK ){
+    if( nData>pFS->nWBufAlloc ){
+      assert( pFS->nWBuf==0 );
+      rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iOff, aData, nData);
+    }else{
+      if( pFS->nWBuf==0 ) pFS->iWBufOff = iOff;
+      memcpy(&pFS->aWBuf[pFS->nWBuf], aData, nData);
+      pFS->nWBuf += nData;
+    }
+  }
+
+  return rc;
+}
+
+/*
+** Read nData bytes of data from offset iOff of the database file into
+** buffer aData. If the range overlaps any data in the write buffer, the
+** write buffer is flushed first.
+*/
+static int fsDbRead(FileSystem *pFS, i64 iOff, u8 *aData, int nData){
+  int rc = LSM_OK;
+  if( pFS->nWBuf>0 
+   && iOff<(pFS->iWBufOff+pFS->nWBuf) && (iOff+nData)>pFS->iWBufOff 
+  ){
+    rc = lsmFsFlushWriteBuffer(pFS);
+  }
+  if( rc==LSM_OK ){
+    rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, aData, nData);
+  }
+  return rc;
+}
+
 
 /*
 ** Write the contents of string buffer pStr into the log file, starting at
@@ -476,6 +637,41 @@ int lsmFsSyncLog(FileSystem *pFS){
   return lsmEnvSync(pFS->pEnv, pFS->fdLog);
 }
 
+/*
+** Make sure that the log file is at least iEnd bytes in size, so that
+** writing to it below that offset does not change the size of the file.
+** If it must be extended, the log file is zero-filled from offset iFree to
+** the next multiple of LSM_LOG_PREALLOC bytes greater than or equal to 
+** iEnd. Parameter iFree must be greater than or equal to the end of all
+** log regions still in use.
+**
+** Since the size of the log file is not known, this function assumes that
+** the file must be zero-filled from offset iFree onwards the first time it
+** is called after the log file is opened.
+*/
+int lsmFsAllocLog(FileSystem *pFS, i64 iFree, i64 iEnd){
+  int rc = LSM_OK;
+
+  assert( pFS->fdLog );
+  if( iFree>pFS->iLogAlloc ) pFS->iLogAlloc = iFree;
+  if( iEnd>pFS->iLogAlloc ){
+    const int nZero = 64*1024;
+    u8 *aZero;
+    i64 iAlloc;
+
+    iAlloc = ((iEnd + LSM_LOG_PREALLOC - 1) / LSM_LOG_PREALLOC);
+    iAlloc = iAlloc * LSM_LOG_PREALLOC;
+    aZero = (u8 *)lsmMallocZeroRc(pFS->pEnv, nZero, &rc);
+    while( rc==LSM_OK && pFS->iLogAlloc<iAlloc ){
+      int n = (int)LSM_MIN(nZero, iAlloc - pFS->iLogAlloc);
+      rc = lsmEnvWrite(pFS->pEnv, pFS->fdLog, pFS->iLogAlloc, aZero, n);
+      if( rc==LSM_OK ) pFS->iLogAlloc += n;
+    }
+    lsmFree(pFS->pEnv, aZero);
+  }
+  return rc;
+}
+
 /*
 ** Read nRead bytes of data starting at offset iOff of the log file. Append
 ** the results to string buffer pStr.
@@ -491,6 +687,129 @@ int lsmFsReadLog(FileSystem *pFS, i64 iOff, int nRead, LsmString *pStr){
   return rc;
 }
 
+/*
+** Open the value log file, if it is not already open.
+*/
+static int fsOpenVlog(FileSystem *pFS){
+  int rc = LSM_OK;
+  if( pFS->fdVlog==0 ){
+    int flags = (pFS->pDb->bReadonly ? LSM_OPEN_READONLY : 0);
+    rc = lsmEnvOpen(pFS->pEnv, pFS->zVlog, flags, &pFS->fdVlog);
+  }
+  return rc;
+}
+
+/*
+** Write nData bytes of data from buffer pData to the value log file,
+** starting at offset iOff.
+*/
+int lsmFsWriteVlog(FileSystem *pFS, i64 iOff, const void *pData, int nData){
+  int rc = fsOpenVlog(pFS);
+  if( rc==LSM_OK ){
+    rc = lsmEnvWrite(pFS->pEnv, pFS->fdVlog, iOff, pData, nData);
+  }
+  return rc;
+}
+
+/*
+** Read nData bytes of data starting at offset iOff of the value log file
+** into buffer pData.
+*/
+int lsmFsReadVlog(FileSystem *pFS, i64 iOff, void *pData, int nData){
+  int rc = fsOpenVlog(pFS);
+  if( rc==LSM_OK ){
+    rc = lsmEnvRead(pFS->pEnv, pFS->fdVlog, iOff, pData, nData);
+  }
+  return rc;
+}
+
+/*
+** fsync() the value log file.
+*/
+int lsmFsSyncVlog(FileSystem *pFS){
+  int rc = fsOpenVlog(pFS);
+  if( rc==LSM_OK ){
+    rc = lsmEnvSync(pFS->pEnv, pFS->fdVlog);
+  }
+  return rc;
+}
+
+/*
+** Release the storage used by the nByte bytes of the value log file
+** starting at offset iOff. See lsmVlogWork().
+*/
+int lsmFsPunchVlog(FileSystem *pFS, i64 iOff, i64 nByte){
+  int rc = fsOpenVlog(pFS);
+  if( rc==LSM_OK ){
+    rc = lsmEnvPunch(pFS->pEnv, pFS->fdVlog, iOff, nByte);
+  }
+  return rc;
+}
+
+/*
+** Open the tree image file, if it is not already open.
+*/
+static int fsOpenTreeImage(FileSystem *pFS){
+  int rc = LSM_OK;
+  if( pFS->fdTimg==0 ){
+    rc = lsmEnvOpen(pFS->pEnv, pFS->zTimg, 0, &pFS->fdTimg);
+  }
+  return rc;
+}
+
+/*
+** Write nData bytes of data from buffer pData to the tree image file,
+** starting at offset iOff.
+*/
+int lsmFsWriteTreeImage(
+  FileSystem *pFS, 
+  i64 iOff, 
+  const void *pData, 
+  int nData
+){
+  int rc = fsOpenTreeImage(pFS);
+  if( rc==LSM_OK ){
+    rc = lsmEnvWrite(pFS->pEnv, pFS->fdTimg, iOff, pData, nData);
+  }
+  return rc;
+}
+
+/*
+** Read nData bytes of data starting at offset iOff of the tree image file
+** into buffer pData. If the file is smaller than (iOff+nData) bytes, the
+** part of the buffer that lies beyond the end of the file is zeroed.
+*/
+int lsmFsReadTreeImage(FileSystem *pFS, i64 iOff, void *pData, int nData){
+  int rc = fsOpenTreeImage(pFS);
+  if( rc==LSM_OK ){
+    rc = lsmEnvRead(pFS->pEnv, pFS->fdTimg, iOff, pData, nData);
+  }
+  return rc;
+}
+
+/*
+** fsync() the tree image file.
+*/
+int lsmFsSyncTreeImage(FileSystem *pFS){
+  int rc = fsOpenTreeImage(pFS);
+  if( rc==LSM_OK ){
+    rc = lsmEnvSync(pFS->pEnv, pFS->fdTimg);
+  }
+  return rc;
+}
+
+/*
+** Close the tree image file, if it is open. Then delete it from the 
+** file-system.
+*/
+void lsmFsCloseAndDeleteTreeImage(FileSystem *pFS){
+  if( pFS->fdTimg ){
+    lsmEnvClose(pFS->pEnv, pFS->fdTimg);
+    pFS->fdTimg = 0;
+  }
+  lsmEnvUnlink(pFS->pEnv, pFS->zTimg);
+}
+
 /*
 ** Truncate the log file to nByte bytes in size.
 */
@@ -503,7 +822,10 @@ int lsmFsTruncateLog(FileSystem *pFS, i64 nByte){
 ** Truncate the db file to nByte bytes in size.
 */
 int lsmFsTruncateDb(FileSystem *pFS, i64 nByte){
+  int rc;
   if( pFS->fdDb==0 ) return LSM_OK;
+  rc = lsmFsFlushWriteBuffer(pFS);
+  if( rc!=LSM_OK ) return rc;
   return lsmEnvTruncate(pFS->pEnv, pFS->fdDb, nByte);
 }
 
@@ -517,6 +839,7 @@ int lsmFsCloseAndDeleteLog(FileSystem *pFS){
   if( pFS->fdLog ){
     lsmEnvClose(pFS->pEnv, pFS->fdLog );
     pFS->fdLog = 0;
+    pFS->iLogAlloc = 0;
   }
 
   zDel = lsmMallocPrintf(pFS->pEnv, "%s-log", pFS->zDb);
@@ -598,6 +921,7 @@ void lsmFsCloseLog(lsm_db *db){
   if( pFS->fdLog ){
     lsmEnvClose(pFS->pEnv, pFS->fdLog);
     pFS->fdLog = 0;
+    pFS->iLogAlloc = 0;
   }
 }
 
@@ -627,22 +951,29 @@ int lsmFsOpen(
   assert( pDb->pFS==0 );
   assert( pDb->pWorker==0 && pDb->pClient==0 );
 
-  nByte = sizeof(FileSystem) + nDb+1 + nDb+4+1;
+  nByte = sizeof(FileSystem) + nDb+1 + nDb+4+1 + nDb+5+1 + nDb+5+1;
   pFS = (FileSystem *)lsmMallocZeroRc(pDb->pEnv, nByte, &rc);
   if( pFS ){
     LsmFile *pLsmFile;
     pFS->zDb = (char *)&pFS[1];
     pFS->zLog = &pFS->zDb[nDb+1];
+    pFS->zVlog = &pFS->zLog[nDb+4+1];
+    pFS->zTimg = &pFS->zVlog[nDb+5+1];
     pFS->nPagesize = LSM_DFLT_PAGE_SIZE;
     pFS->nBlocksize = LSM_DFLT_BLOCK_SIZE;
     pFS->nMetasize = 4 * 1024;
     pFS->pDb = pDb;
     pFS->pEnv = pDb->pEnv;
 
-    /* Make a copy of the database and log file names. */
+    /* Make a copy of the database, log, value log and tree image file 
+    ** names. */
     memcpy(pFS->zDb, zDb, nDb+1);
     memcpy(pFS->zLog, zDb, nDb);
     memcpy(&pFS->zLog[nDb], "-log", 5);
+    memcpy(pFS->zVlog, zDb, nDb);
+    memcpy(&pFS->zVlog[nDb], "-vlog", 6);
+    memcpy(pFS->zTimg, zDb, nDb);
+    memcpy(&pFS->zTimg[nDb], "-tree", 6);
 
     /* Allocate the hash-table here. At some point, it should be changed
     ** so that it can grow dynamicly. */
@@ -701,6 +1032,7 @@ int lsmFsConfigure(lsm_db *db){
     }
 
     /* Free all allocated page structures */
+    fsPageDemoteAll(pFS);
     pPg = pFS->pLruFirst;
     while( pPg ){
       Page *pNext = pPg->pLruNext;
@@ -754,6 +1086,7 @@ void lsmFsClose(FileSystem *pFS){
     lsm_env *pEnv = pFS->pEnv;
 
     assert( pFS->nOut==0 );
+    fsPageDemoteAll(pFS);
     pPg = pFS->pLruFirst;
     while( pPg ){
       Page *pNext = pPg->pLruNext;
@@ -772,10 +1105,13 @@ void lsmFsClose(FileSystem *pFS){
 
     if( pFS->fdDb ) lsmEnvClose(pFS->pEnv, pFS->fdDb );
     if( pFS->fdLog ) lsmEnvClose(pFS->pEnv, pFS->fdLog );
+    if( pFS->fdVlog ) lsmEnvClose(pFS->pEnv, pFS->fdVlog );
+    if( pFS->fdTimg ) lsmEnvClose(pFS->pEnv, pFS->fdTimg );
     lsmFree(pEnv, pFS->pLsmFile);
     lsmFree(pEnv, pFS->apHash);
     lsmFree(pEnv, pFS->aIBuffer);
     lsmFree(pEnv, pFS->aOBuffer);
+    lsmFree(pEnv, pFS->aWBuf);
     lsmFree(pEnv, pFS);
   }
 }
@@ -976,34 +1312,92 @@ Pgno lsmFsPageNumber(Page *pPage){
 ** operation.
 */
 static void fsPageRemoveFromLru(FileSystem *pFS, Page *pPg){
-  assert( pPg->pLruNext || pPg==pFS->pLruLast );
-  assert( pPg->pLruPrev || pPg==pFS->pLruFirst );
+  Page **ppFirst = &pFS->pLruFirst;
+  Page **ppLast = &pFS->pLruLast;
+
+  if( pPg->flags & PAGE_PROTECTED ){
+    ppFirst = &pFS->pProtFirst;
+    ppLast = &pFS->pProtLast;
+    pFS->nProtected--;
+  }
+
+  assert( pPg->pLruNext || pPg==*ppLast );
+  assert( pPg->pLruPrev || pPg==*ppFirst );
   if( pPg->pLruNext ){
     pPg->pLruNext->pLruPrev = pPg->pLruPrev;
   }else{
-    pFS->pLruLast = pPg->pLruPrev;
+    *ppLast = pPg->pLruPrev;
   }
   if( pPg->pLruPrev ){
     pPg->pLruPrev->pLruNext = pPg->pLruNext;
   }else{
-    pFS->pLruFirst = pPg->pLruNext;
+    *ppFirst = pPg->pLruNext;
   }
   pPg->pLruPrev = 0;
   pPg->pLruNext = 0;
 }
 
 /*
-** Page pPg is not currently part of the LRU list belonging to pFS. Add it.
+** Page pPg is not currently part of either LRU list belonging to pFS. Add
+** it to the end of the protected list if the PAGE_PROTECTED or 
+** PAGE_PROMOTE flag is set, or to the end of the probationary list 
+** otherwise.
+**
+** If this causes the protected list to grow too large, pages are moved 
+** from the start of the protected list to the end of the probationary 
+** list.
 */
 static void fsPageAddToLru(FileSystem *pFS, Page *pPg){
+  Page **ppFirst = &pFS->pLruFirst;
+  Page **ppLast = &pFS->pLruLast;
+
   assert( pPg->pLruNext==0 && pPg->pLruPrev==0 );
-  pPg->pLruPrev = pFS->pLruLast;
+  if( pPg->flags & PAGE_PROMOTE ){
+    pPg->flags = (pPg->flags & ~PAGE_PROMOTE) | PAGE_PROTECTED;
+  }
+  if( pPg->flags & PAGE_PROTECTED ){
+    ppFirst = &pFS->pProtFirst;
+    ppLast = &pFS->pProtLast;
+    pFS->nProtected++;
+  }
+
+  pPg->pLruPrev = *ppLast;
   if( pPg->pLruPrev ){
     pPg->pLruPrev->pLruNext = pPg;
   }else{
-    pFS->pLruFirst = pPg;
+    *ppFirst = pPg;
+  }
+  *ppLast = pPg;
+
+  while( pFS->nProtected>(pFS->nCacheMax - pFS->nCacheMax/4) ){
+    Page *pDemote = pFS->pProtFirst;
+    fsPageRemoveFromLru(pFS, pDemote);
+    pDemote->flags &= ~PAGE_PROTECTED;
+    fsPageAddToLru(pFS, pDemote);
+  }
+}
+
+/*
+** Move all pages on the protected LRU list to the end of the probationary
+** list. This is used before freeing all pages with a ref-count of zero.
+*/
+static void fsPageDemoteAll(FileSystem *pFS){
+  Page *pPg;
+  for(pPg=pFS->pProtFirst; pPg; pPg=pPg->pLruNext){
+    pPg->flags &= ~PAGE_PROTECTED;
   }
-  pFS->pLruLast = pPg;
+  if( pFS->pProtFirst ){
+    pFS->pProtFirst->pLruPrev = pFS->pLruLast;
+    if( pFS->pLruLast ){
+      pFS->pLruLast->pLruNext = pFS->pProtFirst;
+    }else{
+      pFS->pLruFirst = pFS->pProtFirst;
+    }
+    pFS->pLruLast = pFS->pProtLast;
+  }
+  pFS->pProtFirst = 0;
+  pFS->pProtLast = 0;
+  pFS->nProtected = 0;
 }
 
 /*
@@ -1035,6 +1429,7 @@ static void fsPageBufferFree(Page *pPg){
 void lsmFsPurgeCache(FileSystem *pFS){
   Page *pPg;
 
+  fsPageDemoteAll(pFS);
   pPg = pFS->pLruFirst;
   while( pPg ){
     Page *pNext = pPg->pLruNext;
@@ -1078,7 +1473,8 @@ static int fsPageBuffer(
 ){
   int rc = LSM_OK;
   Page *pPage = 0;
-  if( pFS->pLruFirst==0 || pFS->nCacheAlloc<pFS->nCacheMax ){
+  Page *pVictim = (pFS->pLruFirst ? pFS->pLruFirst : pFS->pProtFirst);
+  if( pVictim==0 || pFS->nCacheAlloc<pFS->nCacheMax ){
     /* Allocate a new Page object */
     pPage = lsmMallocZero(pFS->pEnv, sizeof(Page));
     if( !pPage ){
@@ -1096,7 +1492,7 @@ static int fsPageBuffer(
   }else{
     /* Reuse an existing Page object */
     u8 *aData;
-    pPage = pFS->pLruFirst;
+    pPage = pVictim;
     aData = pPage->aData;
     fsPageRemoveFromLru(pFS, pPage);
     fsPageRemoveFromHash(pFS, pPage);
@@ -1149,10 +1545,15 @@ static void fsGrowMapping(
 }
 
 /*
-** fsync() the database file.
+** fsync() the database file. Any data in the write buffer is written to
+** the file first.
 */
 int lsmFsSyncDb(FileSystem *pFS, int nBlock){
-  return lsmEnvSync(pFS->pEnv, pFS->fdDb);
+  int rc = lsmFsFlushWriteBuffer(pFS);
+  if( rc==LSM_OK ){
+    rc = lsmEnvSync(pFS->pEnv, pFS->fdDb);
+  }
+  return rc;
 }
 
 /*
@@ -1233,7 +1634,7 @@ static int fsBlockNext(
     u8 aNext[4];                  /* 4-byte pointer read from db file */
 
     iOff = (i64)iRead * pFS->nBlocksize - sizeof(aNext);
-    rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, aNext, sizeof(aNext));
+    rc = fsDbRead(pFS, iOff, aNext, sizeof(aNext));
     if( rc==LSM_OK ){
       *piNext = (int)lsmGetU32(aNext);
     }
@@ -1286,14 +1687,14 @@ static int fsReadData(
   iEob = fsLastPageOnPagesBlock(pFS, iOff) + 1;
   nRead = LSM_MIN(iEob - iOff, nData);
 
-  rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, aData, nRead);
+  rc = fsDbRead(pFS, iOff, aData, nRead);
   if( rc==LSM_OK && nRead!=nData ){
     int iBlk;
 
     rc = fsBlockNext(pFS, pSeg, fsPageToBlock(pFS, iOff), &iBlk);
     if( rc==LSM_OK ){
       i64 iOff2 = fsFirstPageOnBlock(pFS, iBlk);
-      rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff2, &aData[nRead], nData-nRead);
+      rc = fsDbRead(pFS, iOff2, &aData[nRead], nData-nRead);
     }
   }
 
@@ -1320,7 +1721,7 @@ static int fsBlockPrev(
   if( pFS->pCompress ){
     i64 iOff = fsFirstPageOnBlock(pFS, iBlock) - 4;
     u8 aPrev[4];                  /* 4-byte pointer read from db file */
-    rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, aPrev, sizeof(aPrev));
+    rc = fsDbRead(pFS, iOff, aPrev, sizeof(aPrev));
     if( rc==LSM_OK ){
       Redirect *pRedir = (pSeg ? pSeg->pRedirect : 0);
       *piPrev = fsRedirectBlock(pRedir, (int)lsmGetU32(aPrev));
@@ -1548,7 +1949,12 @@ static int fsPageGet(
 
   if( p ){
     assert( p->flags & PAGE_FREE );
-    if( p->nRef==0 ) fsPageRemoveFromLru(pFS, p);
+    if( p->nRef==0 ){
+      /* A cache hit on a page that is not in use. If the page is on the
+      ** probationary list, arrange for it to be promoted when released. */
+      fsPageRemoveFromLru(pFS, p);
+      if( (p->flags & PAGE_PROTECTED)==0 ) p->flags |= PAGE_PROMOTE;
+    }
   }else{
 
     if( fsMmapPage(pFS, iReal) ){
@@ -1592,12 +1998,21 @@ static int fsPageGet(
         if( noContent==0 ){
           if( pFS->pCompress ){
             rc = fsReadPagedata(pFS, pSeg, p, &nSpace);
+            pFS->nRead++;
           }else{
+            /* Try the shared page cache before reading from disk. If the
+            ** page has to be read from disk, add it to the shared cache
+            ** so that other connections may use it.  */
             int nByte = pFS->nPagesize;
-            i64 iOff = (i64)(iReal-1) * pFS->nPagesize;
-            rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, p->aData, nByte);
+            if( lsmDbCacheRead(pFS->pDb, iReal, p->aData, nByte)==0 ){
+              i64 iOff = (i64)(iReal-1) * pFS->nPagesize;
+              rc = fsDbRead(pFS, iOff, p->aData, nByte);
+              if( rc==LSM_OK ){
+                lsmDbCacheWrite(pFS->pDb, iReal, p->aData, nByte);
+              }
+              pFS->nRead++;
+            }
           }
-          pFS->nRead++;
         }
 
         /* If the xRead() call was successful (or not attempted), link the
@@ -2036,6 +2451,12 @@ int lsmFsDbPageNext(Segment *pRun, Page *pPg, int eDir, Page **ppNext){
     rc = fsPageGet(pFS, pRun, iPg, 0, ppNext, 0);
   }
 
+  /* Pages loaded while iterating through a run are not promoted to the
+  ** protected list. Unless some other reference already requested it. */
+  if( *ppNext && (*ppNext)->nRef==1 ){
+    (*ppNext)->flags &= ~PAGE_PROMOTE;
+  }
+
   return rc;
 }
 
@@ -2208,6 +2629,63 @@ int lsmFsSortedFinish(FileSystem *pFS, Segment *p){
   return rc;
 }
 
+/*
+** Segments pSeg and pNext were written separately by a split merge (see
+** lsmSortedMergeJob()). The last page of pSeg is the last page on its
+** block, and the first page of pNext is the first page on its block.
+** Link the blocks together so that pNext directly follows pSeg, and update
+** pSeg to describe the combined segment.
+**
+** Or, if pNext is NULL, allocate a new block and link it to the end of 
+** pSeg, as lsmFsSortedAppend() does when the last page of a block is
+** appended to a segment. This is used when no further segment is to be
+** joined to pSeg, but the b-tree hierarchy still needs to be appended to 
+** it.
+**
+** This function is only used with uncompressed databases. It returns 
+** LSM_OK if successful, or an lsm error code if an error occurs.
+*/
+int lsmFsSortedJoin(FileSystem *pFS, Segment *pSeg, Segment *pNext){
+  int rc = LSM_OK;
+  int iBlk = fsPageToBlock(pFS, pSeg->iLastPg);
+  int iNext = 0;
+  Page *pPg = 0;
+
+  assert( pFS->pCompress==0 );
+  assert( pSeg->pRedirect==0 && fsIsLast(pFS, pSeg->iLastPg) );
+
+  if( pNext ){
+    assert( pNext->pRedirect==0 && fsIsFirst(pFS, pNext->iFirst) );
+    iNext = fsPageToBlock(pFS, pNext->iFirst);
+    rc = fsPageGet(pFS, 0, pNext->iFirst, 0, &pPg, 0);
+    if( rc==LSM_OK ){
+      assert( pPg->flags & PAGE_HASPREV );
+      lsmPutU32(&pPg->aData[-4], iBlk);
+      pPg->flags |= PAGE_DIRTY;
+      rc = lsmFsPagePersist(pPg);
+      lsmFsPageRelease(pPg);
+    }
+  }else{
+    rc = lsmBlockAllocate(pFS->pDb, 0, &iNext);
+  }
+
+  if( rc==LSM_OK ){
+    rc = fsPageGet(pFS, 0, pSeg->iLastPg, 0, &pPg, 0);
+    if( rc==LSM_OK ){
+      lsmPutU32(&pPg->aData[pFS->nPagesize-4], iNext);
+      pPg->flags |= PAGE_DIRTY;
+      rc = lsmFsPagePersist(pPg);
+      lsmFsPageRelease(pPg);
+    }
+  }
+
+  if( rc==LSM_OK && pNext ){
+    pSeg->iLastPg = pNext->iLastPg;
+    pSeg->nSize += pNext->nSize;
+  }
+  return rc;
+}
+
 /*
 ** Obtain a reference to page number iPg.
 **
@@ -2217,6 +2695,15 @@ int lsmFsDbPageGet(FileSystem *pFS, Segment *pSeg, Pgno iPg, Page **ppPg){
   return fsPageGet(pFS, pSeg, iPg, 0, ppPg, 0);
 }
 
+/*
+** Indicate that page pPg is a b-tree page. Once it is released, it will be
+** stored on the protected LRU list. This is a no-op for pages that are not
+** stored in the page cache (i.e. those accessed via the memory mapping).
+*/
+void lsmFsPageProtect(Page *pPg){
+  if( pPg->flags & PAGE_FREE ) pPg->flags |= PAGE_PROMOTE;
+}
+
 /*
 ** Obtain a reference to the last page in the segment passed as the 
 ** second argument.
@@ -2271,7 +2758,7 @@ int lsmFsMetaPageGet(
     }else{
       pPg->aData = lsmMallocRc(pFS->pEnv, pFS->nMetasize, &rc);
       if( rc==LSM_OK && bWrite==0 ){
-        rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, pPg->aData, pFS->nMetasize);
+        rc = fsDbRead(pFS, iOff, pPg->aData, pFS->nMetasize);
       }
 #ifndef NDEBUG
       /* pPg->aData causes an uninitialized access via a downstreadm write().
@@ -2312,7 +2799,10 @@ int lsmFsMetaPageRelease(MetaPage *pPg){
       if( pPg->bWrite ){
         i64 iOff = (pPg->iPg==2 ? pFS->nMetasize : 0);
         int nWrite = pFS->nMetasize;
-        rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iOff, pPg->aData, nWrite);
+        rc = lsmFsFlushWriteBuffer(pFS);
+        if( rc==LSM_OK ){
+          rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iOff, pPg->aData, nWrite);
+        }
       }
       lsmFree(pFS->pEnv, pPg->aData);
     }
@@ -2381,9 +2871,11 @@ int lsmFsMoveBlock(FileSystem *pFS, Segment *pSeg, int iTo, int iFrom){
   assert( iTo!=1 );
   assert( iFrom>iTo );
 
-  /* Grow the mapping as required. */
-  nMap = LSM_MIN(pFS->nMapLimit, (i64)iFrom * pFS->nBlocksize);
-  fsGrowMapping(pFS, nMap, &rc);
+  /* Grow the mapping as required. Compressed databases are never mapped. */
+  if( pFS->pCompress==0 ){
+    nMap = LSM_MIN(pFS->nMapLimit, (i64)iFrom * pFS->nBlocksize);
+    fsGrowMapping(pFS, nMap, &rc);
+  }
 
   if( rc==LSM_OK ){
     const int nPagePerBlock = (pFS->nBlocksize / pFS->nPagesize);
@@ -2404,7 +2896,7 @@ int lsmFsMoveBlock(FileSystem *pFS, Segment *pSeg, int iTo, int iFrom){
           if( aBuf==0 ) break;
         }
         aData = aBuf;
-        rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, aData, nSz);
+        rc = fsDbRead(pFS, iOff, aData, nSz);
       }
 
       /* Copy aData to the to page */
@@ -2414,12 +2906,15 @@ int lsmFsMoveBlock(FileSystem *pFS, Segment *pSeg, int iTo, int iFrom){
           u8 *aMap = (u8 *)(pFS->pMap);
           memcpy(&aMap[iOff], aData, nSz);
         }else{
-          rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iOff, aData, nSz);
+          rc = fsDbWrite(pFS, iOff, aData, nSz);
         }
       }
     }
     lsmFree(pFS->pEnv, aBuf);
     lsmFsPurgeCache(pFS);
+    lsmDbCacheInvalidate(pFS->pDb, 
+        fsFirstPageOnBlock(pFS, iTo), fsLastPageOnBlock(pFS, iTo)
+    );
   }
 
   /* Update append-point list if necessary */
@@ -2478,7 +2973,7 @@ static Pgno fsAppendData(
       nRem = nData - nWrite;
       assert( nWrite>=0 );
       if( nWrite!=0 ){
-        rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iApp, aData, nWrite);
+        rc = fsDbWrite(pFS, iApp, aData, nWrite);
       }
       iApp += nWrite;
     }
@@ -2499,7 +2994,7 @@ static Pgno fsAppendData(
         if( rc==LSM_OK ){
           assert( iApp==(fsPageToBlock(pFS, iApp)*pFS->nBlocksize)-4 );
           lsmPutU32(aPtr, iBlk);
-          rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iApp, aPtr, sizeof(aPtr));
+          rc = fsDbWrite(pFS, iApp, aPtr, sizeof(aPtr));
         }
 
         /* Set the "prev" pointer on the new block */
@@ -2507,7 +3002,7 @@ static Pgno fsAppendData(
           Pgno iWrite;
           lsmPutU32(aPtr, fsPageToBlock(pFS, iApp));
           iWrite = fsFirstPageOnBlock(pFS, iBlk);
-          rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iWrite-4, aPtr, sizeof(aPtr));
+          rc = fsDbWrite(pFS, iWrite-4, aPtr, sizeof(aPtr));
           if( nRem>0 ) iApp = iWrite;
         }
       }else{
@@ -2520,7 +3015,7 @@ static Pgno fsAppendData(
 
       /* Write the remaining data into the new block */
       if( rc==LSM_OK && nRem>0 ){
-        rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iApp, &aData[nWrite], nRem);
+        rc = fsDbWrite(pFS, iApp, &aData[nWrite], nRem);
         iApp += nRem;
       }
     }
@@ -2742,10 +3237,13 @@ int lsmFsPagePersist(Page *pPg){
       }else{
         i64 iOff;                   /* Offset to write within database file */
 
+        /* Other connections may have an old image of this page cached */
+        lsmDbCacheInvalidate(pFS->pDb, pPg->iPg, pPg->iPg);
+
         iOff = (i64)pFS->nPagesize * (i64)(pPg->iPg-1);
         if( fsMmapPage(pFS, pPg->iPg)==0 ){
           u8 *aData = pPg->aData - (pPg->flags & PAGE_HASPREV);
-          rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iOff, aData, pFS->nPagesize);
+          rc = fsDbWrite(pFS, iOff, aData, pFS->nPagesize);
         }else if( pPg->flags & PAGE_FREE ){
           fsGrowMapping(pFS, iOff + pFS->nPagesize, &rc);
           if( rc==LSM_OK ){
@@ -2755,7 +3253,7 @@ int lsmFsPagePersist(Page *pPg){
             lsmFree(pFS->pEnv, aFrom);
             pFS->nCacheAlloc--;
             pPg->aData = aTo + (pPg->flags & PAGE_HASPREV);
-            pPg->flags &= ~PAGE_FREE;
+            pPg->flags &= ~(PAGE_FREE|PAGE_PROTECTED|PAGE_PROMOTE);
             fsPageRemoveFromHash(pFS, pPg);
             pPg->pMappedNext = pFS->pMapped;
             pFS->pMapped = pPg;
@@ -2781,6 +3279,9 @@ int lsmFsPagePersist(Page *pPg){
 ** written is the last byte of a disk sector. This means that if a 
 ** snapshot is taken and checkpointed, subsequent worker processes will
 ** not write to any sector that contains checkpointed data.
+**
+** If the segment is still empty (no data has been appended to it yet), 
+** no padding is required and this function is a no-op.
 */
 int lsmFsSortedPadding(
   FileSystem *pFS, 
@@ -2788,7 +3289,7 @@ int lsmFsSortedPadding(
   Segment *pSeg
 ){
   int rc = LSM_OK;
-  if( pFS->pCompress ){
+  if( pFS->pCompress && pSeg->iFirst ){
     Pgno iLast2;
     Pgno iLast = pSeg->iLastPg;     /* Current last page of segment */
     int nPad;                       /* Bytes of padding required */
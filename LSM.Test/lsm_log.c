@@ -26,6 +26,7 @@
 **
 **   LOG_WRITE:  A key-value pair written to the database.
 **   LOG_DELETE: A delete key issued to the database.
+**   LOG_BATCH:  A batch of writes and deletes (see lsm_batch_write()).
 **   LOG_COMMIT: A transaction commit.
 **
 ** And the following types of records for ancillary purposes..
@@ -55,11 +56,12 @@
 **   the log must be either a LOG_CKSUM or LOG_COMMIT record. If it is
 **   not, the recovery process also stops reading the log.
 **
-**   To recover the log file, it must be read twice. The first time to 
-**   determine the location of the last valid commit record. And the second
-**   time to load data into the in-memory tree.
-**
-**   Todo: Surely there is a better way...
+**   The log file is read once. Records are loaded into the in-memory tree
+**   as they are read. When the end of the log is reached (or a checksum
+**   does not match, or a record cannot be decoded), any records that
+**   follow the last valid commit record are removed from the tree by
+**   rolling it back to the state it was in when that commit record was
+**   read. See lsmLogRecover().
 **
 ** LOG WRAPPING
 **
@@ -159,27 +161,62 @@
 **               * If the first byte was 0x09, an 8 byte checksum.
 **               * The key data.
 **
+**   LOG_BATCH:  * A single 0x0A or 0x0B byte, 
+**               * The number of bytes in the batch, encoded as a varint, 
+**               * If the first byte was 0x0B, an 8 byte checksum.
+**               * The batch data, in the format described in lsm_batch.c.
+**
+**   LOG_VPTR:   * A single 0x0C or 0x0D byte, 
+**               * The number of bytes in the key, encoded as a varint, 
+**               * The number of bytes in the pointer, encoded as a varint, 
+**               * If the first byte was 0x0D, an 8 byte checksum.
+**               * The key data,
+**               * A pointer to the value in the value log (see lsm_vlog.c).
+**
 **   Varints are as described in lsm_varint.c (SQLite 4 format).
 **
 ** CHECKSUMS:
 **
 **   The checksum is calculated using two 32-bit unsigned integers, s0 and
 **   s1. The initial value for both is 42. It is updated each time a record
-**   is written into the log file by treating the encoded (binary) record as 
-**   an array of 32-bit little-endian integers. Then, if x[] is the integer
-**   array, updating the checksum accumulators as follows:
+**   is written into the log file using one of two algorithms, as selected
+**   by LSM_CONFIG_LOG_CHECKSUM when the database was created. 
+**
+**   If the algorithm is LSM_LOG_CKSUM_FLETCHER, the encoded (binary) record
+**   is treated as an array of 32-bit little-endian integers. Then, if x[]
+**   is the integer array, the checksum accumulators are updated as follows:
 **
 **     for i from 0 to n-1 step 2:
 **       s0 += x[i] + s1;
 **       s1 += x[i+1] + s0;
 **     endfor
 **
-**   If the record is not an even multiple of 8-bytes in size it is padded
-**   with zeroes to make it so before the checksum is updated.
+**   Or, if it is LSM_LOG_CKSUM_CRC32C, the record is treated as an array 
+**   of 8-byte blocks, b[]. s0 is the CRC32C (Castagnoli polynomial, no
+**   pre or post inversion) of the data, and s1 the sum of the intermediate
+**   values of s0:
 **
-**   The checksum stored in a COMMIT, WRITE or DELETE is based on all bytes
-**   up to the start of the 8-byte checksum itself, including the COMMIT,
-**   WRITE or DELETE fields that appear before the checksum in the record.
+**     for i from 0 to n-1:
+**       s0 = crc32c(s0, b[i]);
+**       s1 += s0;
+**     endfor
+**
+**   The CRC32C algorithm is implemented by the SSE4.2 and ARMv8 crc32c
+**   instructions, which are used where available.
+**
+**   In either case, if the record is not an even multiple of 8-bytes in 
+**   size it is padded with zeroes to make it so before the checksum is 
+**   updated.
+**
+**   The algorithm is stored in each checkpoint written to the database 
+**   file (see lsm_ckpt.c) and in shared-memory (ShmHeader.eLogCksum). If 
+**   the database does not yet contain a checkpoint, recovery assumes that
+**   the log was written using the algorithm configured for the connection
+**   and, if no valid transactions can be found that way, tries the other.
+**
+**   The checksum stored in a COMMIT, WRITE, DELETE, BATCH or VPTR is based
+**   on all bytes up to the start of the 8-byte checksum itself, including
+**   the fields that appear before the checksum in the record.
 **
 ** VARINT FORMAT
 **
@@ -201,6 +238,10 @@
 #define LSM_LOG_WRITE_CKSUM  0x07
 #define LSM_LOG_DELETE       0x08
 #define LSM_LOG_DELETE_CKSUM 0x09
+#define LSM_LOG_BATCH        0x0A
+#define LSM_LOG_BATCH_CKSUM  0x0B
+#define LSM_LOG_VPTR         0x0C
+#define LSM_LOG_VPTR_CKSUM   0x0D
 
 /* Require a checksum every 32KB. */
 #define LSM_CKSUM_MAXDATA (32*1024)
@@ -208,6 +249,12 @@
 /* Do not wrap a log file smaller than this in bytes. */
 #define LSM_MIN_LOGWRAP      (128*1024)
 
+/*
+** Signature of functions used to update log checksums. See the 
+** "CHECKSUMS" section above.
+*/
+typedef void (*LogCksumFunc)(char *, int, u32 *, u32 *);
+
 /*
 ** szSector:
 **   Commit records must be aligned to end on szSector boundaries. If
@@ -216,6 +263,7 @@
 **   sectors as reported by lsmFsSectorSize().
 */
 struct LogWriter {
+  LogCksumFunc xCksum;            /* Function to update cksum0 and cksum1 */
   u32 cksum0;                     /* Checksum 0 at offset iOff */
   u32 cksum1;                     /* Checksum 1 at offset iOff */
   int iCksumBuf;                  /* Bytes of buf that have been checksummed */
@@ -224,6 +272,9 @@ struct LogWriter {
   LogRegion jump;                 /* Avoid writing to this region */
   i64 iRegion1End;                /* End of first region written by trans */
   i64 iRegion2Start;              /* Start of second regions written by trans */
+  int bCksum;                     /* True to embed a cksum in next record */
+  int bBuffer;                    /* True to append to the log buffers */
+  i64 iLsn;                       /* LSN of last data appended to log buffers */
   LsmString buf;                  /* Buffer containing data not yet written */
 };
 
@@ -274,6 +325,202 @@ static void logCksumUnaligned(
   *pCksum1 = cksum1;
 }
 
+/*
+** Lookup table for the CRC32C polynomial (reflected, 0x82F63B78), used if 
+** the hardware crc32c instruction is not available.
+*/
+static const u32 aCrc32c[256] = {
+  0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4,
+  0xC79A971F, 0x35F1141C, 0x26A1E7E8, 0xD4CA64EB,
+  0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B,
+  0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24,
+  0x105EC76F, 0xE235446C, 0xF165B798, 0x030E349B,
+  0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+  0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54,
+  0x5D1D08BF, 0xAF768BBC, 0xBC267848, 0x4E4DFB4B,
+  0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A,
+  0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35,
+  0xAA64D611, 0x580F5512, 0x4B5FA6E6, 0xB93425E5,
+  0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+  0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45,
+  0xF779DEAE, 0x05125DAD, 0x1642AE59, 0xE4292D5A,
+  0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A,
+  0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595,
+  0x417B1DBC, 0xB3109EBF, 0xA0406D4B, 0x522BEE48,
+  0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+  0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687,
+  0x0C38D26C, 0xFE53516F, 0xED03A29B, 0x1F682198,
+  0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927,
+  0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38,
+  0xDBFC821C, 0x2997011F, 0x3AC7F2EB, 0xC8AC71E8,
+  0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+  0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096,
+  0xA65C047D, 0x5437877E, 0x4767748A, 0xB50CF789,
+  0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859,
+  0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46,
+  0x7198540D, 0x83F3D70E, 0x90A324FA, 0x62C8A7F9,
+  0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+  0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36,
+  0x3CDB9BDD, 0xCEB018DE, 0xDDE0EB2A, 0x2F8B6829,
+  0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C,
+  0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93,
+  0x082F63B7, 0xFA44E0B4, 0xE9141340, 0x1B7F9043,
+  0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+  0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3,
+  0x55326B08, 0xA759E80B, 0xB4091BFF, 0x466298FC,
+  0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C,
+  0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033,
+  0xA24BB5A6, 0x502036A5, 0x4370C551, 0xB11B4652,
+  0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+  0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D,
+  0xEF087A76, 0x1D63F975, 0x0E330A81, 0xFC588982,
+  0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D,
+  0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622,
+  0x38CC2A06, 0xCAA7A905, 0xD9F75AF1, 0x2B9CD9F2,
+  0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+  0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530,
+  0x0417B1DB, 0xF67C32D8, 0xE52CC12C, 0x1747422F,
+  0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF,
+  0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0,
+  0xD3D3E1AB, 0x21B862A8, 0x32E8915C, 0xC083125F,
+  0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+  0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90,
+  0x9E902E7B, 0x6CFBAD78, 0x7FAB5E8C, 0x8DC0DD8F,
+  0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE,
+  0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1,
+  0x69E9F0D5, 0x9B8273D6, 0x88D28022, 0x7AB90321,
+  0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+  0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81,
+  0x34F4F86A, 0xC69F7B69, 0xD5CF889D, 0x27A40B9E,
+  0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E,
+  0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351
+};
+
+/*
+** Update the LSM_LOG_CKSUM_CRC32C checksum values *pCksum0 and *pCksum1 
+** with the n bytes of data in buffer z. As with logCksumUnaligned(), the
+** data is padded with zeroes to a multiple of 8 bytes in size.
+*/
+static void logCksumCrc32c(
+  char *z,                        /* Input buffer */
+  int n,                          /* Size of input buffer in bytes */
+  u32 *pCksum0,                   /* IN/OUT: Checksum value 1 */
+  u32 *pCksum1                    /* IN/OUT: Checksum value 2 */
+){
+  u8 *a = (u8 *)z;
+  u32 cksum0 = *pCksum0;
+  u32 cksum1 = *pCksum1;
+  int nIn = (n/8) * 8;
+  int i;
+  int j;
+
+  assert( n>0 );
+  for(i=0; i<nIn; i+=8){
+    for(j=0; j<8; j++){
+      cksum0 = aCrc32c[(cksum0 ^ a[i+j]) & 0xFF] ^ (cksum0 >> 8);
+    }
+    cksum1 += cksum0;
+  }
+
+  *pCksum0 = cksum0;
+  *pCksum1 = cksum1;
+  if( nIn!=n ){
+    u8 aBuf[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    assert( (n-nIn)<8 && n>nIn );
+    memcpy(aBuf, &a[nIn], n-nIn);
+    logCksumCrc32c((char *)aBuf, 8, pCksum0, pCksum1);
+  }
+}
+
+/*
+** If the compiler and target support them, logCksumCrc32cHw() is a 
+** version of logCksumCrc32c() that uses the crc32c instruction. On x86-64
+** it may only be used if logHaveCrc32c() returns true.
+*/
+#if defined(__x86_64__) && defined(__GNUC__)
+# include <nmmintrin.h>
+# define LSM_CRC32C_HW 1
+# define LSM_CRC32C_TARGET __attribute__((target("sse4.2")))
+# define logCrc32c64(c,x) _mm_crc32_u64(c,x)
+# define logHaveCrc32c() __builtin_cpu_supports("sse4.2")
+#elif defined(_MSC_VER) && defined(_M_X64)
+# include <intrin.h>
+# include <nmmintrin.h>
+# define LSM_CRC32C_HW 1
+# define LSM_CRC32C_TARGET
+# define logCrc32c64(c,x) _mm_crc32_u64(c,x)
+static int logHaveCrc32c(void){
+  int aInfo[4];
+  __cpuid(aInfo, 1);
+  return (aInfo[2] >> 20) & 0x01;
+}
+#elif defined(__ARM_FEATURE_CRC32) && defined(__BYTE_ORDER__) \
+   && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+# include <arm_acle.h>
+# define LSM_CRC32C_HW 1
+# define LSM_CRC32C_TARGET
+# define logCrc32c64(c,x) __crc32cd(c,x)
+# define logHaveCrc32c() 1
+#endif
+
+#ifdef LSM_CRC32C_HW
+LSM_CRC32C_TARGET static void logCksumCrc32cHw(
+  char *z,                        /* Input buffer */
+  int n,                          /* Size of input buffer in bytes */
+  u32 *pCksum0,                   /* IN/OUT: Checksum value 1 */
+  u32 *pCksum1                    /* IN/OUT: Checksum value 2 */
+){
+  u8 *a = (u8 *)z;
+  u32 cksum0 = *pCksum0;
+  u32 cksum1 = *pCksum1;
+  int nIn = (n/8) * 8;
+  int i;
+
+  assert( n>0 );
+  for(i=0; i<nIn; i+=8){
+    u64 x;
+    memcpy(&x, &a[i], 8);
+    cksum0 = (u32)logCrc32c64(cksum0, x);
+    cksum1 += cksum0;
+  }
+
+  if( nIn!=n ){
+    u64 x = 0;
+    assert( (n-nIn)<8 && n>nIn );
+    memcpy(&x, &a[nIn], n-nIn);
+    cksum0 = (u32)logCrc32c64(cksum0, x);
+    cksum1 += cksum0;
+  }
+
+  *pCksum0 = cksum0;
+  *pCksum1 = cksum1;
+}
+#endif
+
+/*
+** Return the function used to update checksums for log checksum algorithm
+** eCksum (LSM_LOG_CKSUM_FLETCHER or LSM_LOG_CKSUM_CRC32C).
+*/
+static LogCksumFunc logCksumFunc(u32 eCksum){
+  if( eCksum==LSM_LOG_CKSUM_CRC32C ){
+#ifdef LSM_CRC32C_HW
+    if( logHaveCrc32c() ) return logCksumCrc32cHw;
+#endif
+    return logCksumCrc32c;
+  }
+  assert( eCksum==LSM_LOG_CKSUM_FLETCHER );
+  return logCksumUnaligned;
+}
+
+/*
+** Update the checksum values aCksum[0] and aCksum[1] with the n bytes of
+** data in buffer a[], using log checksum algorithm eCksum. This is used
+** to checksum the tree image file (see lsmTreeSaveImage()).
+*/
+void lsmLogChecksum(u32 eCksum, const void *a, int n, u32 *aCksum){
+  logCksumFunc(eCksum)((char *)a, n, &aCksum[0], &aCksum[1]);
+}
+
 /*
 ** Update pLog->cksum0 and pLog->cksum1 so that the first nBuf bytes in the 
 ** write buffer (pLog->buf) are included in the checksum.
@@ -283,7 +530,7 @@ static void logUpdateCksum(LogWriter *pLog, int nBuf){
   assert( pLog->iCksumBuf<=nBuf );
   assert( (nBuf % 8)==0 || nBuf==pLog->buf.n );
   if( nBuf>pLog->iCksumBuf ){
-    logCksumUnaligned(
+    pLog->xCksum(
         &pLog->buf.z[pLog->iCksumBuf], nBuf-pLog->iCksumBuf, 
         &pLog->cksum0, &pLog->cksum1
     );
@@ -348,6 +595,19 @@ static int logReclaimSpace(lsm_db *pDb){
   return rc;
 }
 
+/*
+** Write the contents of buffer pStr to offset iOff of the log file. Or, if
+** the transaction is using the log buffers (see LSM_CONFIG_LOG_BUFFER),
+** append it to them so that it is written once the WRITER lock has been
+** released.
+*/
+static int logWrite(lsm_db *pDb, LogWriter *pLog, i64 iOff, LsmString *pStr){
+  if( pLog->bBuffer ){
+    return lsmDbLogWrite(pDb, iOff, pStr, &pLog->iLsn);
+  }
+  return lsmFsWriteLog(pDb->pFS, iOff, pStr);
+}
+
 /*
 ** This function is called when a write-transaction is first opened. It
 ** is assumed that the caller is holding the client-mutex when it is 
@@ -394,6 +654,15 @@ int lsmLogBegin(lsm_db *pDb){
     */
     rc = logReclaimSpace(pDb);
   }
+  if( rc==LSM_OK && lsmDbMultiProc(pDb)==0 ){
+    /* Decide whether or not this transaction appends to the log buffers.
+    ** If it does not, any data appended to them by earlier transactions
+    ** must be written before this transaction writes to the log file 
+    ** directly. With safety=full, the log must be synced before the WRITER
+    ** lock is released, so there is no advantage in using the buffers. */
+    pNew->bBuffer = (pDb->bLogBuffer && pDb->eSafety!=LSM_SAFETY_FULL);
+    if( pNew->bBuffer==0 ) rc = lsmDbLogFlush(pDb, -1);
+  }
   if( rc!=LSM_OK ){
     lsmLogClose(pDb);
     return rc;
@@ -401,8 +670,8 @@ int lsmLogBegin(lsm_db *pDb){
 
   /* Set the effective sector-size for this transaction. Sectors are assumed
   ** to be one byte in size if the safety-mode is OFF or NORMAL, or as
-  ** reported by lsmFsSectorSize if it is FULL.  */
-  if( pDb->eSafety==LSM_SAFETY_FULL ){
+  ** reported by lsmFsSectorSize if it is FULL or WINDOW.  */
+  if( pDb->eSafety==LSM_SAFETY_FULL || pDb->eSafety==LSM_SAFETY_WINDOW ){
     pNew->szSector = lsmFsSectorSize(pDb->pFS);
     assert( pNew->szSector>0 );
   }else{
@@ -426,6 +695,7 @@ int lsmLogBegin(lsm_db *pDb){
   assert( aReg[0].iEnd==0 || aReg[0].iEnd>aReg[0].iStart );
   assert( aReg[1].iEnd==0 || aReg[1].iEnd>aReg[1].iStart );
 
+  pNew->xCksum = logCksumFunc(pDb->pShmhdr->eLogCksum);
   pNew->cksum0 = pDb->treehdr.log.cksum0;
   pNew->cksum1 = pDb->treehdr.log.cksum1;
 
@@ -439,12 +709,18 @@ int lsmLogBegin(lsm_db *pDb){
 
     lsmStringBinAppend(&pNew->buf, aJump, sizeof(aJump));
     logUpdateCksum(pNew, pNew->buf.n);
-    rc = lsmFsWriteLog(pDb->pFS, aReg[2].iEnd, &pNew->buf);
+    rc = logWrite(pDb, pNew, aReg[2].iEnd, &pNew->buf);
     pNew->iCksumBuf = pNew->buf.n = 0;
 
+    /* The regions in the tree-header are modified in place, so they are
+    ** retained even if this transaction is rolled back. Update the 
+    ** checksums in the tree-header to include the JUMP record as well, so
+    ** that the next transaction continues from the right values.  */
     aReg[2].iEnd += 8;
     pNew->jump = aReg[0] = aReg[2];
     aReg[2].iStart = aReg[2].iEnd = 0;
+    pDb->treehdr.log.cksum0 = pNew->cksum0;
+    pDb->treehdr.log.cksum1 = pNew->cksum1;
   }else if( aReg[1].iEnd==0 && aReg[2].iEnd<aReg[0].iEnd ){
     /* Case 2. */
     pNew->iOff = aReg[2].iEnd;
@@ -464,6 +740,16 @@ int lsmLogBegin(lsm_db *pDb){
     pNew->jump.iEnd = lastByteOnSector(pNew, pNew->jump.iEnd);
   }
 
+  /* If the safety-mode is WINDOW, preallocate space for the log file 
+  ** beyond the current write offset. So that syncing the log after this
+  ** transaction is committed does not usually require the file size to
+  ** be updated as well. Space beyond the end of all three regions may 
+  ** be zeroed.  */
+  if( rc==LSM_OK && pDb->eSafety==LSM_SAFETY_WINDOW ){
+    i64 iFree = LSM_MAX(aReg[0].iEnd, LSM_MAX(aReg[1].iEnd, aReg[2].iEnd));
+    rc = lsmFsAllocLog(pDb->pFS, iFree, pNew->iOff + LSM_LOG_PREALLOC);
+  }
+
   pDb->pLogWriter = pNew;
   return rc;
 }
@@ -502,6 +788,18 @@ void lsmLogEnd(lsm_db *pDb, int bCommit){
   }
 }
 
+/*
+** This is called by lsm_commit() after the WRITER lock has been released.
+** If the transaction just committed appended its log records to the log
+** buffers, wait until they have been written to the log file. Return
+** LSM_OK if successful, or an LSM error code otherwise.
+*/
+int lsmLogWait(lsm_db *pDb){
+  LogWriter *pLog = pDb->pLogWriter;
+  if( pDb->bUseLog==0 || pLog==0 || pLog->iLsn==0 ) return LSM_OK;
+  return lsmDbLogFlush(pDb, pLog->iLsn);
+}
+
 static int jumpIfRequired(
   lsm_db *pDb,
   LogWriter *pLog,
@@ -553,7 +851,7 @@ static int jumpIfRequired(
     rc = lsmStringBinAppend(&pLog->buf, aJump, nJump);
     if( rc!=LSM_OK ) return rc;
     assert( (pLog->buf.n % 8)==0 );
-    rc = lsmFsWriteLog(pDb->pFS, pLog->iOff, &pLog->buf);
+    rc = logWrite(pDb, pLog, pLog->iOff, &pLog->buf);
     if( rc!=LSM_OK ) return rc;
     logUpdateCksum(pLog, pLog->buf.n);
     pLog->iRegion1End = (pLog->iOff + pLog->buf.n);
@@ -578,9 +876,10 @@ static int logCksumAndFlush(lsm_db *pDb){
   pLog->buf.n += 4;
 
   /* Write the contents of the buffer to disk. */
-  rc = lsmFsWriteLog(pDb->pFS, pLog->iOff, &pLog->buf);
+  rc = logWrite(pDb, pLog, pLog->iOff, &pLog->buf);
   pLog->iOff += pLog->buf.n;
   pLog->iCksumBuf = pLog->buf.n = 0;
+  pLog->bCksum = 0;
 
   return rc;
 }
@@ -611,9 +910,11 @@ static int logFlush(lsm_db *pDb, int eType){
 
     /* Determine the value of nPad. */
     nPad = ((pLog->iOff + pLog->buf.n + 9) % pLog->szSector);
-    if( nPad ) nPad = pLog->szSector - nPad;
-    rc = lsmStringExtend(&pLog->buf, nPad);
-    if( rc!=LSM_OK ) return rc;
+    if( nPad ){
+      nPad = pLog->szSector - nPad;
+      rc = lsmStringExtend(&pLog->buf, nPad);
+      if( rc!=LSM_OK ) return rc;
+    }
 
     while( nPad ){
       if( nPad==1 ){
@@ -638,6 +939,16 @@ static int logFlush(lsm_db *pDb, int eType){
   pLog->buf.z[pLog->buf.n++] = eType;
   memset(&pLog->buf.z[pLog->buf.n], 0, 8);
 
+  /* If this is a commit and synchronous=full or window, sync any values
+  ** written to the value log before the COMMIT record that refers to 
+  ** them.  */
+  if( eType==LSM_LOG_COMMIT 
+   && (pDb->eSafety==LSM_SAFETY_FULL || pDb->eSafety==LSM_SAFETY_WINDOW)
+  ){
+    rc = lsmVlogSync(pDb, pDb->treehdr.iVlogOff);
+    if( rc!=LSM_OK ) return rc;
+  }
+
   rc = logCksumAndFlush(pDb);
 
   /* If this is a commit and synchronous=full, sync the log to disk. */
@@ -649,10 +960,12 @@ static int logFlush(lsm_db *pDb, int eType){
 
 /*
 ** Append an LSM_LOG_WRITE (if nVal>=0) or LSM_LOG_DELETE (if nVal<0) 
-** record to the database log.
+** record to the database log. Or, if bPtr is true, an LSM_LOG_VPTR record
+** for which pVal/nVal is a pointer into the value log.
 */
 int lsmLogWrite(
   lsm_db *pDb,                    /* Database handle */
+  int bPtr,                       /* True if pVal is a value log pointer */
   void *pKey, int nKey,           /* Database key to write to log */
   void *pVal, int nVal            /* Database value (or nVal<0) to write */
 ){
@@ -672,10 +985,10 @@ int lsmLogWrite(
   /* Jump over the jump region if required. Set bCksum to true to tell the
   ** code below to include a checksum in the record if either (a) writing
   ** this record would mean that more than LSM_CKSUM_MAXDATA bytes of data
-  ** have been written to the log since the last checksum, or (b) the jump
-  ** is taken.  */
+  ** have been written to the log since the last checksum, (b) the jump
+  ** is taken, or (c) lsmLogSeek() has set LogWriter.bCksum.  */
   rc = jumpIfRequired(pDb, pLog, nReq, &bCksum);
-  if( (pLog->buf.n+nReq) > LSM_CKSUM_MAXDATA ) bCksum = 1;
+  if( pLog->bCksum || (pLog->buf.n+nReq) > LSM_CKSUM_MAXDATA ) bCksum = 1;
 
   if( rc==LSM_OK ){
     rc = lsmStringExtend(&pLog->buf, nReq);
@@ -684,10 +997,16 @@ int lsmLogWrite(
     u8 *a = (u8 *)&pLog->buf.z[pLog->buf.n];
     
     /* Write the record header - the type byte followed by either 1 (for
-    ** DELETE) or 2 (for WRITE) varints.  */
+    ** DELETE) or 2 (for WRITE or VPTR) varints.  */
     assert( LSM_LOG_WRITE_CKSUM == (LSM_LOG_WRITE | 0x0001) );
     assert( LSM_LOG_DELETE_CKSUM == (LSM_LOG_DELETE | 0x0001) );
-    *(a++) = (nVal>=0 ? LSM_LOG_WRITE : LSM_LOG_DELETE) | (u8)bCksum;
+    assert( LSM_LOG_VPTR_CKSUM == (LSM_LOG_VPTR | 0x0001) );
+    assert( bPtr==0 || nVal>=0 );
+    if( bPtr ){
+      *(a++) = LSM_LOG_VPTR | (u8)bCksum;
+    }else{
+      *(a++) = (nVal>=0 ? LSM_LOG_WRITE : LSM_LOG_DELETE) | (u8)bCksum;
+    }
     a += lsmVarintPut32(a, nKey);
     if( nVal>=0 ) a += lsmVarintPut32(a, nVal);
 
@@ -710,6 +1029,50 @@ int lsmLogWrite(
   return rc;
 }
 
+/*
+** Append an LSM_LOG_BATCH record containing the encoded batch aBatch/nBatch
+** to the database log. The batch is copied into the log buffer in a single
+** block, so that the checksum is updated in one pass when it is flushed.
+*/
+int lsmLogWriteBatch(lsm_db *pDb, const u8 *aBatch, int nBatch){
+  int rc = LSM_OK;
+  LogWriter *pLog;                /* Log object to write to */
+  int nReq;                       /* Bytes of space required in log */
+  int bCksum = 0;                 /* True to embed a checksum in this record */
+
+  if( pDb->bUseLog==0 ) return LSM_OK;
+  pLog = pDb->pLogWriter;
+
+  /* See lsmLogWrite() for details. */
+  nReq = 1 + lsmVarintLen32(nBatch) + 8 + nBatch;
+  rc = jumpIfRequired(pDb, pLog, nReq, &bCksum);
+  if( pLog->bCksum || (pLog->buf.n+nReq) > LSM_CKSUM_MAXDATA ) bCksum = 1;
+
+  if( rc==LSM_OK ){
+    rc = lsmStringExtend(&pLog->buf, nReq);
+  }
+  if( rc==LSM_OK ){
+    u8 *a = (u8 *)&pLog->buf.z[pLog->buf.n];
+    
+    assert( LSM_LOG_BATCH_CKSUM == (LSM_LOG_BATCH | 0x0001) );
+    *(a++) = LSM_LOG_BATCH | (u8)bCksum;
+    a += lsmVarintPut32(a, nBatch);
+
+    if( bCksum ){
+      pLog->buf.n = (a - (u8 *)pLog->buf.z);
+      rc = logCksumAndFlush(pDb);
+      a = (u8 *)&pLog->buf.z[pLog->buf.n];
+    }
+
+    memcpy(a, aBatch, nBatch);
+    a += nBatch;
+    pLog->buf.n = a - (u8 *)pLog->buf.z;
+    assert( pLog->buf.n<=pLog->buf.nAlloc );
+  }
+
+  return rc;
+}
+
 /*
 ** Append an LSM_LOG_COMMIT record to the database log.
 */
@@ -766,12 +1129,22 @@ void lsmLogSeek(
     memcpy(pLog->buf.z, pMark->aBuf, pMark->nBuf);
     pLog->iCksumBuf = 0;
     pLog->iOff = pMark->iOff - pMark->nBuf;
+
+    /* The buffer no longer begins at the last checksum, so its size says
+    ** nothing about how much data has been written since then. If it is
+    ** more than LSM_CKSUM_MAXDATA bytes, recovery requires the next record
+    ** to contain a checksum. So always include one.  */
+    pLog->bCksum = 1;
   }
   pLog->cksum0 = pMark->cksum0;
   pLog->cksum1 = pMark->cksum1;
 
-  if( pMark->iOff > pLog->iRegion1End ) pLog->iRegion1End = 0;
-  if( pMark->iOff > pLog->iRegion2Start ) pLog->iRegion2Start = 0;
+  /* If the mark was taken before the transaction jumped over region 0,
+  ** the jump has been rolled back too.  */
+  if( pMark->iOff < pLog->iRegion2Start ){
+    pLog->iRegion1End = 0;
+    pLog->iRegion2Start = 0;
+  }
 }
 
 /*
@@ -818,6 +1191,7 @@ struct LogReader {
   int iBuf;                       /* Current read offset in buf */
   LsmString buf;                  /* Buffer containing file content */
 
+  LogCksumFunc xCksum;            /* Function to update cksum0 and cksum1 */
   int iCksumBuf;                  /* Offset in buf corresponding to cksum[01] */
   u32 cksum0;                     /* Checksum 0 at offset iCksumBuf */
   u32 cksum1;                     /* Checksum 1 at offset iCksumBuf */
@@ -830,7 +1204,7 @@ static void logReaderBlob(
   u8 **ppBlob,                    /* OUT: Pointer to blob read */
   int *pRc                        /* IN/OUT: Error code */
 ){
-  static const int LOG_READ_SIZE = 512;
+  static const int LOG_READ_SIZE = 64*1024;
   int rc = *pRc;                  /* Return code */
   int nReq = nBlob;               /* Bytes required */
 
@@ -845,7 +1219,7 @@ static void logReaderBlob(
         nCarry = nCksum % 8;
         nCksum = ((nCksum / 8) * 8);
         if( nCksum>0 ){
-          logCksumUnaligned(
+          p->xCksum(
               &p->buf.z[p->iCksumBuf], nCksum, &p->cksum0, &p->cksum1
           );
         }
@@ -868,12 +1242,15 @@ static void logReaderBlob(
     }else{
       int nCopy = LSM_MIN(nAvail, nReq);
       if( nBlob==nReq ){
-        if( ppBlob ) *ppBlob = (u8 *)pBuf->z;
         pBuf->n = 0;
       }
       rc = lsmStringBinAppend(pBuf, (u8 *)&p->buf.z[p->iBuf], nCopy);
       nReq -= nCopy;
       p->iBuf += nCopy;
+
+      /* Set the output pointer only after the data has been appended, as
+      ** appending may reallocate pBuf->z.  */
+      if( ppBlob && nReq==0 ) *ppBlob = (u8 *)pBuf->z;
     }
   }
 
@@ -895,6 +1272,9 @@ static void logReaderVarint(
       logReaderBlob(p, pBuf, lsmVarintSize(p->buf.z[p->iBuf]), &aVarint, pRc);
       if( LSM_OK==*pRc ) lsmVarintGet32(aVarint, piVal);
     }
+
+    /* All varints in the log are sizes or offsets. */
+    if( LSM_OK==*pRc && *piVal<0 ) *pRc = LSM_CORRUPT_BKPT;
   }
 }
 
@@ -912,7 +1292,7 @@ static void logReaderCksum(LogReader *p, LsmString *pBuf, int *pbEof, int *pRc){
 
     /* Update in-memory (expected) checksums */
     assert( nCksum>=0 );
-    logCksumUnaligned(&p->buf.z[p->iCksumBuf], nCksum, &p->cksum0, &p->cksum1);
+    p->xCksum(&p->buf.z[p->iCksumBuf], nCksum, &p->cksum0, &p->cksum1);
     p->iCksumBuf = p->iBuf + 8;
     logReaderBlob(p, pBuf, 8, &pPtr, pRc);
 
@@ -934,6 +1314,7 @@ static void logReaderInit(
 ){
   p->pFS = pDb->pFS;
   p->iOff = pLog->aRegion[2].iStart;
+  p->xCksum = logCksumFunc(pDb->pShmhdr->eLogCksum);
   p->cksum0 = pLog->cksum0;
   p->cksum1 = pLog->cksum1;
   if( bInitBuf ){ lsmStringInit(&p->buf, pDb->pEnv); }
@@ -960,11 +1341,16 @@ int lsmLogRecover(lsm_db *pDb){
   LsmString buf2;                 /* Value buffer */
   LogReader reader;               /* Log reader object */
   int rc = LSM_OK;                /* Return code */
-  int nCommit = 0;                /* Number of transactions to recover */
-  int iPass;
-  int nJump = 0;                  /* Number of LSM_LOG_JUMP records in pass 0 */
+  int nCommit = 0;                /* Number of transactions recovered */
+  int nJump = 0;                  /* Number of LSM_LOG_JUMP records read */
+  int bEof = 0;                   /* True once end of log is reached */
   DbLog *pLog;
+  DbLog commit;                   /* Value of *pLog at last COMMIT */
+  i64 iVlogCommit;                /* Value of iVlogOff at last COMMIT */
+  TreeMark mark;                  /* Tree state at last COMMIT */
   int bOpen;
+  int bProbe = 0;                 /* Set if the checksum algorithm unknown */
+  ShmHeader *pShm = pDb->pShmhdr;
 
   rc = lsmFsOpenLog(pDb, &bOpen);
   if( rc!=LSM_OK ) return rc;
@@ -974,139 +1360,213 @@ int lsmLogRecover(lsm_db *pDb){
 
   pLog = &pDb->treehdr.log;
   lsmCheckpointLogoffset(pDb->pShmhdr->aSnap2, pLog);
+  pLog->aRegion[2].iEnd = pLog->aRegion[2].iStart;
+  pDb->treehdr.iVlogOff = lsmCheckpointVlogOffset(pDb->pShmhdr->aSnap2);
+
+  /* Determine the checksum algorithm used by the log. If the database
+  ** has never been checkpointed, try the one configured for this 
+  ** connection first. If no transactions can be recovered using it,
+  ** try the other before concluding that the log is empty.  */
+  pShm->eLogCksum = lsmCheckpointLogCksum(pShm->aSnap2);
+  if( pShm->eLogCksum==LSM_LOG_CKSUM_UNKNOWN ){
+    pShm->eLogCksum = (u32)pDb->eLogCksum;
+    bProbe = 1;
+  }else if( pShm->eLogCksum!=LSM_LOG_CKSUM_FLETCHER 
+         && pShm->eLogCksum!=LSM_LOG_CKSUM_CRC32C 
+  ){
+    return LSM_CORRUPT_BKPT;
+  }
 
   logReaderInit(pDb, pLog, 1, &reader);
   lsmStringInit(&buf1, pDb->pEnv);
   lsmStringInit(&buf2, pDb->pEnv);
 
-  /* The outer for() loop runs at most twice. The first iteration is to 
-  ** count the number of committed transactions in the log. The second 
-  ** iterates through those transactions and updates the in-memory tree 
-  ** structure with their contents.  */
-  if( bOpen ){
-    for(iPass=0; iPass<2 && rc==LSM_OK; iPass++){
-      int bEof = 0;
-
-      while( rc==LSM_OK && !bEof ){
-        u8 eType = 0;
-        logReaderByte(&reader, &eType, &rc);
-
-        switch( eType ){
-          case LSM_LOG_PAD1:
-            break;
-
-          case LSM_LOG_PAD2: {
-            int nPad;
-            logReaderVarint(&reader, &buf1, &nPad, &rc);
-            logReaderBlob(&reader, &buf1, nPad, 0, &rc);
-            break;
-          }
+  /* Records are inserted into the in-memory tree as they are read, so 
+  ** that the log is only read once. Each time a valid COMMIT record is
+  ** found the state of the tree, the log regions and the value log offset
+  ** are saved. When the end of the log is reached, the records of the
+  ** last, incomplete, transaction (if any) are discarded by rolling back 
+  ** to the saved state.  */
+  memcpy(&commit, pLog, sizeof(DbLog));
+  iVlogCommit = pDb->treehdr.iVlogOff;
+  lsmTreeMark(pDb, &mark);
+
+  while( bOpen && rc==LSM_OK && !bEof ){
+    u8 eType = 0;
+    logReaderByte(&reader, &eType, &rc);
+
+    switch( eType ){
+      case LSM_LOG_PAD1:
+        break;
+
+      case LSM_LOG_PAD2: {
+        int nPad;
+        logReaderVarint(&reader, &buf1, &nPad, &rc);
+        logReaderBlob(&reader, &buf1, nPad, 0, &rc);
+        break;
+      }
 
-          case LSM_LOG_WRITE:
-          case LSM_LOG_WRITE_CKSUM: {
-            int nKey;
-            int nVal;
-            u8 *aVal;
-            logReaderVarint(&reader, &buf1, &nKey, &rc);
-            logReaderVarint(&reader, &buf2, &nVal, &rc);
-
-            if( eType==LSM_LOG_WRITE_CKSUM ){
-              logReaderCksum(&reader, &buf1, &bEof, &rc);
-            }else{
-              bEof = logRequireCksum(&reader, nKey+nVal);
-            }
-            if( bEof ) break;
+      case LSM_LOG_WRITE:
+      case LSM_LOG_WRITE_CKSUM:
+      case LSM_LOG_VPTR:
+      case LSM_LOG_VPTR_CKSUM: {
+        int nKey;
+        int nVal;
+        u8 *aVal;
+        logReaderVarint(&reader, &buf1, &nKey, &rc);
+        logReaderVarint(&reader, &buf2, &nVal, &rc);
+
+        if( eType & 0x0001 ){
+          logReaderCksum(&reader, &buf1, &bEof, &rc);
+        }else{
+          bEof = logRequireCksum(&reader, nKey+nVal);
+        }
+        if( bEof ) break;
 
-            logReaderBlob(&reader, &buf1, nKey, 0, &rc);
-            logReaderBlob(&reader, &buf2, nVal, &aVal, &rc);
-            if( iPass==1 && rc==LSM_OK ){ 
-              rc = lsmTreeInsert(pDb, (u8 *)buf1.z, nKey, aVal, nVal);
+        logReaderBlob(&reader, &buf1, nKey, 0, &rc);
+        logReaderBlob(&reader, &buf2, nVal, &aVal, &rc);
+        if( rc==LSM_OK ){ 
+          if( eType==LSM_LOG_WRITE || eType==LSM_LOG_WRITE_CKSUM ){
+            rc = lsmTreeInsert(pDb, (u8 *)buf1.z, nKey, aVal, nVal);
+          }else{
+            /* Make sure values written after recovery do not 
+            ** overwrite the value this entry points to. */
+            i64 iOff = 0;
+            int nByte = 0;
+            rc = lsmVlogPtrDecode(aVal, nVal, &iOff, &nByte);
+            if( rc==LSM_OK ){
+              TreeHeader *pHdr = &pDb->treehdr;
+              pHdr->iVlogOff = LSM_MAX(pHdr->iVlogOff, iOff+nByte);
+              rc = lsmTreeInsertPtr(pDb, (u8 *)buf1.z, nKey, aVal, nVal);
             }
-            break;
           }
+        }
+        break;
+      }
 
-          case LSM_LOG_DELETE:
-          case LSM_LOG_DELETE_CKSUM: {
-            int nKey; u8 *aKey;
-            logReaderVarint(&reader, &buf1, &nKey, &rc);
+      case LSM_LOG_DELETE:
+      case LSM_LOG_DELETE_CKSUM: {
+        int nKey; u8 *aKey;
+        logReaderVarint(&reader, &buf1, &nKey, &rc);
 
-            if( eType==LSM_LOG_DELETE_CKSUM ){
-              logReaderCksum(&reader, &buf1, &bEof, &rc);
-            }else{
-              bEof = logRequireCksum(&reader, nKey);
-            }
-            if( bEof ) break;
+        if( eType==LSM_LOG_DELETE_CKSUM ){
+          logReaderCksum(&reader, &buf1, &bEof, &rc);
+        }else{
+          bEof = logRequireCksum(&reader, nKey);
+        }
+        if( bEof ) break;
 
-            logReaderBlob(&reader, &buf1, nKey, &aKey, &rc);
-            if( iPass==1 && rc==LSM_OK ){ 
-              rc = lsmTreeInsert(pDb, aKey, nKey, NULL, -1);
-            }
-            break;
-          }
+        logReaderBlob(&reader, &buf1, nKey, &aKey, &rc);
+        if( rc==LSM_OK ){ 
+          rc = lsmTreeInsert(pDb, aKey, nKey, NULL, -1);
+        }
+        break;
+      }
 
-          case LSM_LOG_COMMIT:
-            logReaderCksum(&reader, &buf1, &bEof, &rc);
-            if( bEof==0 ){
-              nCommit++;
-              assert( nCommit>0 || iPass==1 );
-              if( nCommit==0 ) bEof = 1;
-            }
-            break;
+      case LSM_LOG_BATCH:
+      case LSM_LOG_BATCH_CKSUM: {
+        int nBatch; u8 *aBatch;
+        logReaderVarint(&reader, &buf1, &nBatch, &rc);
 
-          case LSM_LOG_JUMP: {
-            int iOff = 0;
-            logReaderVarint(&reader, &buf1, &iOff, &rc);
-            if( rc==LSM_OK ){
-              if( iPass==1 ){
-                if( pLog->aRegion[2].iStart==0 ){
-                  assert( pLog->aRegion[1].iStart==0 );
-                  pLog->aRegion[1].iEnd = reader.iOff;
-                }else{
-                  assert( pLog->aRegion[0].iStart==0 );
-                  pLog->aRegion[0].iStart = pLog->aRegion[2].iStart;
-                  pLog->aRegion[0].iEnd = reader.iOff-reader.buf.n+reader.iBuf;
-                }
-                pLog->aRegion[2].iStart = iOff;
-              }else{
-                if( (nJump++)==2 ){
-                  bEof = 1;
-                }
-              }
-
-              reader.iOff = iOff;
-              reader.buf.n = reader.iBuf;
-            }
-            break;
-          }
+        if( eType==LSM_LOG_BATCH_CKSUM ){
+          logReaderCksum(&reader, &buf1, &bEof, &rc);
+        }else{
+          bEof = logRequireCksum(&reader, nBatch);
+        }
+        if( bEof ) break;
 
-          default:
-            /* Including LSM_LOG_EOF */
-            bEof = 1;
-            break;
+        logReaderBlob(&reader, &buf1, nBatch, &aBatch, &rc);
+        if( rc==LSM_OK ){ 
+          rc = lsmBatchApply(pDb, aBatch, nBatch);
         }
+        break;
       }
 
-      if( rc==LSM_OK && iPass==0 ){
-        if( nCommit==0 ){
+      case LSM_LOG_COMMIT:
+        logReaderCksum(&reader, &buf1, &bEof, &rc);
+        if( bEof==0 && rc==LSM_OK ){
+          nCommit++;
+          memcpy(&commit, pLog, sizeof(DbLog));
+          commit.aRegion[2].iEnd = reader.iOff - reader.buf.n + reader.iBuf;
+          commit.cksum0 = reader.cksum0;
+          commit.cksum1 = reader.cksum1;
+          iVlogCommit = pDb->treehdr.iVlogOff;
+          lsmTreeRecoverCommit(pDb);
+          lsmTreeMark(pDb, &mark);
+        }
+        break;
+
+      case LSM_LOG_JUMP: {
+        int iOff = 0;
+        logReaderVarint(&reader, &buf1, &iOff, &rc);
+        if( rc==LSM_OK ){
+          if( (nJump++)==2 ){
+            bEof = 1;
+            break;
+          }
           if( pLog->aRegion[2].iStart==0 ){
-            iPass = 1;
+            assert( pLog->aRegion[1].iStart==0 );
+            pLog->aRegion[1].iEnd = reader.iOff-reader.buf.n+reader.iBuf;
           }else{
-            pLog->aRegion[2].iStart = 0;
-            iPass = -1;
-            lsmCheckpointZeroLogoffset(pDb);
+            assert( pLog->aRegion[0].iStart==0 );
+            pLog->aRegion[0].iStart = pLog->aRegion[2].iStart;
+            pLog->aRegion[0].iEnd = reader.iOff-reader.buf.n+reader.iBuf;
           }
+          pLog->aRegion[2].iStart = iOff;
+
+          reader.iOff = iOff;
+          reader.buf.n = reader.iBuf;
         }
-        logReaderInit(pDb, pLog, 0, &reader);
-        nCommit = nCommit * -1;
+        break;
       }
+
+      default:
+        /* Including LSM_LOG_EOF */
+        bEof = 1;
+        break;
     }
-  }
 
-  /* Initialize DbLog object */
-  if( rc==LSM_OK ){
-    pLog->aRegion[2].iEnd = reader.iOff - reader.buf.n + reader.iBuf;
-    pLog->cksum0 = reader.cksum0;
-    pLog->cksum1 = reader.cksum1;
+    /* The checksum that covers a record is not read until after the record
+    ** has been decoded. So a record that cannot be decoded may be part of
+    ** a transaction that was only partially written to the log. Treat it
+    ** as the end of the log, in the same way as a checksum mismatch.  */
+    if( rc==LSM_CORRUPT ){
+      rc = LSM_OK;
+      bEof = 1;
+    }
+
+    if( rc==LSM_OK && bEof ){
+      /* Discard the incomplete transaction at the end of the log. */
+      lsmTreeRollback(pDb, &mark);
+      memcpy(pLog, &commit, sizeof(DbLog));
+      pDb->treehdr.iVlogOff = iVlogCommit;
+
+      if( nCommit==0 && bProbe==1 ){
+        /* Try again using the other checksum algorithm. */
+        pShm->eLogCksum = (pShm->eLogCksum==LSM_LOG_CKSUM_CRC32C ?
+            LSM_LOG_CKSUM_FLETCHER : LSM_LOG_CKSUM_CRC32C
+        );
+        bProbe = 2;
+        bEof = 0;
+      }else if( nCommit==0 && pLog->aRegion[2].iStart ){
+        /* No transactions were found following the log offset stored in
+        ** the checkpoint. Try again from the start of the log file. */
+        if( bProbe ) pShm->eLogCksum = (u32)pDb->eLogCksum;
+        bProbe = 0;
+        pLog->aRegion[2].iStart = 0;
+        pLog->aRegion[2].iEnd = 0;
+        memcpy(&commit, pLog, sizeof(DbLog));
+        lsmCheckpointZeroLogoffset(pDb);
+        bEof = 0;
+      }else if( nCommit==0 && bProbe ){
+        pShm->eLogCksum = (u32)pDb->eLogCksum;
+      }
+
+      if( bEof==0 ){
+        nJump = 0;
+        logReaderInit(pDb, pLog, 0, &reader);
+      }
+    }
   }
 
   if( rc==LSM_OK ){
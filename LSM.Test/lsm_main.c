@@ -97,6 +97,20 @@ int lsm_new(lsm_env *pEnv, lsm_db **ppDb){
   pDb->iRwclient = -1;
   pDb->bMultiProc = LSM_DFLT_MULTIPLE_PROCESSES;
   pDb->iMmap = LSM_DFLT_MMAP;
+  pDb->nCacheSize = LSM_DFLT_CACHE_SIZE;
+  pDb->nBloomBits = LSM_DFLT_BLOOM_BITS;
+  pDb->bPrefixKeys = LSM_DFLT_PREFIX_KEYS;
+  pDb->bGroupCommit = LSM_DFLT_GROUP_COMMIT;
+  pDb->nBgWorker = LSM_DFLT_BACKGROUND_WORKERS;
+  pDb->nThrottleLevels = LSM_DFLT_THROTTLE_LEVELS;
+  pDb->bSkiplist = LSM_DFLT_SKIPLIST;
+  pDb->nValueLog = LSM_DFLT_VALUE_LOG;
+  pDb->eLogCksum = LSM_DFLT_LOG_CHECKSUM;
+  pDb->bTreeImage = LSM_DFLT_TREE_IMAGE;
+  pDb->nSyncWindow = LSM_DFLT_SYNC_WINDOW;
+  pDb->bLogBuffer = LSM_DFLT_LOG_BUFFER;
+  pDb->nVlogGc = LSM_DFLT_VALUE_LOG_GC;
+  lsmStringInit(&pDb->vlogGcKey, pEnv);
   pDb->xLog = xLog;
   pDb->compress.iId = LSM_COMPRESSION_NONE;
   return LSM_OK;
@@ -162,6 +176,163 @@ static void assertRwclientLockValue(lsm_db *db){
 #endif
 }
 
+/*
+** The set of background worker threads started by a connection configured
+** with LSM_CONFIG_BACKGROUND_WORKERS. Each thread uses its own connection
+** to the database, stored in apDb[].
+*/
+struct BgWork {
+  lsm_env *pEnv;                  /* Environment used to start threads */
+  lsm_mutex *pMutex;              /* Mutex protecting bStop */
+  int bStop;                      /* Set to true to stop the threads */
+  int nThread;                    /* Number of threads started */
+  lsm_thread **apThread;          /* Array of nThread threads */
+  lsm_db **apDb;                  /* Array of worker connections */
+};
+
+/*
+** Return true if the background worker threads have been asked to stop.
+** The argument is a pointer to the BgWork object.
+*/
+static int bgWorkStopped(void *pCtx){
+  BgWork *p = (BgWork *)pCtx;
+  int bStop;
+  lsmMutexEnter(p->pEnv, p->pMutex);
+  bStop = p->bStop;
+  lsmMutexLeave(p->pEnv, p->pMutex);
+  return bStop;
+}
+
+/*
+** Main routine for background worker threads. Argument pArg is the
+** connection used by the thread. Flush in-memory trees, merge segments and
+** run auto-checkpoints until the BgWork object is stopped.
+**
+** If there is more than one thread, each also runs merge jobs (see 
+** lsmSortedMergeJob()), so that several merges may be run at once. In 
+** this case lsm_work() only starts a new merge if it is required before
+** an in-memory tree can be flushed.
+*/
+static void bgWorkMain(void *pArg){
+  lsm_db *db = (lsm_db *)pArg;
+  BgWork *p = db->pBgWork;
+
+  while( bgWorkStopped(p)==0 ){
+    int nWrite = 0;
+    int nJob = 0;
+    int rc = lsm_work(db, 0, LSM_BGWORK_KB, &nWrite);
+    if( rc!=LSM_OK && rc!=LSM_BUSY ){
+      lsmLogMessage(db, rc, "background work failed");
+    }else if( db->bMergeJobs ){
+      rc = lsmSortedMergeJob(db, bgWorkStopped, (void *)p, &nJob);
+      if( rc!=LSM_OK && rc!=LSM_BUSY ){
+        lsmLogMessage(db, rc, "background merge failed");
+      }
+    }
+    if( rc!=LSM_OK || (nWrite==0 && nJob==0) ){
+      db->pEnv->xSleep(db->pEnv, LSM_BGWORK_SLEEP_US);
+    }
+  }
+}
+
+/*
+** Stop and join any background worker threads started by connection pDb,
+** close their database connections and free the BgWork object.
+*/
+static void bgWorkStop(lsm_db *pDb){
+  BgWork *p = pDb->pBgWork;
+  if( p ){
+    int i;
+    lsmMutexEnter(p->pEnv, p->pMutex);
+    p->bStop = 1;
+    lsmMutexLeave(p->pEnv, p->pMutex);
+    for(i=0; i<p->nThread; i++){
+      lsmThreadJoin(p->pEnv, p->apThread[i]);
+    }
+    for(i=0; i<pDb->nBgWorker; i++){
+      if( p->apDb[i] ){
+        p->apDb[i]->pBgWork = 0;
+        lsm_close(p->apDb[i]);
+      }
+    }
+    lsmMutexDel(p->pEnv, p->pMutex);
+    lsmFree(p->pEnv, p->apThread);
+    lsmFree(p->pEnv, p);
+    pDb->pBgWork = 0;
+  }
+}
+
+/*
+** Open pDb->nBgWorker new connections to database zFilename, configured
+** in the same way as pDb, and start a background worker thread for each.
+** This is called by lsm_open() once pDb has been successfully connected.
+*/
+static int bgWorkStart(lsm_db *pDb, const char *zFilename){
+  lsm_env *pEnv = pDb->pEnv;
+  int nByte;
+  int rc = LSM_OK;
+  int i;
+  BgWork *p;
+
+  assert( pDb->pBgWork==0 && pDb->nBgWorker>0 );
+  nByte = sizeof(BgWork) + pDb->nBgWorker * sizeof(lsm_db *);
+  p = (BgWork *)lsmMallocZeroRc(pEnv, nByte, &rc);
+  if( p ){
+    p->pEnv = pEnv;
+    p->apDb = (lsm_db **)&p[1];
+    p->apThread = (lsm_thread **)lsmMallocZeroRc(pEnv, 
+        pDb->nBgWorker * sizeof(lsm_thread *), &rc
+    );
+    if( rc==LSM_OK ) rc = lsmMutexNew(pEnv, &p->pMutex);
+    pDb->pBgWork = p;
+  }
+
+  for(i=0; rc==LSM_OK && i<pDb->nBgWorker; i++){
+    lsm_db *db = 0;
+    rc = lsm_new(pEnv, &db);
+    if( rc==LSM_OK ){
+      p->apDb[i] = db;
+      db->pBgWork = p;
+      db->xCmp = pDb->xCmp;
+      db->eSafety = pDb->eSafety;
+      db->bAutowork = 0;
+      db->nTreeLimit = pDb->nTreeLimit;
+      db->nMerge = pDb->nMerge;
+      db->bUseLog = pDb->bUseLog;
+      db->eLogCksum = pDb->eLogCksum;
+      db->nDfltPgsz = pDb->nDfltPgsz;
+      db->nDfltBlksz = pDb->nDfltBlksz;
+      db->nMaxFreelist = pDb->nMaxFreelist;
+      db->iMmap = pDb->iMmap;
+      db->nCacheSize = pDb->nCacheSize;
+      db->nBloomBits = pDb->nBloomBits;
+      db->bPrefixKeys = pDb->bPrefixKeys;
+      db->nAutockpt = pDb->nAutockpt;
+      db->nVlogGc = pDb->nVlogGc;
+      db->bMultiProc = pDb->bMultiProc;
+      db->xLog = pDb->xLog;
+      db->pLogCtx = pDb->pLogCtx;
+
+      /* The worker connections share pDb's compression callbacks, but do
+      ** not own them. So clear the xFree() pointers.  */
+      db->compress = pDb->compress;
+      db->compress.xFree = 0;
+      db->factory = pDb->factory;
+      db->factory.xFree = 0;
+
+      rc = lsm_open(db, zFilename);
+    }
+    if( rc==LSM_OK ){
+      db->bMergeJobs = (pDb->nBgWorker>1 && lsmDbMultiProc(db)==0);
+      db->nSplitMerge = (db->bMergeJobs ? pDb->nBgWorker : 0);
+      rc = lsmThreadNew(pEnv, bgWorkMain, (void *)db, &p->apThread[i]);
+      if( rc==LSM_OK ) p->nThread++;
+    }
+  }
+
+  return rc;
+}
+
 /*
 ** Open a new connection to database zFilename.
 */
@@ -198,6 +369,11 @@ int lsm_open(lsm_db *pDb, const char *zFilename){
         lsmFsSetPageSize(pDb->pFS, lsmCheckpointPgsz(pDb->aSnapshot));
         lsmFsSetBlockSize(pDb->pFS, lsmCheckpointBlksz(pDb->aSnapshot));
       }
+
+      /* Start any background worker threads */
+      if( rc==LSM_OK && pDb->nBgWorker>0 ){
+        rc = bgWorkStart(pDb, zFull);
+      }
     }
 
     lsmFree(pDb->pEnv, zFull);
@@ -217,7 +393,9 @@ int lsm_close(lsm_db *pDb){
     if( pDb->pCsr || pDb->nTransOpen ){
       rc = LSM_MISUSE_BKPT;
     }else{
+      bgWorkStop(pDb);
       lsmMCursorFreeCache(pDb);
+      lsmSortedFreeFilterCache(pDb);
       lsmFreeSnapshot(pDb->pEnv, pDb->pClient);
       pDb->pClient = 0;
 
@@ -233,6 +411,7 @@ int lsm_close(lsm_db *pDb){
       if( pDb->factory.xFree ) pDb->factory.xFree(pDb->factory.pCtx);
       if( pDb->compress.xFree ) pDb->compress.xFree(pDb->compress.pCtx);
 
+      lsmStringClear(&pDb->vlogGcKey);
       lsmFree(pDb->pEnv, pDb->rollback.aArray);
       lsmFree(pDb->pEnv, pDb->aTrans);
       lsmFree(pDb->pEnv, pDb->apShm);
@@ -320,7 +499,7 @@ int lsm_config(lsm_db *pDb, int eParam, ...){
 
     case LSM_CONFIG_SAFETY: {
       int *piVal = va_arg(ap, int *);
-      if( *piVal>=0 && *piVal<=2 ){
+      if( *piVal>=0 && *piVal<=3 ){
         pDb->eSafety = *piVal;
       }
       *piVal = pDb->eSafety;
@@ -385,6 +564,143 @@ int lsm_config(lsm_db *pDb, int eParam, ...){
       break;
     }
 
+    case LSM_CONFIG_CACHE_SIZE: {
+      int *piVal = va_arg(ap, int *);
+      if( pDb->pDatabase ){
+        pDb->nCacheSize = lsmDbCacheConfigure(pDb, *piVal);
+      }else if( *piVal>=0 ){
+        pDb->nCacheSize = *piVal;
+      }
+      *piVal = pDb->nCacheSize;
+      break;
+    }
+
+    case LSM_CONFIG_BLOOM_BITS: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 && *piVal<=LSM_MAX_BLOOM_BITS ){
+        pDb->nBloomBits = *piVal;
+      }
+      *piVal = pDb->nBloomBits;
+      break;
+    }
+
+    case LSM_CONFIG_PREFIX_KEYS: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal==0 || *piVal==1 ){
+        pDb->bPrefixKeys = *piVal;
+      }
+      *piVal = pDb->bPrefixKeys;
+      break;
+    }
+
+    case LSM_CONFIG_GROUP_COMMIT: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal==0 || *piVal==1 ){
+        pDb->bGroupCommit = *piVal;
+      }
+      *piVal = pDb->bGroupCommit;
+      break;
+    }
+
+    case LSM_CONFIG_BACKGROUND_WORKERS: {
+      int *piVal = va_arg(ap, int *);
+      if( pDb->pDatabase ){
+        /* If lsm_open() has been called, this is a read-only parameter. 
+        ** Set the output variable to the number of threads running.  */
+        *piVal = (pDb->pBgWork ? pDb->pBgWork->nThread : 0);
+      }else{
+        if( *piVal>=0 && *piVal<=LSM_MAX_BACKGROUND_WORKERS 
+         && lsmThreadSupported(pDb->pEnv)
+        ){
+          pDb->nBgWorker = *piVal;
+        }
+        *piVal = pDb->nBgWorker;
+      }
+      break;
+    }
+
+    case LSM_CONFIG_THROTTLE_LEVELS: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>0 ){
+        pDb->nThrottleLevels = *piVal;
+      }
+      *piVal = pDb->nThrottleLevels;
+      break;
+    }
+
+    case LSM_CONFIG_SKIPLIST: {
+      int *piVal = va_arg(ap, int *);
+      if( pDb->pDatabase ){
+        /* If lsm_open() has been called, this is a read-only parameter. 
+        ** Set the output variable to true if the in-memory tree of the
+        ** database is a skiplist.  */
+        *piVal = (pDb->treehdr.eTree==TREE_SKIPLIST);
+      }else{
+        pDb->bSkiplist = *piVal = (*piVal!=0);
+      }
+      break;
+    }
+
+    case LSM_CONFIG_VALUE_LOG: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 ){
+        pDb->nValueLog = *piVal;
+      }
+      *piVal = pDb->nValueLog;
+      break;
+    }
+
+    case LSM_CONFIG_LOG_CHECKSUM: {
+      int *piVal = va_arg(ap, int *);
+      if( pDb->pShmhdr ){
+        /* If lsm_open() has been called, this is a read-only parameter. 
+        ** Report the algorithm used by the database log.  */
+        *piVal = (int)pDb->pShmhdr->eLogCksum;
+      }else{
+        if( *piVal==LSM_LOG_CKSUM_FLETCHER || *piVal==LSM_LOG_CKSUM_CRC32C ){
+          pDb->eLogCksum = *piVal;
+        }
+        *piVal = pDb->eLogCksum;
+      }
+      break;
+    }
+
+    case LSM_CONFIG_TREE_IMAGE: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal==0 || *piVal==1 ){
+        pDb->bTreeImage = *piVal;
+      }
+      *piVal = pDb->bTreeImage;
+      break;
+    }
+
+    case LSM_CONFIG_SYNC_WINDOW: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 && *piVal<=LSM_MAX_SYNC_WINDOW ){
+        pDb->nSyncWindow = *piVal;
+      }
+      *piVal = pDb->nSyncWindow;
+      break;
+    }
+
+    case LSM_CONFIG_LOG_BUFFER: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal==0 || *piVal==1 ){
+        pDb->bLogBuffer = *piVal;
+      }
+      *piVal = pDb->bLogBuffer;
+      break;
+    }
+
+    case LSM_CONFIG_VALUE_LOG_GC: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 && *piVal<=100 ){
+        pDb->nVlogGc = *piVal;
+      }
+      *piVal = pDb->nVlogGc;
+      break;
+    }
+
     case LSM_CONFIG_SET_COMPRESSION: {
       lsm_compress *p = va_arg(ap, lsm_compress *);
       if( pDb->iReader>=0 && pDb->bInFactory==0 ){
@@ -396,8 +712,10 @@ int lsm_config(lsm_db *pDb, int eParam, ...){
           pDb->compress.xFree(pDb->compress.pCtx);
         }
         if( p->xBound==0 ){
-          memset(&pDb->compress, 0, sizeof(lsm_compress));
-          pDb->compress.iId = LSM_COMPRESSION_NONE;
+          if( lsmCodecBuiltin(p->iId, &pDb->compress)==0 ){
+            memset(&pDb->compress, 0, sizeof(lsm_compress));
+            pDb->compress.iId = LSM_COMPRESSION_NONE;
+          }
         }else{
           memcpy(&pDb->compress, p, sizeof(lsm_compress));
         }
@@ -645,6 +963,13 @@ int lsm_info(lsm_db *pDb, int eParam, ...){
       break;
     }
 
+    case LSM_INFO_VALUE_LOG: {
+      lsm_i64 *pnSize = va_arg(ap, lsm_i64 *);
+      lsm_i64 *pnDead = va_arg(ap, lsm_i64 *);
+      rc = lsmInfoValueLog(pDb, pnSize, pnDead);
+      break;
+    }
+
     default:
       rc = LSM_MISUSE;
       break;
@@ -654,53 +979,165 @@ int lsm_info(lsm_db *pDb, int eParam, ...){
   return rc;
 }
 
-static int doWriteOp(
+/*
+** This is called after data has been written to the in-memory tree. 
+** Parameter nBefore is the size of the tree (as returned by lsmTreeSize())
+** before the data was written. Run any auto-work required as a result of
+** the tree growing.
+*/
+static int doAutowork(lsm_db *pDb, int nBefore){
+  int rc = LSM_OK;
+  int pgsz = lsmFsPageSize(pDb->pFS);
+  int nQuant = LSM_AUTOWORK_QUANT * pgsz;
+  int nAfter;
+  int nDiff;
+
+  if( nQuant>pDb->nTreeLimit ){
+    nQuant = pDb->nTreeLimit;
+  }
+
+  nAfter = lsmTreeSize(pDb);
+  nDiff = (nAfter/nQuant) - (nBefore/nQuant);
+  if( pDb->bAutowork && nDiff!=0 ){
+    rc = lsmSortedAutoWork(pDb, nDiff * LSM_AUTOWORK_QUANT);
+  }
+  return rc;
+}
+
+/*
+** Write a single entry to the log and in-memory tree of the write 
+** transaction open on connection pDb. Run any auto-work required as a
+** result of the in-memory tree growing.
+*/
+static int doWriteOne(
   lsm_db *pDb,
   int bDeleteRange,
   const void *pKey, int nKey,     /* Key to write or delete */
   const void *pVal, int nVal      /* Value to write. Or nVal==-1 for a delete */
 ){
   int rc = LSM_OK;                /* Return code */
-  int bCommit = 0;                /* True to commit before returning */
 
-  if( pDb->nTransOpen==0 ){
-    bCommit = 1;
-    rc = lsm_begin(pDb, 1);
-  }
+  u8 aPtr[LSM_VLOG_MAXPTR];       /* Value log pointer, if bPtr */
+  int nPtr = 0;                   /* Size of aPtr[] in bytes */
+  int bPtr = 0;                   /* True to store value in the value log */
 
-  if( rc==LSM_OK ){
-    if( bDeleteRange==0 ){
-      rc = lsmLogWrite(pDb, (void *)pKey, nKey, (void *)pVal, nVal);
+  assert( pDb->nTransOpen>0 );
+  if( bDeleteRange==0 ){
+    if( pDb->nValueLog>0 && nVal>=pDb->nValueLog ){
+      bPtr = 1;
+      rc = lsmVlogWrite(pDb, pVal, nVal, aPtr, &nPtr);
+      if( rc==LSM_OK ){
+        rc = lsmLogWrite(pDb, 1, (void *)pKey, nKey, (void *)aPtr, nPtr);
+      }
     }else{
-      /* TODO */
+      rc = lsmLogWrite(pDb, 0, (void *)pKey, nKey, (void *)pVal, nVal);
     }
+  }else{
+    /* TODO */
   }
 
   lsmSortedSaveTreeCursors(pDb);
 
   if( rc==LSM_OK ){
-    int pgsz = lsmFsPageSize(pDb->pFS);
-    int nQuant = LSM_AUTOWORK_QUANT * pgsz;
-    int nBefore;
-    int nAfter;
-    int nDiff;
-
-    if( nQuant>pDb->nTreeLimit ){
-      nQuant = pDb->nTreeLimit;
-    }
-
-    nBefore = lsmTreeSize(pDb);
+    int nBefore = lsmTreeSize(pDb);
     if( bDeleteRange ){
       rc = lsmTreeDelete(pDb, (void *)pKey, nKey, (void *)pVal, nVal);
+    }else if( bPtr ){
+      rc = lsmTreeInsertPtr(pDb, (void *)pKey, nKey, aPtr, nPtr);
     }else{
       rc = lsmTreeInsert(pDb, (void *)pKey, nKey, (void *)pVal, nVal);
     }
+    if( rc==LSM_OK ) rc = doAutowork(pDb, nBefore);
+  }
+
+  return rc;
+}
 
-    nAfter = lsmTreeSize(pDb);
-    nDiff = (nAfter/nQuant) - (nBefore/nQuant);
-    if( rc==LSM_OK && pDb->bAutowork && nDiff!=0 ){
-      rc = lsmSortedAutoWork(pDb, nDiff * LSM_AUTOWORK_QUANT);
+/*
+** Perform an auto-commit write as part of a group commit (see the 
+** description of LSM_CONFIG_GROUP_COMMIT in lsm.h).
+**
+** The write is added to the queue of writes waiting to be committed. If
+** another connection is already committing a group of writes, this call
+** blocks until either that connection (or a subsequent leader) commits
+** this write too, or until this connection is required to become the
+** leader. The leader opens a write transaction, writes each queued entry
+** within its own nested transaction so that a failed write does not affect
+** the others, and commits them all together.
+*/
+static int doGroupWrite(
+  lsm_db *pDb,
+  int bDeleteRange,
+  const void *pKey, int nKey,     /* Key to write or delete */
+  const void *pVal, int nVal      /* Value to write. Or nVal==-1 for a delete */
+){
+  GroupWrite w;                   /* This connection's write */
+
+  memset(&w, 0, sizeof(GroupWrite));
+  w.pDb = pDb;
+  w.bDeleteRange = bDeleteRange;
+  w.pKey = pKey;
+  w.nKey = nKey;
+  w.pVal = pVal;
+  w.nVal = nVal;
+
+  if( lsmGroupJoin(pDb, &w) ){
+    /* The list contains only writes made by connections configured the
+    ** same way as this one, so committing them all using this connection's
+    ** settings honours each writer's.  */
+    GroupWrite *pList = lsmGroupTake(pDb);
+    GroupWrite *p;
+    int rc;
+
+    rc = lsm_begin(pDb, 1);
+    for(p=pList; p; p=p->pNext){
+      p->rc = rc;
+      if( rc==LSM_OK ){
+        p->rc = lsm_begin(pDb, 2);
+        if( p->rc==LSM_OK ){
+          p->rc = doWriteOne(pDb, 
+              p->bDeleteRange, p->pKey, p->nKey, p->pVal, p->nVal
+          );
+          if( p->rc!=LSM_OK ) lsm_rollback(pDb, 2);
+          lsm_commit(pDb, 1);
+        }
+      }
     }
+
+    if( rc==LSM_OK ){
+      rc = lsm_commit(pDb, 0);
+      if( rc!=LSM_OK ){
+        for(p=pList; p; p=p->pNext){
+          if( p->rc==LSM_OK ) p->rc = rc;
+        }
+      }
+    }
+
+    lsmGroupDone(pDb, pList);
+  }
+
+  return w.rc;
+}
+
+static int doWriteOp(
+  lsm_db *pDb,
+  int bDeleteRange,
+  const void *pKey, int nKey,     /* Key to write or delete */
+  const void *pVal, int nVal      /* Value to write. Or nVal==-1 for a delete */
+){
+  int rc = LSM_OK;                /* Return code */
+  int bCommit = 0;                /* True to commit before returning */
+
+  if( pDb->nTransOpen==0 ){
+    if( pDb->bGroupCommit && pDb->iReader<0 && pDb->bReadonly==0 ){
+      return doGroupWrite(pDb, bDeleteRange, pKey, nKey, pVal, nVal);
+    }
+    bCommit = 1;
+    rc = lsm_begin(pDb, 1);
+  }
+
+  if( rc==LSM_OK ){
+    rc = doWriteOne(pDb, bDeleteRange, pKey, nKey, pVal, nVal);
   }
 
   /* If a transaction was opened at the start of this function, commit it. 
@@ -749,6 +1186,140 @@ int lsm_delete_range(
   return rc;
 }
 
+/*
+** Write the contents of a write batch to the database. The batch is 
+** written to the log as a single LOG_BATCH record and then applied to the
+** in-memory tree, with cursors saved and auto-work run once for the whole
+** batch rather than once for each operation it contains.
+**
+** The batch is written within a sub-transaction of any transaction that is
+** already open, so that if an error occurs partway through none of it is
+** applied.
+*/
+int lsm_batch_write(lsm_db *pDb, lsm_batch *pBatch){
+  int rc;                         /* Return code */
+  int iLevel = pDb->nTransOpen;   /* Transaction level on entry */
+
+  if( pBatch->nOp==0 ) return LSM_OK;
+
+  rc = lsm_begin(pDb, iLevel+1);
+  if( rc==LSM_OK ){
+    const u8 *aBatch = (const u8 *)pBatch->buf.z;
+    int nBatch = pBatch->buf.n;
+
+    rc = lsmLogWriteBatch(pDb, aBatch, nBatch);
+    lsmSortedSaveTreeCursors(pDb);
+    if( rc==LSM_OK ){
+      int nBefore = lsmTreeSize(pDb);
+      rc = lsmBatchApply(pDb, aBatch, nBatch);
+      if( rc==LSM_OK ) rc = doAutowork(pDb, nBefore);
+    }
+
+    if( rc==LSM_OK ){
+      rc = lsm_commit(pDb, iLevel);
+    }else if( iLevel==0 ){
+      lsm_rollback(pDb, 0);
+    }else{
+      lsm_rollback(pDb, iLevel+1);
+      lsm_commit(pDb, iLevel);
+    }
+  }
+
+  return rc;
+}
+
+/*
+** Open a blob writer for key pKey/nKey. See lsm_blob_open() in lsm.h.
+**
+** A nested write transaction is opened for the lifetime of the writer.
+** Chunks passed to lsm_blob_write() are appended directly to the value 
+** log, so the complete value is never buffered in memory. When the writer
+** is closed, a pointer to the value is written to the log and in-memory
+** tree and the nested transaction is committed. Or, if the writer is
+** abandoned, the nested transaction is rolled back.
+*/
+int lsm_blob_open(lsm_db *pDb, const void *pKey, int nKey, lsm_blob **ppBlob){
+  int rc = LSM_OK;                /* Return code */
+  int iLevel = pDb->nTransOpen;   /* Transaction level on entry */
+  lsm_blob *p = 0;                /* New blob writer */
+
+  assert_db_state(pDb);
+  *ppBlob = 0;
+  if( pDb->pBlob || nKey<0 ) return LSM_MISUSE_BKPT;
+
+  p = (lsm_blob *)lsmMallocZeroRc(pDb->pEnv, sizeof(lsm_blob)+nKey, &rc);
+  if( rc==LSM_OK ){
+    rc = lsm_begin(pDb, iLevel+1);
+  }
+  if( rc==LSM_OK ){
+    p->pDb = pDb;
+    p->iLevel = iLevel;
+    p->iOff = pDb->treehdr.iVlogOff;
+    p->pKey = (u8 *)&p[1];
+    p->nKey = nKey;
+    memcpy(p->pKey, pKey, nKey);
+    pDb->pBlob = p;
+    *ppBlob = p;
+  }else{
+    lsmFree(pDb->pEnv, p);
+  }
+  return rc;
+}
+
+/*
+** Append nData bytes from buffer pData to the value being written by
+** blob writer p.
+*/
+int lsm_blob_write(lsm_blob *p, const void *pData, int nData){
+  int rc;
+  if( nData<0 || nData>(0x7FFFFFFF - p->nVal) ){
+    return LSM_MISUSE_BKPT;
+  }
+  rc = lsmVlogAppend(p->pDb, pData, nData);
+  if( rc==LSM_OK ){
+    p->nVal += nData;
+  }
+  return rc;
+}
+
+/*
+** Close blob writer p. If bCommit is true, write the value to the database.
+** Otherwise, abandon it. The writer is freed in either case.
+*/
+int lsm_blob_close(lsm_blob *p, int bCommit){
+  int rc = LSM_OK;
+  if( p ){
+    lsm_db *pDb = p->pDb;
+    int iLevel = p->iLevel;
+
+    assert( pDb->pBlob==p && pDb->nTransOpen>iLevel );
+    pDb->pBlob = 0;
+    if( bCommit ){
+      u8 aPtr[LSM_VLOG_MAXPTR];
+      int nPtr = lsmVlogPtrEncode(aPtr, p->iOff, p->nVal);
+
+      rc = lsmLogWrite(pDb, 1, p->pKey, p->nKey, aPtr, nPtr);
+      lsmSortedSaveTreeCursors(pDb);
+      if( rc==LSM_OK ){
+        int nBefore = lsmTreeSize(pDb);
+        rc = lsmTreeInsertPtr(pDb, p->pKey, p->nKey, aPtr, nPtr);
+        if( rc==LSM_OK ) rc = doAutowork(pDb, nBefore);
+      }
+    }
+
+    if( bCommit && rc==LSM_OK ){
+      rc = lsm_commit(pDb, iLevel);
+    }else if( iLevel==0 ){
+      lsm_rollback(pDb, 0);
+    }else{
+      lsm_rollback(pDb, iLevel+1);
+      lsm_commit(pDb, iLevel);
+    }
+    lsmFree(pDb->pEnv, p);
+  }
+  return rc;
+}
+
 /*
 ** Open a new cursor handle. 
 **
@@ -801,6 +1372,95 @@ int lsm_csr_close(lsm_cursor *p){
   return LSM_OK;
 }
 
+/*
+** Sort the nIdx indexes in array aIdx[] so that the keys they identify in
+** arrays apKey[] and anKey[] are in ascending order. Array aSpace[] is used
+** as temporary space. It must be as large as aIdx[].
+*/
+static void multiGetSort(
+  lsm_db *pDb,                    /* Database handle (for xCmp) */
+  void **apKey, const int *anKey, /* Keys to sort by */
+  int *aIdx, int nIdx,            /* Array of indexes to sort */
+  int *aSpace                     /* Temporary space */
+){
+  int nHalf = nIdx/2;
+  int i1 = 0;
+  int i2 = nHalf;
+  int iOut = 0;
+
+  if( nIdx<2 ) return;
+  multiGetSort(pDb, apKey, anKey, aIdx, nHalf, aSpace);
+  multiGetSort(pDb, apKey, anKey, &aIdx[nHalf], nIdx-nHalf, aSpace);
+
+  while( i1<nHalf || i2<nIdx ){
+    if( i2>=nIdx || (i1<nHalf && 0>=pDb->xCmp(
+          apKey[aIdx[i1]], anKey[aIdx[i1]], apKey[aIdx[i2]], anKey[aIdx[i2]]
+    ))){
+      aSpace[iOut++] = aIdx[i1++];
+    }else{
+      aSpace[iOut++] = aIdx[i2++];
+    }
+  }
+  memcpy(aIdx, aSpace, sizeof(int)*nIdx);
+}
+
+/*
+** Look up each of the nKey keys in arrays apKey[] and anKey[] and invoke
+** the xGet callback with the results. See lsm_multi_get() in lsm.h.
+**
+** The keys are looked up in sorted order using a single cursor that 
+** retains the leaf page of each segment between lookups. So that when
+** neighbouring keys are stored on the same page, the b-tree search is
+** skipped. Each distinct key is only looked up once.
+*/
+int lsm_multi_get(
+  lsm_db *pDb,                    /* Database handle */
+  const void **apKey,             /* Array of keys to look up */
+  const int *anKey,               /* Array of key sizes */
+  int nKey,                       /* Number of keys */
+  void (*xGet)(void *, int, const void *, int),
+  void *pCtx                      /* First argument passed to xGet */
+){
+  int rc = LSM_OK;                /* Return code */
+  MultiCursor *pCsr = 0;          /* Cursor used for lookups */
+  int *aIdx;                      /* Key indexes in sorted order */
+  void *pVal = 0;                 /* Value for previous key */
+  int nVal = -1;                  /* Size of pVal (or -1 if not found) */
+  int i;
+
+  if( nKey<=0 ) return LSM_OK;
+  aIdx = (int *)lsmMallocRc(pDb->pEnv, sizeof(int)*nKey*2, &rc);
+  if( rc==LSM_OK ){
+    rc = lsm_csr_open(pDb, (lsm_cursor **)&pCsr);
+  }
+
+  if( rc==LSM_OK ){
+    void **apK = (void **)apKey;
+    for(i=0; i<nKey; i++) aIdx[i] = i;
+    multiGetSort(pDb, apK, anKey, aIdx, nKey, &aIdx[nKey]);
+    lsmMCursorKeepLeaves(pCsr);
+
+    for(i=0; rc==LSM_OK && i<nKey; i++){
+      int iKey = aIdx[i];
+      if( i==0 || pDb->xCmp(
+            apK[aIdx[i-1]], anKey[aIdx[i-1]], apK[iKey], anKey[iKey]
+      )){
+        rc = lsmMCursorSeek(pCsr, 0, apK[iKey], anKey[iKey], LSM_SEEK_EQ);
+        pVal = 0;
+        nVal = -1;
+        if( rc==LSM_OK && lsmMCursorValid(pCsr) ){
+          rc = lsmMCursorValue(pCsr, &pVal, &nVal);
+        }
+      }
+      if( rc==LSM_OK ) xGet(pCtx, iKey, pVal, nVal);
+    }
+  }
+
+  lsm_csr_close((lsm_cursor *)pCsr);
+  lsmFree(pDb->pEnv, aIdx);
+  return rc;
+}
+
 /*
 ** Attempt to seek the cursor to the database entry specified by pKey/nKey.
 ** If an error occurs (e.g. an OOM or IO error), return an LSM error code.
@@ -838,6 +1498,23 @@ int lsm_csr_value(lsm_cursor *pCsr, const void **ppVal, int *pnVal){
   return lsmMCursorValue((MultiCursor *)pCsr, (void **)ppVal, pnVal);
 }
 
+int lsm_csr_value_size(lsm_cursor *pCsr, int *pnVal){
+  return lsmMCursorValueSize((MultiCursor *)pCsr, pnVal);
+}
+
+int lsm_csr_value_iov(lsm_cursor *pCsr, const lsm_iovec **paIov, int *pnIov){
+  return lsmMCursorValueIov((MultiCursor *)pCsr, paIov, pnIov);
+}
+
+int lsm_csr_value_read(
+  lsm_cursor *pCsr, 
+  int iOff, 
+  void *pBuf, int nBuf, 
+  int *pnRead
+){
+  return lsmMCursorValueRead((MultiCursor *)pCsr, iOff, pBuf, nBuf, pnRead);
+}
+
 void lsm_config_log(
   lsm_db *pDb, 
   void (*xLog)(void *, int, const char *), 
@@ -915,24 +1592,43 @@ int lsm_begin(lsm_db *pDb, int iLevel){
 
 int lsm_commit(lsm_db *pDb, int iLevel){
   int rc = LSM_OK;
+  int bRelocate = 0;              /* True if a write transaction committed */
 
   assert_db_state( pDb );
 
   /* A value less than zero means close the innermost nested transaction. */
   if( iLevel<0 ) iLevel = LSM_MAX(0, pDb->nTransOpen - 1);
 
+  /* The transaction opened by an open blob writer may not be closed. */
+  if( pDb->pBlob && iLevel<=pDb->pBlob->iLevel ) return LSM_MISUSE_BKPT;
+
   if( iLevel<pDb->nTransOpen ){
     if( iLevel==0 ){
-      /* Commit the transaction to disk. */
+      /* Commit the transaction to disk. If the safety-mode is FULL, 
+      ** lsmLogCommit() syncs the log file too.  */
       if( rc==LSM_OK ) rc = lsmLogCommit(pDb);
-      if( rc==LSM_OK && pDb->eSafety==LSM_SAFETY_FULL ){
-        rc = lsmFsSyncLog(pDb->pFS);
-      }
       lsmFinishWriteTrans(pDb, (rc==LSM_OK));
+
+      /* If the COMMIT record was appended to the log buffer, wait for it
+      ** to be written to the log file. Then, with safety=window, sync the
+      ** log. Both happen once the WRITER lock has been released, so that
+      ** other writers may share the write and sync.  */
+      if( rc==LSM_OK ) rc = lsmLogWait(pDb);
+      if( rc==LSM_OK && pDb->eSafety==LSM_SAFETY_WINDOW && pDb->bUseLog ){
+        rc = lsmGroupSync(pDb, lsmGroupSyncQueue(pDb));
+      }
+      bRelocate = pDb->bAutowork;
     }
     pDb->nTransOpen = iLevel;
   }
   dbReleaseClientSnapshot(pDb);
+
+  /* If the value log is being garbage collected, rewrite some of the 
+  ** values that are still live as part of auto-work. This opens a new
+  ** read transaction, so it must follow dbReleaseClientSnapshot().  */
+  if( rc==LSM_OK && bRelocate ){
+    rc = lsmVlogRelocate(pDb, LSM_VLOG_GC_QUANT);
+  }
   return rc;
 }
 
@@ -943,6 +1639,7 @@ int lsm_rollback(lsm_db *pDb, int iLevel){
   if( pDb->nTransOpen ){
     /* A value less than zero means close the innermost nested transaction. */
     if( iLevel<0 ) iLevel = LSM_MAX(0, pDb->nTransOpen - 1);
+    if( pDb->pBlob && iLevel<=pDb->pBlob->iLevel ) return LSM_MISUSE_BKPT;
 
     if( iLevel<=pDb->nTransOpen ){
       TransMark *pMark = &pDb->aTrans[(iLevel==0 ? 0 : iLevel-1)];
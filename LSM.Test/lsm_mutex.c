@@ -10,7 +10,7 @@
 **
 *************************************************************************
 **
-** Mutex functions for LSM.
+** Mutex and thread functions for LSM.
 */
 #include "lsmInt.h"
 
@@ -86,3 +86,85 @@ int lsmMutexNotHeld(lsm_env *pEnv, lsm_mutex *pMutex){
   return pEnv->xMutexNotHeld ? pEnv->xMutexNotHeld(pMutex) : 1;
 }
 #endif
+
+/*
+** Return non-zero if environment pEnv supports starting threads (i.e. 
+** implements the iVersion 2 xThreadNew() and xThreadJoin() methods), or
+** zero otherwise.
+*/
+int lsmThreadSupported(lsm_env *pEnv){
+  return (pEnv->iVersion>=2 && pEnv->xThreadNew && pEnv->xThreadJoin);
+}
+
+/*
+** Start a new thread that runs xMain(pArg). It is an error to call this
+** function unless lsmThreadSupported() returns true.
+*/
+int lsmThreadNew(
+  lsm_env *pEnv, 
+  void (*xMain)(void *), 
+  void *pArg,
+  lsm_thread **ppThread
+){
+  assert( lsmThreadSupported(pEnv) );
+  return pEnv->xThreadNew(pEnv, xMain, pArg, ppThread);
+}
+
+/*
+** Wait for a thread started by lsmThreadNew() to exit, then free it.
+*/
+void lsmThreadJoin(lsm_env *pEnv, lsm_thread *pThread){
+  if( pThread ) pEnv->xThreadJoin(pThread);
+}
+
+/*
+** Allocate a new condition variable. If successful, set *ppNew to point
+** to it and return LSM_OK. If environment pEnv does not implement the 
+** iVersion 4 condition variable methods, set *ppNew to NULL and return
+** LSM_OK - the other lsmCondXXX() functions accept a NULL pointer and 
+** fall back to polling. Or, if an error occurs, return an LSM error code.
+*/
+int lsmCondNew(lsm_env *pEnv, lsm_cond **ppNew){
+  *ppNew = 0;
+  if( pEnv->iVersion<4 || pEnv->xCondNew==0 || pEnv->xCondDel==0
+   || pEnv->xCondWait==0 || pEnv->xCondBroadcast==0 
+  ){
+    return LSM_OK;
+  }
+  return pEnv->xCondNew(pEnv, ppNew);
+}
+
+/*
+** Free a condition variable allocated by lsmCondNew().
+*/
+void lsmCondDel(lsm_env *pEnv, lsm_cond *pCond){
+  if( pCond ) pEnv->xCondDel(pCond);
+}
+
+/*
+** The caller must hold mutex pMutex. Release it, wait until pCond is 
+** signalled by lsmCondBroadcast(), then enter pMutex again. As with any
+** condition variable, the caller must check the condition it is waiting
+** for in a loop, as this may return before it is true.
+**
+** If pCond is NULL, sleep for nUs microseconds with the mutex released
+** instead.
+*/
+void lsmCondWait(lsm_env *pEnv, lsm_cond *pCond, lsm_mutex *pMutex, int nUs){
+  assert( lsmMutexHeld(pEnv, pMutex) );
+  if( pCond ){
+    pEnv->xCondWait(pCond, pMutex);
+  }else{
+    lsmMutexLeave(pEnv, pMutex);
+    pEnv->xSleep(pEnv, nUs);
+    lsmMutexEnter(pEnv, pMutex);
+  }
+}
+
+/*
+** Wake all threads waiting on condition variable pCond. The caller should
+** hold the mutex that the waiting threads pass to lsmCondWait().
+*/
+void lsmCondBroadcast(lsm_env *pEnv, lsm_cond *pCond){
+  if( pCond ) pEnv->xCondBroadcast(pCond);
+}
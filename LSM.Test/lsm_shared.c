@@ -28,6 +28,61 @@ static struct SharedData {
   Database *pDatabase;            /* Linked list of all Database objects */
 } gShared;
 
+/*
+** Number of independently locked shards in the shared page cache. Pages
+** are assigned to shards based on their page number, so that readers
+** working on different parts of the file rarely contend for a mutex.
+*/
+#define LSM_CACHE_NSHARD 16
+
+/*
+** The initial number of hash slots allocated for each cache shard. The
+** hash table is doubled in size each time the number of entries exceeds
+** the number of slots.
+*/
+#define LSM_CACHE_MIN_HASH 64
+
+typedef struct CacheEntry CacheEntry;
+typedef struct CacheShard CacheShard;
+typedef struct LogBuffer LogBuffer;
+
+/*
+** A single page image stored in the shared page cache. The nData bytes
+** of page data immediately follow this structure in memory.
+*/
+struct CacheEntry {
+  Pgno iPg;                       /* Page number */
+  int nData;                      /* Size of page image in bytes */
+  CacheEntry *pHashNext;          /* Next entry in same hash slot */
+  CacheEntry *pLruNext;           /* Next (more recently used) entry */
+  CacheEntry *pLruPrev;           /* Previous (less recently used) entry */
+};
+
+/*
+** One shard of the shared page cache. All fields are protected by
+** CacheShard.pMutex.
+*/
+struct CacheShard {
+  lsm_mutex *pMutex;              /* Mutex protecting this shard */
+  i64 nByteMax;                   /* Maximum bytes of page data to cache */
+  i64 nByte;                      /* Current bytes of page data cached */
+  int nEntry;                     /* Number of entries in hash table */
+  int nHash;                      /* Number of slots in apHash[] */
+  CacheEntry **apHash;            /* Hash table */
+  CacheEntry *pLruFirst;          /* Least recently used entry */
+  CacheEntry *pLruLast;           /* Most recently used entry */
+};
+
+/*
+** One of the two log buffers used if LSM_CONFIG_LOG_BUFFER is set. See
+** lsmDbLogWrite(). All fields are protected by Database.pLogMutex.
+*/
+struct LogBuffer {
+  i64 iOff;                       /* Log file offset of first byte in buf */
+  i64 iLsn;                       /* LSN of last byte in buf, once sealed */
+  LsmString buf;                  /* Data not yet written to the log file */
+};
+
 /*
 ** Database structure. There is one such structure for each distinct 
 ** database accessed by this process. They are stored in the singly linked 
@@ -39,6 +94,63 @@ static struct SharedData {
 **   In multi-process mode, this file descriptor is used to obtain locks 
 **   and to access shared-memory. In single process mode, its only job is
 **   to hold the exclusive lock on the file.
+**
+** aShard/nCacheSize/iCacheSnapshot:
+**   The shared page cache. Connections that read database pages using 
+**   ordinary read IO (not via the memory mapping) copy each page image
+**   read from disk into this cache, and check it before reading from 
+**   disk. Since pages are only ever written to blocks that are not part of
+**   any snapshot still in use, the cache remains valid as long as every
+**   write made by a connection in this process invalidates the pages 
+**   written (see lsmDbCacheInvalidate()).
+**
+**   Writes made by other processes cannot be tracked this way. Instead, 
+**   iCacheSnapshot is set to the id of the most recent snapshot known to
+**   have been produced by a connection within this process (or that the
+**   cache has been purged since). If a connection loads a snapshot with a 
+**   larger id, it may have been written by some other process, so the 
+**   whole cache is purged (see lsmDbCacheSnapshotLoaded()).
+**
+** pMergeJob/iReserveEnd:
+**   The list of merge jobs currently running on the database (see 
+**   lsmSortedMergeJob()), and the largest block number allocated by any
+**   of them from beyond the end of the file. Merge jobs are only used in
+**   single process mode, so these fields are protected by the WORKER lock.
+**
+** pMergeFilter:
+**   The bloom filters being built by incomplete merges, saved between 
+**   calls to lsm_work() etc. by connections in this process (see
+**   sortedFilterSave() in lsm_sorted.c). Protected by the WORKER lock.
+**
+** pGroupCond:
+**   A condition variable broadcast, with the group commit mutex held, 
+**   each time a group commit leader finishes committing a group of writes
+**   and each time a connection finishes syncing the log for safety=window 
+**   commits. Writers waiting for their write to be committed or synced 
+**   wait on it (see lsmGroupJoin() and lsmGroupSync()). NULL if the 
+**   lsm_env does not support condition variables, in which case waiting
+**   writers poll instead.
+**
+** iSyncQueue/iSyncDone/bSyncing/nSyncLast:
+**   Used to share log file syncs between connections committing with
+**   LSM_CONFIG_SAFETY set to 3 (window). iSyncQueue is the number of such
+**   commits written to the log by connections in this process, and
+**   iSyncDone the number of those known to have been synced. bSyncing is
+**   true while a connection is syncing the log, and nSyncLast is the number
+**   of commits covered by the most recent sync. See lsmGroupSync().
+**
+** aLogBuf/iLogFill/bLogFlush/iLogQueued/iLogWritten:
+**   The log buffers used by connections with LSM_CONFIG_LOG_BUFFER set.
+**   Log data is appended to buffer aLogBuf[iLogFill] by the connection
+**   holding the WRITER lock. The other buffer is either empty, or contains
+**   data that was appended earlier but has not yet been written to the 
+**   log file. bLogFlush is true while a connection is writing a buffer to
+**   the log file. Log data is identified by LSN - the total number of 
+**   bytes appended to the buffers before and including it. iLogQueued is
+**   the LSN of the last byte appended, and iLogWritten the LSN of the
+**   last byte written to the log file. See lsmDbLogWrite(). pLogCond is
+**   broadcast each time bLogFlush is cleared, to wake connections waiting
+**   for a buffer write to finish (or NULL, as for pGroupCond).
 **   
 */
 struct Database {
@@ -57,6 +169,36 @@ struct Database {
   int nShmChunk;                  /* Number of entries in apShmChunk[] array */
   void **apShmChunk;              /* Array of "shared" memory regions */
   lsm_db *pConn;                  /* List of connections to this db. */
+  int nCacheSize;                 /* Configured cache size in KB */
+  i64 iCacheSnapshot;             /* Id of most recent local snapshot */
+
+  /* Each shard is protected by its own mutex (CacheShard.pMutex) */
+  CacheShard aShard[LSM_CACHE_NSHARD];
+
+  /* Protected by the group commit mutex (pGroupMutex) */
+  lsm_mutex *pGroupMutex;         /* Protects the following fields */
+  GroupWrite *pGroupFirst;        /* First write waiting to be committed */
+  GroupWrite *pGroupLast;         /* Last write waiting to be committed */
+  int bGroupLeader;               /* True while a leader is committing */
+  lsm_cond *pGroupCond;           /* Broadcast when group state changes */
+  i64 iSyncQueue;                 /* Commits written to the log */
+  i64 iSyncDone;                  /* Commits synced to disk */
+  int bSyncing;                   /* True while the log is being synced */
+  int nSyncLast;                  /* Commits covered by the last sync */
+
+  /* Protected by the log buffer mutex (pLogMutex) */
+  lsm_mutex *pLogMutex;           /* Protects the following fields */
+  LogBuffer aLogBuf[2];           /* Log buffers */
+  int iLogFill;                   /* Index of aLogBuf[] being appended to */
+  int bLogFlush;                  /* True while a buffer is being written */
+  i64 iLogQueued;                 /* LSN of last byte appended */
+  i64 iLogWritten;                /* LSN of last byte written to log file */
+  lsm_cond *pLogCond;             /* Broadcast when bLogFlush is cleared */
+
+  /* Protected by the WORKER lock */
+  MergeJob *pMergeJob;            /* List of running merge jobs */
+  int iReserveEnd;                /* Largest block allocated by a job */
+  MergeFilter *pMergeFilter;      /* Filters of incomplete merges */
 };
 
 /*
@@ -137,6 +279,275 @@ int freelistAppend(lsm_db *db, int iBlk, i64 iId){
   return LSM_OK;
 }
 
+/*
+** Remove entry pEntry from the LRU list of cache shard pShard.
+*/
+static void cacheLruRemove(CacheShard *pShard, CacheEntry *pEntry){
+  if( pEntry->pLruPrev ){
+    pEntry->pLruPrev->pLruNext = pEntry->pLruNext;
+  }else{
+    pShard->pLruFirst = pEntry->pLruNext;
+  }
+  if( pEntry->pLruNext ){
+    pEntry->pLruNext->pLruPrev = pEntry->pLruPrev;
+  }else{
+    pShard->pLruLast = pEntry->pLruPrev;
+  }
+  pEntry->pLruNext = 0;
+  pEntry->pLruPrev = 0;
+}
+
+/*
+** Append entry pEntry to the (most recently used) end of the LRU list of
+** cache shard pShard.
+*/
+static void cacheLruAppend(CacheShard *pShard, CacheEntry *pEntry){
+  pEntry->pLruPrev = pShard->pLruLast;
+  pEntry->pLruNext = 0;
+  if( pShard->pLruLast ){
+    pShard->pLruLast->pLruNext = pEntry;
+  }else{
+    pShard->pLruFirst = pEntry;
+  }
+  pShard->pLruLast = pEntry;
+}
+
+/*
+** Return the hash slot that page iPg belongs in within shard pShard. The
+** shard hash table must have been allocated.
+*/
+static int cacheHashKey(CacheShard *pShard, Pgno iPg){
+  assert( pShard->nHash>0 && (pShard->nHash & (pShard->nHash-1))==0 );
+  return (int)((iPg / LSM_CACHE_NSHARD) & (pShard->nHash-1));
+}
+
+/*
+** Search cache shard pShard for an entry for page iPg. Return a pointer
+** to the pointer that points to the entry if one is found, or a pointer
+** to the NULL pointer at the end of the hash chain otherwise.
+*/
+static CacheEntry **cacheFind(CacheShard *pShard, Pgno iPg){
+  CacheEntry **pp = &pShard->apHash[cacheHashKey(pShard, iPg)];
+  while( *pp && (*pp)->iPg!=iPg ) pp = &(*pp)->pHashNext;
+  return pp;
+}
+
+/*
+** Remove the entry that *pp points to from cache shard pShard and free it.
+*/
+static void cacheRemove(lsm_env *pEnv, CacheShard *pShard, CacheEntry **pp){
+  CacheEntry *pEntry = *pp;
+  *pp = pEntry->pHashNext;
+  cacheLruRemove(pShard, pEntry);
+  pShard->nByte -= pEntry->nData;
+  pShard->nEntry--;
+  lsmFree(pEnv, pEntry);
+}
+
+/*
+** Remove least recently used entries from cache shard pShard until the
+** total size of the cached page images is no greater than nByteMax.
+*/
+static void cacheShardEvict(lsm_env *pEnv, CacheShard *pShard){
+  while( pShard->nByte>pShard->nByteMax ){
+    CacheEntry *pEntry = pShard->pLruFirst;
+    cacheRemove(pEnv, pShard, cacheFind(pShard, pEntry->iPg));
+  }
+}
+
+/*
+** Remove all entries from cache shard pShard.
+*/
+static void cacheShardPurge(lsm_env *pEnv, CacheShard *pShard){
+  CacheEntry *pEntry;
+  CacheEntry *pNext;
+  for(pEntry=pShard->pLruFirst; pEntry; pEntry=pNext){
+    pNext = pEntry->pLruNext;
+    lsmFree(pEnv, pEntry);
+  }
+  if( pShard->apHash ){
+    memset(pShard->apHash, 0, sizeof(CacheEntry *) * pShard->nHash);
+  }
+  pShard->pLruFirst = 0;
+  pShard->pLruLast = 0;
+  pShard->nByte = 0;
+  pShard->nEntry = 0;
+}
+
+/*
+** Attempt to double the size of the hash table belonging to cache shard
+** pShard (or to allocate it, if it has not been allocated yet). If an
+** OOM occurs, the existing hash table is left as is.
+*/
+static void cacheGrowHash(lsm_env *pEnv, CacheShard *pShard){
+  int nNew = (pShard->nHash ? pShard->nHash*2 : LSM_CACHE_MIN_HASH);
+  CacheEntry **apNew;
+
+  apNew = (CacheEntry **)lsmMallocZero(pEnv, sizeof(CacheEntry *) * nNew);
+  if( apNew ){
+    CacheEntry *pEntry;
+    lsmFree(pEnv, pShard->apHash);
+    pShard->apHash = apNew;
+    pShard->nHash = nNew;
+    for(pEntry=pShard->pLruFirst; pEntry; pEntry=pEntry->pLruNext){
+      int iHash = cacheHashKey(pShard, pEntry->iPg);
+      pEntry->pHashNext = apNew[iHash];
+      apNew[iHash] = pEntry;
+    }
+  }
+}
+
+/*
+** Set the maximum size of the shared page cache belonging to Database p
+** to nKB kilobytes, divided evenly between the shards. Any entries that 
+** no longer fit are evicted.
+*/
+static void cacheSetSize(lsm_env *pEnv, Database *p, int nKB){
+  int i;
+  for(i=0; i<LSM_CACHE_NSHARD; i++){
+    CacheShard *pShard = &p->aShard[i];
+    lsmMutexEnter(pEnv, pShard->pMutex);
+    pShard->nByteMax = ((i64)nKB * 1024) / LSM_CACHE_NSHARD;
+    cacheShardEvict(pEnv, pShard);
+    lsmMutexLeave(pEnv, pShard->pMutex);
+  }
+}
+
+/*
+** Return a pointer to the shared page cache shard that page iPg belongs
+** to.
+*/
+static CacheShard *cacheShard(lsm_db *pDb, Pgno iPg){
+  return &pDb->pDatabase->aShard[iPg % LSM_CACHE_NSHARD];
+}
+
+/*
+** Search the shared page cache for an nData byte image of page iPg. If one
+** is found, copy it into buffer aData[] and return non-zero. Otherwise,
+** return zero.
+*/
+int lsmDbCacheRead(lsm_db *pDb, Pgno iPg, u8 *aData, int nData){
+  CacheShard *pShard = cacheShard(pDb, iPg);
+  int bHit = 0;
+
+  lsmMutexEnter(pDb->pEnv, pShard->pMutex);
+  if( pShard->nEntry>0 ){
+    CacheEntry *pEntry = *cacheFind(pShard, iPg);
+    if( pEntry && pEntry->nData==nData ){
+      memcpy(aData, (u8 *)&pEntry[1], nData);
+      cacheLruRemove(pShard, pEntry);
+      cacheLruAppend(pShard, pEntry);
+      bHit = 1;
+    }
+  }
+  lsmMutexLeave(pDb->pEnv, pShard->pMutex);
+
+  return bHit;
+}
+
+/*
+** Add a copy of the nData byte page image in buffer aData[] to the shared
+** page cache as the content of page iPg, replacing any existing entry.
+** This is a no-op if the cache is too small to hold the page or if a 
+** malloc() fails.
+*/
+void lsmDbCacheWrite(lsm_db *pDb, Pgno iPg, const u8 *aData, int nData){
+  lsm_env *pEnv = pDb->pEnv;
+  CacheShard *pShard = cacheShard(pDb, iPg);
+
+  lsmMutexEnter(pEnv, pShard->pMutex);
+  if( nData<=pShard->nByteMax ){
+    if( pShard->nEntry>=pShard->nHash ) cacheGrowHash(pEnv, pShard);
+    if( pShard->apHash ){
+      CacheEntry **pp = cacheFind(pShard, iPg);
+      CacheEntry *pEntry;
+      if( *pp ) cacheRemove(pEnv, pShard, pp);
+
+      pEntry = (CacheEntry *)lsmMallocZero(pEnv, sizeof(CacheEntry) + nData);
+      if( pEntry ){
+        int iHash = cacheHashKey(pShard, iPg);
+        pEntry->iPg = iPg;
+        pEntry->nData = nData;
+        memcpy((u8 *)&pEntry[1], aData, nData);
+        pEntry->pHashNext = pShard->apHash[iHash];
+        pShard->apHash[iHash] = pEntry;
+        cacheLruAppend(pShard, pEntry);
+        pShard->nByte += nData;
+        pShard->nEntry++;
+        cacheShardEvict(pEnv, pShard);
+      }
+    }
+  }
+  lsmMutexLeave(pEnv, pShard->pMutex);
+}
+
+/*
+** Remove any entries for pages iFirst to iLast, inclusive, from the shared
+** page cache. This must be called whenever a connection writes to any
+** of these pages of the database file.
+*/
+void lsmDbCacheInvalidate(lsm_db *pDb, Pgno iFirst, Pgno iLast){
+  Pgno iPg;
+  for(iPg=iFirst; iPg<=iLast; iPg++){
+    CacheShard *pShard = cacheShard(pDb, iPg);
+    lsmMutexEnter(pDb->pEnv, pShard->pMutex);
+    if( pShard->nEntry>0 ){
+      CacheEntry **pp = cacheFind(pShard, iPg);
+      if( *pp ) cacheRemove(pDb->pEnv, pShard, pp);
+    }
+    lsmMutexLeave(pDb->pEnv, pShard->pMutex);
+  }
+}
+
+/*
+** Connection pDb has just loaded snapshot iId. If this snapshot may have 
+** been produced by a connection in some other process, purge the shared
+** page cache.
+*/
+void lsmDbCacheSnapshotLoaded(lsm_db *pDb, i64 iId){
+  Database *p = pDb->pDatabase;
+  lsmMutexEnter(pDb->pEnv, p->pClientMutex);
+  if( iId>p->iCacheSnapshot ){
+    int i;
+    for(i=0; i<LSM_CACHE_NSHARD; i++){
+      CacheShard *pShard = &p->aShard[i];
+      lsmMutexEnter(pDb->pEnv, pShard->pMutex);
+      cacheShardPurge(pDb->pEnv, pShard);
+      lsmMutexLeave(pDb->pEnv, pShard->pMutex);
+    }
+    p->iCacheSnapshot = iId;
+  }
+  lsmMutexLeave(pDb->pEnv, p->pClientMutex);
+}
+
+/*
+** Connection pDb is about to publish snapshot iId, which was produced by
+** modifying snapshot iId-1.
+*/
+void lsmDbCacheSnapshotSaved(lsm_db *pDb, i64 iId){
+  Database *p = pDb->pDatabase;
+  lsmMutexEnter(pDb->pEnv, p->pClientMutex);
+  if( p->iCacheSnapshot==iId-1 ) p->iCacheSnapshot = iId;
+  lsmMutexLeave(pDb->pEnv, p->pClientMutex);
+}
+
+/*
+** Set the size of the shared page cache to nKB kilobytes. Or, if nKB is
+** less than zero, leave it unchanged. Either way, return the configured
+** size of the shared page cache in KB.
+*/
+int lsmDbCacheConfigure(lsm_db *pDb, int nKB){
+  Database *p = pDb->pDatabase;
+  lsmMutexEnter(pDb->pEnv, p->pClientMutex);
+  if( nKB>=0 ){
+    p->nCacheSize = nKB;
+    cacheSetSize(pDb->pEnv, p, nKB);
+  }
+  nKB = p->nCacheSize;
+  lsmMutexLeave(pDb->pEnv, p->pClientMutex);
+  return nKB;
+}
+
 /*
 ** This function frees all resources held by the Database structure passed
 ** as the only argument.
@@ -144,8 +555,27 @@ int freelistAppend(lsm_db *db, int iBlk, i64 iId){
 static void freeDatabase(lsm_env *pEnv, Database *p){
   assert( holdingGlobalMutex(pEnv) );
   if( p ){
+    int i;
+
+    /* Free the shared page cache */
+    for(i=0; i<LSM_CACHE_NSHARD; i++){
+      CacheShard *pShard = &p->aShard[i];
+      cacheShardPurge(pEnv, pShard);
+      lsmFree(pEnv, pShard->apHash);
+      lsmMutexDel(pEnv, pShard->pMutex);
+    }
+
     /* Free the mutexes */
     lsmMutexDel(pEnv, p->pClientMutex);
+    lsmMutexDel(pEnv, p->pGroupMutex);
+    lsmMutexDel(pEnv, p->pLogMutex);
+    lsmCondDel(pEnv, p->pGroupCond);
+    lsmCondDel(pEnv, p->pLogCond);
+
+    /* Free the log buffers. Any data they still contain belongs to 
+    ** transactions that were rolled back.  */
+    lsmStringClear(&p->aLogBuf[0].buf);
+    lsmStringClear(&p->aLogBuf[1].buf);
 
     if( p->pFile ){
       lsmEnvClose(pEnv, p->pFile);
@@ -154,6 +584,9 @@ static void freeDatabase(lsm_env *pEnv, Database *p){
     /* Free the array of shm pointers */
     lsmFree(pEnv, p->apShmChunk);
 
+    /* Free any bloom filters saved by incomplete merges */
+    lsmSortedFreeMergeFilters(pEnv, p->pMergeFilter);
+
     /* Free the memory allocated for the Database struct itself */
     lsmFree(pEnv, p);
   }
@@ -259,12 +692,17 @@ static void doDbDisconnect(lsm_db *pDb){
       }
       if( rc==LSM_OK ){
         int bReadonly = 0;        /* True if there exist read-only conns. */
+        int bImage = 0;           /* True to save a tree image */
 
         /* Flush the in-memory tree, if required. If there is data to flush,
         ** this will create a new client snapshot in Database.pClient. The
         ** checkpoint (serialization) of this snapshot may be written to disk
         ** by the following block.  
         **
+        ** Or, if LSM_CONFIG_TREE_IMAGE is set and there is no old tree, 
+        ** the tree is written to the tree image file instead, once the
+        ** checkpoint has been written.
+        **
         ** There is no need to take a WRITER lock here. That there are no 
         ** other locks on DMS2 guarantees that there are no other read-write
         ** connections at this time (and the lock on DMS1 guarantees that
@@ -272,7 +710,11 @@ static void doDbDisconnect(lsm_db *pDb){
         */
         rc = lsmTreeLoadHeader(pDb, 0);
         if( rc==LSM_OK && (lsmTreeHasOld(pDb) || lsmTreeSize(pDb)>0) ){
-          rc = lsmFlushTreeToDisk(pDb);
+          if( pDb->bTreeImage && lsmTreeHasOld(pDb)==0 ){
+            bImage = 1;
+          }else{
+            rc = lsmFlushTreeToDisk(pDb);
+          }
         }
 
         /* Now check if there are any read-only connections. If there are,
@@ -286,13 +728,29 @@ static void doDbDisconnect(lsm_db *pDb){
           }
         }
 
+        /* Read-only connections continue to use the in-memory tree in
+        ** shared-memory, and the next read-write connection will not run
+        ** recovery and so delete the image file. So if there are any, 
+        ** flush the tree to disk after all.  */
+        if( rc==LSM_OK && bImage && bReadonly ){
+          bImage = 0;
+          rc = lsmFlushTreeToDisk(pDb);
+        }
+
         /* Write a checkpoint to disk. */
         if( rc==LSM_OK ){
           rc = lsmCheckpointWrite(pDb, (bReadonly==0), 0);
         }
 
+        /* Write the tree image, if required. */
+        if( rc==LSM_OK && bImage ){
+          rc = lsmTreeSaveImage(pDb);
+        }
+
         /* If the checkpoint was written successfully, delete the log file
-        ** and, if possible, truncate the database file.  */
+        ** and, if possible, truncate the database file. The log file is
+        ** not deleted if a tree image was written, as it is required if
+        ** the image cannot be used.  */
         if( rc==LSM_OK ){
           int bRotrans = 0;
           Database *p = pDb->pDatabase;
@@ -300,16 +758,18 @@ static void doDbDisconnect(lsm_db *pDb){
           /* The log file may only be deleted if there are no clients 
           ** read-only clients running rotrans transactions.  */
           rc = lsmDetectRoTrans(pDb, &bRotrans);
-          if( rc==LSM_OK && bRotrans==0 ){
+          if( rc==LSM_OK && bRotrans==0 && bImage==0 ){
             lsmFsCloseAndDeleteLog(pDb->pFS);
           }
 
           /* The database may only be truncated if there exist no read-only
-          ** clients - either connected or running rotrans transactions. */
+          ** clients - either connected or running rotrans transactions. 
+          ** If a tree image was saved in multi-process mode, the shared 
+          ** memory file contains its chunks, so it is not deleted.  */
           if( bReadonly==0 && bRotrans==0 ){
             dbTruncateFile(pDb);
             if( p->pFile && p->bMultiProc ){
-              lsmEnvShmUnmap(pDb->pEnv, p->pFile, 1);
+              lsmEnvShmUnmap(pDb->pEnv, p->pFile, bImage==0);
             }
           }
         }
@@ -359,11 +819,18 @@ static int doDbConnect(lsm_db *pDb){
   assert( LSM_LOCK_DMS3==1+LSM_LOCK_DMS2 );
   rc = lsmShmTestLock(pDb, LSM_LOCK_DMS2, 2, LSM_LOCK_EXCL);
   if( rc==LSM_OK ){
+    int bImage = 0;               /* True if a tree image was loaded */
     memset(pDb->pShmhdr, 0, sizeof(ShmHeader));
     rc = lsmCheckpointRecover(pDb);
-    if( rc==LSM_OK ){
+    if( rc==LSM_OK && pDb->bTreeImage ){
+      rc = lsmTreeLoadImage(pDb, &bImage);
+    }
+    if( rc==LSM_OK && bImage==0 ){
       rc = lsmLogRecover(pDb);
     }
+    if( rc==LSM_OK ){
+      lsmFsCloseAndDeleteTreeImage(pDb->pFS);
+    }
     if( rc==LSM_OK ){
       ShmHeader *pShm = pDb->pShmhdr;
       pShm->aReader[0].iLsmId = lsmCheckpointId(pShm->aSnap1, 0);
@@ -463,6 +930,24 @@ int lsmDbDatabaseConnect(
         p->nName = nName;
         memcpy((void *)p->zName, zName, nName+1);
         rc = lsmMutexNew(pEnv, &p->pClientMutex);
+        if( rc==LSM_OK ) rc = lsmMutexNew(pEnv, &p->pGroupMutex);
+        if( rc==LSM_OK ) rc = lsmMutexNew(pEnv, &p->pLogMutex);
+        if( rc==LSM_OK ) rc = lsmCondNew(pEnv, &p->pGroupCond);
+        if( rc==LSM_OK ) rc = lsmCondNew(pEnv, &p->pLogCond);
+        lsmStringInit(&p->aLogBuf[0].buf, pEnv);
+        lsmStringInit(&p->aLogBuf[1].buf, pEnv);
+      }
+
+      /* Allocate the shared page cache mutexes and set its size. */
+      if( rc==LSM_OK ){
+        int i;
+        for(i=0; rc==LSM_OK && i<LSM_CACHE_NSHARD; i++){
+          rc = lsmMutexNew(pEnv, &p->aShard[i].pMutex);
+        }
+        if( rc==LSM_OK ){
+          p->nCacheSize = pDb->nCacheSize;
+          cacheSetSize(pEnv, p, p->nCacheSize);
+        }
       }
 
       /* If nothing has gone wrong so far, open the shared fd. And if that
@@ -496,6 +981,7 @@ int lsmDbDatabaseConnect(
       lsmMutexEnter(pDb->pEnv, p->pClientMutex);
       pDb->pNext = p->pConn;
       p->pConn = pDb;
+      pDb->nCacheSize = p->nCacheSize;
       lsmMutexLeave(pDb->pEnv, p->pClientMutex);
     }
   }
@@ -726,14 +1212,32 @@ int lsmWalkFreelist(
 
 typedef struct FindFreeblockCtx FindFreeblockCtx;
 struct FindFreeblockCtx {
+  Database *pDatabase;
   i64 iInUse;
   int iRet;
   int bNotOne;
 };
 
+/*
+** Return true if block iBlk has been allocated by a merge job that is still
+** running on database p.
+*/
+static int mergeJobReserved(Database *p, int iBlk){
+  MergeJob *pJob;
+  for(pJob=p->pMergeJob; pJob; pJob=pJob->pNext){
+    int i;
+    for(i=0; i<pJob->nBlk; i++){
+      if( pJob->aBlk[i]==iBlk || pJob->aBlk[i]==-iBlk ) return 1;
+    }
+  }
+  return 0;
+}
+
 static int findFreeblockCb(void *pCtx, int iBlk, i64 iSnapshot){
   FindFreeblockCtx *p = (FindFreeblockCtx *)pCtx;
-  if( iSnapshot<p->iInUse && (iBlk!=1 || p->bNotOne==0) ){
+  if( iSnapshot<p->iInUse && (iBlk!=1 || p->bNotOne==0) 
+   && mergeJobReserved(p->pDatabase, iBlk)==0
+  ){
     p->iRet = iBlk;
     return 1;
   }
@@ -744,6 +1248,7 @@ static int findFreeblock(lsm_db *pDb, i64 iInUse, int bNotOne, int *piRet){
   int rc;                         /* Return code */
   FindFreeblockCtx ctx;           /* Context object */
 
+  ctx.pDatabase = pDb->pDatabase;
   ctx.iInUse = iInUse;
   ctx.iRet = 0;
   ctx.bNotOne = bNotOne;
@@ -754,21 +1259,57 @@ static int findFreeblock(lsm_db *pDb, i64 iInUse, int bNotOne, int *piRet){
 }
 
 /*
-** Allocate a new database file block to write data to, either by extending
-** the database file or by recycling a free-list entry. The worker snapshot 
-** must be held in order to call this function.
+** Set *piInUse to the smallest snapshot id that is either:
 **
-** If successful, *piBlk is set to the block number allocated and LSM_OK is
-** returned. Otherwise, *piBlk is zeroed and an lsm error code returned.
+**   * Currently in use by a database client,
+**   * May be used by a database client in the future, or
+**   * Is the most recently checkpointed snapshot (i.e. the one that will
+**     be used following recovery if a failure occurs at this point).
+**
+** The worker snapshot must be held in order to call this function. Return
+** LSM_OK if successful, or an LSM error code otherwise. Read-only 
+** transactions are not considered - see lsmDetectRoTrans().
 */
-int lsmBlockAllocate(lsm_db *pDb, int iBefore, int *piBlk){
-  Snapshot *p = pDb->pWorker;
-  int iRet = 0;                   /* Block number of allocated block */
+int lsmSnapshotInUse(lsm_db *pDb, i64 *piInUse){
+  i64 iInUse;                     /* Snapshot id still in use */
+  i64 iSynced = 0;                /* Snapshot id synced to disk */
+  int rc;
+
+  assert( pDb->pWorker );
+  rc = lsmCheckpointSynced(pDb, &iSynced, 0, 0);
+  if( rc==LSM_OK && iSynced==0 ) iSynced = pDb->pWorker->iId;
+  iInUse = iSynced;
+  if( rc==LSM_OK && pDb->iReader>=0 ){
+    assert( pDb->pClient );
+    iInUse = LSM_MIN(iInUse, pDb->pClient->iId);
+  }
+  if( rc==LSM_OK ) rc = firstSnapshotInUse(pDb, &iInUse);
+  *piInUse = iInUse;
+  return rc;
+}
+
+/*
+** Search the free block list for a block that may be reused. The worker
+** snapshot must be held in order to call this function. If argument 
+** bNotOne is true, block 1 is never returned.
+**
+** If successful, LSM_OK is returned and *piRet set to the block number 
+** found, or to zero if there is no block that can be reused. *piInUse is 
+** set to the smallest snapshot id that is still in use (and so is the 
+** oldest snapshot that blocks on the free block list may still be
+** required by). If an error occurs, an LSM error code is returned.
+*/
+static int findReusableBlock(
+  lsm_db *pDb, 
+  int bNotOne, 
+  i64 *piInUse,
+  int *piRet
+){
+  int iRet = 0;                   /* Block number of free block */
   int rc = LSM_OK;
   i64 iInUse = 0;                 /* Snapshot id still in use */
-  i64 iSynced = 0;                /* Snapshot id synced to disk */
 
-  assert( p );
+  assert( pDb->pWorker );
 
 #ifdef LSM_LOG_FREELIST
   {
@@ -782,27 +1323,13 @@ int lsmBlockAllocate(lsm_db *pDb, int iBefore, int *piBlk){
   }
 #endif
 
-  /* Set iInUse to the smallest snapshot id that is either:
-  **
-  **   * Currently in use by a database client,
-  **   * May be used by a database client in the future, or
-  **   * Is the most recently checkpointed snapshot (i.e. the one that will
-  **     be used following recovery if a failure occurs at this point).
-  */
-  rc = lsmCheckpointSynced(pDb, &iSynced, 0, 0);
-  if( rc==LSM_OK && iSynced==0 ) iSynced = p->iId;
-  iInUse = iSynced;
-  if( rc==LSM_OK && pDb->iReader>=0 ){
-    assert( pDb->pClient );
-    iInUse = LSM_MIN(iInUse, pDb->pClient->iId);
-  }
-  if( rc==LSM_OK ) rc = firstSnapshotInUse(pDb, &iInUse);
+  rc = lsmSnapshotInUse(pDb, &iInUse);
 
 #ifdef LSM_LOG_FREELIST
   {
     lsmLogMessage(pDb, 0, "lsmBlockAllocate(): "
-        "snapshot-in-use: %lld (iSynced=%lld) (client-id=%lld)", 
-        iInUse, iSynced, (pDb->iReader>=0 ? pDb->pClient->iId : 0)
+        "snapshot-in-use: %lld (client-id=%lld)", 
+        iInUse, (pDb->iReader>=0 ? pDb->pClient->iId : 0)
     );
   }
 #endif
@@ -821,9 +1348,111 @@ int lsmBlockAllocate(lsm_db *pDb, int iBefore, int *piBlk){
     rc = lsmDetectRoTrans(pDb, &bRotrans);
 
     if( rc==LSM_OK && bRotrans==0 ){
-      rc = findFreeblock(pDb, iInUse, (iBefore>0), &iRet);
+      rc = findFreeblock(pDb, iInUse, bNotOne, &iRet);
+    }
+  }
+
+  *piInUse = iInUse;
+  *piRet = iRet;
+  return rc;
+}
+
+/*
+** Take the WORKER lock on behalf of a merge job, waiting for it if some 
+** other connection holds it. The worker snapshot is not loaded. Merge jobs
+** are only run in single process mode, where taking the lock cannot fail.
+*/
+static int mergeJobWorkerLock(lsm_db *pDb){
+  int rc;
+  assert( pDb->pDatabase->bMultiProc==0 );
+  while( (rc = lsmShmLock(pDb, LSM_LOCK_WORKER, LSM_LOCK_EXCL, 0))==LSM_BUSY ){
+    lsmEnvSleep(pDb->pEnv, LSM_MERGEJOB_SLEEP_US);
+  }
+  return rc;
+}
+
+/*
+** Add block iBlk to the list of blocks allocated by merge job pJob.
+*/
+static int mergeJobAddBlock(lsm_env *pEnv, MergeJob *pJob, int iBlk){
+  if( pJob->nBlk==pJob->nBlkAlloc ){
+    int nNew = (pJob->nBlkAlloc ? pJob->nBlkAlloc*2 : 16);
+    int *aNew = (int *)lsmRealloc(pEnv, pJob->aBlk, sizeof(int)*nNew);
+    if( aNew==0 ) return LSM_NOMEM_BKPT;
+    pJob->aBlk = aNew;
+    pJob->nBlkAlloc = nNew;
+  }
+  pJob->aBlk[pJob->nBlk++] = iBlk;
+  return LSM_OK;
+}
+
+/*
+** This version of lsmBlockAllocate() is used while connection pDb is 
+** running a merge job. In this case pDb->pWorker is the job's private 
+** copy of the worker snapshot, and the WORKER lock is not held.
+**
+** The WORKER lock is taken (waiting for it if necessary) and the current
+** worker snapshot loaded in order to find a block. The block is not marked
+** as used in the worker snapshot - instead it is added to the list of
+** blocks allocated by the job, which prevents it from being allocated by
+** any other connection. The snapshot is updated when the job is finished
+** (see lsmMergeJobCommit()).
+*/
+static int mergeJobBlockAllocate(lsm_db *pDb, int *piBlk){
+  MergeJob *pJob = pDb->pMergeJob;
+  Snapshot *pSnap = pDb->pWorker;
+  int iRet = 0;
+  int rc;
+  int rcdummy = LSM_BUSY;
+
+  pDb->pWorker = 0;
+  pDb->pMergeJob = 0;
+  rc = lsmMergeJobLock(pDb);
+  if( rc==LSM_OK ){
+    Database *p = pDb->pDatabase;
+    i64 iInUse = 0;
+
+    /* Pages of the free-list segments cached by this connection may be
+    ** out of date, as other connections have been writing to the db. */
+    lsmFsPurgeCache(pDb->pFS);
+    rc = findReusableBlock(pDb, 0, &iInUse, &iRet);
+    if( rc==LSM_OK && iRet==0 ){
+      iRet = LSM_MAX(pDb->pWorker->nBlock, p->iReserveEnd) + 1;
+      p->iReserveEnd = iRet;
+    }
+    if( rc==LSM_OK ){
+      rc = mergeJobAddBlock(pDb->pEnv, pJob, iRet);
     }
   }
+  lsmFinishWork(pDb, 0, &rcdummy);
+  pDb->pWorker = pSnap;
+  pDb->pMergeJob = pJob;
+
+  *piBlk = (rc==LSM_OK ? iRet : 0);
+  return rc;
+}
+
+/*
+** Allocate a new database file block to write data to, either by extending
+** the database file or by recycling a free-list entry. The worker snapshot 
+** must be held in order to call this function.
+**
+** If successful, *piBlk is set to the block number allocated and LSM_OK is
+** returned. Otherwise, *piBlk is zeroed and an lsm error code returned.
+*/
+int lsmBlockAllocate(lsm_db *pDb, int iBefore, int *piBlk){
+  Snapshot *p = pDb->pWorker;
+  int iRet = 0;                   /* Block number of allocated block */
+  int rc = LSM_OK;
+  i64 iInUse = 0;                 /* Snapshot id still in use */
+
+  assert( p );
+  if( pDb->pMergeJob ){
+    assert( iBefore==0 );
+    return mergeJobBlockAllocate(pDb, piBlk);
+  }
+
+  rc = findReusableBlock(pDb, (iBefore>0), &iInUse, &iRet);
 
   if( iBefore>0 && (iRet<=0 || iRet>=iBefore) ){
     iRet = 0;
@@ -831,7 +1460,9 @@ int lsmBlockAllocate(lsm_db *pDb, int iBefore, int *piBlk){
   }else if( rc==LSM_OK ){
     /* If a block was found in the free block list, use it and remove it from 
     ** the list. Otherwise, if no suitable block was found, allocate one from
-    ** the end of the file.  */
+    ** the end of the file. Blocks past the end of the file that have been
+    ** allocated by running merge jobs are skipped. They are added to the
+    ** free block list so that they are not lost if the job is abandoned. */
     if( iRet>0 ){
 #ifdef LSM_LOG_FREELIST
       lsmLogMessage(pDb, 0, 
@@ -843,6 +1474,10 @@ int lsmBlockAllocate(lsm_db *pDb, int iBefore, int *piBlk){
       }
     }else{
       iRet = ++(p->nBlock);
+      while( rc==LSM_OK && mergeJobReserved(pDb->pDatabase, iRet) ){
+        rc = freelistAppend(pDb, iRet, 0);
+        iRet = ++(p->nBlock);
+      }
 #ifdef LSM_LOG_FREELIST
       lsmLogMessage(pDb, 0, "extending file to %d blocks", iRet);
 #endif
@@ -864,6 +1499,7 @@ int lsmBlockAllocate(lsm_db *pDb, int iBefore, int *piBlk){
 int lsmBlockFree(lsm_db *pDb, int iBlk){
   Snapshot *p = pDb->pWorker;
   assert( lsmShmAssertWorker(pDb) );
+  assert( pDb->pMergeJob==0 );
 
 #ifdef LSM_LOG_FREELIST
   lsmLogMessage(pDb, LSM_OK, "lsmBlockFree(): Free block %d", iBlk);
@@ -881,6 +1517,9 @@ int lsmBlockFree(lsm_db *pDb, int iBlk){
 ** the freelist. Refreeing a block is different from freeing is, as a refreed
 ** block may be reused immediately. Whereas a freed block can not be reused 
 ** until (at least) after the next checkpoint.
+**
+** If a merge job is running, the block is only marked as unused in the
+** list of blocks allocated by the job.
 */
 int lsmBlockRefree(lsm_db *pDb, int iBlk){
   int rc = LSM_OK;                /* Return code */
@@ -889,7 +1528,237 @@ int lsmBlockRefree(lsm_db *pDb, int iBlk){
   lsmLogMessage(pDb, LSM_OK, "lsmBlockRefree(): Refree block %d", iBlk);
 #endif
 
-  rc = freelistAppend(pDb, iBlk, 0);
+  if( pDb->pMergeJob ){
+    /* The job may be shared with other connections running the key ranges
+    ** of a split merge, so the WORKER lock is required to modify aBlk[]. */
+    MergeJob *pJob = pDb->pMergeJob;
+    int i;
+    mergeJobWorkerLock(pDb);
+    for(i=0; i<pJob->nBlk; i++){
+      if( pJob->aBlk[i]==iBlk ) pJob->aBlk[i] = -iBlk;
+    }
+    lsmShmLock(pDb, LSM_LOCK_WORKER, LSM_LOCK_UNLOCK, 0);
+  }else{
+    rc = freelistAppend(pDb, iBlk, 0);
+  }
+  return rc;
+}
+
+/*
+** Add merge job pJob to the list of jobs running on the database. The 
+** WORKER lock must be held to call this function. 
+*/
+void lsmMergeJobBegin(lsm_db *pDb, MergeJob *pJob){
+  Database *p = pDb->pDatabase;
+  assert( lsmShmAssertLock(pDb, LSM_LOCK_WORKER, LSM_LOCK_EXCL) );
+  assert( p->bMultiProc==0 );
+  pJob->pNext = p->pMergeJob;
+  p->pMergeJob = pJob;
+}
+
+/*
+** Remove merge job pJob from the list of jobs running on the database. The
+** levels claimed and blocks allocated by the job become available to other
+** connections. The WORKER lock must be held to call this function.
+*/
+void lsmMergeJobEnd(lsm_db *pDb, MergeJob *pJob){
+  Database *p = pDb->pDatabase;
+  MergeJob **pp;
+  assert( lsmShmAssertLock(pDb, LSM_LOCK_WORKER, LSM_LOCK_EXCL) );
+  for(pp=&p->pMergeJob; *pp!=pJob; pp=&(*pp)->pNext);
+  *pp = pJob->pNext;
+  pJob->pNext = 0;
+  if( p->pMergeJob==0 ) p->iReserveEnd = 0;
+}
+
+/*
+** Return true if there are any merge jobs running on the database.
+*/
+int lsmMergeJobRunning(lsm_db *pDb){
+  return (pDb->pDatabase->pMergeJob!=0);
+}
+
+/*
+** Return true if level pLevel has been claimed by a running merge job.
+*/
+int lsmMergeJobClaimed(lsm_db *pDb, Level *pLevel){
+  MergeJob *pJob;
+  if( pLevel->nRight==0 ){
+    for(pJob=pDb->pDatabase->pMergeJob; pJob; pJob=pJob->pNext){
+      int i;
+      for(i=0; i<pJob->nClaim; i++){
+        if( pJob->aiClaim[i]==pLevel->lhs.iFirst ) return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+** Take the WORKER lock and load the worker snapshot, as for lsmBeginWork().
+** Except, if the lock is held by some other connection, wait for it to be
+** released instead of returning LSM_BUSY. This is used by merge jobs, 
+** which cannot give up on a merge whenever another connection is busy.
+**
+** Merge jobs are only run in single process mode, where taking the lock
+** cannot fail. So the lock is always held when this function returns, even
+** if an error occurs while loading the snapshot. The caller must release
+** it using lsmFinishWork().
+*/
+int lsmMergeJobLock(lsm_db *pDb){
+  int rc;
+  rc = mergeJobWorkerLock(pDb);
+  if( rc==LSM_OK ){
+    rc = lsmCheckpointLoadWorker(pDb);
+  }
+  return rc;
+}
+
+/*
+** Mark merge job pJob as a split merge of the nRange key ranges in array
+** aRange[], writing level pLevel. The caller must be the connection that
+** started the job, and must not hold the WORKER lock. Once this function 
+** returns, other connections may run the key ranges (see 
+** lsmMergeJobHelp()).
+*/
+void lsmMergeJobSplit(
+  lsm_db *pDb, 
+  MergeJob *pJob, 
+  Level *pLevel, 
+  int nRange, 
+  MergeRange *aRange
+){
+  mergeJobWorkerLock(pDb);
+  pJob->pLevel = pLevel;
+  pJob->aRange = aRange;
+  pJob->iNextRange = 0;
+  pJob->nRangeDone = 0;
+  pJob->nRange = nRange;
+  lsmShmLock(pDb, LSM_LOCK_WORKER, LSM_LOCK_UNLOCK, 0);
+}
+
+/*
+** Search the list of running merge jobs for a split merge with a key range
+** that has not yet been started. If one is found, claim the key range, set
+** *piRange to its index and return a pointer to the job. Otherwise, return
+** NULL. The WORKER lock must be held to call this function.
+*/
+MergeJob *lsmMergeJobHelp(lsm_db *pDb, int *piRange){
+  MergeJob *pJob;
+  assert( lsmShmAssertLock(pDb, LSM_LOCK_WORKER, LSM_LOCK_EXCL) );
+  for(pJob=pDb->pDatabase->pMergeJob; pJob; pJob=pJob->pNext){
+    if( pJob->iNextRange<pJob->nRange ){
+      *piRange = pJob->iNextRange++;
+      break;
+    }
+  }
+  return pJob;
+}
+
+/*
+** Claim the next key range of split merge pJob that has not yet been 
+** started and return its index. Or, if all key ranges have been started,
+** return -1. The WORKER lock must not be held.
+*/
+int lsmMergeJobRangeNext(lsm_db *pDb, MergeJob *pJob){
+  int iRet = -1;
+  mergeJobWorkerLock(pDb);
+  if( pJob->iNextRange<pJob->nRange ){
+    iRet = pJob->iNextRange++;
+  }
+  lsmShmLock(pDb, LSM_LOCK_WORKER, LSM_LOCK_UNLOCK, 0);
+  return iRet;
+}
+
+/*
+** Record that a key range of split merge pJob has been finished (or 
+** abandoned). The WORKER lock must not be held.
+*/
+void lsmMergeJobRangeDone(lsm_db *pDb, MergeJob *pJob){
+  mergeJobWorkerLock(pDb);
+  pJob->nRangeDone++;
+  lsmShmLock(pDb, LSM_LOCK_WORKER, LSM_LOCK_UNLOCK, 0);
+}
+
+/*
+** Wait until all key ranges of split merge pJob have been finished. The
+** WORKER lock must not be held.
+*/
+void lsmMergeJobRangeWait(lsm_db *pDb, MergeJob *pJob){
+  while( 1 ){
+    int bDone;
+    mergeJobWorkerLock(pDb);
+    bDone = (pJob->nRangeDone==pJob->nRange);
+    lsmShmLock(pDb, LSM_LOCK_WORKER, LSM_LOCK_UNLOCK, 0);
+    if( bDone ) break;
+    lsmEnvSleep(pDb->pEnv, LSM_MERGEJOB_WAIT_US);
+  }
+}
+
+/*
+** Return a pointer to the head of the list of bloom filters saved by 
+** incomplete merges. The WORKER lock must be held to call this function.
+*/
+MergeFilter **lsmDbMergeFilters(lsm_db *pDb){
+  assert( lsmShmAssertLock(pDb, LSM_LOCK_WORKER, LSM_LOCK_EXCL) );
+  return &pDb->pDatabase->pMergeFilter;
+}
+
+/*
+** Sort the nBlk entries of array aBlk[] in ascending order of their 
+** absolute values.
+*/
+static void mergeJobSortBlocks(int *aBlk, int nBlk){
+  int i;
+  for(i=1; i<nBlk; i++){
+    int iVal = aBlk[i];
+    int iKey = (iVal<0 ? -iVal : iVal);
+    int j;
+    for(j=i; j>0 && (aBlk[j-1]<0 ? -aBlk[j-1] : aBlk[j-1])>iKey; j--){
+      aBlk[j] = aBlk[j-1];
+    }
+    aBlk[j] = iVal;
+  }
+}
+
+/*
+** Merge job pJob has finished and its results are about to be saved. The
+** WORKER lock is held and pDb->pWorker is the current worker snapshot.
+** Update the worker snapshot to account for the blocks allocated by the
+** job:
+**
+**   * Blocks that were reused from the free block list, or that some other
+**     connection skipped past when extending the file, are removed from
+**     the free block list.
+**
+**   * If the job used blocks past the end of the file, the file is 
+**     extended. Any blocks skipped over that are not used by the job are
+**     added to the free block list.
+**
+** Blocks allocated by the job and then refreed are ignored.
+*/
+int lsmMergeJobCommit(lsm_db *pDb, MergeJob *pJob){
+  Snapshot *pWorker = pDb->pWorker;
+  int rc = LSM_OK;
+  int i;
+
+  assert( lsmShmAssertWorker(pDb) );
+  assert( pDb->pMergeJob==0 && pDb->bUseFreelist==0 );
+
+  mergeJobSortBlocks(pJob->aBlk, pJob->nBlk);
+  for(i=0; rc==LSM_OK && i<pJob->nBlk; i++){
+    int iBlk = pJob->aBlk[i];
+    if( iBlk<0 ) continue;
+    if( iBlk<=pWorker->nBlock ){
+      rc = freelistAppend(pDb, iBlk, -1);
+    }else{
+      int iFree;
+      for(iFree=pWorker->nBlock+1; rc==LSM_OK && iFree<iBlk; iFree++){
+        rc = freelistAppend(pDb, iFree, 0);
+      }
+      pWorker->nBlock = iBlk;
+    }
+  }
   return rc;
 }
 
@@ -941,7 +1810,9 @@ int lsmCheckpointWrite(lsm_db *pDb, int bTruncate, u32 *pnWrite){
     if( rc==LSM_OK && bDone==0 ){
       int iMeta = (pShm->iMetaPage % 2) + 1;
       if( pDb->eSafety!=LSM_SAFETY_OFF ){
-        rc = lsmFsSyncDb(pDb->pFS, nBlock);
+        i64 iVlogOff = lsmCheckpointVlogOffset(pDb->aSnapshot);
+        rc = lsmVlogSync(pDb, iVlogOff);
+        if( rc==LSM_OK ) rc = lsmFsSyncDb(pDb->pFS, nBlock);
       }
       if( rc==LSM_OK ) rc = lsmCheckpointStore(pDb, iMeta);
       if( rc==LSM_OK && pDb->eSafety!=LSM_SAFETY_OFF){
@@ -1104,7 +1975,9 @@ int lsmFinishRecovery(lsm_db *pDb){
 **
 ** If the check shows that the current compression are incompatible and there
 ** is a compression factory registered, give it a chance to install new
-** compression routines.
+** compression routines. Otherwise, if no compression routines are 
+** configured and iReq is the id of a codec built into the library, 
+** install the built-in codec.
 **
 ** If, after any registered factory is invoked, the compression functions
 ** are still incompatible, return LSM_MISMATCH. Otherwise, LSM_OK.
@@ -1115,6 +1988,14 @@ int lsmCheckCompressionId(lsm_db *pDb, u32 iReq){
       pDb->bInFactory = 1;
       pDb->factory.xFactory(pDb->factory.pCtx, pDb, iReq);
       pDb->bInFactory = 0;
+    }else if( pDb->compress.iId==LSM_COMPRESSION_NONE ){
+      lsm_compress builtin;
+      if( lsmCodecBuiltin(iReq, &builtin) ){
+        int rc;
+        memcpy(&pDb->compress, &builtin, sizeof(lsm_compress));
+        rc = lsmFsConfigure(pDb);
+        if( rc!=LSM_OK ) return rc;
+      }
     }
     if( pDb->compress.iId!=iReq ){
       /* Incompatible */
@@ -1474,6 +2355,9 @@ int lsmReadlock(lsm_db *db, i64 iLsm, u32 iShmMin, u32 iShmMax){
       rc = lsmShmLock(db, LSM_LOCK_READER(i), LSM_LOCK_SHARED, 0);
       if( rc==LSM_OK && p->iLsmId==iLsm && p->iTreeId==iShmMax ){
         db->iReader = i;
+      }else if( rc==LSM_OK ){
+        /* The slot was modified before the lock was obtained. */
+        lsmShmLock(db, LSM_LOCK_READER(i), LSM_LOCK_UNLOCK, 0);
       }else if( rc==LSM_BUSY ){
         rc = LSM_OK;
       }
@@ -1503,6 +2387,8 @@ int lsmReadlock(lsm_db *db, i64 iLsm, u32 iShmMin, u32 iShmMax){
       rc = lsmShmLock(db, LSM_LOCK_READER(i), LSM_LOCK_SHARED, 0);
       if( rc==LSM_OK && slotIsUsable(p, iLsm, iShmMin, iShmMax) ){
         db->iReader = i;
+      }else if( rc==LSM_OK ){
+        lsmShmLock(db, LSM_LOCK_READER(i), LSM_LOCK_UNLOCK, 0);
       }else if( rc==LSM_BUSY ){
         rc = LSM_OK;
       }
@@ -1965,3 +2851,320 @@ int lsm_checkpoint(lsm_db *pDb, int *pnKB){
 
   return rc;
 }
+
+/*
+** Add the auto-commit write pWrite to the queue of writes waiting to be
+** committed as part of a group (see LSM_CONFIG_GROUP_COMMIT). If no other
+** connection is currently acting as the group leader, the calling 
+** connection becomes the leader and this function returns non-zero. The
+** caller must then call lsmGroupTake() to obtain the list of writes to
+** commit (which includes pWrite), commit them, and call lsmGroupDone().
+**
+** Otherwise, block until either pWrite has been committed by another 
+** connection (in which case zero is returned and pWrite->rc contains the
+** result), or until there is no leader and this connection is required 
+** to take over (in which case non-zero is returned). Both happen only when
+** a leader calls lsmGroupDone(), which wakes the waiting writers.
+*/
+int lsmGroupJoin(lsm_db *pDb, GroupWrite *pWrite){
+  Database *p = pDb->pDatabase;
+  int bLeader = 0;
+
+  lsmMutexEnter(pDb->pEnv, p->pGroupMutex);
+  pWrite->pNext = 0;
+  if( p->pGroupLast ){
+    p->pGroupLast->pNext = pWrite;
+  }else{
+    p->pGroupFirst = pWrite;
+  }
+  p->pGroupLast = pWrite;
+
+  while( pWrite->bDone==0 ){
+    if( p->bGroupLeader==0 ){
+      p->bGroupLeader = 1;
+      bLeader = 1;
+      break;
+    }
+    lsmCondWait(pDb->pEnv, p->pGroupCond, p->pGroupMutex, LSM_GROUP_SLEEP_US);
+  }
+  lsmMutexLeave(pDb->pEnv, p->pGroupMutex);
+
+  return bLeader;
+}
+
+/*
+** Return true if connections p1 and p2 are configured the same way in
+** every respect that affects how a write is committed. That is, in each
+** setting read by the write, commit and auto-work code.
+*/
+static int groupSameConfig(lsm_db *p1, lsm_db *p2){
+  return p1->eSafety==p2->eSafety
+      && p1->bAutowork==p2->bAutowork
+      && p1->nTreeLimit==p2->nTreeLimit
+      && p1->nMerge==p2->nMerge
+      && p1->bUseLog==p2->bUseLog
+      && p1->nMaxFreelist==p2->nMaxFreelist
+      && p1->nBloomBits==p2->nBloomBits
+      && p1->bPrefixKeys==p2->bPrefixKeys
+      && p1->nBgWorker==p2->nBgWorker
+      && p1->nThrottleLevels==p2->nThrottleLevels
+      && p1->nValueLog==p2->nValueLog
+      && p1->nSyncWindow==p2->nSyncWindow
+      && p1->bLogBuffer==p2->bLogBuffer
+      && p1->nVlogGc==p2->nVlogGc
+      && p1->nAutockpt==p2->nAutockpt
+      && p1->compress.xCompress==p2->compress.xCompress
+      && p1->compress.pCtx==p2->compress.pCtx;
+}
+
+/*
+** This is called by the group leader. Remove from the queue all writes
+** made by connections configured the same way as pDb (see 
+** groupSameConfig()) and return them as a linked list, in the order they
+** were queued. Other writes are left in the queue for a later leader.
+*/
+GroupWrite *lsmGroupTake(lsm_db *pDb){
+  Database *p = pDb->pDatabase;
+  GroupWrite *pRet = 0;
+  GroupWrite **ppRet = &pRet;
+  GroupWrite **pp;
+
+  lsmMutexEnter(pDb->pEnv, p->pGroupMutex);
+  assert( p->bGroupLeader );
+  p->pGroupLast = 0;
+  pp = &p->pGroupFirst;
+  while( *pp ){
+    GroupWrite *pWrite = *pp;
+    if( pWrite->pDb==pDb || groupSameConfig(pWrite->pDb, pDb) ){
+      *pp = pWrite->pNext;
+      *ppRet = pWrite;
+      ppRet = &pWrite->pNext;
+    }else{
+      p->pGroupLast = pWrite;
+      pp = &pWrite->pNext;
+    }
+  }
+  *ppRet = 0;
+  lsmMutexLeave(pDb->pEnv, p->pGroupMutex);
+
+  return pRet;
+}
+
+/*
+** This is called by the group leader once the writes in list pList (as
+** returned by lsmGroupTake()) have been committed and the rc field of each
+** set. Wake the writers and relinquish leadership. Any writes that were
+** queued in the meantime are committed by the next leader.
+**
+** The list must not be accessed after this call, as each entry may be 
+** deallocated as soon as its bDone flag is set.
+*/
+void lsmGroupDone(lsm_db *pDb, GroupWrite *pList){
+  Database *p = pDb->pDatabase;
+  GroupWrite *pWrite;
+  GroupWrite *pNext;
+
+  lsmMutexEnter(pDb->pEnv, p->pGroupMutex);
+  for(pWrite=pList; pWrite; pWrite=pNext){
+    pNext = pWrite->pNext;
+    pWrite->bDone = 1;
+  }
+  p->bGroupLeader = 0;
+  lsmCondBroadcast(pDb->pEnv, p->pGroupCond);
+  lsmMutexLeave(pDb->pEnv, p->pGroupMutex);
+}
+
+/*
+** This is called by a connection committing with LSM_CONFIG_SAFETY set
+** to 3 (window) after the COMMIT record has been written to the log file.
+** It returns a value that must be passed to lsmGroupSync().
+*/
+i64 lsmGroupSyncQueue(lsm_db *pDb){
+  Database *p = pDb->pDatabase;
+  i64 iRet;
+
+  lsmMutexEnter(pDb->pEnv, p->pGroupMutex);
+  iRet = ++p->iSyncQueue;
+  lsmMutexLeave(pDb->pEnv, p->pGroupMutex);
+
+  return iRet;
+}
+
+/*
+** Wait until the commit identified by iSync (a value returned by an
+** earlier call to lsmGroupSyncQueue()) has been synced to disk. Return
+** LSM_OK if successful, or an LSM error code if the sync fails.
+**
+** If no other connection is syncing the log, the calling connection syncs
+** it, covering all commits queued up until that point. Otherwise, it blocks
+** until the other connection has finished (see Database.pGroupCond). If 
+** that sync did not cover commit iSync, the caller (or some other waiting
+** connection) syncs again.
+**
+** Before syncing, the syncing connection sleeps for LSM_CONFIG_SYNC_WINDOW
+** microseconds to allow more commits to be queued, but only if the
+** previous sync covered more than one commit. So that a lone writer is
+** not delayed.
+*/
+int lsmGroupSync(lsm_db *pDb, i64 iSync){
+  Database *p = pDb->pDatabase;
+  int rc = LSM_OK;
+
+  lsmMutexEnter(pDb->pEnv, p->pGroupMutex);
+  while( rc==LSM_OK && p->iSyncDone<iSync ){
+    if( p->bSyncing==0 ){
+      i64 iTarget;
+      p->bSyncing = 1;
+      if( pDb->nSyncWindow>0 && p->nSyncLast>1 ){
+        lsmMutexLeave(pDb->pEnv, p->pGroupMutex);
+        lsmEnvSleep(pDb->pEnv, pDb->nSyncWindow);
+        lsmMutexEnter(pDb->pEnv, p->pGroupMutex);
+      }
+      iTarget = p->iSyncQueue;
+      lsmMutexLeave(pDb->pEnv, p->pGroupMutex);
+
+      rc = lsmFsSyncLog(pDb->pFS);
+
+      lsmMutexEnter(pDb->pEnv, p->pGroupMutex);
+      if( rc==LSM_OK ){
+        p->nSyncLast = (int)(iTarget - p->iSyncDone);
+        p->iSyncDone = iTarget;
+      }
+      p->bSyncing = 0;
+      lsmCondBroadcast(pDb->pEnv, p->pGroupCond);
+    }else{
+      lsmCondWait(pDb->pEnv, p->pGroupCond, p->pGroupMutex, LSM_GROUP_SLEEP_US);
+    }
+  }
+  lsmMutexLeave(pDb->pEnv, p->pGroupMutex);
+
+  return rc;
+}
+
+/*
+** Write the oldest data in the log buffers to the log file. The caller
+** must hold the log buffer mutex and bLogFlush must be clear. The mutex
+** is released while the write is in progress, so that the connection 
+** holding the WRITER lock may continue to append to the other buffer.
+**
+** If the buffer not being appended to is empty, the buffer being appended
+** to is sealed first, so that the next append goes to the other one.
+** Return LSM_OK if successful, or an LSM error code otherwise. If an error
+** occurs, the data remains buffered and is written by the next call.
+*/
+static int dbLogFlushOne(lsm_db *pDb){
+  Database *p = pDb->pDatabase;
+  LogBuffer *pBuf = &p->aLogBuf[!p->iLogFill];
+  int rc;
+
+  assert( p->bLogFlush==0 );
+  if( pBuf->buf.n==0 ){
+    pBuf = &p->aLogBuf[p->iLogFill];
+    pBuf->iLsn = p->iLogQueued;
+    p->iLogFill = !p->iLogFill;
+  }
+  assert( pBuf->buf.n>0 );
+
+  p->bLogFlush = 1;
+  lsmMutexLeave(pDb->pEnv, p->pLogMutex);
+  rc = lsmFsWriteLog(pDb->pFS, pBuf->iOff, &pBuf->buf);
+  lsmMutexEnter(pDb->pEnv, p->pLogMutex);
+  if( rc==LSM_OK ){
+    p->iLogWritten = pBuf->iLsn;
+    pBuf->buf.n = 0;
+  }
+  p->bLogFlush = 0;
+  lsmCondBroadcast(pDb->pEnv, p->pLogCond);
+
+  return rc;
+}
+
+/*
+** This is used instead of lsmFsWriteLog() by a connection holding the 
+** WRITER lock with LSM_CONFIG_LOG_BUFFER set. Instead of writing the
+** contents of buffer pStr to offset iOff of the log file, append it to
+** the log buffers and set *piLsn to the LSN of its last byte. The caller
+** passes this value to lsmDbLogFlush() once the WRITER lock has been 
+** released to wait until the data has been written to the log file.
+**
+** Data is appended to the current buffer if it is contiguous with the
+** data already there. If it overwrites part of the current buffer (as 
+** happens after a savepoint rollback), the overwritten part is discarded.
+** Otherwise, or if the current buffer has grown to LSM_LOG_BUFFER_SIZE
+** bytes, the current buffer is sealed and the data appended to the other 
+** one. This requires the other buffer to be empty - if it is not, this
+** function waits for or performs the write of its contents. This is the
+** only case in which a writer holding the WRITER lock blocks on log IO.
+**
+** Since all log data is written in the order in which it was appended,
+** data in the log buffers may safely be overwritten by later appends. 
+*/
+int lsmDbLogWrite(lsm_db *pDb, i64 iOff, LsmString *pStr, i64 *piLsn){
+  Database *p = pDb->pDatabase;
+  int rc = LSM_OK;
+
+  if( pStr->n==0 ) return LSM_OK;
+  lsmMutexEnter(pDb->pEnv, p->pLogMutex);
+  while( rc==LSM_OK ){
+    LogBuffer *pFill = &p->aLogBuf[p->iLogFill];
+    i64 iEnd = pFill->iOff + pFill->buf.n;
+
+    if( pFill->buf.n==0 ){
+      pFill->iOff = iOff;
+      rc = lsmStringBinAppend(&pFill->buf, (u8 *)pStr->z, pStr->n);
+      break;
+    }
+    if( iOff>=pFill->iOff && iOff<=iEnd 
+     && (iOff - pFill->iOff)<LSM_LOG_BUFFER_SIZE
+    ){
+      pFill->buf.n = (int)(iOff - pFill->iOff);
+      rc = lsmStringBinAppend(&pFill->buf, (u8 *)pStr->z, pStr->n);
+      break;
+    }
+
+    /* Seal the current buffer. Or, if the other buffer is not yet empty,
+    ** wait for or write its contents first.  */
+    if( p->aLogBuf[!p->iLogFill].buf.n==0 ){
+      pFill->iLsn = p->iLogQueued;
+      p->iLogFill = !p->iLogFill;
+    }else if( p->bLogFlush ){
+      lsmCondWait(pDb->pEnv, p->pLogCond, p->pLogMutex, LSM_GROUP_SLEEP_US);
+    }else{
+      rc = dbLogFlushOne(pDb);
+    }
+  }
+  if( rc==LSM_OK ){
+    p->iLogQueued += pStr->n;
+    *piLsn = p->iLogQueued;
+  }
+  lsmMutexLeave(pDb->pEnv, p->pLogMutex);
+
+  return rc;
+}
+
+/*
+** Wait until all log data up to and including LSN iLsn (a value returned
+** by an earlier call to lsmDbLogWrite()) has been written to the log 
+** file. Or, if iLsn is less than zero, until all data currently in the log
+** buffers has been written. If no other connection is writing a log
+** buffer, the calling connection writes it.
+**
+** Return LSM_OK if successful, or an LSM error code if a write fails.
+*/
+int lsmDbLogFlush(lsm_db *pDb, i64 iLsn){
+  Database *p = pDb->pDatabase;
+  int rc = LSM_OK;
+
+  lsmMutexEnter(pDb->pEnv, p->pLogMutex);
+  if( iLsn<0 ) iLsn = p->iLogQueued;
+  while( rc==LSM_OK && p->iLogWritten<iLsn ){
+    if( p->bLogFlush==0 ){
+      rc = dbLogFlushOne(pDb);
+    }else{
+      lsmCondWait(pDb->pEnv, p->pLogCond, p->pLogMutex, LSM_GROUP_SLEEP_US);
+    }
+  }
+  lsmMutexLeave(pDb->pEnv, p->pLogMutex);
+
+  return rc;
+}
@@ -51,6 +51,7 @@
 **       LSM_INSERT    
 **       LSM_SEPARATOR
 **       LSM_SYSTEMKEY
+**       LSM_VALUEPTR
 **
 **   Immediately following the type byte is a pointer to the smallest key 
 **   in the next file that is larger than the key in the current record. The 
@@ -64,7 +65,57 @@
 **   a varint, is next.
 **
 **   Finally, the blob of data containing the key, and for LSM_INSERT
-**   records, the value as well.
+**   records, the value as well. If the LSM_VALUEPTR flag is set, the value
+**   is a pointer to the actual value in the value log (see lsm_vlog.c).
+**
+** PREFIX COMPRESSION:
+**
+**   If the SEGMENT_PREFIX_FLAG bit is set in the page footer flags field, 
+**   the records that start on the page are stored with prefix compressed 
+**   keys. The cells with indexes that are multiples of 
+**   SEGMENT_RESTART_INTERVAL are "restart points". Each record on such a
+**   page contains an extra varint field following the key size (and value 
+**   size, if present) - the number of leading bytes the record's key 
+**   shares with the key of the nearest restart point at or before it on 
+**   the same page. Only the remaining bytes of the key are stored in the 
+**   record. The shared prefix size of a restart point is always zero, so 
+**   any key on the page may be assembled from at most two records, and the
+**   cell-pointer array in the footer may still be binary searched directly.
+**
+**   Pages written by a connection with LSM_CONFIG_PREFIX_KEYS enabled use
+**   this format. The footer flag means pages of both formats may be mixed
+**   within a single database or segment.
+**
+** BLOOM FILTERS:
+**
+**   When a merge that produces a segment with a b-tree completes, a bloom
+**   filter containing each key in the segment is appended to it. The filter
+**   is built in memory as the keys are written (see struct MergeFilter). It
+**   is split into one or more filter pages, followed by a single filter
+**   header page. Since the header page is always the last page of the 
+**   segment, the filter can be located using only the Segment.iLastPg value
+**   already stored in each checkpoint. Only user keys (not system keys) are
+**   added to filters, and no filter is built for a segment that contains 
+**   user range-delete markers.
+**
+**   Both filter pages and the header page have the SEGMENT_BTREE_FLAG and
+**   SEGMENT_FILTER_FLAG bits set in their footers and zero records, so they
+**   are ignored by code that iterates through the records of a segment.
+**
+**   The first FILTER_HDR_SIZE bytes of the header page contain the following 
+**   values, each stored as a 32-bit big-endian integer:
+**
+**     * Magic number (FILTER_MAGIC).
+**     * Number of bits set for each key.
+**     * Number of bytes of filter data on each filter page.
+**     * Total number of filter pages.
+**     * Number of runs of contiguous filter pages.
+**
+**   Followed by an array of runs, each consisting of the 64-bit page number
+**   of the first page in the run and the 32-bit number of pages in it. Each
+**   key is hashed to a single filter page, and all bits for the key are set
+**   within that page. This way testing a key requires reading only the
+**   header page and one filter page.
 */
 
 #ifndef _LSM_INT_H
@@ -98,6 +149,30 @@
 #define SEGMENT_BTREE_FLAG     0x0001
 #define PGFTR_SKIP_NEXT_FLAG   0x0002
 #define PGFTR_SKIP_THIS_FLAG   0x0004
+#define SEGMENT_FILTER_FLAG    0x0008
+#define SEGMENT_PREFIX_FLAG    0x0010
+
+/*
+** On pages with the SEGMENT_PREFIX_FLAG flag set, every 
+** SEGMENT_RESTART_INTERVAL'th cell is a restart point. See "PREFIX 
+** COMPRESSION" above.
+*/
+#define SEGMENT_RESTART_INTERVAL 16
+
+/*
+** Values used by the bloom filter header page. See "BLOOM FILTERS" above.
+*/
+#define FILTER_MAGIC           0x4C534D46
+#define FILTER_HDR_SIZE        20
+#define FILTER_RUN_SIZE        12
+#define FILTER_MAX_PROBE       30
+
+/*
+** Values for SegmentPtr.eFilter.
+*/
+#define FILTER_UNKNOWN         0
+#define FILTER_MAYBE           1
+#define FILTER_MISS            2
 
 typedef struct SegmentPtr SegmentPtr;
 typedef struct Blob Blob;
@@ -133,10 +208,17 @@ struct SegmentPtr {
   Pgno iPgPtr;                  /* Cascade pointer offset */
   void *pKey; int nKey;         /* Key associated with current record */
   void *pVal; int nVal;         /* Current record value (eType==WRITE only) */
+  int iValOff;                  /* Offset of value data on pPg */
 
   /* Blobs used to allocate buffers for pKey and pVal as required */
   Blob blob1;
   Blob blob2;
+
+  /* Result of testing the bloom filter during an LSM_SEEK_EQ seek */
+  int eFilter;                  /* FILTER_UNKNOWN, FILTER_MAYBE or MISS */
+
+  /* Leaf page found by the last seek (if CURSOR_KEEP_LEAF is set) */
+  Page *pLeaf;
 };
 
 /*
@@ -192,6 +274,12 @@ struct BtreeCursor {
 **   This variable is only used by cursors providing input data for a
 **   new top-level segment. Such cursors only ever iterate forwards, not
 **   backwards.
+**
+** aIov/apIovPg/aIovOff:
+**   The slices returned by the most recent lsmMCursorValueIov() call. If
+**   apIovPg[i] is not NULL, slice i points to offset aIovOff[i] of that
+**   page, and the cursor holds a reference to the page. So that the slice
+**   may be recalculated if the database file is remapped.
 */
 struct MultiCursor {
   lsm_db *pDb;                    /* Connection that owns this cursor */
@@ -201,6 +289,7 @@ struct MultiCursor {
   int eType;                      /* Cache of current key type */
   Blob key;                       /* Cache of current key (or NULL) */
   Blob val;                       /* Cache of current value */
+  Blob vlog;                      /* Value read from the value log */
 
   /* All the component cursors: */
   TreeCursor *apTreeCsr[2];       /* Up to two tree cursors */
@@ -216,8 +305,16 @@ struct MultiCursor {
   /* Used by cursors flushing the in-memory tree only */
   void *pSystemVal;               /* Pointer to buffer to free */
 
+  /* Used by lsmMCursorValueIov() only */
+  int nIov;                       /* Number of slices in aIov[] */
+  int nIovAlloc;                  /* Allocated size of the three arrays */
+  lsm_iovec *aIov;                /* Slices of current value */
+  Page **apIovPg;                 /* Page each slice points to (or NULL) */
+  int *aIovOff;                   /* Offset of each slice within its page */
+
   /* Used by worker cursors only */
   Pgno *pPrevMergePtr;
+  i64 nVlogDead;                  /* Bytes of value log values discarded */
 };
 
 /*
@@ -262,6 +359,15 @@ struct MultiCursor {
 #define CURSOR_PREV_OK          0x00000040
 #define CURSOR_READ_SEPARATORS  0x00000080
 #define CURSOR_SEEK_EQ          0x00000100
+#define CURSOR_KEEP_LEAF        0x00000200
+
+/*
+** Age assigned to the level created by lsm_bulk_load(). Such a level is
+** equivalent to the output of many rounds of merging, so it is given an
+** age high enough that it is not selected for merging along with the much
+** smaller levels subsequently flushed on top of it.
+*/
+#define SORTED_BULK_LEVEL_AGE 0x4000
 
 typedef struct MergeWorker MergeWorker;
 typedef struct Hierarchy Hierarchy;
@@ -282,6 +388,12 @@ struct Hierarchy {
 **   b-tree hierarchy. aSave[1] is used to save the page number of the
 **   page containing the indirect key most recently written to the b-tree.
 **   see mergeWorkerPushHierarchy() for details.
+**
+** pHierLog:
+**   If this is not NULL, keys are not added to the b-tree hierarchy as the
+**   segment is written. Instead, each key that would have been added is
+**   appended to this buffer, to be added to a b-tree later on. This is 
+**   used by split merges - see sortedMergeRange() for details.
 */
 struct MergeWorker {
   lsm_db *pDb;                    /* Database handle */
@@ -291,6 +403,7 @@ struct MergeWorker {
   Hierarchy hier;                 /* B-tree hierarchy under construction */
   Page *pPage;                    /* Current output page */
   int nWork;                      /* Number of calls to mergeWorkerNextPage() */
+  i64 nVlogDead;                  /* Bytes of value log values discarded */
   Pgno *aGobble;                  /* Gobble point for each input segment */
 
   Pgno iIndirect;
@@ -298,6 +411,7 @@ struct MergeWorker {
     Pgno iPgno;
     int bStore;
   } aSave[2];
+  LsmString *pHierLog;            /* Log of b-tree keys (or NULL) */
 };
 
 #ifdef LSM_DEBUG_EXPENSIVE
@@ -397,6 +511,46 @@ static void sortedBlobFree(Blob *pBlob){
   memset(pBlob, 0, sizeof(Blob));
 }
 
+/*
+** Page *ppPg is a page of segment pSeg. Release the reference to it held
+** by the caller and replace it with a reference to the next page in the
+** segment that is not a b-tree page. Set *paData to point to the data of
+** the new page and *piEnd to the offset of the end of its record area.
+*/
+static int sortedNextDataPage(
+  Segment *pSeg,                  /* Segment to read from */
+  Page **ppPg,                    /* IN/OUT: Current page */
+  u8 **paData,                    /* OUT: Data of new page */
+  int *piEnd                      /* OUT: End of record data on new page */
+){
+  Page *pPg = *ppPg;
+  u8 *aData = 0;
+  int nData = 0;
+  int flags;
+  int rc;
+
+  do {
+    Page *pNext;
+    rc = lsmFsDbPageNext(pSeg, pPg, 1, &pNext);
+    if( rc==LSM_OK && pNext==0 ){
+      rc = LSM_CORRUPT_BKPT;
+    }
+    if( rc ) break;
+    lsmFsPageRelease(pPg);
+    pPg = pNext;
+    aData = fsPageData(pPg, &nData);
+    flags = lsmGetU16(&aData[SEGMENT_FLAGS_OFFSET(nData)]);
+  }while( flags&SEGMENT_BTREE_FLAG );
+
+  if( rc==LSM_OK ){
+    *paData = aData;
+    *piEnd = SEGMENT_EOF(nData, lsmGetU16(&aData[nData-2]));
+    assert( *piEnd>0 && *piEnd<nData );
+  }
+  *ppPg = pPg;
+  return rc;
+}
+
 static int sortedReadData(
   Segment *pSeg,
   Page *pPg,
@@ -434,9 +588,6 @@ static int sortedReadData(
     lsmFsPageRef(pPg);
 
     while( rc==LSM_OK ){
-      Page *pNext;
-      int flags;
-
       /* Copy data from pPg into the output buffer. */
       int nCopy = LSM_MIN(nRem, iEnd-i);
       if( nCopy>0 ){
@@ -450,21 +601,7 @@ static int sortedReadData(
       i -= iEnd;
 
       /* Grab the next page in the segment */
-
-      do {
-        rc = lsmFsDbPageNext(pSeg, pPg, 1, &pNext);
-        if( rc==LSM_OK && pNext==0 ){
-          rc = LSM_CORRUPT_BKPT;
-        }
-        if( rc ) break;
-        lsmFsPageRelease(pPg);
-        pPg = pNext;
-        aData = fsPageData(pPg, &nData);
-        flags = lsmGetU16(&aData[SEGMENT_FLAGS_OFFSET(nData)]);
-      }while( flags&SEGMENT_BTREE_FLAG );
-
-      iEnd = SEGMENT_EOF(nData, lsmGetU16(&aData[nData-2]));
-      assert( iEnd>0 && iEnd<nData );
+      rc = sortedNextDataPage(pSeg, &pPg, &aData, &iEnd);
     }
 
     lsmFsPageRelease(pPg);
@@ -512,6 +649,94 @@ static Pgno pageGetRecordPtr(u8 *aData, int nData, int iCell){
   return iRet;
 }
 
+/*
+** Page aData/nData has the SEGMENT_PREFIX_FLAG flag set. Return a pointer
+** to the key stored in the restart cell that cell iCell is encoded 
+** against and set *pnKey to its size in bytes. The restart cell always 
+** precedes iCell on the same page, so its key is never split across pages.
+*/
+static u8 *pageGetRestartKey(u8 *aData, int nData, int iCell, int *pnKey){
+  u8 *aCell;
+  int eType;
+  Pgno iDummy;
+  int nDummy;
+
+  aCell = pageGetCell(aData, nData, iCell - (iCell % SEGMENT_RESTART_INTERVAL));
+  eType = *aCell++;
+  aCell += lsmVarintGet64(aCell, &iDummy);
+  aCell += lsmVarintGet32(aCell, pnKey);
+  if( rtIsWrite(eType) ) aCell += lsmVarintGet32(aCell, &nDummy);
+  aCell += lsmVarintGet32(aCell, &nDummy);
+  assert( nDummy==0 );
+  return aCell;
+}
+
+/*
+** Read the key belonging to cell iCell of page pPg, followed by nExtra
+** bytes of data (the value, if any). Offset *piOff is the offset of the
+** key data within the page (the byte following the record header fields
+** that precede it). Before returning, *piOff is set to the offset of the 
+** first byte following the key, as understood by sortedReadData().
+**
+** If the page has the SEGMENT_PREFIX_FLAG flag set, only the part of the
+** key that follows the prefix it shares with its restart key is stored 
+** in the cell, preceded by a varint containing the size of the shared 
+** prefix. In this case the complete key is assembled in pBlob.
+*/
+static int sortedReadKey(
+  Segment *pSeg,                  /* Segment pPg belongs to */
+  Page *pPg,                      /* Page to read from */
+  int iCell,                      /* Index of cell on page to read */
+  int *piOff,                     /* IN/OUT: Offset of key data in page */
+  int nKey,                       /* Size of key in bytes */
+  int nExtra,                     /* Bytes of data to read following key */
+  void **ppKey,                   /* OUT: Pointer to key (and extra data) */
+  Blob *pBlob                     /* If required, use this for dynamic memory */
+){
+  int rc;
+  int iOff = *piOff;
+  int nPrefix = 0;
+  u8 *aData;
+  int nData;
+
+  aData = fsPageData(pPg, &nData);
+  if( pageGetFlags(aData, nData) & SEGMENT_PREFIX_FLAG ){
+    iOff += lsmVarintGet32(&aData[iOff], &nPrefix);
+  }
+
+  if( nPrefix==0 ){
+    rc = sortedReadData(pSeg, pPg, iOff, nKey+nExtra, ppKey, pBlob);
+  }else if( nPrefix>nKey || (iCell % SEGMENT_RESTART_INTERVAL)==0 ){
+    rc = LSM_CORRUPT_BKPT;
+  }else{
+    int nSuffix = nKey + nExtra - nPrefix;
+    void *pSuffix = 0;
+    rc = sortedReadData(pSeg, pPg, iOff, nSuffix, &pSuffix, pBlob);
+    if( rc==LSM_OK ){
+      int bInBlob = (pSuffix==pBlob->pData);
+      u8 *aRestart;
+      int nRestart;
+      rc = sortedBlobGrow(lsmPageEnv(pPg), pBlob, nKey+nExtra);
+      if( rc==LSM_OK ){
+        u8 *aOut = (u8 *)pBlob->pData;
+        if( bInBlob ){
+          memmove(&aOut[nPrefix], aOut, nSuffix);
+        }else{
+          memcpy(&aOut[nPrefix], pSuffix, nSuffix);
+        }
+        aRestart = pageGetRestartKey(aData, nData, iCell, &nRestart);
+        assert( nPrefix<=nRestart );
+        memcpy(aOut, aRestart, nPrefix);
+        pBlob->nData = nKey+nExtra;
+        *ppKey = (void *)aOut;
+      }
+    }
+  }
+
+  *piOff = iOff + nKey - nPrefix;
+  return rc;
+}
+
 static u8 *pageGetKey(
   Segment *pSeg,                  /* Segment pPg belongs to */
   Page *pPg,                      /* Page to read from */
@@ -525,6 +750,7 @@ static u8 *pageGetKey(
   int eType;
   u8 *aData;
   int nData;
+  int iOff;
 
   aData = fsPageData(pPg, &nData);
 
@@ -540,7 +766,8 @@ static u8 *pageGetKey(
   }
   *piTopic = rtTopic(eType);
 
-  sortedReadData(pSeg, pPg, pKey-aData, *pnKey, (void **)&pKey, pBlob);
+  iOff = pKey-aData;
+  sortedReadKey(pSeg, pPg, iCell, &iOff, *pnKey, 0, (void **)&pKey, pBlob);
   return pKey;
 }
 
@@ -1071,13 +1298,18 @@ static int segmentPtrLoadCell(
     }
     assert( pPtr->nKey>=0 );
 
-    rc = segmentPtrReadData(
-        pPtr, iOff, pPtr->nKey, &pPtr->pKey, &pPtr->blob1
+    rc = sortedReadKey(pPtr->pSeg, pPtr->pPg, pPtr->iCell, 
+        &iOff, pPtr->nKey, 0, &pPtr->pKey, &pPtr->blob1
     );
     if( rc==LSM_OK && rtIsWrite(pPtr->eType) ){
-      rc = segmentPtrReadData(
-          pPtr, iOff+pPtr->nKey, pPtr->nVal, &pPtr->pVal, &pPtr->blob2
-      );
+      /* If the value is not entirely stored on this page, defer reading 
+      ** it until it is actually required. See segmentPtrLoadVal().  */
+      pPtr->iValOff = iOff;
+      if( iOff+pPtr->nVal<=SEGMENT_EOF(nPgsz, pPtr->nCell) ){
+        pPtr->pVal = &aData[iOff];
+      }else{
+        pPtr->pVal = 0;
+      }
     }else{
       pPtr->nVal = 0;
       pPtr->pVal = 0;
@@ -1087,6 +1319,25 @@ static int segmentPtrLoadCell(
   return rc;
 }
 
+/*
+** If the value belonging to the current record of pPtr spans more than
+** one page and has not yet been loaded into SegmentPtr.blob2, load it now.
+*/
+static int segmentPtrLoadVal(SegmentPtr *pPtr){
+  int rc = LSM_OK;
+  if( pPtr->pVal==0 && pPtr->nVal>0 ){
+    /* Reading the value may extend the mapping of the database file, in
+    ** which case lsmSortedRemap() reloads the current cell and clears
+    ** pPtr->pVal. So set pPtr->pVal only once all pages have been read.  */
+    void *pVal = 0;
+    rc = segmentPtrReadData(
+        pPtr, pPtr->iValOff, pPtr->nVal, &pVal, &pPtr->blob2
+    );
+    if( rc==LSM_OK ) pPtr->pVal = pVal;
+  }
+  return rc;
+}
+
 
 static Segment *sortedSplitkeySegment(Level *pLevel){
   Merge *pMerge = pLevel->pMerge;
@@ -1157,6 +1408,7 @@ static void segmentPtrReset(SegmentPtr *pPtr){
   pPtr->nKey = 0;
   pPtr->pVal = 0;
   pPtr->nVal = 0;
+  pPtr->iValOff = 0;
   pPtr->eType = 0;
   pPtr->iCell = 0;
   sortedBlobFree(&pPtr->blob1);
@@ -1296,6 +1548,7 @@ static int segmentPtrEnd(MultiCursor *pCsr, SegmentPtr *pPtr, int bLast){
     pPtr->nKey = pLvl->nSplitKey;
     pPtr->pVal = 0;
     pPtr->nVal = 0;
+    pPtr->iValOff = 0;
   }
 #endif
 
@@ -1468,8 +1721,11 @@ static int segmentPtrSearchOversized(
     if( pNext==0 ) break;
     segmentPtrSetPage(pPtr, pNext);
 
-    /* This should probably be an LSM_CORRUPT error. */
-    assert( rc!=LSM_OK || (pPtr->flags & PGFTR_SKIP_THIS_FLAG) );
+    /* The page loaded usually has the SKIP_THIS flag set. Except that in
+    ** a segment written by a split merge (see sortedMergeStitch()), the 
+    ** first page of each key range does not, even if the last page of the
+    ** previous key range has SKIP_NEXT set. Either way, the search
+    ** continues from the new page.  */
   }
 
   return rc;
@@ -1531,6 +1787,24 @@ static int sortedRhsFirst(MultiCursor *pCsr, Level *pLvl, SegmentPtr *pPtr){
   return rc;
 }
 
+/*
+** Return true if the FC pointer obtained by seeking within segment-pointer 
+** pPtr will not be used. This is the case if the next segment searched
+** has its own b-tree, or if there is no next segment.
+*/
+static int segmentPtrFcUnused(SegmentPtr *pPtr){
+  Level *pLvl = pPtr->pLevel;
+  Level *pNext = pLvl->pNext;
+
+  if( pPtr->pSeg==&pLvl->lhs || pPtr->pSeg==&pLvl->aRhs[pLvl->nRight-1] ){
+    return (pNext==0 
+        || (pNext->nRight==0 && pNext->lhs.iRoot)
+        || (pNext->nRight!=0 && pNext->aRhs[0].iRoot)
+    );
+  }
+  return (pPtr[1].pSeg->iRoot!=0);
+}
+
 
 /*
 ** This function is called as part of a SEEK_GE op on a multi-cursor if the 
@@ -1566,25 +1840,14 @@ static int segmentPtrFwdPointer(
   SegmentPtr *pPtr,               /* Segment-pointer to extract FC ptr from */
   Pgno *piPtr                     /* OUT: FC pointer value */
 ){
-  Level *pLvl = pPtr->pLevel;
-  Level *pNext = pLvl->pNext;
   Page *pPg = pPtr->pPg;
   int rc;
   int bFound;
   Pgno iOut = 0;
 
-  if( pPtr->pSeg==&pLvl->lhs || pPtr->pSeg==&pLvl->aRhs[pLvl->nRight-1] ){
-    if( pNext==0 
-        || (pNext->nRight==0 && pNext->lhs.iRoot)
-        || (pNext->nRight!=0 && pNext->aRhs[0].iRoot)
-      ){
-      /* Do nothing. The pointer will not be used anyway. */
-      return LSM_OK;
-    }
-  }else{
-    if( pPtr[1].pSeg->iRoot ){
-      return LSM_OK;
-    }
+  if( segmentPtrFcUnused(pPtr) ){
+    /* Do nothing. The pointer will not be used anyway. */
+    return LSM_OK;
   }
 
   /* Search for a pointer within the current segment. */
@@ -1711,7 +1974,13 @@ static int segmentPtrSeek(
               *pbStop = 1;
               pCsr->eType = pPtr->eType;
               rc = sortedBlobSet(pEnv, &pCsr->key, pPtr->pKey, pPtr->nKey);
-              if( rc==LSM_OK ){
+              if( rc==LSM_OK && pPtr->pVal==0 && pPtr->nVal>0 ){
+                /* Read a value that spans pages straight into pCsr->val */
+                void *pDummy;
+                rc = segmentPtrReadData(
+                    pPtr, pPtr->iValOff, pPtr->nVal, &pDummy, &pCsr->val
+                );
+              }else if( rc==LSM_OK ){
                 rc = sortedBlobSet(pEnv, &pCsr->val, pPtr->pVal, pPtr->nVal);
               }
               pCsr->flags |= CURSOR_SEEK_EQ;
@@ -1789,6 +2058,7 @@ static int seekInBtree(
       aData = fsPageData(pPg, &nData);
       flags = pageGetFlags(aData, nData);
       if( (flags & SEGMENT_BTREE_FLAG)==0 ) break;
+      lsmFsPageProtect(pPg);
 
       iPg = pageGetPtr(aData, nData);
       nRec = pageGetNRec(aData, nData);
@@ -1837,109 +2107,743 @@ static int seekInBtree(
   return rc;
 }
 
-static int seekInSegment(
-  MultiCursor *pCsr, 
-  SegmentPtr *pPtr,
-  int iTopic,
-  void *pKey, int nKey,
-  int iPg,                        /* Page to search */
-  int eSeek,                      /* Search bias - see above */
-  int *piPtr,                     /* OUT: FC pointer */
-  int *pbStop                     /* OUT: Stop search flag */
-){
-  int iPtr = iPg;
-  int rc = LSM_OK;
+/*
+** Mix the bits of 32-bit value h. This is the finalizer used by the 
+** MurmurHash3 hash function.
+*/
+static u32 sortedFilterMix(u32 h){
+  h ^= h >> 16;
+  h *= 0x85EBCA6B;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35;
+  h ^= h >> 16;
+  return h;
+}
 
-  if( pPtr->pSeg->iRoot ){
-    Page *pPg;
-    assert( pPtr->pSeg->iRoot!=0 );
-    rc = seekInBtree(pCsr, pPtr->pSeg, iTopic, pKey, nKey, 0, &pPg);
-    if( rc==LSM_OK ) segmentPtrSetPage(pPtr, pPg);
-  }else{
-    if( iPtr==0 ){
-      iPtr = pPtr->pSeg->iFirst;
-    }
-    if( rc==LSM_OK ){
-      rc = segmentPtrLoadPage(pCsr->pDb->pFS, pPtr, iPtr);
-    }
+/*
+** Return the bloom filter hash value for the key with topic iTopic 
+** and contents aKey/nKey.
+*/
+static u32 sortedFilterHash(int iTopic, u8 *aKey, int nKey){
+  u32 h = 0x811C9DC5 ^ (u32)iTopic;
+  int i;
+  for(i=0; i<nKey; i++){
+    h = (h * 0x01000193) ^ aKey[i];
   }
+  return sortedFilterMix(h);
+}
 
-  if( rc==LSM_OK ){
-    rc = segmentPtrSeek(pCsr, pPtr, iTopic, pKey, nKey, eSeek, piPtr, pbStop);
+/*
+** Return the index of the filter page (between 0 and nPg-1) that key hash 
+** h is stored on.
+*/
+static u32 sortedFilterPage(u32 h, u32 nPg){
+  return sortedFilterMix(h ^ 0x9E3779B9) % nPg;
+}
+
+/*
+** Set (if bSet is true) or test (if bSet is false) the nProbe bits that
+** correspond to key hash h within the nByte byte filter page aBit[]. When
+** testing, return true if all bits are set, or false otherwise.
+*/
+static int sortedFilterBits(u8 *aBit, u32 nByte, int nProbe, u32 h, int bSet){
+  u32 nBit = nByte * 8;
+  u32 delta = (h >> 17) | (h << 15);
+  int i;
+  for(i=0; i<nProbe; i++){
+    u32 iBit = h % nBit;
+    if( bSet ){
+      aBit[iBit/8] |= (u8)(1 << (iBit%8));
+    }else if( (aBit[iBit/8] & (1 << (iBit%8)))==0 ){
+      return 0;
+    }
+    h += delta;
   }
-  return rc;
+  return 1;
 }
 
 /*
-** Seek each segment pointer in the array of (pLvl->nRight+1) at aPtr[].
+** A bloom filter being built by a merge. Keys are added to the filter as
+** they are written to the output segment (see mergeWorkerWrite()), and the
+** filter is appended to the segment once the merge has finished (see
+** sortedFilterFinish()).
 **
-** pbStop:
-**   This parameter is only significant if parameter eSeek is set to
-**   LSM_SEEK_EQ. In this case, it is set to true before returning if
-**   the seek operation is finished. This can happen in two ways:
-**   
-**     a) A key matching (pKey/nKey) is found, or
-**     b) A point-delete or range-delete deleting the key is found.
+** The number of keys in the output is not known until the merge has 
+** finished. So the filter is sized for twice an estimate of the number of
+** keys in the input (see sortedFilterEstimate()), rounded up to a power-of-
+** two number of filter pages. When the merge has finished, it is folded 
+** down to the smallest power-of-two number of pages large enough for the
+** number of keys actually written, by OR-ing page i into page (i % nPg).
+** Since the page each key is stored on is (hash % nPg), the result is the
+** filter that would have been built had the smaller number of pages been
+** used from the start.
 **
-**   In case (a), the multi-cursor CURSOR_SEEK_EQ flag is set and the pCsr->key
-**   and pCsr->val blobs populated before returning.
+** A bulk load (see lsm_bulk_load()) has no input from which to estimate 
+** the number of keys. So instead, the hash of each key is stored in 
+** aHash[] until the load has finished.
+**
+** The Merge object is reloaded from the checkpoint each time the worker
+** snapshot is. So between calls to lsm_work() etc., the filter of an 
+** incomplete merge is stored in a list attached to the Database object
+** (see sortedFilterSave()), along with the size and last page of the 
+** output segment at that point. The saved filter is only used if the 
+** output segment has not changed since. Otherwise, if the merge has been 
+** continued by some other process or the database has been closed and 
+** reopened, no filter is built for the segment.
+**
+** If aBit and aHash are both NULL, no filter is being built. Either 
+** because filters are disabled, the saved filter was not available, or a 
+** range-delete has been written to the segment.
 */
-static int seekInLevel(
-  MultiCursor *pCsr,              /* Sorted cursor object to seek */
-  SegmentPtr *aPtr,               /* Pointer to array of (nRhs+1) SPs */
-  int eSeek,                      /* Search bias - see above */
-  int iTopic,                     /* Key topic to search for */
-  void *pKey, int nKey,           /* Key to search for */
-  Pgno *piPgno,                   /* IN/OUT: fraction cascade pointer (or 0) */
-  int *pbStop                     /* OUT: See above */
-){
-  Level *pLvl = aPtr[0].pLevel;   /* Level to seek within */
-  int rc = LSM_OK;                /* Return code */
-  int iOut = 0;                   /* Pointer to return to caller */
-  int res = -1;                   /* Result of xCmp(pKey, split) */
-  int nRhs = pLvl->nRight;        /* Number of right-hand-side segments */
-  int bStop = 0;
+struct MergeFilter {
+  int nByte;                      /* Bytes of filter data on each page */
+  int nPg;                        /* Number of filter pages in aBit[] */
+  int nBitPerKey;                 /* LSM_CONFIG_BLOOM_BITS value */
+  i64 nKey;                       /* Number of keys added to filter */
+  u8 *aBit;                       /* Filter data, nPg*nByte bytes */
+  u32 *aHash;                     /* Hash of each key (bulk load only) */
+  int nHashAlloc;                 /* Allocated size of aHash[] */
+  int bSaved;                     /* True if in Database.pMergeFilter list */
+  Pgno iFirst;                    /* First page of output when saved */
+  Pgno iLastPg;                   /* Last page of output when saved */
+  Pgno nSize;                     /* Size of output in pages when saved */
+  MergeFilter *pNext;             /* Next in Database.pMergeFilter list */
+};
 
-  /* If this is a composite level (one currently undergoing an incremental
-  ** merge), figure out if the search key is larger or smaller than the
-  ** levels split-key.  */
-  if( nRhs ){
-    res = sortedKeyCompare(pCsr->pDb->xCmp, iTopic, pKey, nKey, 
-        pLvl->iSplitTopic, pLvl->pSplitKey, pLvl->nSplitKey
-    );
+/*
+** Return the number of bits set for each key in a filter built with 
+** nBitPerKey bits per key.
+*/
+static int sortedFilterProbe(int nBitPerKey){
+  int nProbe = (nBitPerKey * 69) / 100;
+  return LSM_MAX(1, LSM_MIN(FILTER_MAX_PROBE, nProbe));
+}
+
+/*
+** Set *pnByte to the number of bytes of filter data stored on each filter 
+** page and *pnRunMax to the maximum number of runs that may be described 
+** by a filter header page. Return the maximum number of filter pages, 
+** which is always a power of two.
+*/
+static int sortedFilterGeometry(lsm_db *pDb, int *pnByte, int *pnRunMax){
+  FileSystem *pFS = pDb->pFS;
+  int nPgsz = lsmFsPageSize(pFS);
+  int nData;                      /* Usable size of each page */
+  int nRunMax;                    /* Max runs that fit on header page */
+  int nPgMax;                     /* Max filter pages */
+  int nRet = 1;
+
+  /* In an uncompressed database, the first and last page of each block
+  ** are 4 bytes smaller than the others. Use the smaller size for all
+  ** filter pages.  */
+  nData = nPgsz - (pDb->compress.xCompress ? 0 : 4);
+  *pnByte = SEGMENT_POINTER_OFFSET(nData);
+  nRunMax = (*pnByte - FILTER_HDR_SIZE) / FILTER_RUN_SIZE;
+  if( pnRunMax ) *pnRunMax = nRunMax;
+
+  /* Limit the filter to the number of pages that can be described by a 
+  ** single header page. In an uncompressed database, every run except
+  ** the first and last covers the whole of a block.  */
+  if( pDb->compress.xCompress ){
+    nPgMax = nRunMax;
+  }else{
+    nPgMax = (nRunMax-2) * LSM_MAX(1, (lsmFsBlockSize(pFS) / nPgsz) / 2);
   }
+  while( nRet*2<=nPgMax ) nRet = nRet*2;
+  return nRet;
+}
 
-  /* If (res<0), then key pKey/nKey is smaller than the split-key (or this
-  ** is not a composite level and there is no split-key). Search the 
-  ** left-hand-side of the level in this case.  */
-  if( res<0 ){
-    int iPtr = 0;
-    if( nRhs==0 ) iPtr = *piPgno;
+/*
+** Return the smallest power of two between 1 and nPgMax (inclusive) 
+** number of filter pages, each containing nByte bytes of filter data, 
+** that provide at least nBit bits. Or nPgMax if there is no such value.
+*/
+static int sortedFilterPages(i64 nBit, int nByte, int nPgMax){
+  int nPg = 1;
+  while( nPg<nPgMax && (i64)nPg*nByte*8<nBit ) nPg = nPg*2;
+  return nPg;
+}
 
-    rc = seekInSegment(
-        pCsr, &aPtr[0], iTopic, pKey, nKey, iPtr, eSeek, &iOut, &bStop
-    );
-    if( rc==LSM_OK && nRhs>0 && eSeek==LSM_SEEK_GE && aPtr[0].pPg==0 ){
-      res = 0;
+/*
+** Return an estimate of the number of keys a merge that reads from 
+** multi-cursor pCsr will write. The cursor must be positioned at the start
+** of its input.
+**
+** The number of keys in each input segment is estimated from its size and
+** the number of keys on its first page. Each entry in an in-memory tree 
+** uses at least 16 bytes (a TreeKey and a node slot), so the size of a 
+** tree divided by 16 is an upper bound on the number of keys in it.
+*/
+static i64 sortedFilterEstimate(MultiCursor *pCsr){
+  TreeHeader *pHdr = &pCsr->pDb->treehdr;
+  i64 nKey = 0;
+  int i;
+  for(i=0; i<pCsr->nPtr; i++){
+    SegmentPtr *pPtr = &pCsr->aPtr[i];
+    nKey += (i64)pPtr->pSeg->nSize * LSM_MAX(1, pPtr->nCell);
+  }
+  if( pCsr->apTreeCsr[0] ) nKey += pHdr->root.nByte / 16;
+  if( pCsr->apTreeCsr[1] ) nKey += pHdr->oldroot.nByte / 16;
+  return nKey;
+}
+
+/*
+** Allocate a new MergeFilter object sized for nKeyEst keys. Or, if nKeyEst
+** is less than zero, one that stores the hash of each key in aHash[].
+*/
+static MergeFilter *sortedFilterNew(lsm_db *pDb, i64 nKeyEst, int *pRc){
+  MergeFilter *p;
+  p = (MergeFilter *)lsmMallocZeroRc(pDb->pEnv, sizeof(MergeFilter), pRc);
+  if( p && pDb->nBloomBits>0 ){
+    int nPgMax = sortedFilterGeometry(pDb, &p->nByte, 0);
+    p->nBitPerKey = pDb->nBloomBits;
+    if( nKeyEst<0 ){
+      p->nHashAlloc = 1024;
+      p->aHash = (u32 *)lsmMallocRc(pDb->pEnv, 1024*sizeof(u32), pRc);
+    }else{
+      i64 nBit = nKeyEst * 2 * p->nBitPerKey;
+      p->nPg = sortedFilterPages(nBit, p->nByte, nPgMax);
+      p->aBit = (u8 *)lsmMallocZeroRc(pDb->pEnv, p->nPg*p->nByte, pRc);
     }
   }
-  
-  if( res>=0 ){
-    int bHit = 0;                 /* True if at least one rhs is not EOF */
-    int iPtr = *piPgno;
-    int i;
-    for(i=1; rc==LSM_OK && i<=nRhs && bStop==0; i++){
-      SegmentPtr *pPtr = &aPtr[i];
-      iOut = 0;
-      rc = seekInSegment(
-          pCsr, pPtr, iTopic, pKey, nKey, iPtr, eSeek, &iOut, &bStop
-      );
-      iPtr = iOut;
+  return p;
+}
 
-      /* If the segment-pointer has settled on a key that is smaller than
-      ** the splitkey, invalidate the segment-pointer.  */
-      if( pPtr->pPg ){
-        res = sortedKeyCompare(pCsr->pDb->xCmp, 
+/*
+** Stop building filter p. No filter is built for the segment.
+*/
+static void sortedFilterDiscard(lsm_env *pEnv, MergeFilter *p){
+  lsmFree(pEnv, p->aBit);
+  lsmFree(pEnv, p->aHash);
+  p->aBit = 0;
+  p->aHash = 0;
+}
+
+/*
+** Free filter p, unless it is stored in the Database.pMergeFilter list.
+*/
+static void sortedFilterFree(lsm_env *pEnv, MergeFilter *p){
+  if( p && p->bSaved==0 ){
+    sortedFilterDiscard(pEnv, p);
+    lsmFree(pEnv, p);
+  }
+}
+
+/*
+** Free the list of filters saved by incomplete merges (see 
+** sortedFilterSave()). This is called when the Database object is freed.
+*/
+void lsmSortedFreeMergeFilters(lsm_env *pEnv, MergeFilter *pList){
+  while( pList ){
+    MergeFilter *pNext = pList->pNext;
+    pList->bSaved = 0;
+    sortedFilterFree(pEnv, pList);
+    pList = pNext;
+  }
+}
+
+/*
+** A record of type eType with key pKey/nKey has just been written to the
+** output of a merge building filter p (which may be NULL). Add the key to 
+** the filter if required.
+*/
+static void sortedFilterAdd(
+  lsm_env *pEnv,                  /* Environment (for malloc) */
+  MergeFilter *p,                 /* Filter to add key to (or NULL) */
+  int eType,                      /* Record type */
+  void *pKey, int nKey,           /* Key */
+  int *pRc                        /* IN/OUT: Error code */
+){
+  if( p==0 || (p->aBit==0 && p->aHash==0) ) return;
+
+  /* Only user keys (not system keys or separators) are added to filters.
+  ** No filter is built for a segment containing range-deletes, as it may
+  ** need to be searched even if it does not contain the key itself.  */
+  if( rtTopic(eType) || rtIsSeparator(eType) ) return;
+  if( eType & (LSM_START_DELETE|LSM_END_DELETE) ){
+    sortedFilterDiscard(pEnv, p);
+    return;
+  }
+
+  if( p->aHash ){
+    if( p->nKey==p->nHashAlloc ){
+      p->nHashAlloc = p->nHashAlloc*2;
+      p->aHash = (u32 *)lsmReallocOrFreeRc(
+          pEnv, p->aHash, p->nHashAlloc*sizeof(u32), pRc
+      );
+      if( p->aHash==0 ) return;
+    }
+    p->aHash[p->nKey] = sortedFilterHash(0, (u8 *)pKey, nKey);
+  }else{
+    u32 h = sortedFilterHash(0, (u8 *)pKey, nKey);
+    u8 *aPgBit = &p->aBit[sortedFilterPage(h, (u32)p->nPg) * p->nByte];
+    sortedFilterBits(aPgBit, (u32)p->nByte, 
+        sortedFilterProbe(p->nBitPerKey), h, 1
+    );
+  }
+  p->nKey++;
+}
+
+/*
+** Each connection caches the contents of recently used bloom filter header
+** pages, so that testing a filter usually requires reading just a single
+** filter page. The cache is a direct-mapped hash table keyed by the page
+** number of the header page (the last page of the segment). Since the 
+** contents of a segment may not change while it is part of a snapshot, and
+** a segment is identified by its last page within a snapshot, the cache is
+** valid until the client snapshot changes. At that point it is cleared.
+**
+** An entry with nPg==0 indicates that the corresponding segment has no 
+** bloom filter.
+*/
+#define FILTER_CACHE_SIZE 64
+
+typedef struct FilterEntry FilterEntry;
+struct FilterEntry {
+  Pgno iLastPg;                   /* Last page of segment (header page) */
+  int nProbe;                     /* Number of bits set for each key */
+  u32 nByte;                      /* Bytes of filter data on each page */
+  u32 nPg;                        /* Number of filter pages (0 == none) */
+  u32 nRun;                       /* Number of runs in aRun[] */
+  u8 *aRun;                       /* Run array copied from header page */
+};
+
+struct FilterCache {
+  i64 iSnapshot;                  /* Id of snapshot entries are valid for */
+  FilterEntry *apEntry[FILTER_CACHE_SIZE];
+};
+
+/*
+** Free the bloom filter cache belonging to connection pDb, if any.
+*/
+void lsmSortedFreeFilterCache(lsm_db *pDb){
+  FilterCache *p = pDb->pFilterCache;
+  if( p ){
+    int i;
+    for(i=0; i<FILTER_CACHE_SIZE; i++){
+      lsmFree(pDb->pEnv, p->apEntry[i]);
+    }
+    lsmFree(pDb->pEnv, p);
+    pDb->pFilterCache = 0;
+  }
+}
+
+/*
+** Read the bloom filter header page for segment pSeg and return a new 
+** FilterEntry object describing it via *ppEntry.
+*/
+static int sortedFilterEntryLoad(
+  lsm_db *pDb,                    /* Database handle */
+  Segment *pSeg,                  /* Segment to load filter header for */
+  FilterEntry **ppEntry           /* OUT: New FilterEntry object */
+){
+  FilterEntry *pEntry = 0;
+  Page *pHdr = 0;
+  int rc;
+
+  rc = lsmFsDbPageLast(pDb->pFS, pSeg, &pHdr);
+  if( rc==LSM_OK ){
+    int nData;
+    u8 *aData = fsPageData(pHdr, &nData);
+    int nProbe = 0;
+    u32 nByte = 0;
+    u32 nPg = 0;
+    u32 nRun = 0;
+
+    if( (pageGetFlags(aData, nData) & SEGMENT_FILTER_FLAG)
+     && lsmGetU32(aData)==FILTER_MAGIC
+    ){
+      nProbe = (int)lsmGetU32(&aData[4]);
+      nByte = lsmGetU32(&aData[8]);
+      nPg = lsmGetU32(&aData[12]);
+      nRun = lsmGetU32(&aData[16]);
+      if( nPg==0 || nByte==0 || nProbe<1 || nProbe>FILTER_MAX_PROBE
+       || nRun==0
+       || nRun > (SEGMENT_POINTER_OFFSET(nData)-FILTER_HDR_SIZE)/FILTER_RUN_SIZE
+      ){
+        rc = LSM_CORRUPT_BKPT;
+      }
+    }
+
+    if( rc==LSM_OK ){
+      int nRunByte = nPg ? nRun*FILTER_RUN_SIZE : 0;
+      pEntry = (FilterEntry *)lsmMallocZeroRc(
+          pDb->pEnv, sizeof(FilterEntry) + nRunByte, &rc
+      );
+      if( pEntry ){
+        pEntry->iLastPg = pSeg->iLastPg;
+        pEntry->nProbe = nProbe;
+        pEntry->nByte = nByte;
+        pEntry->nPg = nPg;
+        pEntry->nRun = nRun;
+        pEntry->aRun = (u8 *)&pEntry[1];
+        memcpy(pEntry->aRun, &aData[FILTER_HDR_SIZE], nRunByte);
+      }
+    }
+    lsmFsPageRelease(pHdr);
+  }
+
+  *ppEntry = pEntry;
+  return rc;
+}
+
+/*
+** Return the FilterEntry object for segment pSeg, loading it into the 
+** filter cache of connection pDb if necessary.
+*/
+static int sortedFilterEntry(
+  lsm_db *pDb,                    /* Database handle */
+  Segment *pSeg,                  /* Segment to find filter header for */
+  FilterEntry **ppEntry           /* OUT: FilterEntry object */
+){
+  FilterCache *p = pDb->pFilterCache;
+  u32 h = sortedFilterMix((u32)pSeg->iLastPg ^ (u32)(pSeg->iLastPg >> 32));
+  int iSlot = (int)(h % FILTER_CACHE_SIZE);
+  int rc = LSM_OK;
+
+  *ppEntry = 0;
+  if( p==0 ){
+    p = (FilterCache *)lsmMallocZeroRc(pDb->pEnv, sizeof(FilterCache), &rc);
+    if( p==0 ) return rc;
+    pDb->pFilterCache = p;
+  }
+
+  /* If the client snapshot has changed since the cache was populated, 
+  ** discard its contents.  */
+  if( p->iSnapshot!=pDb->pClient->iId ){
+    int i;
+    for(i=0; i<FILTER_CACHE_SIZE; i++){
+      lsmFree(pDb->pEnv, p->apEntry[i]);
+      p->apEntry[i] = 0;
+    }
+    p->iSnapshot = pDb->pClient->iId;
+  }
+
+  if( p->apEntry[iSlot]==0 || p->apEntry[iSlot]->iLastPg!=pSeg->iLastPg ){
+    FilterEntry *pNew = 0;
+    rc = sortedFilterEntryLoad(pDb, pSeg, &pNew);
+    if( rc==LSM_OK ){
+      lsmFree(pDb->pEnv, p->apEntry[iSlot]);
+      p->apEntry[iSlot] = pNew;
+    }
+  }
+
+  if( rc==LSM_OK ) *ppEntry = p->apEntry[iSlot];
+  return rc;
+}
+
+/*
+** Test the bloom filter attached to the segment that segment-pointer pPtr
+** points to (if any) for key pKey/nKey. If the filter indicates that the
+** segment does not contain the key, set *pbMiss to true before returning.
+** Otherwise, if the key may be present or there is no usable filter, set 
+** *pbMiss to false.
+**
+** Return LSM_OK if successful, or an LSM error code otherwise.
+*/
+static int segmentPtrFilter(
+  MultiCursor *pCsr,              /* Multi-cursor object */
+  SegmentPtr *pPtr,               /* Segment to test filter of */
+  int iTopic,                     /* Key topic */
+  void *pKey, int nKey,           /* Key to test */
+  int *pbMiss                     /* OUT: True if key is not in segment */
+){
+  lsm_db *pDb = pCsr->pDb;
+  Segment *pSeg = pPtr->pSeg;
+  FilterEntry *pEntry = 0;
+  int rc = LSM_OK;
+
+  *pbMiss = 0;
+
+  /* A filter can only be used if the segment is complete (is not the lhs 
+  ** of a level undergoing an incremental merge). Filters are only used by
+  ** client cursors, as the filter cache is tied to the client snapshot,
+  ** and only contain user keys.  */
+  if( pDb->pClient==0 || pDb->pWorker || iTopic!=0
+   || pSeg->iLastPg==0 
+   || (pSeg==&pPtr->pLevel->lhs && pPtr->pLevel->nRight>0)
+  ){
+    return LSM_OK;
+  }
+
+  rc = sortedFilterEntry(pDb, pSeg, &pEntry);
+  if( rc==LSM_OK && pEntry->nPg ){
+    u32 h = sortedFilterHash(iTopic, (u8 *)pKey, nKey);
+    u32 iFilter = sortedFilterPage(h, pEntry->nPg);
+    Pgno iPg = 0;
+    u32 i;
+
+    for(i=0; i<pEntry->nRun; i++){
+      u8 *aRun = &pEntry->aRun[i*FILTER_RUN_SIZE];
+      u32 nRunPg = lsmGetU32(&aRun[8]);
+      if( iFilter<nRunPg ){
+        iPg = (Pgno)lsmGetU64(aRun) + iFilter;
+        break;
+      }
+      iFilter -= nRunPg;
+    }
+
+    if( iPg ){
+      Page *pPg = 0;
+      rc = lsmFsDbPageGet(pDb->pFS, pSeg, iPg, &pPg);
+      if( rc==LSM_OK ){
+        int nBit;
+        u8 *aBit = fsPageData(pPg, &nBit);
+        if( pEntry->nByte>(u32)SEGMENT_POINTER_OFFSET(nBit) ){
+          rc = LSM_CORRUPT_BKPT;
+        }else{
+          int nProbe = pEntry->nProbe;
+          *pbMiss = !sortedFilterBits(aBit, pEntry->nByte, nProbe, h, 0);
+        }
+        lsmFsPageProtect(pPg);
+        lsmFsPageRelease(pPg);
+      }
+    }
+  }
+
+  return rc;
+}
+
+/*
+** Return a pointer to the segment-pointer that will use the FC pointer 
+** obtained by seeking within segment-pointer pPtr. Or NULL if the FC
+** pointer will not be used or the segment-pointer cannot be found.
+*/
+static SegmentPtr *segmentPtrFcConsumer(MultiCursor *pCsr, SegmentPtr *pPtr){
+  Level *pLvl = pPtr->pLevel;
+  SegmentPtr *pRet;
+
+  if( pPtr->pSeg==&pLvl->lhs ){
+    pRet = &pPtr[1 + pLvl->nRight];
+  }else if( pPtr->pSeg!=&pLvl->aRhs[pLvl->nRight-1] ){
+    return &pPtr[1];
+  }else{
+    pRet = &pPtr[1];
+  }
+
+  /* pRet now points to the lhs of the next level, if any. If the next level
+  ** is undergoing an incremental merge, the pointer is used by the first 
+  ** of its rhs segments.  */
+  if( pRet>=&pCsr->aPtr[pCsr->nPtr] || pRet->pLevel!=pLvl->pNext ) return 0;
+  if( pRet->pLevel->nRight ) pRet = &pRet[1];
+  return pRet;
+}
+
+/*
+** This function is called as part of an LSM_SEEK_EQ seek for key 
+** pKey/nKey. Set *pbSkip to true if there is no need to search the 
+** segment that pPtr points to. This is the case if its bloom filter shows 
+** that the key is not present, and if no subsequent segment requires the
+** FC pointer that would be read from it. A subsequent segment does not
+** require the FC pointer if it has its own b-tree, or if it too may be 
+** skipped.
+**
+** The results of bloom filter tests are cached in SegmentPtr.eFilter
+** so that each filter is tested at most once per seek.
+*/
+static int segmentPtrCanSkip(
+  MultiCursor *pCsr,              /* Multi-cursor object */
+  SegmentPtr *pPtr,               /* Segment-pointer to test */
+  int iTopic,                     /* Key topic */
+  void *pKey, int nKey,           /* Key to seek to */
+  int *pbSkip                     /* OUT: True if segment may be skipped */
+){
+  int rc = LSM_OK;
+
+  *pbSkip = 0;
+  if( pPtr->eFilter==FILTER_UNKNOWN ){
+    int bMiss = 0;
+    rc = segmentPtrFilter(pCsr, pPtr, iTopic, pKey, nKey, &bMiss);
+    pPtr->eFilter = (bMiss ? FILTER_MISS : FILTER_MAYBE);
+  }
+
+  if( rc==LSM_OK && pPtr->eFilter==FILTER_MISS ){
+    if( segmentPtrFcUnused(pPtr) ){
+      *pbSkip = 1;
+    }else{
+      SegmentPtr *pNext = segmentPtrFcConsumer(pCsr, pPtr);
+      if( pNext ){
+        rc = segmentPtrCanSkip(pCsr, pNext, iTopic, pKey, nKey, pbSkip);
+      }
+    }
+  }
+
+  return rc;
+}
+
+/*
+** Release the leaf page retained by segment-pointer pPtr, if any.
+*/
+static void segmentPtrReleaseLeaf(SegmentPtr *pPtr){
+  lsmFsPageRelease(pPtr->pLeaf);
+  pPtr->pLeaf = 0;
+}
+
+/*
+** Segment-pointer pPtr has retained the leaf page found by the previous
+** seek (see CURSOR_KEEP_LEAF). Since seeks on such a cursor are made in
+** ascending key order, key pKey/nKey is no smaller than the key that 
+** the b-tree search for that page was made for. So if it is no larger 
+** than the last key on the page, the page is also the one that a b-tree 
+** search for pKey/nKey would find. In this case set *ppPg to a new 
+** reference to the page. Otherwise, release the retained page and leave
+** *ppPg unmodified.
+*/
+static int segmentPtrSearchLeaf(
+  MultiCursor *pCsr,              /* Multi-cursor object */
+  SegmentPtr *pPtr,               /* Segment-pointer with retained leaf */
+  int iTopic,                     /* Key topic */
+  void *pKey, int nKey,           /* Key to seek to */
+  Page **ppPg                     /* OUT: Leaf page to search */
+){
+  Page *pLeaf = pPtr->pLeaf;
+  int bHit = 0;
+  int rc = LSM_OK;
+
+  lsmFsPageRef(pLeaf);
+  segmentPtrSetPage(pPtr, pLeaf);
+  if( pPtr->nCell>0 ){
+    rc = segmentPtrLoadCell(pPtr, pPtr->nCell-1);
+    bHit = (rc==LSM_OK && 0<=sortedKeyCompare(pCsr->pDb->xCmp, 
+        rtTopic(pPtr->eType), pPtr->pKey, pPtr->nKey, iTopic, pKey, nKey
+    ));
+  }
+  segmentPtrReset(pPtr);
+
+  if( bHit ){
+    lsmFsPageRef(pLeaf);
+    *ppPg = pLeaf;
+  }else{
+    segmentPtrReleaseLeaf(pPtr);
+  }
+  return rc;
+}
+
+static int seekInSegment(
+  MultiCursor *pCsr, 
+  SegmentPtr *pPtr,
+  int iTopic,
+  void *pKey, int nKey,
+  int iPg,                        /* Page to search */
+  int eSeek,                      /* Search bias - see above */
+  int *piPtr,                     /* OUT: FC pointer */
+  int *pbStop                     /* OUT: Stop search flag */
+){
+  int iPtr = iPg;
+  int rc = LSM_OK;
+
+  /* If this is an LSM_SEEK_EQ search and the segment bloom filter shows
+  ** that the key is not present, there may be no need to search the 
+  ** segment. In this case leave the segment-pointer at EOF and *piPtr and
+  ** *pbStop unmodified.  */
+  if( eSeek==LSM_SEEK_EQ ){
+    int bSkip = 0;
+    rc = segmentPtrCanSkip(pCsr, pPtr, iTopic, pKey, nKey, &bSkip);
+    if( rc!=LSM_OK || bSkip ){
+      segmentPtrReset(pPtr);
+      return rc;
+    }
+  }
+
+  if( pPtr->pSeg->iRoot ){
+    Page *pPg = 0;
+    assert( pPtr->pSeg->iRoot!=0 );
+    if( pPtr->pLeaf ){
+      rc = segmentPtrSearchLeaf(pCsr, pPtr, iTopic, pKey, nKey, &pPg);
+    }
+    if( rc==LSM_OK && pPg==0 ){
+      rc = seekInBtree(pCsr, pPtr->pSeg, iTopic, pKey, nKey, 0, &pPg);
+      if( rc==LSM_OK && (pCsr->flags & CURSOR_KEEP_LEAF) ){
+        lsmFsPageRef(pPg);
+        pPtr->pLeaf = pPg;
+      }
+    }
+    if( rc==LSM_OK ) segmentPtrSetPage(pPtr, pPg);
+  }else{
+    if( iPtr==0 ){
+      iPtr = pPtr->pSeg->iFirst;
+    }
+    if( rc==LSM_OK ){
+      rc = segmentPtrLoadPage(pCsr->pDb->pFS, pPtr, iPtr);
+    }
+  }
+
+  if( rc==LSM_OK ){
+    rc = segmentPtrSeek(pCsr, pPtr, iTopic, pKey, nKey, eSeek, piPtr, pbStop);
+  }
+  return rc;
+}
+
+/*
+** Seek each segment pointer in the array of (pLvl->nRight+1) at aPtr[].
+**
+** pbStop:
+**   This parameter is only significant if parameter eSeek is set to
+**   LSM_SEEK_EQ. In this case, it is set to true before returning if
+**   the seek operation is finished. This can happen in two ways:
+**   
+**     a) A key matching (pKey/nKey) is found, or
+**     b) A point-delete or range-delete deleting the key is found.
+**
+**   In case (a), the multi-cursor CURSOR_SEEK_EQ flag is set and the pCsr->key
+**   and pCsr->val blobs populated before returning.
+*/
+static int seekInLevel(
+  MultiCursor *pCsr,              /* Sorted cursor object to seek */
+  SegmentPtr *aPtr,               /* Pointer to array of (nRhs+1) SPs */
+  int eSeek,                      /* Search bias - see above */
+  int iTopic,                     /* Key topic to search for */
+  void *pKey, int nKey,           /* Key to search for */
+  Pgno *piPgno,                   /* IN/OUT: fraction cascade pointer (or 0) */
+  int *pbStop                     /* OUT: See above */
+){
+  Level *pLvl = aPtr[0].pLevel;   /* Level to seek within */
+  int rc = LSM_OK;                /* Return code */
+  int iOut = 0;                   /* Pointer to return to caller */
+  int res = -1;                   /* Result of xCmp(pKey, split) */
+  int nRhs = pLvl->nRight;        /* Number of right-hand-side segments */
+  int bStop = 0;
+
+  /* If this is a composite level (one currently undergoing an incremental
+  ** merge), figure out if the search key is larger or smaller than the
+  ** levels split-key.  */
+  if( nRhs ){
+    res = sortedKeyCompare(pCsr->pDb->xCmp, iTopic, pKey, nKey, 
+        pLvl->iSplitTopic, pLvl->pSplitKey, pLvl->nSplitKey
+    );
+  }
+
+  /* If (res<0), then key pKey/nKey is smaller than the split-key (or this
+  ** is not a composite level and there is no split-key). Search the 
+  ** left-hand-side of the level in this case.  */
+  if( res<0 ){
+    int iPtr = 0;
+    if( nRhs==0 ) iPtr = *piPgno;
+
+    rc = seekInSegment(
+        pCsr, &aPtr[0], iTopic, pKey, nKey, iPtr, eSeek, &iOut, &bStop
+    );
+    if( rc==LSM_OK && nRhs>0 && eSeek==LSM_SEEK_GE && aPtr[0].pPg==0 ){
+      res = 0;
+    }
+  }
+  
+  if( res>=0 ){
+    int bHit = 0;                 /* True if at least one rhs is not EOF */
+    int iPtr = *piPgno;
+    int i;
+    for(i=1; rc==LSM_OK && i<=nRhs && bStop==0; i++){
+      SegmentPtr *pPtr = &aPtr[i];
+      iOut = 0;
+      rc = seekInSegment(
+          pCsr, pPtr, iTopic, pKey, nKey, iPtr, eSeek, &iOut, &bStop
+      );
+      iPtr = iOut;
+
+      /* If the segment-pointer has settled on a key that is smaller than
+      ** the splitkey, invalidate the segment-pointer.  */
+      if( pPtr->pPg ){
+        res = sortedKeyCompare(pCsr->pDb->xCmp, 
             rtTopic(pPtr->eType), pPtr->pKey, pPtr->nKey, 
             pLvl->iSplitTopic, pLvl->pSplitKey, pLvl->nSplitKey
         );
@@ -2209,6 +3113,18 @@ static int segmentCursorAdvance(
   return rc;
 }
 
+/*
+** Release the page references held for the slices returned by the most
+** recent call to lsmMCursorValueIov(), if any.
+*/
+static void mcursorIovRelease(MultiCursor *pCsr){
+  int i;
+  for(i=0; i<pCsr->nIov; i++){
+    lsmFsPageRelease(pCsr->apIovPg[i]);
+  }
+  pCsr->nIov = 0;
+}
+
 static void mcursorFreeComponents(MultiCursor *pCsr){
   int i;
   lsm_env *pEnv = pCsr->pDb->pEnv;
@@ -2220,6 +3136,7 @@ static void mcursorFreeComponents(MultiCursor *pCsr){
   /* Reset the segment pointers */
   for(i=0; i<pCsr->nPtr; i++){
     segmentPtrReset(&pCsr->aPtr[i]);
+    segmentPtrReleaseLeaf(&pCsr->aPtr[i]);
   }
 
   /* And the b-tree cursor, if any */
@@ -2271,6 +3188,7 @@ void lsmMCursorClose(MultiCursor *pCsr, int bCache){
       }
     }
 
+    mcursorIovRelease(pCsr);
     if( bCache ){
       int i;                      /* Used to iterate through segment-pointers */
 
@@ -2280,6 +3198,7 @@ void lsmMCursorClose(MultiCursor *pCsr, int bCache){
         SegmentPtr *pPtr = &pCsr->aPtr[i];
         lsmFsPageRelease(pPtr->pPg);
         pPtr->pPg = 0;
+        segmentPtrReleaseLeaf(pPtr);
       }
 
       /* Reset the tree cursors */
@@ -2293,6 +3212,10 @@ void lsmMCursorClose(MultiCursor *pCsr, int bCache){
       /* Free the allocation used to cache the current key, if any. */
       sortedBlobFree(&pCsr->key);
       sortedBlobFree(&pCsr->val);
+      sortedBlobFree(&pCsr->vlog);
+      lsmFree(pDb->pEnv, pCsr->aIov);
+      lsmFree(pDb->pEnv, pCsr->apIovPg);
+      lsmFree(pDb->pEnv, pCsr->aIovOff);
 
       /* Free the component cursors */
       mcursorFreeComponents(pCsr);
@@ -2421,11 +3344,24 @@ void lsmSortedRemap(lsm_db *pDb){
   MultiCursor *pCsr;
   for(pCsr=pDb->pCsr; pCsr; pCsr=pCsr->pNext){
     int iPtr;
+    int i;
     if( pCsr->pBtCsr ){
       btreeCursorLoadKey(pCsr->pBtCsr);
     }
     for(iPtr=0; iPtr<pCsr->nPtr; iPtr++){
-      segmentPtrLoadCell(&pCsr->aPtr[iPtr], pCsr->aPtr[iPtr].iCell);
+      /* A pointer with no current cell is moving to another page. Its
+      ** cell is loaded once it gets there.  */
+      SegmentPtr *pPtr = &pCsr->aPtr[iPtr];
+      if( pPtr->iCell>=0 && pPtr->iCell<pPtr->nCell ){
+        segmentPtrLoadCell(pPtr, pPtr->iCell);
+      }
+    }
+    for(i=0; i<pCsr->nIov; i++){
+      if( pCsr->apIovPg[i] ){
+        int nData;
+        u8 *aData = fsPageData(pCsr->apIovPg[i], &nData);
+        pCsr->aIov[i].pData = &aData[pCsr->aIovOff[i]];
+      }
     }
   }
 }
@@ -2548,8 +3484,11 @@ static int multiCursorGetVal(
       if( iPtr<pCsr->nPtr ){
         SegmentPtr *pPtr = &pCsr->aPtr[iPtr];
         if( pPtr->pPg ){
-          *ppVal = pPtr->pVal;
-          *pnVal = pPtr->nVal;
+          rc = segmentPtrLoadVal(pPtr);
+          if( rc==LSM_OK ){
+            *ppVal = pPtr->pVal;
+            *pnVal = pPtr->nVal;
+          }
         }
       }
     }
@@ -2849,6 +3788,8 @@ static int multiCursorEnd(MultiCursor *pCsr, int bLast){
   int rc = LSM_OK;
   int i;
 
+  mcursorIovRelease(pCsr);
+
   pCsr->flags &= ~(CURSOR_NEXT_OK | CURSOR_PREV_OK);
   pCsr->flags |= (bLast ? CURSOR_PREV_OK : CURSOR_NEXT_OK);
   pCsr->iFree = 0;
@@ -2966,6 +3907,7 @@ lsm_db *lsmMCursorDb(MultiCursor *pCsr){
 
 void lsmMCursorReset(MultiCursor *pCsr){
   int i;
+  mcursorIovRelease(pCsr);
   lsmTreeCursorReset(pCsr->apTreeCsr[0]);
   lsmTreeCursorReset(pCsr->apTreeCsr[1]);
   for(i=0; i<pCsr->nPtr; i++){
@@ -3042,6 +3984,7 @@ int lsmMCursorSeek(
   assert( pCsr->apTreeCsr[1]==0 || iTopic==0 );
 
   if( eESeek==LSM_SEEK_LEFAST ) eESeek = LSM_SEEK_LE;
+  mcursorIovRelease(pCsr);
 
   assert( eESeek==LSM_SEEK_EQ || eESeek==LSM_SEEK_LE || eESeek==LSM_SEEK_GE );
   assert( (pCsr->flags & CURSOR_FLUSH_FREELIST)==0 );
@@ -3054,6 +3997,9 @@ int lsmMCursorSeek(
   }
 
   /* Seek all segment pointers. */
+  for(iPtr=0; iPtr<pCsr->nPtr; iPtr++){
+    pCsr->aPtr[iPtr].eFilter = FILTER_UNKNOWN;
+  }
   for(iPtr=0; iPtr<pCsr->nPtr && rc==LSM_OK && bStop==0; iPtr++){
     SegmentPtr *pPtr = &pCsr->aPtr[iPtr];
     assert( pPtr->pSeg==&pPtr->pLevel->lhs );
@@ -3090,7 +4036,18 @@ int lsmMCursorSeek(
     }
   }
 
-  return rc;
+  return rc;
+}
+
+/*
+** Configure cursor pCsr to retain the leaf page of each segment found by
+** a seek. A subsequent seek for a key on the same page then avoids 
+** searching the segment b-tree. The caller must only seek the cursor for
+** keys in ascending order from this point on. This is used by 
+** lsm_multi_get(), which looks up keys in sorted order.
+*/
+void lsmMCursorKeepLeaves(MultiCursor *pCsr){
+  pCsr->flags |= CURSOR_KEEP_LEAF;
 }
 
 int lsmMCursorValid(MultiCursor *pCsr){
@@ -3134,6 +4091,25 @@ static int mcursorAdvanceOk(
     );
 
     if( (bReverse==0 && res<=0) || (bReverse!=0 && res>=0) ){
+      /* If this is a merge cursor skipping over an older version of the
+      ** key just written to the output, and that version is a pointer
+      ** into the value log, the value it points to is now garbage. Unless
+      ** it is in a part of the value log that is being (or has been) 
+      ** reclaimed, count it.  */
+      if( res==0 && pCsr->pPrevMergePtr 
+       && (eNewType & LSM_VALUEPTR)
+       && (pCsr->eType & (LSM_INSERT|LSM_POINT_DELETE))
+      ){
+        Snapshot *pWorker = pCsr->pDb->pWorker;
+        i64 iMin = (pWorker->iVlogGc ? pWorker->iVlogGc : pWorker->iVlogFree);
+        void *pPtr; int nPtr;
+        i64 iOff; int nByte;
+        *pRc = multiCursorGetVal(pCsr, pCsr->aTree[1], &pPtr, &nPtr);
+        if( *pRc==LSM_OK ){
+          *pRc = lsmVlogPtrDecode((u8 *)pPtr, nPtr, &iOff, &nByte);
+          if( iOff>=iMin ) pCsr->nVlogDead += nByte;
+        }
+      }
       return 0;
     }
 
@@ -3181,6 +4157,8 @@ static void flCsrAdvance(MultiCursor *pCsr){
 
 static int multiCursorAdvance(MultiCursor *pCsr, int bReverse){
   int rc = LSM_OK;                /* Return Code */
+
+  mcursorIovRelease(pCsr);
   if( lsmMCursorValid(pCsr) ){
     do {
       int iKey = pCsr->aTree[1];
@@ -3291,12 +4269,46 @@ int lsm_csr_cmp(lsm_cursor *csr, const void *pKey, int nKey, int *piRes){
   return rc;
 }
 
+/*
+** The current entry of cursor pCsr has the LSM_VALUEPTR flag set, and 
+** *ppVal/nVal is the value log pointer stored with it. Read the value it
+** points to into the MultiCursor.vlog buffer and set *ppVal and *pnVal to
+** refer to it.
+**
+** The value is read from the value log each time this is called. Space
+** freed by a rolled back transaction is reused by the next writer, so a
+** cached copy of a value read at the same offset might be stale.
+*/
+static int multiCursorVlogValue(MultiCursor *pCsr, void **ppVal, int *pnVal){
+  lsm_db *pDb = pCsr->pDb;
+  i64 iOff = 0;
+  int nByte = 0;
+  int rc;
+
+  rc = lsmVlogPtrDecode((u8 *)*ppVal, *pnVal, &iOff, &nByte);
+  if( rc==LSM_OK ){
+    if( sortedBlobGrow(pDb->pEnv, &pCsr->vlog, LSM_MAX(nByte, 1)) ){
+      rc = LSM_NOMEM_BKPT;
+    }else{
+      rc = lsmFsReadVlog(pDb->pFS, iOff, pCsr->vlog.pData, nByte);
+      pCsr->vlog.nData = nByte;
+    }
+  }
+  if( rc==LSM_OK ){
+    *ppVal = pCsr->vlog.pData;
+    *pnVal = nByte;
+  }
+  return rc;
+}
+
 int lsmMCursorValue(MultiCursor *pCsr, void **ppVal, int *pnVal){
   void *pVal;
   int nVal;
+  int eType;
   int rc;
   if( (pCsr->flags & CURSOR_SEEK_EQ) || pCsr->aTree==0 ){
     rc = LSM_OK;
+    eType = pCsr->eType;
     nVal = pCsr->val.nData;
     pVal = pCsr->val.pData;
   }else{
@@ -3304,22 +4316,316 @@ int lsmMCursorValue(MultiCursor *pCsr, void **ppVal, int *pnVal){
     assert( pCsr->aTree );
     assert( mcursorLocationOk(pCsr, (pCsr->flags & CURSOR_IGNORE_DELETE)) );
 
+    multiCursorGetKey(pCsr, pCsr->aTree[1], &eType, 0, 0);
     rc = multiCursorGetVal(pCsr, pCsr->aTree[1], &pVal, &nVal);
     if( pVal && rc==LSM_OK ){
       rc = sortedBlobSet(pCsr->pDb->pEnv, &pCsr->val, pVal, nVal);
       pVal = pCsr->val.pData;
     }
+  }
 
-    if( rc!=LSM_OK ){
-      pVal = 0;
-      nVal = 0;
-    }
+  if( rc==LSM_OK && (eType & LSM_VALUEPTR) ){
+    rc = multiCursorVlogValue(pCsr, &pVal, &nVal);
+  }
+  if( rc!=LSM_OK ){
+    pVal = 0;
+    nVal = 0;
   }
   *ppVal = pVal;
   *pnVal = nVal;
   return rc;
 }
 
+/*
+** Set *pnVal to the size of the value that cursor pCsr currently points 
+** to. Unlike lsmMCursorValue(), this does not load values that span more
+** than one page, or read values from the value log.
+*/
+int lsmMCursorValueSize(MultiCursor *pCsr, int *pnVal){
+  void *pVal = 0;
+  int nVal = 0;
+  int eType;
+  int rc = LSM_OK;
+
+  if( (pCsr->flags & CURSOR_SEEK_EQ) || pCsr->aTree==0 ){
+    eType = pCsr->eType;
+    nVal = pCsr->val.nData;
+    pVal = pCsr->val.pData;
+  }else{
+    int iKey = pCsr->aTree[1];
+    int iPtr = iKey - CURSOR_DATA_SEGMENT;
+    multiCursorGetKey(pCsr, iKey, &eType, 0, 0);
+    if( iPtr>=0 && iPtr<pCsr->nPtr && (eType & LSM_VALUEPTR)==0 ){
+      nVal = pCsr->aPtr[iPtr].nVal;
+    }else{
+      rc = multiCursorGetVal(pCsr, iKey, &pVal, &nVal);
+    }
+  }
+
+  if( rc==LSM_OK && (eType & LSM_VALUEPTR) ){
+    i64 iOff;
+    rc = lsmVlogPtrDecode((u8 *)pVal, nVal, &iOff, &nVal);
+  }
+  *pnVal = (rc==LSM_OK ? nVal : 0);
+  return rc;
+}
+
+/*
+** If the value that cursor pCsr currently points to is stored in the value
+** log, set *piOff to its offset within the value log. Otherwise, set *piOff
+** to -1. Return LSM_OK if successful, or an LSM error code otherwise.
+*/
+int lsmMCursorVlogPtr(MultiCursor *pCsr, i64 *piOff){
+  void *pVal = 0;
+  int nVal = 0;
+  int eType;
+  int rc = LSM_OK;
+
+  *piOff = -1;
+  if( (pCsr->flags & CURSOR_SEEK_EQ) || pCsr->aTree==0 ){
+    eType = pCsr->eType;
+    nVal = pCsr->val.nData;
+    pVal = pCsr->val.pData;
+  }else{
+    multiCursorGetKey(pCsr, pCsr->aTree[1], &eType, 0, 0);
+    if( eType & LSM_VALUEPTR ){
+      rc = multiCursorGetVal(pCsr, pCsr->aTree[1], &pVal, &nVal);
+    }
+  }
+
+  if( rc==LSM_OK && (eType & LSM_VALUEPTR) ){
+    int nByte;
+    rc = lsmVlogPtrDecode((u8 *)pVal, nVal, piOff, &nByte);
+  }
+  return rc;
+}
+
+/*
+** Append a slice to the array returned by lsmMCursorValueIov(). If pPg is
+** not NULL, the slice is the nData bytes at offset iOff of page pPg, and a
+** reference to pPg is held until mcursorIovRelease() is called. Otherwise,
+** it is the nData bytes at pData.
+*/
+static int mcursorIovAppend(
+  MultiCursor *pCsr,              /* Cursor to add slice to */
+  Page *pPg,                      /* Page slice is part of (or NULL) */
+  int iOff,                       /* Offset of slice within pPg */
+  void *pData,                    /* Pointer to slice data */
+  int nData                       /* Size of slice in bytes */
+){
+  if( pCsr->nIov==pCsr->nIovAlloc ){
+    lsm_env *pEnv = pCsr->pDb->pEnv;
+    int nNew = (pCsr->nIovAlloc ? pCsr->nIovAlloc*2 : 8);
+    void *pNew;
+
+    pNew = lsmRealloc(pEnv, pCsr->aIov, nNew*sizeof(lsm_iovec));
+    if( pNew==0 ) return LSM_NOMEM_BKPT;
+    pCsr->aIov = (lsm_iovec *)pNew;
+    pNew = lsmRealloc(pEnv, pCsr->apIovPg, nNew*sizeof(Page *));
+    if( pNew==0 ) return LSM_NOMEM_BKPT;
+    pCsr->apIovPg = (Page **)pNew;
+    pNew = lsmRealloc(pEnv, pCsr->aIovOff, nNew*sizeof(int));
+    if( pNew==0 ) return LSM_NOMEM_BKPT;
+    pCsr->aIovOff = (int *)pNew;
+    pCsr->nIovAlloc = nNew;
+  }
+
+  if( pPg ) lsmFsPageRef(pPg);
+  pCsr->aIov[pCsr->nIov].pData = pData;
+  pCsr->aIov[pCsr->nIov].nData = nData;
+  pCsr->apIovPg[pCsr->nIov] = pPg;
+  pCsr->aIovOff[pCsr->nIov] = iOff;
+  pCsr->nIov++;
+  return LSM_OK;
+}
+
+/*
+** Populate the slice array of cursor pCsr with the pages that the value
+** of the current record of segment-pointer pPtr is stored on.
+*/
+static int mcursorIovSegment(MultiCursor *pCsr, SegmentPtr *pPtr){
+  Page *pPg = pPtr->pPg;          /* Current page */
+  int iOff = pPtr->iValOff;       /* Offset of next slice on pPg */
+  int nRem = pPtr->nVal;          /* Bytes of value remaining */
+  int nData;                      /* Size of page pPg in bytes */
+  u8 *aData;                      /* Page pPg data */
+  int iEnd;                       /* End of record data on pPg */
+  int rc = LSM_OK;
+
+  aData = fsPageData(pPg, &nData);
+  iEnd = SEGMENT_EOF(nData, pPtr->nCell);
+  lsmFsPageRef(pPg);
+
+  while( rc==LSM_OK && nRem>0 ){
+    int n = LSM_MIN(nRem, iEnd-iOff);
+    if( n>0 ){
+      rc = mcursorIovAppend(pCsr, pPg, iOff, &aData[iOff], n);
+      nRem -= n;
+      iOff += n;
+    }
+    if( rc==LSM_OK && nRem>0 ){
+      iOff -= iEnd;
+      rc = sortedNextDataPage(pPtr->pSeg, &pPg, &aData, &iEnd);
+    }
+  }
+
+  lsmFsPageRelease(pPg);
+  return rc;
+}
+
+/*
+** Set *paIov and *pnIov to an array of slices that make up the value that
+** cursor pCsr currently points to. Values stored in database pages are
+** not copied - the cursor holds references to the pages they are stored
+** on until it is next moved, reset or closed. See lsm_csr_value_iov().
+*/
+int lsmMCursorValueIov(MultiCursor *pCsr, const lsm_iovec **paIov, int *pnIov){
+  int rc = LSM_OK;
+  int bDone = 0;
+
+  mcursorIovRelease(pCsr);
+  if( (pCsr->flags & CURSOR_SEEK_EQ)==0 && pCsr->aTree ){
+    int iKey = pCsr->aTree[1];
+    int iPtr = iKey - CURSOR_DATA_SEGMENT;
+    int eType;
+
+    assert( mcursorLocationOk(pCsr, (pCsr->flags & CURSOR_IGNORE_DELETE)) );
+    multiCursorGetKey(pCsr, iKey, &eType, 0, 0);
+    if( iPtr>=0 && iPtr<pCsr->nPtr && (eType & LSM_VALUEPTR)==0 ){
+      rc = mcursorIovSegment(pCsr, &pCsr->aPtr[iPtr]);
+      bDone = 1;
+    }
+  }
+
+  if( rc==LSM_OK && bDone==0 ){
+    /* Tree, value log and LSM_SEEK_EQ values are all stored in a single 
+    ** buffer that remains valid until the cursor is moved. */
+    void *pVal;
+    int nVal;
+    rc = lsmMCursorValue(pCsr, &pVal, &nVal);
+    if( rc==LSM_OK && nVal>0 ){
+      rc = mcursorIovAppend(pCsr, 0, 0, pVal, nVal);
+    }
+  }
+
+  if( rc!=LSM_OK ) mcursorIovRelease(pCsr);
+  *paIov = pCsr->aIov;
+  *pnIov = pCsr->nIov;
+  return rc;
+}
+
+/*
+** Copy nBuf bytes of the value belonging to the current record of 
+** segment-pointer pPtr, starting at offset iOff of the value, into buffer
+** aBuf. The caller guarantees that (iOff+nBuf) is not greater than the size
+** of the value. Unless it has already been loaded, the value is read 
+** directly from the pages it is stored on.
+*/
+static int segmentPtrReadValue(
+  SegmentPtr *pPtr,               /* Segment pointer to read value of */
+  int iOff,                       /* Offset within value to read from */
+  u8 *aBuf,                       /* Buffer to copy data to */
+  int nBuf                        /* Number of bytes to copy */
+){
+  Page *pPg = pPtr->pPg;          /* Current page */
+  int iPgOff = pPtr->iValOff + iOff;
+  int nData;                      /* Size of page pPg in bytes */
+  u8 *aData;                      /* Page pPg data */
+  int iEnd;                       /* End of record data on pPg */
+  int rc = LSM_OK;
+
+  assert( iOff>=0 && nBuf>=0 && iOff+nBuf<=pPtr->nVal );
+  if( pPtr->pVal ){
+    memcpy(aBuf, &((u8 *)pPtr->pVal)[iOff], nBuf);
+    return LSM_OK;
+  }
+
+  aData = fsPageData(pPg, &nData);
+  iEnd = SEGMENT_EOF(nData, pPtr->nCell);
+  lsmFsPageRef(pPg);
+
+  /* Skip over the pages that hold the first iOff bytes of the value. */
+  while( rc==LSM_OK && iPgOff>=iEnd ){
+    iPgOff -= iEnd;
+    rc = sortedNextDataPage(pPtr->pSeg, &pPg, &aData, &iEnd);
+  }
+
+  while( rc==LSM_OK && nBuf>0 ){
+    int n = LSM_MIN(nBuf, iEnd-iPgOff);
+    memcpy(aBuf, &aData[iPgOff], n);
+    aBuf += n;
+    nBuf -= n;
+    iPgOff += n;
+    if( nBuf>0 ){
+      iPgOff -= iEnd;
+      rc = sortedNextDataPage(pPtr->pSeg, &pPg, &aData, &iEnd);
+    }
+  }
+
+  lsmFsPageRelease(pPg);
+  return rc;
+}
+
+/*
+** Copy up to nBuf bytes of the value that cursor pCsr currently points to,
+** starting at offset iOff, into buffer pBuf. Set *pnRead to the number of
+** bytes copied. Only the pages or value log region that contain the 
+** requested bytes are read. See lsm_csr_value_read().
+*/
+int lsmMCursorValueRead(
+  MultiCursor *pCsr,              /* Cursor to read value of */
+  int iOff,                       /* Offset within value to read from */
+  void *pBuf,                     /* Buffer to copy data to */
+  int nBuf,                       /* Size of buffer pBuf in bytes */
+  int *pnRead                     /* OUT: Number of bytes copied */
+){
+  SegmentPtr *pPtr = 0;
+  void *pVal = 0;
+  int nVal = 0;
+  int nRead = 0;
+  int eType;
+  int rc = LSM_OK;
+
+  if( iOff<0 || nBuf<0 ) return LSM_MISUSE_BKPT;
+
+  if( (pCsr->flags & CURSOR_SEEK_EQ) || pCsr->aTree==0 ){
+    eType = pCsr->eType;
+    nVal = pCsr->val.nData;
+    pVal = pCsr->val.pData;
+  }else{
+    int iKey = pCsr->aTree[1];
+    int iPtr = iKey - CURSOR_DATA_SEGMENT;
+
+    assert( mcursorLocationOk(pCsr, (pCsr->flags & CURSOR_IGNORE_DELETE)) );
+    multiCursorGetKey(pCsr, iKey, &eType, 0, 0);
+    if( iPtr>=0 && iPtr<pCsr->nPtr && (eType & LSM_VALUEPTR)==0 ){
+      pPtr = &pCsr->aPtr[iPtr];
+      nVal = pPtr->nVal;
+    }else{
+      rc = multiCursorGetVal(pCsr, iKey, &pVal, &nVal);
+    }
+  }
+
+  if( rc==LSM_OK && (eType & LSM_VALUEPTR) ){
+    i64 iVlog = 0;
+    rc = lsmVlogPtrDecode((u8 *)pVal, nVal, &iVlog, &nVal);
+    if( rc==LSM_OK && iOff<nVal ){
+      nRead = LSM_MIN(nBuf, nVal-iOff);
+      rc = lsmFsReadVlog(pCsr->pDb->pFS, iVlog+iOff, pBuf, nRead);
+    }
+  }else if( rc==LSM_OK && iOff<nVal ){
+    nRead = LSM_MIN(nBuf, nVal-iOff);
+    if( pPtr ){
+      rc = segmentPtrReadValue(pPtr, iOff, (u8 *)pBuf, nRead);
+    }else{
+      memcpy(pBuf, &((u8 *)pVal)[iOff], nRead);
+    }
+  }
+
+  *pnRead = (rc==LSM_OK ? nRead : 0);
+  return rc;
+}
+
 int lsmMCursorType(MultiCursor *pCsr, int *peType){
   assert( pCsr->aTree );
   multiCursorGetKey(pCsr, pCsr->aTree[1], peType, 0, 0);
@@ -3670,6 +4976,39 @@ static int mergeWorkerBtreeIndirect(MergeWorker *pMW){
   return rc;
 }
 
+/*
+** Append an entry for key iTopic/pKey/nKey, to be stored in the b-tree 
+** along with pointer iPtr, to the b-tree key log pLog (see the comments 
+** above struct MergeWorker). Each entry consists of:
+**
+**   * The pointer value, as a varint,
+**   * The topic, as a single byte,
+**   * The size of the key in bytes, as a varint,
+**   * The key data.
+*/
+static int sortedHierLogAppend(
+  LsmString *pLog,
+  Pgno iPtr,
+  int iTopic,
+  void *pKey,
+  int nKey
+){
+  int nReq = 9 + 1 + 5 + nKey;
+  int rc = LSM_OK;
+  if( pLog->n+nReq>=pLog->nAlloc ){
+    rc = lsmStringExtend(pLog, LSM_MAX(pLog->nAlloc, nReq));
+  }
+  if( rc==LSM_OK ){
+    u8 *a = (u8 *)&pLog->z[pLog->n];
+    a += lsmVarintPut64(a, iPtr);
+    *(a++) = (u8)iTopic;
+    a += lsmVarintPut32(a, nKey);
+    memcpy(a, pKey, nKey);
+    pLog->n = (int)((a + nKey) - (u8 *)pLog->z);
+  }
+  return rc;
+}
+
 /*
 ** Append the database key (iTopic/pKey/nKey) to the b-tree under 
 ** construction. This key has not yet been written to a segment page.
@@ -3696,6 +5035,10 @@ static int mergeWorkerPushHierarchy(
   iPtr = pMW->aSave[0].iPgno;
   assert( iPtr!=0 );
 
+  if( pMW->pHierLog ){
+    return sortedHierLogAppend(pMW->pHierLog, iPtr, iTopic, pKey, nKey);
+  }
+
   /* Determine if the indirect format should be used. */
   if( (nKey*4 > lsmFsPageSize(pMW->pDb->pFS)) ){
     pMW->iIndirect = iPtr;
@@ -3804,8 +5147,9 @@ static int mergeWorkerPersistAndRelease(MergeWorker *pMW){
 /*
 ** Advance to the next page of an output run being populated by merge-worker
 ** pMW. The footer of the new page is initialized to indicate that it contains
-** zero records. The flags field is cleared. The page footer pointer field
-** is set to iFPtr.
+** zero records. The flags field is cleared, except that SEGMENT_PREFIX_FLAG
+** is set if the connection is configured to write prefix compressed keys
+** (LSM_CONFIG_PREFIX_KEYS). The page footer pointer field is set to iFPtr.
 **
 ** If successful, LSM_OK is returned. Otherwise, an error code.
 */
@@ -3830,7 +5174,9 @@ static int mergeWorkerNextPage(
     pMW->pLevel->pMerge->iOutputOff = 0;
     aData = fsPageData(pNext, &nData);
     lsmPutU16(&aData[SEGMENT_NRECORD_OFFSET(nData)], 0);
-    lsmPutU16(&aData[SEGMENT_FLAGS_OFFSET(nData)], 0);
+    lsmPutU16(&aData[SEGMENT_FLAGS_OFFSET(nData)], 
+        pDb->bPrefixKeys ? SEGMENT_PREFIX_FLAG : 0
+    );
     lsmPutU64(&aData[SEGMENT_POINTER_OFFSET(nData)], iFPtr);
     pMW->nWork++;
   }
@@ -3942,6 +5288,8 @@ static int mergeWorkerWrite(
   Segment *pSeg;                  /* Segment being written */
   int flags = 0;                  /* If != 0, flags value for page footer */
   int bFirst = 0;                 /* True for first key of output run */
+  int bPrefix = 0;                /* True if pPg uses prefix compression */
+  int nPrefix = 0;                /* Bytes of key shared with restart key */
 
   pMerge = pMW->pLevel->pMerge;    
   pSeg = &pMW->pLevel->lhs;
@@ -3949,6 +5297,12 @@ static int mergeWorkerWrite(
   if( pSeg->iFirst==0 && pMW->pPage==0 ){
     rc = mergeWorkerFirstPage(pMW);
     bFirst = 1;
+
+    /* When logging b-tree keys, the first key is logged with a zero 
+    ** pointer. See sortedMergeStitch() for details.  */
+    if( rc==LSM_OK && pMW->pHierLog ){
+      rc = sortedHierLogAppend(pMW->pHierLog, 0, rtTopic(eType), pKey, nKey);
+    }
   }
   pPg = pMW->pPage;
   if( pPg ){
@@ -3971,19 +5325,34 @@ static int mergeWorkerWrite(
   **     2) Page-pointer-offset - 1 varint
   **     3) Key size - 1 varint
   **     4) Value size - 1 varint (only if LSM_INSERT flag is set)
+  **     5) Shared prefix size - 1 varint (only on SEGMENT_PREFIX_FLAG pages)
   */
   if( rc==LSM_OK ){
+    iOff = pMerge->iOutputOff;
+    if( iOff>=0 && pPg ){
+      bPrefix = (pageGetFlags(aData, nData) & SEGMENT_PREFIX_FLAG);
+      if( bPrefix && (nRec % SEGMENT_RESTART_INTERVAL) ){
+        int nRestart;
+        u8 *aRestart = pageGetRestartKey(aData, nData, nRec, &nRestart);
+        int nMax = LSM_MIN(nRestart, nKey);
+        while( nPrefix<nMax && aRestart[nPrefix]==((u8 *)pKey)[nPrefix] ){
+          nPrefix++;
+        }
+      }
+    }
+
     nHdr = 1 + lsmVarintLen32(iRPtr) + lsmVarintLen32(nKey);
     if( rtIsWrite(eType) ) nHdr += lsmVarintLen32(nVal);
+    if( bPrefix ) nHdr += lsmVarintLen32(nPrefix);
 
     /* If the entire header will not fit on page pPg, or if page pPg is 
     ** marked read-only, advance to the next page of the output run. */
-    iOff = pMerge->iOutputOff;
     if( iOff<0 || pPg==0 || iOff+nHdr > SEGMENT_EOF(nData, nRec+1) ){
       iFPtr = *pMW->pCsr->pPrevMergePtr;
       iRPtr = iPtr - iFPtr;
       iOff = 0;
       nRec = 0;
+      nPrefix = 0;
       rc = mergeWorkerNextPage(pMW, iFPtr);
       pPg = pMW->pPage;
     }
@@ -4012,6 +5381,8 @@ static int mergeWorkerWrite(
   /* Update the output segment */
   if( rc==LSM_OK ){
     aData = fsPageData(pPg, &nData);
+    flags |= pageGetFlags(aData, nData);
+    bPrefix = (flags & SEGMENT_PREFIX_FLAG);
 
     /* Update the page footer. */
     lsmPutU16(&aData[SEGMENT_NRECORD_OFFSET(nData)], nRec+1);
@@ -4023,16 +5394,25 @@ static int mergeWorkerWrite(
     iOff += lsmVarintPut32(&aData[iOff], iRPtr);                         /* 2 */
     iOff += lsmVarintPut32(&aData[iOff], nKey);                          /* 3 */
     if( rtIsWrite(eType) ) iOff += lsmVarintPut32(&aData[iOff], nVal);   /* 4 */
+    if( bPrefix ) iOff += lsmVarintPut32(&aData[iOff], nPrefix);         /* 5 */
     pMerge->iOutputOff = iOff;
 
     /* Write the key and data into the segment. */
     assert( iFPtr==pageGetPtr(aData, nData) );
-    rc = mergeWorkerData(pMW, 0, iFPtr+iRPtr, pKey, nKey);
+    assert( bPrefix || nPrefix==0 );
+    rc = mergeWorkerData(
+        pMW, 0, iFPtr+iRPtr, &((u8 *)pKey)[nPrefix], nKey-nPrefix
+    );
     if( rc==LSM_OK && rtIsWrite(eType) ){
       if( rc==LSM_OK ){
         rc = mergeWorkerData(pMW, 0, iFPtr+iRPtr, pVal, nVal);
       }
     }
+
+    /* Add the key to the bloom filter being built for the segment. */
+    if( rc==LSM_OK ){
+      sortedFilterAdd(pMW->pDb->pEnv, pMerge->pFilter, eType, pKey, nKey, &rc);
+    }
   }
 
   return rc;
@@ -4085,6 +5465,7 @@ static void mergeWorkerShutdown(MergeWorker *pMW, int *pRc){
     pMerge->iOutputOff = -1;
   }
 
+  if( pCsr ) pMW->nVlogDead = pCsr->nVlogDead;
   lsmMCursorClose(pCsr, 0);
 
   /* Persist and release the output page. */
@@ -4141,7 +5522,7 @@ static void mergeRangeDeletes(MultiCursor *pCsr, int *piVal, int *piFlags){
           if( res==0 ){
             if( (f & (LSM_INSERT|LSM_POINT_DELETE))==0 ){
               if( eType & LSM_INSERT ){
-                f |= LSM_INSERT;
+                f |= LSM_INSERT | (eType & LSM_VALUEPTR);
                 *piVal = i;
               }
               else if( eType & LSM_POINT_DELETE ){
@@ -4257,8 +5638,247 @@ static int mergeWorkerDone(MergeWorker *pMW){
   return pMW->pCsr==0 || !lsmMCursorValid(pMW->pCsr);
 }
 
+/*
+** Append the nPg pages of bloom filter data in buffer aBit[] (nByte bytes
+** per page), followed by a filter header page, to the lhs of level pLvl.
+** See "BLOOM FILTERS" at the top of this file for the format.
+*/
+static int sortedFilterWrite(
+  lsm_db *pDb,                    /* Worker connection */
+  Level *pLvl,                    /* Level to append filter to */
+  u8 *aBit,                       /* Filter data */
+  int nByte,                      /* Bytes of filter data on each page */
+  int nPg,                        /* Number of filter pages */
+  int nProbe,                     /* Number of bits set for each key */
+  int nRunMax                     /* Maximum number of runs in header page */
+){
+  FileSystem *pFS = pDb->pFS;
+  int bCompress = (pDb->compress.xCompress!=0);
+  Page *pPg = 0;
+  u8 *aData;
+  int nData;
+  u8 *aRun;                       /* Run array, FILTER_RUN_SIZE bytes each */
+  int nRun = 0;                   /* Number of entries in aRun[] */
+  int bOverflow = 0;              /* True if aRun[] is too small */
+  int rc = LSM_OK;
+  int i;
+
+  aRun = lsmMallocZeroRc(pDb->pEnv, nRunMax*FILTER_RUN_SIZE, &rc);
+  for(i=0; rc==LSM_OK && bOverflow==0 && i<nPg; i++){
+    rc = lsmFsSortedAppend(pFS, pDb->pWorker, pLvl, 0, &pPg);
+    if( rc==LSM_OK ){
+      aData = fsPageData(pPg, &nData);
+      assert( SEGMENT_POINTER_OFFSET(nData)>=nByte );
+      memcpy(aData, &aBit[i*nByte], nByte);
+      lsmPutU64(&aData[SEGMENT_POINTER_OFFSET(nData)], 0);
+      lsmPutU16(&aData[SEGMENT_FLAGS_OFFSET(nData)], 
+          SEGMENT_BTREE_FLAG | SEGMENT_FILTER_FLAG
+      );
+      lsmPutU16(&aData[SEGMENT_NRECORD_OFFSET(nData)], 0);
+      rc = lsmFsPagePersist(pPg);
+    }
+    if( rc==LSM_OK ){
+      /* Pages of an uncompressed database are allocated sequentially within
+      ** each block, so add this page to the current run if possible. The
+      ** page number of a compressed page is a byte offset, so each such 
+      ** page is a run of its own.  */
+      Pgno iPg = lsmFsPageNumber(pPg);
+      u8 *pRun = (nRun>0 ? &aRun[(nRun-1)*FILTER_RUN_SIZE] : 0);
+      if( pRun && bCompress==0
+       && (Pgno)lsmGetU64(pRun) + lsmGetU32(&pRun[8])==iPg
+      ){
+        lsmPutU32(&pRun[8], lsmGetU32(&pRun[8]) + 1);
+      }else if( nRun<nRunMax ){
+        pRun = &aRun[nRun*FILTER_RUN_SIZE];
+        lsmPutU64(pRun, iPg);
+        lsmPutU32(&pRun[8], 1);
+        nRun++;
+      }else{
+        /* Too many runs to fit on the header page. This should never 
+        ** happen, as the caller limits the number of filter pages. Write 
+        ** a header page without FILTER_MAGIC so that the filter is ignored.
+        */
+        assert( 0 );
+        bOverflow = 1;
+      }
+    }
+    lsmFsPageRelease(pPg);
+    pPg = 0;
+  }
+
+  /* Append the header page */
+  if( rc==LSM_OK ){
+    rc = lsmFsSortedAppend(pFS, pDb->pWorker, pLvl, 0, &pPg);
+  }
+  if( rc==LSM_OK ){
+    aData = fsPageData(pPg, &nData);
+    memset(aData, 0, nData);
+    lsmPutU32(&aData[0], bOverflow ? 0 : FILTER_MAGIC);
+    lsmPutU32(&aData[4], (u32)nProbe);
+    lsmPutU32(&aData[8], (u32)nByte);
+    lsmPutU32(&aData[12], (u32)nPg);
+    lsmPutU32(&aData[16], (u32)nRun);
+    memcpy(&aData[FILTER_HDR_SIZE], aRun, nRun*FILTER_RUN_SIZE);
+    lsmPutU16(&aData[SEGMENT_FLAGS_OFFSET(nData)], 
+        SEGMENT_BTREE_FLAG | SEGMENT_FILTER_FLAG
+    );
+    rc = lsmFsPagePersist(pPg);
+    lsmFsPageRelease(pPg);
+  }
+
+  if( rc==LSM_OK ){
+    rc = lsmFsSortedPadding(pFS, pDb->pWorker, &pLvl->lhs);
+  }
+  lsmFsFlushWaiting(pFS, &rc);
+  lsmFree(pDb->pEnv, aRun);
+  return rc;
+}
+
+/*
+** This function is called after a merge that writes the lhs of level pLvl 
+** has finished, but before lsmFsSortedFinish() is called on the segment.
+** If a bloom filter has been built for the segment, and the segment has a
+** b-tree (and so more than a handful of pages), append the filter to it.
+** Either way, the MergeFilter object is freed.
+**
+** If *pRc is not LSM_OK when this function is called, the filter is freed
+** but not written. Otherwise, *pRc is set to an LSM error code if an error
+** occurs.
+*/
+static void sortedFilterFinish(lsm_db *pDb, Level *pLvl, int *pRc){
+  lsm_env *pEnv = pDb->pEnv;
+  MergeFilter *p = pLvl->pMerge->pFilter;
+  int rc = *pRc;
+
+  if( p==0 ) return;
+  if( rc==LSM_OK && pLvl->lhs.iRoot && p->nKey>0 && (p->aBit || p->aHash) ){
+    i64 nBit = p->nKey * p->nBitPerKey;
+    int nProbe = sortedFilterProbe(p->nBitPerKey);
+    int nByte;
+    int nRunMax;
+    int nPgMax = sortedFilterGeometry(pDb, &nByte, &nRunMax);
+    int nPg;
+    int i;
+
+    assert( nByte==p->nByte );
+    if( p->aHash ){
+      /* Build the filter from the hashes stored by a bulk load. */
+      nPg = sortedFilterPages(nBit, nByte, nPgMax);
+      p->aBit = (u8 *)lsmMallocZeroRc(pEnv, nPg*nByte, &rc);
+      for(i=0; rc==LSM_OK && i<p->nKey; i++){
+        u32 h = p->aHash[i];
+        u8 *aPgBit = &p->aBit[sortedFilterPage(h, (u32)nPg) * nByte];
+        sortedFilterBits(aPgBit, (u32)nByte, nProbe, h, 1);
+      }
+    }else{
+      /* Fold the filter down to the number of pages required. */
+      nPg = sortedFilterPages(nBit, nByte, p->nPg);
+      for(i=nPg*nByte; i<p->nPg*nByte; i++){
+        p->aBit[i % (nPg*nByte)] |= p->aBit[i];
+      }
+    }
+    if( rc==LSM_OK ){
+      rc = sortedFilterWrite(pDb, pLvl, p->aBit, nByte, nPg, nProbe, nRunMax);
+    }
+  }
+
+  /* If the filter was saved by an earlier call to lsm_work(), remove it 
+  ** from the Database.pMergeFilter list before freeing it.  */
+  if( p->bSaved ){
+    MergeFilter **pp;
+    for(pp=lsmDbMergeFilters(pDb); *pp!=p; pp=&(*pp)->pNext);
+    *pp = p->pNext;
+    p->bSaved = 0;
+  }
+  sortedFilterFree(pEnv, p);
+  pLvl->pMerge->pFilter = 0;
+  *pRc = rc;
+}
+
+/*
+** Merge worker pMW, which is about to start writing to the lhs of its
+** level, has just been initialized. Attach a MergeFilter object to the 
+** Merge object if there is not one already.
+**
+** If the output segment is still empty, the new filter is sized based on
+** the input of the merge. Otherwise, the filter saved by sortedFilterSave()
+** is used if it is available.
+*/
+static int sortedFilterAttach(MergeWorker *pMW){
+  lsm_db *pDb = pMW->pDb;
+  Level *pLvl = pMW->pLevel;
+  Merge *pMerge = pLvl->pMerge;
+  int rc = LSM_OK;
+
+  if( pMerge->pFilter==0 ){
+    if( pLvl->lhs.iFirst==0 ){
+      i64 nKeyEst = sortedFilterEstimate(pMW->pCsr);
+      pMerge->pFilter = sortedFilterNew(pDb, nKeyEst, &rc);
+    }else{
+      MergeFilter **pp;
+      MergeFilter *p;
+      for(pp=lsmDbMergeFilters(pDb); (p = *pp); pp=&p->pNext){
+        if( p->iFirst==pLvl->lhs.iFirst ) break;
+      }
+      if( p && p->iLastPg==pLvl->lhs.iLastPg && p->nSize==pLvl->lhs.nSize ){
+        pMerge->pFilter = p;
+      }else{
+        if( p ){
+          *pp = p->pNext;
+          p->bSaved = 0;
+          sortedFilterFree(pDb->pEnv, p);
+        }
+        pMerge->pFilter = sortedFilterNew(pDb, 0, &rc);
+        if( pMerge->pFilter ) sortedFilterDiscard(pDb->pEnv, pMerge->pFilter);
+      }
+    }
+  }
+  return rc;
+}
+
+/*
+** An incremental merge writing the lhs of level pLvl has been suspended.
+** Add its filter to the Database.pMergeFilter list, so that it may be 
+** used when the merge is continued (see sortedFilterAttach()). Also remove 
+** any filters belonging to merges that are no longer in progress from the
+** list.
+*/
+static void sortedFilterSave(lsm_db *pDb, Level *pLvl){
+  MergeFilter *p = pLvl->pMerge->pFilter;
+  MergeFilter **pp;
+
+  if( p==0 ) return;
+  p->iFirst = pLvl->lhs.iFirst;
+  p->iLastPg = pLvl->lhs.iLastPg;
+  p->nSize = pLvl->lhs.nSize;
+
+  pp = lsmDbMergeFilters(pDb);
+  while( *pp ){
+    MergeFilter *pSaved = *pp;
+    Level *pIter;
+    for(pIter=lsmDbSnapshotLevel(pDb->pWorker); pIter; pIter=pIter->pNext){
+      if( pIter->pMerge && pIter->lhs.iFirst==pSaved->iFirst ) break;
+    }
+    if( pIter==0 && pSaved!=p ){
+      *pp = pSaved->pNext;
+      pSaved->bSaved = 0;
+      sortedFilterFree(pDb->pEnv, pSaved);
+    }else{
+      pp = &pSaved->pNext;
+    }
+  }
+
+  if( p->bSaved==0 ){
+    pp = lsmDbMergeFilters(pDb);
+    p->pNext = *pp;
+    *pp = p;
+    p->bSaved = 1;
+  }
+}
+
 static void sortedFreeLevel(lsm_env *pEnv, Level *p){
   if( p ){
+    if( p->pMerge ) sortedFilterFree(pEnv, p->pMerge->pFilter);
     lsmFree(pEnv, p->pSplitKey);
     lsmFree(pEnv, p->pMerge);
     lsmFree(pEnv, p->aRhs);
@@ -4353,15 +5973,20 @@ static int sortedNewToplevel(
 
     /* Do the work to create the new merged segment on disk */
     if( rc==LSM_OK ) rc = lsmMCursorFirst(pCsr);
+    if( rc==LSM_OK ){
+      merge.pFilter = sortedFilterNew(pDb, sortedFilterEstimate(pCsr), &rc);
+    }
     while( rc==LSM_OK && mergeWorkerDone(&mergeworker)==0 ){
       rc = mergeWorkerStep(&mergeworker);
     }
     mergeWorkerShutdown(&mergeworker, &rc);
     assert( rc!=LSM_OK || mergeworker.nWork==0 || pNew->lhs.iFirst );
+    sortedFilterFinish(pDb, pNew, &rc);
     if( rc==LSM_OK && pNew->lhs.iFirst ){
       rc = lsmFsSortedFinish(pDb->pFS, &pNew->lhs);
     }
     nWrite = mergeworker.nWork;
+    pDb->pWorker->nVlogDead += mergeworker.nVlogDead;
     pNew->flags &= ~LEVEL_INCOMPLETE;
     if( eTree==TREE_NONE ){
       pNew->flags |= LEVEL_FREELIST_ONLY;
@@ -4473,9 +6098,13 @@ static int sortedMergeSetup(
     *pp = pNew;
     lsmDbSnapshotSetLevel(pDb->pWorker, pTopLevel);
 
-    /* Determine whether or not the next separators will be linked in */
+    /* Determine whether or not the next separators will be linked in. They
+    ** are not if this merge is being run by a merge job, as the next level
+    ** may be modified by other connections while the job is running. Nor
+    ** are they if the next level has been claimed by a merge job.  */
     if( pNext && pNext->pMerge==0 && pNext->lhs.iRoot && pNext 
      && (bFreeOnly==0 || (pNext->flags & LEVEL_FREELIST_ONLY))
+     && pDb->pMergeJob==0 && lsmMergeJobClaimed(pDb, pNext)==0
     ){
       bUseNext = 1;
     }
@@ -4582,6 +6211,9 @@ static int mergeWorkerInit(
     pCsr->flags |= CURSOR_NEXT_OK;
   }
 
+  /* Set up the bloom filter for the output segment. */
+  if( rc==LSM_OK ) rc = sortedFilterAttach(pMW);
+
   return rc;
 }
 
@@ -4621,19 +6253,36 @@ static int sortedBtreeGobble(
 
 /*
 ** Argument p points to a level of age N. Return the number of levels in
-** the linked list starting at p that have age=N (always at least 1).
+** the linked list starting at p that have age=N (always at least 1). 
+** Levels claimed by merge jobs are not counted, nor are any levels that
+** follow them.
 */
-static int sortedCountLevels(Level *p){
+static int sortedCountLevels(lsm_db *pDb, Level *p){
   int iAge = p->iAge;
   int nRet = 0;
   do {
     nRet++;
     p = p->pNext;
-  }while( p && p->iAge==iAge );
+  }while( p && p->iAge==iAge && lsmMergeJobClaimed(pDb, p)==0 );
   return nRet;
 }
 
-static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
+/*
+** Select a level to work on. If there is a suitable level that is already
+** undergoing a merge, *ppOut is set to point to it. Or, if a new merge is 
+** to be started, it is set up by calling sortedMergeSetup() and *ppOut 
+** set to point to the new level. If there is no work to do, *ppOut is 
+** left unmodified.
+**
+** Levels claimed by merge jobs are not considered. If argument bNoNew is
+** true, only levels already undergoing a merge are considered.
+*/
+static int sortedSelectLevel(
+  lsm_db *pDb,                    /* Worker connection */
+  int nMerge,                     /* Try to merge this many levels at once */
+  int bNoNew,                     /* True to not start a new merge */
+  Level **ppOut                   /* OUT: Level to work on */
+){
   Level *pTopLevel = lsmDbSnapshotLevel(pDb->pWorker);
   int rc = LSM_OK;
   Level *pLevel = 0;            /* Output value */
@@ -4649,18 +6298,22 @@ static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
   ** merge with the same age in the structure. Or the level being merged
   ** with the largest number of right-hand segments. Work on it. */
   for(pLevel=pTopLevel; pLevel; pLevel=pLevel->pNext){
-    if( pLevel->nRight==0 && pThis && pLevel->iAge==pThis->iAge ){
+    int bClaimed = lsmMergeJobClaimed(pDb, pLevel);
+    if( pLevel->nRight==0 && pThis && pLevel->iAge==pThis->iAge && !bClaimed ){
       nThis++;
     }else{
       if( nThis>nBest ){
-        if( (pLevel->iAge!=pThis->iAge+1)
-         || (pLevel->nRight==0 && sortedCountLevels(pLevel)<=pDb->nMerge)
+        if( bClaimed || (pLevel->iAge!=pThis->iAge+1)
+         || (pLevel->nRight==0 && sortedCountLevels(pDb, pLevel)<=pDb->nMerge)
         ){
           pBest = pThis;
           nBest = nThis;
         }
       }
-      if( pLevel->nRight ){
+      if( bClaimed ){
+        nThis = 0;
+        pThis = 0;
+      }else if( pLevel->nRight ){
         if( pLevel->nRight>nBest ){
           nBest = pLevel->nRight;
           pBest = pLevel;
@@ -4679,7 +6332,7 @@ static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
     nBest = nThis;
   }
 
-  if( pBest==0 && nMerge==1 ){
+  if( pBest==0 && nMerge==1 && lsmMergeJobRunning(pDb)==0 ){
     int nFree = 0;
     int nUsr = 0;
     for(pLevel=pTopLevel; pLevel; pLevel=pLevel->pNext){
@@ -4698,6 +6351,7 @@ static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
 
   if( pBest ){
     if( pBest->nRight==0 ){
+      if( bNoNew ) return LSM_OK;
       rc = sortedMergeSetup(pDb, pBest, nBest, ppOut);
     }else{
       *ppOut = pBest;
@@ -4707,12 +6361,23 @@ static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
   return rc;
 }
 
+/*
+** Return true if the database is "full" - if too many levels must be merged
+** before another in-memory tree may be flushed to disk. While merge jobs 
+** are running, levels claimed by them are not considered, as this 
+** connection cannot merge them. And the limit on the total number of 
+** segments is not enforced, as the jobs will reduce it when they finish.
+*/
 static int sortedDbIsFull(lsm_db *pDb){
   Level *pTop = lsmDbSnapshotLevel(pDb->pWorker);
 
-  if( lsmDatabaseFull(pDb) ) return 1;
+  if( lsmMergeJobRunning(pDb) ){
+    if( pTop && lsmMergeJobClaimed(pDb, pTop) ) return 0;
+  }else if( lsmDatabaseFull(pDb) ){
+    return 1;
+  }
   if( pTop && pTop->iAge==0
-   && (pTop->nRight || sortedCountLevels(pTop)>=pDb->nMerge)
+   && (pTop->nRight || sortedCountLevels(pDb, pTop)>=pDb->nMerge)
   ){
     return 1;
   }
@@ -4902,8 +6567,9 @@ static int sortedWork(
   while( nRemaining>0 ){
     Level *pLevel = 0;
 
-    /* Find a level to work on. */
-    rc = sortedSelectLevel(pDb, nMerge, &pLevel);
+    /* Find a level to work on. Connections that run merge jobs only start
+    ** new merges here if they are required to make room for a flush. */
+    rc = sortedSelectLevel(pDb, nMerge, (pDb->bMergeJobs && !bFlush), &pLevel);
     assert( rc==LSM_OK || pLevel==0 );
 
     if( pLevel==0 ){
@@ -4918,6 +6584,7 @@ static int sortedWork(
       if( nDone==0 ) break;
     }else{
       int bSave = 0;
+      int bSuspend = 0;           /* True if the merge is not finished */
       Freelist freelist = {0, 0, 0};
       MergeWorker mergeworker;    /* State used to work on the level merge */
 
@@ -4980,6 +6647,7 @@ static int sortedWork(
         ** the lhs of the level.  */
         if( mergeWorkerDone(&mergeworker)==0 ){
           int i;
+          bSuspend = 1;
           for(i=0; i<pLevel->nRight; i++){
             SegmentPtr *pGobble = &mergeworker.pCsr->aPtr[i];
             if( pGobble->pSeg->iRoot ){
@@ -4994,6 +6662,7 @@ static int sortedWork(
           mergeWorkerShutdown(&mergeworker, &rc);
           bEmpty = (pLevel->lhs.iFirst==0);
 
+          sortedFilterFinish(pDb, pLevel, &rc);
           if( bEmpty==0 && rc==LSM_OK ){
             rc = lsmFsSortedFinish(pDb->pFS, &pLevel->lhs);
           }
@@ -5059,7 +6728,9 @@ static int sortedWork(
       ** has occurred, invoke the work-hook to inform the application that
       ** the database structure has changed. */
       mergeWorkerShutdown(&mergeworker, &rc);
+      pWorker->nVlogDead += mergeworker.nVlogDead;
       pDb->bIncrMerge = 0;
+      if( rc==LSM_OK && bSuspend ) sortedFilterSave(pDb, pLevel);
       if( rc==LSM_OK ) sortedInvokeWorkHook(pDb);
 
 #if LSM_LOG_STRUCTURE
@@ -5190,127 +6861,963 @@ static int doLsmSingleWork(
       bDirty = 1;
     }
 
-    if( rc==LSM_OK && nRem>0 ){
-      int nPg = 0;
-      rc = sortedNewToplevel(pDb, TREE_OLD, &nPg);
-      nRem -= nPg;
-      if( rc==LSM_OK ){
-        if( pDb->nTransOpen>0 ){
-          lsmTreeDiscardOld(pDb);
+    if( rc==LSM_OK && nRem>0 ){
+      int nPg = 0;
+      rc = sortedNewToplevel(pDb, TREE_OLD, &nPg);
+      nRem -= nPg;
+      if( rc==LSM_OK ){
+        if( pDb->nTransOpen>0 ){
+          lsmTreeDiscardOld(pDb);
+        }
+        rc = lsmSaveWorker(pDb, 1);
+        bDirty = 0;
+      }
+    }
+  }
+
+  /* If nPage is still greater than zero, do some merging. */
+  if( rc==LSM_OK && nRem>0 && bShutdown==0 ){
+    int nPg = 0;
+    rc = sortedWork(pDb, nRem, nMerge, 0, &nPg);
+    nRem -= nPg;
+    if( nPg ) bDirty = 1;
+  }
+
+  /* If the in-memory part of the free-list is too large, write a new 
+  ** top-level containing just the in-memory free-list entries to disk. */
+  if( rc==LSM_OK && pDb->pWorker->freelist.nEntry > pDb->nMaxFreelist ){
+    int nPg = 0;
+    while( rc==LSM_OK && lsmDatabaseFull(pDb) ){
+      rc = sortedWork(pDb, 16, nMerge, 1, &nPg);
+      nRem -= nPg;
+      if( nPg==0 ) break;
+    }
+    if( rc==LSM_OK ){
+      rc = sortedNewFreelistOnly(pDb);
+    }
+    nRem -= nPg;
+    if( nPg ) bDirty = 1;
+  }
+
+  /* Start or finish reclaiming space in the value log, if required. */
+  if( rc==LSM_OK && bShutdown==0 ){
+    rc = lsmVlogWork(pDb, &bDirty);
+  }
+
+  if( rc==LSM_OK ){
+    *pnWrite = (nMax - nRem);
+    *pbCkpt = (bCkpt && nRem<=0);
+    if( nMerge==1 && pDb->nAutockpt>0 && *pnWrite>0
+     && pWorker->pLevel 
+     && pWorker->pLevel->nRight==0 
+     && pWorker->pLevel->pNext==0 
+    ){
+      *pbCkpt = 1;
+    }
+  }
+
+  if( rc==LSM_OK && bDirty ){
+    lsmFinishWork(pDb, 0, &rc);
+  }else{
+    int rcdummy = LSM_BUSY;
+    lsmFinishWork(pDb, 0, &rcdummy);
+    *pnWrite = 0;
+  }
+  assert( pDb->pWorker==0 );
+  return rc;
+}
+
+static int doLsmWork(lsm_db *pDb, int nMerge, int nPage, int *pnWrite){
+  int rc = LSM_OK;                /* Return code */
+  int nWrite = 0;                 /* Number of pages written */
+
+  assert( nMerge>=1 );
+
+  if( nPage!=0 ){
+    int bCkpt = 0;
+    do {
+      int nThis = 0;
+      int nReq = (nPage>=0) ? (nPage-nWrite) : ((int)0x7FFFFFFF);
+
+      bCkpt = 0;
+      rc = doLsmSingleWork(pDb, 0, nMerge, nReq, &nThis, &bCkpt);
+      nWrite += nThis;
+      if( rc==LSM_OK && bCkpt ){
+        rc = lsm_checkpoint(pDb, 0);
+      }
+    }while( rc==LSM_OK && bCkpt && (nWrite<nPage || nPage<0) );
+  }
+
+  if( pnWrite ){
+    if( rc==LSM_OK ){
+      *pnWrite = nWrite;
+    }else{
+      *pnWrite = 0;
+    }
+  }
+  return rc;
+}
+
+/*
+** Perform work to merge database segments together.
+*/
+int lsm_work(lsm_db *pDb, int nMerge, int nKB, int *pnWrite){
+  int rc;                         /* Return code */
+  int nPgsz;                      /* Nominal page size in bytes */
+  int nPage;                      /* Equivalent of nKB in pages */
+  int nWrite = 0;                 /* Number of pages written */
+
+  /* This function may not be called if pDb has an open read or write
+  ** transaction. Return LSM_MISUSE if an application attempts this.  */
+  if( pDb->nTransOpen || pDb->pCsr ) return LSM_MISUSE_BKPT;
+  if( nMerge<=0 ) nMerge = pDb->nMerge;
+
+  lsmFsPurgeCache(pDb->pFS);
+
+  /* Convert from KB to pages */
+  nPgsz = lsmFsPageSize(pDb->pFS);
+  if( nKB>=0 ){
+    nPage = ((i64)nKB * 1024 + nPgsz - 1) / nPgsz;
+  }else{
+    nPage = -1;
+  }
+
+  rc = doLsmWork(pDb, nMerge, nPage, &nWrite);
+
+  /* Rewrite live values from any part of the value log being reclaimed.
+  ** This requires the WRITER lock, so background worker threads do not,
+  ** lest they cause writes made by the application to fail with LSM_BUSY.
+  ** An LSM_BUSY from this is not an error either.  */
+  if( rc==LSM_OK && pDb->pBgWork==0 ){
+    int nByte = (nKB>=0 ? nKB*1024 : 0x7FFFFFFF);
+    rc = lsmVlogRelocate(pDb, nByte);
+  }
+  
+  if( pnWrite ){
+    /* Convert back from pages to KB */
+    *pnWrite = (int)(((i64)nWrite * 1024 + nPgsz - 1) / nPgsz);
+  }
+  return rc;
+}
+
+/*
+** Select a run of levels for a merge job to merge together. The WORKER 
+** lock must be held. Return a pointer to the first level in the run and
+** set *pnLevel to the number of levels in it. Or, if there is no suitable
+** run of levels, return NULL.
+**
+** As for sortedSelectLevel(), the longest run of adjacent levels with the
+** same age is selected, provided it contains at least (nMerge-1) levels.
+** None of the levels in the run may be undergoing a merge, claimed by
+** another merge job or be free-list only levels. And the first level in
+** the run may not be the level that follows a level undergoing a merge
+** that will link in its separators.
+*/
+static Level *sortedSelectJobLevels(lsm_db *pDb, int *pnLevel){
+  Level *pBest = 0;               /* First level in best run found so far */
+  int nBest;                      /* Number of levels in run at pBest */
+  Level *pThis = 0;               /* First level in current run */
+  int nThis = 0;                  /* Number of levels in run at pThis */
+  Level *pAbove = 0;              /* Level preceding pLevel */
+  Level *pLevel;                  /* Used to iterate through levels */
+
+  nBest = LSM_MAX(1, pDb->nMerge-1);
+  for(pLevel=lsmDbSnapshotLevel(pDb->pWorker); 
+      pLevel; 
+      pAbove=pLevel, pLevel=pLevel->pNext
+  ){
+    int bOk = (pLevel->nRight==0 
+        && (pLevel->flags & LEVEL_FREELIST_ONLY)==0
+        && pLevel->lhs.iFirst!=0 && pLevel->lhs.pRedirect==0
+        && lsmMergeJobClaimed(pDb, pLevel)==0
+    );
+    if( bOk && pThis && pLevel->iAge==pThis->iAge ){
+      nThis++;
+    }else{
+      if( nThis>nBest ){
+        pBest = pThis;
+        nBest = nThis;
+      }
+      pThis = 0;
+      nThis = 0;
+      if( bOk && (pAbove==0 || pAbove->nRight==0 
+               || pAbove->pMerge->nInput==pAbove->nRight)
+      ){
+        pThis = pLevel;
+        nThis = 1;
+      }
+    }
+  }
+  if( nThis>nBest ){
+    pBest = pThis;
+    nBest = nThis;
+  }
+
+  *pnLevel = (pBest ? nBest : 0);
+  return pBest;
+}
+
+/*
+** Merge job pJob has finished merging the levels it claimed into new 
+** level pNew, a level of the job's private snapshot. The WORKER lock is 
+** held and pDb->pWorker is the current worker snapshot. Replace the
+** claimed levels in the worker snapshot with pNew (or just remove them, if
+** pNew is empty) and free the blocks they occupied.
+*/
+static int sortedMergeJobCommit(
+  lsm_db *pDb,                    /* Connection that ran the merge job */
+  MergeJob *pJob,                 /* Merge job */
+  Snapshot *pSnap,                /* Private snapshot used by job */
+  Level *pNew,                    /* New level in pSnap */
+  int nWrite,                     /* Pages written by job */
+  i64 nVlogDead                   /* Value log bytes discarded by job */
+){
+  Snapshot *pWorker = pDb->pWorker;
+  Level *pTop = lsmDbSnapshotLevel(pWorker);
+  Level **pp;                     /* Pointer to first claimed level */
+  Level *pNext;                   /* Level following claimed levels */
+  Level *p;
+  int i;
+  int rc;
+
+  /* Find the claimed levels in the worker snapshot. Other connections may
+  ** have added or removed levels before or after them, but not modified
+  ** the claimed levels themselves. */
+  for(pp=&pTop; *pp && (*pp)->lhs.iFirst!=pJob->aiClaim[0]; pp=&(*pp)->pNext);
+  pNext = *pp;
+  for(i=0; pNext && i<pJob->nClaim; i++){
+    if( pNext->nRight || pNext->lhs.iFirst!=pJob->aiClaim[i] ) break;
+    pNext = pNext->pNext;
+  }
+  if( i<pJob->nClaim ) return LSM_CORRUPT_BKPT;
+
+  rc = lsmMergeJobCommit(pDb, pJob);
+
+  /* Remove pNew from the private snapshot. It becomes an ordinary level,
+  ** not one undergoing a merge. */
+  if( rc==LSM_OK ){
+    Level **ppNew;
+    Level *pSnapTop = lsmDbSnapshotLevel(pSnap);
+    for(ppNew=&pSnapTop; *ppNew!=pNew; ppNew=&(*ppNew)->pNext);
+    *ppNew = pNew->pNext;
+    lsmDbSnapshotSetLevel(pSnap, pSnapTop);
+    lsmFree(pDb->pEnv, pNew->aRhs);
+    sortedFilterFree(pDb->pEnv, pNew->pMerge->pFilter);
+    lsmFree(pDb->pEnv, pNew->pMerge);
+    pNew->nRight = 0;
+    pNew->aRhs = 0;
+    pNew->pMerge = 0;
+
+    /* Free the blocks used by the claimed levels. The segments are 
+    ** deleted while the levels are still part of the snapshot, so that
+    ** blocks shared by two of them are not freed twice. Then replace 
+    ** the claimed levels with pNew.  */
+    for(p=*pp; p!=pNext; p=p->pNext){
+      lsmFsSortedDelete(pDb->pFS, pWorker, 1, &p->lhs);
+    }
+    p = *pp;
+    if( pNew->lhs.iFirst ){
+      pNew->pNext = pNext;
+      *pp = pNew;
+    }else{
+      sortedFreeLevel(pDb->pEnv, pNew);
+      *pp = pNext;
+    }
+    while( p!=pNext ){
+      Level *pDel = p;
+      p = p->pNext;
+      sortedFreeLevel(pDb->pEnv, pDel);
+    }
+    lsmDbSnapshotSetLevel(pWorker, pTop);
+
+    /* Add any append points left by the job to the worker snapshot */
+    for(i=0; i<LSM_APPLIST_SZ; i++){
+      int iApp;
+      if( pSnap->aiAppend[i]==0 ) continue;
+      for(iApp=0; iApp<LSM_APPLIST_SZ && pWorker->aiAppend[iApp]; iApp++);
+      if( iApp<LSM_APPLIST_SZ ) pWorker->aiAppend[iApp] = pSnap->aiAppend[i];
+    }
+    pWorker->nWrite += nWrite;
+    pWorker->nVlogDead += nVlogDead;
+  }
+
+  return rc;
+}
+
+/*
+** SPLIT MERGES
+**
+** If there is more than one background worker thread, a merge job that
+** merges a large amount of data may be split into several key ranges.
+** Each key range is merged separately, by whichever worker threads are
+** available (see lsmMergeJobHelp()), so that the merge as a whole finishes
+** sooner. The key ranges are selected using the keys on the root page of
+** the b-tree of the largest segment being merged.
+**
+** The output of each key range is written to its own chain of blocks, 
+** starting at the first page of a block. Each chain except the last is
+** padded with empty b-tree pages to the end of its last block. And instead
+** of building a b-tree hierarchy, the keys that would be added to it are
+** logged in memory (see MergeWorker.pHierLog). Once all key ranges have 
+** been merged, the chains are linked together to form a single segment 
+** and a b-tree hierarchy built for it from the logged keys (see 
+** sortedMergeStitch()).
+**
+** Split merges are only used with uncompressed databases. And, since the
+** merge of each key range starts from scratch without a pointer into the
+** following level, only if the output is the oldest level in the database.
+** In practice this is where the largest merges occur.
+*/
+
+/*
+** The minimum amount of input data for each key range of a split merge,
+** in blocks.
+*/
+#define SORTED_SPLIT_MIN_BLOCKS 8
+
+/*
+** One key range of a split merge.
+**
+** iTopic/pKey/nKey:
+**   The smallest key in the range. The range extends up to, but does not 
+**   include, the smallest key in the next range. For the first range, pKey
+**   is NULL and the range starts at the start of the input.
+**
+** seg/iLastPtr/log:
+**   Once the range has been merged, the segment it was written to, the
+**   value of MergeWorker.aSave[0].iPgno when it was finished (the right-
+**   child pointer for the b-tree hierarchy) and the log of keys for the
+**   b-tree hierarchy.
+**
+** pFilter:
+**   Once the range has been merged, the bloom filter built for the keys 
+**   written to seg. The filters of all key ranges have the same geometry,
+**   so they may be combined by sortedMergeStitch().
+*/
+struct MergeRange {
+  int iTopic;                     /* Topic of smallest key in range */
+  void *pKey;                     /* Smallest key in range (or NULL) */
+  int nKey;                       /* Size of pKey in bytes */
+  int rc;                         /* Error code from merging range */
+  int bAbandon;                   /* True if merge was abandoned */
+  int nWrite;                     /* Number of pages written */
+  i64 nVlogDead;                  /* Value log bytes discarded */
+  Segment seg;                    /* Output segment */
+  Pgno iLastPtr;                  /* Right-child pointer for b-tree */
+  LsmString log;                  /* Keys for b-tree hierarchy */
+  MergeFilter *pFilter;           /* Bloom filter for keys in seg */
+};
+
+/*
+** Segment-pointer pPtr belongs to merge cursor pCsr. Position it at the
+** first entry in its segment with a key equal to or larger than
+** iTopic/pKey/nKey, or at EOF if there is no such entry.
+*/
+static int sortedRhsSeek(
+  MultiCursor *pCsr,              /* Merge cursor */
+  SegmentPtr *pPtr,               /* Segment-pointer to seek */
+  int iTopic,                     /* Topic of key to seek to */
+  void *pKey, int nKey            /* Key to seek to */
+){
+  int (*xCmp)(void *, int, void *, int) = pCsr->pDb->xCmp;
+  Segment *pSeg = pPtr->pSeg;
+  int rc;
+
+  segmentPtrReset(pPtr);
+  if( pSeg->iRoot ){
+    Page *pPg = 0;
+    rc = seekInBtree(pCsr, pSeg, iTopic, pKey, nKey, 0, &pPg);
+    if( rc==LSM_OK ) segmentPtrSetPage(pPtr, pPg);
+  }else{
+    rc = segmentPtrLoadPage(pCsr->pDb->pFS, pPtr, pSeg->iFirst);
+  }
+  while( rc==LSM_OK && pPtr->pPg 
+      && (pPtr->nCell==0 || (pPtr->flags & SEGMENT_BTREE_FLAG))
+  ){
+    rc = segmentPtrNextPage(pPtr, 1);
+  }
+  if( rc==LSM_OK && pPtr->pPg ){
+    rc = segmentPtrLoadCell(pPtr, 0);
+  }
+
+  /* The b-tree seek finds the page that the key would be stored on. Skip
+  ** past any smaller keys (and separators, if required) on it.  */
+  while( rc==LSM_OK && pPtr->pPg ){
+    if( (rtIsSeparator(pPtr->eType)==0 
+         || segmentPtrIgnoreSeparators(pCsr, pPtr)==0)
+     && sortedKeyCompare(xCmp, rtTopic(pPtr->eType), pPtr->pKey, pPtr->nKey,
+                         iTopic, pKey, nKey)>=0
+    ){
+      break;
+    }
+    rc = segmentPtrAdvance(pCsr, pPtr, 0);
+  }
+  return rc;
+}
+
+/*
+** Append empty b-tree pages to the lhs of level pLvl until its last page
+** is the last page on a block.
+*/
+static int sortedPadToBlockEnd(lsm_db *pDb, Level *pLvl){
+  FileSystem *pFS = pDb->pFS;
+  int nPagePerBlock = lsmFsBlockSize(pFS) / lsmFsPageSize(pFS);
+  int rc = LSM_OK;
+
+  assert( pDb->compress.xCompress==0 );
+  while( rc==LSM_OK && (pLvl->lhs.iLastPg % nPagePerBlock)!=0 ){
+    Page *pPg = 0;
+    rc = lsmFsSortedAppend(pFS, pDb->pWorker, pLvl, 0, &pPg);
+    if( rc==LSM_OK ){
+      int nData;
+      u8 *aData = fsPageData(pPg, &nData);
+      memset(aData, 0, nData);
+      lsmPutU16(&aData[SEGMENT_FLAGS_OFFSET(nData)], SEGMENT_BTREE_FLAG);
+      rc = lsmFsPagePersist(pPg);
+    }
+    lsmFsPageRelease(pPg);
+  }
+  return rc;
+}
+
+/*
+** Merge key range iRange of split merge pJob using connection pDb. The key
+** range has already been claimed by the caller. pDb->pWorker is a private 
+** copy of the worker snapshot with no append points, and pDb->pMergeJob is
+** set to pJob, so that blocks are allocated on behalf of the job.
+**
+** The results are stored in the MergeRange object.
+*/
+static void sortedMergeRange(
+  lsm_db *pDb,                    /* Connection to merge key range with */
+  MergeJob *pJob,                 /* Split merge job */
+  int iRange,                     /* Index of key range to merge */
+  int (*xStop)(void *),           /* Return true to abandon the merge */
+  void *pStopCtx                  /* First argument passed to xStop */
+){
+  int (*xCmp)(void *, int, void *, int) = pDb->xCmp;
+  Level *pSplit = pJob->pLevel;   /* Level written by split merge */
+  MergeRange *pRange = &pJob->aRange[iRange];
+  MergeRange *pEnd = 0;           /* Next key range, if any */
+  Level lvl;                      /* Level to write key range to */
+  Merge merge;                    /* Merge object for lvl */
+  int nByte;
+  int rc = LSM_OK;
+
+  assert( pDb->pWorker && pDb->pMergeJob==pJob );
+  if( iRange+1<pJob->nRange ) pEnd = &pRange[1];
+
+  /* Set up a level to merge the same segments as pSplit. */
+  memset(&lvl, 0, sizeof(Level));
+  memset(&merge, 0, sizeof(Merge));
+  lvl.iAge = pSplit->iAge;
+  lvl.flags = pSplit->flags;
+  lvl.nRight = pSplit->nRight;
+  lvl.pNext = pSplit->pNext;
+  lvl.pMerge = &merge;
+  merge.nInput = pSplit->pMerge->nInput;
+  nByte = sizeof(Segment)*lvl.nRight + sizeof(MergeInput)*merge.nInput;
+  lvl.aRhs = (Segment *)lsmMallocZeroRc(pDb->pEnv, nByte, &rc);
+
+  pRange->bAbandon = xStop(pStopCtx);
+  if( rc==LSM_OK && pRange->bAbandon==0 ){
+    MergeWorker mergeworker;      /* State used to merge the key range */
+    MultiCursor *pCsr;            /* Merge cursor */
+
+    memcpy(lvl.aRhs, pSplit->aRhs, sizeof(Segment)*lvl.nRight);
+    merge.aInput = (MergeInput *)&lvl.aRhs[lvl.nRight];
+    rc = mergeWorkerInit(pDb, &lvl, &mergeworker);
+    mergeworker.pHierLog = &pRange->log;
+    pCsr = mergeworker.pCsr;
+
+    /* Position the merge cursor at the start of the key range. */
+    if( rc==LSM_OK && pRange->pKey ){
+      int i;
+      for(i=0; rc==LSM_OK && i<pCsr->nPtr; i++){
+        rc = sortedRhsSeek(pCsr, &pCsr->aPtr[i], 
+            pRange->iTopic, pRange->pKey, pRange->nKey
+        );
+      }
+      if( rc==LSM_OK ) rc = multiCursorSetupTree(pCsr, 0);
+    }
+
+    /* Merge entries until the start of the next key range. */
+    while( rc==LSM_OK 
+        && pRange->bAbandon==0 
+        && 0==mergeWorkerDone(&mergeworker) 
+    ){
+      int nPrev = mergeworker.nWork;
+      if( pEnd ){
+        void *pKey; int nKey;
+        lsmMCursorKey(pCsr, &pKey, &nKey);
+        if( sortedKeyCompare(xCmp, rtTopic(pCsr->eType), pKey, nKey,
+                pEnd->iTopic, pEnd->pKey, pEnd->nKey)>=0
+        ){
+          break;
         }
-        rc = lsmSaveWorker(pDb, 1);
-        bDirty = 0;
       }
+      rc = mergeWorkerStep(&mergeworker);
+      if( mergeworker.nWork!=nPrev ) pRange->bAbandon = xStop(pStopCtx);
+    }
+    pRange->nWrite = mergeworker.nWork;
+    mergeWorkerShutdown(&mergeworker, &rc);
+    pRange->nVlogDead = mergeworker.nVlogDead;
+    pRange->iLastPtr = mergeworker.aSave[0].iPgno;
+    pRange->pFilter = merge.pFilter;
+    merge.pFilter = 0;
+
+    /* Unless this is the last key range, pad the output to the end of its
+    ** last block. Then release the extra block allocated when the last
+    ** page of the block was appended.  */
+    if( rc==LSM_OK && pRange->bAbandon==0 && pEnd && lvl.lhs.iFirst ){
+      rc = sortedPadToBlockEnd(pDb, &lvl);
+      if( rc==LSM_OK ) rc = lsmFsSortedFinish(pDb->pFS, &lvl.lhs);
     }
+    pRange->seg = lvl.lhs;
   }
 
-  /* If nPage is still greater than zero, do some merging. */
-  if( rc==LSM_OK && nRem>0 && bShutdown==0 ){
-    int nPg = 0;
-    rc = sortedWork(pDb, nRem, nMerge, 0, &nPg);
-    nRem -= nPg;
-    if( nPg ) bDirty = 1;
+  lsmFree(pDb->pEnv, lvl.aRhs);
+  pRange->rc = rc;
+}
+
+/*
+** Level pNew has just been set up by sortedMergeSetup() for merge job 
+** pJob. Decide whether or not the merge should be split into key ranges.
+** If so, select the key ranges and make them available to other 
+** connections (see lsmMergeJobSplit()).
+*/
+static int sortedMergeSplit(lsm_db *pDb, MergeJob *pJob, Level *pNew){
+  FileSystem *pFS = pDb->pFS;
+  lsm_env *pEnv = pDb->pEnv;
+  int nPagePerBlock = lsmFsBlockSize(pFS) / lsmFsPageSize(pFS);
+  Segment *pSeg = 0;              /* Segment to select key ranges from */
+  MergeRange *aRange = 0;         /* Array of key ranges */
+  Page *pPg = 0;                  /* Root page of pSeg b-tree */
+  i64 nPg = 0;                    /* Total size of input in pages */
+  int nRange;                     /* Number of key ranges */
+  int rc = LSM_OK;
+  int i;
+
+  if( pDb->nSplitMerge<2 || pDb->compress.xCompress || pNew->pNext ){
+    return LSM_OK;
   }
 
-  /* If the in-memory part of the free-list is too large, write a new 
-  ** top-level containing just the in-memory free-list entries to disk. */
-  if( rc==LSM_OK && pDb->pWorker->freelist.nEntry > pDb->nMaxFreelist ){
-    int nPg = 0;
-    while( rc==LSM_OK && lsmDatabaseFull(pDb) ){
-      rc = sortedWork(pDb, 16, nMerge, 1, &nPg);
-      nRem -= nPg;
-    }
-    if( rc==LSM_OK ){
-      rc = sortedNewFreelistOnly(pDb);
-    }
-    nRem -= nPg;
-    if( nPg ) bDirty = 1;
+  for(i=0; i<pNew->nRight; i++){
+    Segment *p = &pNew->aRhs[i];
+    nPg += p->nSize;
+    if( p->iRoot && (pSeg==0 || p->nSize>pSeg->nSize) ) pSeg = p;
   }
+  nRange = (int)LSM_MIN(pDb->nSplitMerge, 
+      nPg / (SORTED_SPLIT_MIN_BLOCKS * nPagePerBlock)
+  );
+  if( pSeg==0 || nRange<2 ) return LSM_OK;
 
+  /* Take the first key of each range other than the first from the root
+  ** page of the b-tree of the largest input segment.  */
+  rc = lsmFsDbPageGet(pFS, pSeg, pSeg->iRoot, &pPg);
   if( rc==LSM_OK ){
-    *pnWrite = (nMax - nRem);
-    *pbCkpt = (bCkpt && nRem<=0);
-    if( nMerge==1 && pDb->nAutockpt>0 && *pnWrite>0
-     && pWorker->pLevel 
-     && pWorker->pLevel->nRight==0 
-     && pWorker->pLevel->pNext==0 
-    ){
-      *pbCkpt = 1;
+    int nData;
+    u8 *aData = fsPageData(pPg, &nData);
+    int nRootKey = pageGetNRec(aData, nData);
+
+    nRange = LSM_MIN(nRange, nRootKey+1);
+    aRange = (MergeRange *)lsmMallocZeroRc(pEnv, sizeof(MergeRange)*nRange, &rc);
+    for(i=0; rc==LSM_OK && i<nRange; i++){
+      lsmStringInit(&aRange[i].log, pEnv);
+      if( i>0 ){
+        Blob blob = {0, 0, 0, 0};
+        Pgno iPtr;
+        void *pKey;
+        int nKey;
+        rc = pageGetBtreeKey(pSeg, pPg, (i*nRootKey)/nRange, 
+            &iPtr, &aRange[i].iTopic, &pKey, &nKey, &blob
+        );
+        if( rc==LSM_OK ){
+          aRange[i].pKey = lsmMallocRc(pEnv, LSM_MAX(nKey, 1), &rc);
+          if( aRange[i].pKey ){
+            memcpy(aRange[i].pKey, pKey, nKey);
+            aRange[i].nKey = nKey;
+          }
+        }
+        sortedBlobFree(&blob);
+      }
     }
+    lsmFsPageRelease(pPg);
   }
 
-  if( rc==LSM_OK && bDirty ){
-    lsmFinishWork(pDb, 0, &rc);
-  }else{
-    int rcdummy = LSM_BUSY;
-    lsmFinishWork(pDb, 0, &rcdummy);
-    *pnWrite = 0;
+  if( rc==LSM_OK ){
+    lsmMergeJobSplit(pDb, pJob, pNew, nRange, aRange);
+  }else if( aRange ){
+    for(i=0; i<nRange; i++) lsmFree(pEnv, aRange[i].pKey);
+    lsmFree(pEnv, aRange);
   }
-  assert( pDb->pWorker==0 );
   return rc;
 }
 
-static int doLsmWork(lsm_db *pDb, int nMerge, int nPage, int *pnWrite){
-  int rc = LSM_OK;                /* Return code */
-  int nWrite = 0;                 /* Number of pages written */
+/*
+** Combine the bloom filters built for each key range of split merge pJob
+** into a single filter and attach it to the Merge object of the level the
+** split merge is writing. If the filter for any key range is missing, or 
+** has a different geometry to the others, no filter is built.
+*/
+static void sortedFilterCombine(lsm_db *pDb, MergeJob *pJob){
+  MergeFilter *pOut = 0;
+  int i;
 
-  assert( nMerge>=1 );
+  for(i=0; i<pJob->nRange; i++){
+    MergeFilter *p = pJob->aRange[i].pFilter;
+    pJob->aRange[i].pFilter = 0;
+    if( i==0 ){
+      pOut = p;
+      continue;
+    }
+    if( pOut==0 ){
+      /* No filter was built for key range 0. */
+    }else if( p==0 || p->aBit==0 || pOut->aBit==0
+           || p->nPg!=pOut->nPg || p->nByte!=pOut->nByte
+           || p->nBitPerKey!=pOut->nBitPerKey
+    ){
+      sortedFilterDiscard(pDb->pEnv, pOut);
+    }else{
+      int iByte;
+      for(iByte=0; iByte<p->nPg*p->nByte; iByte++){
+        pOut->aBit[iByte] |= p->aBit[iByte];
+      }
+      pOut->nKey += p->nKey;
+    }
+    sortedFilterFree(pDb->pEnv, p);
+  }
 
-  if( nPage!=0 ){
-    int bCkpt = 0;
-    do {
-      int nThis = 0;
-      int nReq = (nPage>=0) ? (nPage-nWrite) : ((int)0x7FFFFFFF);
+  assert( pJob->pLevel->pMerge->pFilter==0 );
+  pJob->pLevel->pMerge->pFilter = pOut;
+}
 
-      bCkpt = 0;
-      rc = doLsmSingleWork(pDb, 0, nMerge, nReq, &nThis, &bCkpt);
-      nWrite += nThis;
-      if( rc==LSM_OK && bCkpt ){
-        rc = lsm_checkpoint(pDb, 0);
+/*
+** All key ranges of split merge pJob have been merged successfully. Join
+** the segments they were written to together to form the lhs of level
+** pJob->pLevel, and build a b-tree hierarchy for it from the logged keys.
+** The bloom filters built for the key ranges are combined as well.
+**
+** The first key logged for each key range is the first key written to its
+** output segment, and is logged with a zero pointer. It is not added to the
+** b-tree at all for the first key range with any output, as it is the 
+** first key in the segment. For the others, the right-child pointer of the
+** previous key range is used.
+**
+** If a key is too large to store directly in the b-tree, an indirect 
+** reference to the page it is stored on is used instead (as in 
+** mergeWorkerPushHierarchy()). That page is the one the next key logged 
+** for the same key range points to, or, for the last key logged for a key
+** range, the right-child pointer of the key range.
+*/
+static int sortedMergeStitch(lsm_db *pDb, MergeJob *pJob){
+  FileSystem *pFS = pDb->pFS;
+  Level *pLvl = pJob->pLevel;     /* Level to write */
+  Segment *pSeg = &pLvl->lhs;     /* Segment to write */
+  int nPgsz = lsmFsPageSize(pFS);
+  int bPadded = 0;                /* True if pSeg ends with padding */
+  Pgno iLastPtr = 0;              /* Right-child ptr of previous key range */
+  MergeWorker mergeworker;        /* Used to build b-tree hierarchy */
+  int rc = LSM_OK;
+  int i;
+
+  assert( pSeg->iFirst==0 );
+
+  /* Pages written by other connections may be cached by this one. */
+  lsmFsPurgeCache(pFS);
+
+  /* Join the output segments together. If the last one ends with padding,
+  ** link a new block to the end of it, for the b-tree hierarchy and bloom 
+  ** filter to be written to.  */
+  for(i=0; rc==LSM_OK && i<pJob->nRange; i++){
+    MergeRange *pRange = &pJob->aRange[i];
+    if( pRange->seg.iFirst ){
+      if( pSeg->iFirst==0 ){
+        *pSeg = pRange->seg;
+      }else{
+        rc = lsmFsSortedJoin(pFS, pSeg, &pRange->seg);
       }
-    }while( rc==LSM_OK && bCkpt && (nWrite<nPage || nPage<0) );
+      bPadded = (i+1<pJob->nRange);
+    }
+  }
+  if( rc==LSM_OK && bPadded ){
+    rc = lsmFsSortedJoin(pFS, pSeg, 0);
   }
 
-  if( pnWrite ){
-    if( rc==LSM_OK ){
-      *pnWrite = nWrite;
-    }else{
-      *pnWrite = 0;
+  /* Build the b-tree hierarchy. */
+  memset(&mergeworker, 0, sizeof(MergeWorker));
+  mergeworker.pDb = pDb;
+  mergeworker.pLevel = pLvl;
+  for(i=0; rc==LSM_OK && i<pJob->nRange; i++){
+    MergeRange *pRange = &pJob->aRange[i];
+    u8 *a = (u8 *)pRange->log.z;
+    int iOff = 0;
+
+    while( rc==LSM_OK && iOff<pRange->log.n ){
+      i64 iPtr;                   /* Pointer for this key */
+      Pgno iKeyPg;                /* Page the key is stored on */
+      int iTopic;
+      int nKey;
+      u8 *pKey;
+
+      iOff += lsmVarintGet64(&a[iOff], &iPtr);
+      iTopic = a[iOff++];
+      iOff += lsmVarintGet32(&a[iOff], &nKey);
+      pKey = &a[iOff];
+      iOff += nKey;
+
+      if( iPtr==0 ) iPtr = iLastPtr;
+      if( iPtr==0 ) continue;
+      if( iOff<pRange->log.n ){
+        lsmVarintGet64(&a[iOff], &iKeyPg);
+      }else{
+        iKeyPg = pRange->iLastPtr;
+      }
+
+      if( nKey*4 > nPgsz ){
+        rc = mergeWorkerBtreeWrite(&mergeworker, 0, iPtr, iKeyPg, 0, 0);
+      }else{
+        rc = mergeWorkerBtreeWrite(&mergeworker, 
+            (u8)(iTopic | LSM_SEPARATOR), iPtr, 0, pKey, nKey
+        );
+      }
     }
+    if( pRange->seg.iFirst ) iLastPtr = pRange->iLastPtr;
   }
+  mergeworker.aSave[0].iPgno = iLastPtr;
+  if( rc==LSM_OK ) rc = mergeWorkerFinishHierarchy(&mergeworker);
+  lsmFsFlushWaiting(pFS, &rc);
+  mergeWorkerReleaseAll(&mergeworker);
+  sortedFilterCombine(pDb, pJob);
+
   return rc;
 }
 
 /*
-** Perform work to merge database segments together.
+** Merge the key ranges of split merge pJob, which was started by 
+** connection pDb. Key ranges are merged until all of them have been 
+** started, either by pDb or some other connection. Once they have all been
+** finished, sortedMergeStitch() is called to assemble the results.
+**
+** *pnWrite is set to the total number of pages written by all key ranges,
+** and *pnVlogDead to the total number of value log bytes they discarded.
+** If any of the key ranges was abandoned, *pbAbandon is set to true.
 */
-int lsm_work(lsm_db *pDb, int nMerge, int nKB, int *pnWrite){
+static int sortedMergeSplitRun(
+  lsm_db *pDb,                    /* Connection that started the job */
+  MergeJob *pJob,                 /* Split merge job */
+  int (*xStop)(void *),           /* Return true to abandon the merge */
+  void *pStopCtx,                 /* First argument passed to xStop */
+  int *pbAbandon,                 /* OUT: True if merge was abandoned */
+  int *pnWrite,                   /* OUT: Number of pages written */
+  i64 *pnVlogDead                 /* OUT: Value log bytes discarded */
+){
+  int rc = LSM_OK;
+  int iRange;
+  int i;
+
+  while( (iRange = lsmMergeJobRangeNext(pDb, pJob))>=0 ){
+    sortedMergeRange(pDb, pJob, iRange, xStop, pStopCtx);
+    lsmMergeJobRangeDone(pDb, pJob);
+  }
+  lsmMergeJobRangeWait(pDb, pJob);
+
+  for(i=0; i<pJob->nRange; i++){
+    MergeRange *pRange = &pJob->aRange[i];
+    if( rc==LSM_OK ) rc = pRange->rc;
+    if( pRange->bAbandon ) *pbAbandon = 1;
+    *pnWrite += pRange->nWrite;
+    *pnVlogDead += pRange->nVlogDead;
+  }
+  if( rc==LSM_OK && *pbAbandon==0 ){
+    rc = sortedMergeStitch(pDb, pJob);
+  }
+  return rc;
+}
+
+/*
+** Connection pDb has claimed key range iRange of split merge pJob, which 
+** was started by some other connection, while holding the WORKER lock. 
+** Merge the key range. The WORKER lock is released before this function
+** returns.
+*/
+static int sortedMergeJobHelp(
+  lsm_db *pDb,                    /* Connection to merge key range with */
+  MergeJob *pJob,                 /* Split merge job */
+  int iRange,                     /* Key range claimed by pDb */
+  int (*xStop)(void *),           /* Return true to abandon the merge */
+  void *pStopCtx,                 /* First argument passed to xStop */
+  int *pnWrite                    /* OUT: Number of pages written */
+){
+  Snapshot *pSnap = pDb->pWorker;
+  int rcdummy = LSM_BUSY;
+  int rc;
+
+  pDb->pWorker = 0;
+  memset(pSnap->aiAppend, 0, sizeof(pSnap->aiAppend));
+  lsmFinishWork(pDb, 0, &rcdummy);
+
+  pDb->pWorker = pSnap;
+  pDb->pMergeJob = pJob;
+  sortedMergeRange(pDb, pJob, iRange, xStop, pStopCtx);
+  pDb->pWorker = 0;
+  pDb->pMergeJob = 0;
+
+  /* The connection that started the job reads the key range output, and
+  ** modifies its first and last pages when it links the segments together.
+  ** So flush the write buffer and purge any cached pages. Once 
+  ** lsmMergeJobRangeDone() has been called, that connection may also free
+  ** the MergeRange object.  */
+  rc = lsmFsFlushWriteBuffer(pDb->pFS);
+  lsmFsPurgeCache(pDb->pFS);
+  if( rc==LSM_OK ) rc = pJob->aRange[iRange].rc;
+  *pnWrite = pJob->aRange[iRange].nWrite;
+  lsmMergeJobRangeDone(pDb, pJob);
+
+  lsmFreeSnapshot(pDb->pEnv, pSnap);
+  return rc;
+}
+
+/*
+** Run a merge job on connection pDb. This is used by background worker
+** threads (see LSM_CONFIG_BACKGROUND_WORKERS) so that several merges may
+** run at the same time, each on its own thread.
+**
+** A run of levels to merge is selected and claimed while holding the WORKER
+** lock, and a private copy of the worker snapshot taken. The lock is then
+** released and the whole merge done using the private snapshot. Meanwhile,
+** other connections may flush in-memory trees to disk and merge other 
+** levels, but may not modify the claimed levels. Whenever the job needs a 
+** new block to write to, it briefly takes the WORKER lock to allocate one 
+** (see lsmBlockAllocate()). Once the merge is finished, the WORKER lock is
+** taken again and the new level and the blocks used by the job are added
+** to the worker snapshot.
+**
+** If xStop returns true while the merge is running, the merge is abandoned
+** and the claimed levels and allocated blocks released unmodified.
+**
+** If successful, LSM_OK is returned and *pnWrite set to the number of 
+** pages written (zero if there were no levels to merge). LSM_BUSY is 
+** returned if some other connection holds the WORKER lock when the job 
+** is started. Otherwise, an LSM error code is returned.
+*/
+int lsmSortedMergeJob(
+  lsm_db *pDb,                    /* Connection to run merge job on */
+  int (*xStop)(void *),           /* Return true to abandon the merge */
+  void *pStopCtx,                 /* First argument passed to xStop */
+  int *pnWrite                    /* OUT: Number of pages written */
+){
   int rc;                         /* Return code */
-  int nPgsz;                      /* Nominal page size in bytes */
-  int nPage;                      /* Equivalent of nKB in pages */
-  int nWrite = 0;                 /* Number of pages written */
+  int rc2;                        /* Return code of lsmMergeJobLock() */
+  MergeJob *pJob = 0;             /* Merge job object */
+  Snapshot *pSnap = 0;            /* Job's private copy of worker snapshot */
+  Level *pLevel;                  /* First level to merge */
+  Level *pNew = 0;                /* New level in pSnap */
+  int nLevel = 0;                 /* Number of levels to merge */
+  int nWrite = 0;                 /* Pages written */
+  i64 nVlogDead = 0;              /* Value log bytes discarded */
+  int bAbandon = 0;               /* True if xStop() returned true */
+  int iRange = 0;                 /* Key range of split merge to help with */
+  int rcdummy = LSM_BUSY;
+  int i;
 
-  /* This function may not be called if pDb has an open read or write
-  ** transaction. Return LSM_MISUSE if an application attempts this.  */
+  assert( pDb->bMergeJobs && pDb->pWorker==0 && pDb->pMergeJob==0 );
+  *pnWrite = 0;
   if( pDb->nTransOpen || pDb->pCsr ) return LSM_MISUSE_BKPT;
-  if( nMerge<=0 ) nMerge = pDb->nMerge;
 
+  /* If some other connection is running a split merge with a key range 
+  ** that has not yet been started, help with that instead of starting a
+  ** new merge. Otherwise, select and claim a run of levels to merge. */
   lsmFsPurgeCache(pDb->pFS);
+  rc = lsmBeginWork(pDb);
+  if( rc!=LSM_OK ) return rc;
+  pJob = lsmMergeJobHelp(pDb, &iRange);
+  if( pJob ){
+    return sortedMergeJobHelp(pDb, pJob, iRange, xStop, pStopCtx, pnWrite);
+  }
+  pLevel = sortedSelectJobLevels(pDb, &nLevel);
+  if( pLevel ){
+    int nByte = sizeof(MergeJob) + nLevel*sizeof(Pgno);
+    pJob = (MergeJob *)lsmMallocZeroRc(pDb->pEnv, nByte, &rc);
+    if( pJob ){
+      Level *p = pLevel;
+      int i;
+      pJob->aiClaim = (Pgno *)&pJob[1];
+      pJob->nClaim = nLevel;
+      for(i=0; i<nLevel; i++){
+        pJob->aiClaim[i] = p->lhs.iFirst;
+        p = p->pNext;
+      }
+      lsmMergeJobBegin(pDb, pJob);
 
-  /* Convert from KB to pages */
-  nPgsz = lsmFsPageSize(pDb->pFS);
-  if( nKB>=0 ){
-    nPage = ((i64)nKB * 1024 + nPgsz - 1) / nPgsz;
+      /* The output of the merge starts on a new block, as append points 
+      ** are at the end of segments other connections may be working on. */
+      pSnap = pDb->pWorker;
+      pDb->pWorker = 0;
+      memset(pSnap->aiAppend, 0, sizeof(pSnap->aiAppend));
+    }
+  }
+  lsmFinishWork(pDb, 0, &rcdummy);
+  if( pJob==0 ) return rc;
+
+  /* Do the merge. */
+  pDb->pWorker = pSnap;
+  pDb->pMergeJob = pJob;
+  rc = sortedMergeSetup(pDb, pLevel, nLevel, &pNew);
+  if( rc==LSM_OK ){
+    rc = sortedMergeSplit(pDb, pJob, pNew);
+  }
+  if( rc==LSM_OK && pJob->nRange ){
+    rc = sortedMergeSplitRun(
+        pDb, pJob, xStop, pStopCtx, &bAbandon, &nWrite, &nVlogDead
+    );
+  }else if( rc==LSM_OK ){
+    MergeWorker mergeworker;      /* State used to work on the level merge */
+    rc = mergeWorkerInit(pDb, pNew, &mergeworker);
+    while( rc==LSM_OK && bAbandon==0 && 0==mergeWorkerDone(&mergeworker) ){
+      int nPrev = mergeworker.nWork;
+      rc = mergeWorkerStep(&mergeworker);
+      if( mergeworker.nWork!=nPrev ) bAbandon = xStop(pStopCtx);
+    }
+    nWrite = mergeworker.nWork;
+    mergeWorkerShutdown(&mergeworker, &rc);
+    nVlogDead = mergeworker.nVlogDead;
+  }
+  if( rc==LSM_OK && bAbandon==0 && pNew->lhs.iFirst ){
+    sortedFilterFinish(pDb, pNew, &rc);
+    if( rc==LSM_OK ) rc = lsmFsSortedFinish(pDb->pFS, &pNew->lhs);
+  }
+  pDb->pWorker = 0;
+  pDb->pMergeJob = 0;
+
+  /* Take the WORKER lock again and either add the results of the merge to 
+  ** the worker snapshot or, if an error occurred or the merge was 
+  ** abandoned, just release the claimed levels and allocated blocks.  */
+  rc2 = lsmMergeJobLock(pDb);
+  if( rc==LSM_OK ) rc = rc2;
+  if( rc==LSM_OK && bAbandon==0 ){
+    rc = sortedMergeJobCommit(pDb, pJob, pSnap, pNew, nWrite, nVlogDead);
+  }
+  lsmMergeJobEnd(pDb, pJob);
+  if( rc==LSM_OK && bAbandon==0 ){
+    lsmFinishWork(pDb, 0, &rc);
+    if( rc==LSM_OK ){
+      sortedInvokeWorkHook(pDb);
+      *pnWrite = nWrite;
+    }
   }else{
-    nPage = -1;
+    lsmFinishWork(pDb, 0, &rcdummy);
   }
 
-  rc = doLsmWork(pDb, nMerge, nPage, &nWrite);
-  
-  if( pnWrite ){
-    /* Convert back from pages to KB */
-    *pnWrite = (int)(((i64)nWrite * 1024 + nPgsz - 1) / nPgsz);
+  lsmFreeSnapshot(pDb->pEnv, pSnap);
+  for(i=0; i<pJob->nRange; i++){
+    lsmFree(pDb->pEnv, pJob->aRange[i].pKey);
+    lsmStringClear(&pJob->aRange[i].log);
+    sortedFilterFree(pDb->pEnv, pJob->aRange[i].pFilter);
   }
+  lsmFree(pDb->pEnv, pJob->aRange);
+  lsmFree(pDb->pEnv, pJob->aBlk);
+  lsmFree(pDb->pEnv, pJob);
   return rc;
 }
 
@@ -5322,7 +7829,14 @@ int lsm_flush(lsm_db *db){
   }else{
     rc = lsmBeginWriteTrans(db);
     if( rc==LSM_OK ){
-      lsmFlushTreeToDisk(db);
+      /* Make the current tree the old tree before flushing it, so that the
+      ** checkpoint records the log offset that the flush corresponds to. 
+      ** Otherwise, log recovery would start from the beginning of the log
+      ** with the initial checksum values.  */
+      lsmTreeMakeOld(db);
+      rc = lsmFlushTreeToDisk(db);
+    }
+    if( rc==LSM_OK ){
       lsmTreeDiscardOld(db);
       lsmTreeMakeOld(db);
       lsmTreeDiscardOld(db);
@@ -5339,6 +7853,145 @@ int lsm_flush(lsm_db *db){
   return rc;
 }
 
+/*
+** Write the entries returned by xNext (see lsm_bulk_load()) to the lhs of
+** new level pNew, which is the only level in the worker snapshot. If 
+** successful, the number of pages written is added to *pnWrite.
+**
+** If xNext returns an error, or the keys it returns are out of order, the
+** segment is still completed as normal before the error is returned. The
+** caller discards it along with the rest of the worker snapshot.
+*/
+static int sortedBulkWrite(
+  lsm_db *pDb,                    /* Connection handle */
+  Level *pNew,                    /* Level to write */
+  int (*xNext)(void *, const void **, int *, const void **, int *),
+  void *pCtx,                     /* First argument for xNext */
+  int *pnWrite                    /* IN/OUT: Number of pages written */
+){
+  int rc = LSM_OK;                /* Return Code */
+  int rcNext = LSM_OK;            /* Error from xNext, or LSM_MISUSE */
+  Pgno iLeftPtr = 0;              /* Pointer value for all records */
+  Merge merge;                    /* Merge object used to create new level */
+  MergeWorker mergeworker;        /* MergeWorker object for the same purpose */
+  Blob prev = {0, 0, 0, 0};       /* Copy of previous key */
+  int bPrev = 0;                  /* True once prev contains a key */
+
+  memset(&merge, 0, sizeof(Merge));
+  memset(&mergeworker, 0, sizeof(MergeWorker));
+  pNew->pMerge = &merge;
+  pNew->flags |= LEVEL_INCOMPLETE;
+  mergeworker.pDb = pDb;
+  mergeworker.pLevel = pNew;
+
+  /* There is no input to merge. But the MergeWorker object requires a 
+  ** cursor to supply the (always zero) pointer value for output pages. */
+  mergeworker.pCsr = multiCursorNew(pDb, &rc);
+  if( rc==LSM_OK ){
+    mergeworker.pCsr->pPrevMergePtr = &iLeftPtr;
+    prev.pEnv = pDb->pEnv;
+  }
+
+  /* The number of keys is not known in advance, so the bloom filter is 
+  ** built from the hash of each key once they have all been written.  */
+  merge.pFilter = sortedFilterNew(pDb, -1, &rc);
+
+  while( rc==LSM_OK ){
+    const void *pKey = 0; int nKey = 0;
+    const void *pVal = 0; int nVal = 0;
+
+    rcNext = xNext(pCtx, &pKey, &nKey, &pVal, &nVal);
+    if( rcNext!=LSM_OK || pKey==0 ) break;
+    if( nKey<0 || nVal<0 || (bPrev 
+     && pDb->xCmp(prev.pData, prev.nData, (void *)pKey, nKey)>=0) 
+    ){
+      rcNext = LSM_MISUSE_BKPT;
+      break;
+    }
+
+    rc = sortedBlobSet(pDb->pEnv, &prev, (void *)pKey, nKey);
+    if( rc==LSM_OK ){
+      bPrev = 1;
+      rc = mergeWorkerWrite(&mergeworker, 
+          LSM_INSERT, prev.pData, nKey, (void *)pVal, nVal, 0
+      );
+    }
+  }
+
+  mergeWorkerShutdown(&mergeworker, &rc);
+  if( rcNext==LSM_OK ){
+    sortedFilterFinish(pDb, pNew, &rc);
+  }else{
+    sortedFilterFree(pDb->pEnv, merge.pFilter);
+  }
+  if( rc==LSM_OK && pNew->lhs.iFirst ){
+    rc = lsmFsSortedFinish(pDb->pFS, &pNew->lhs);
+  }
+  *pnWrite += mergeworker.nWork;
+  pNew->flags &= ~LEVEL_INCOMPLETE;
+  pNew->pMerge = 0;
+  sortedBlobFree(&prev);
+  return (rc==LSM_OK ? rcNext : rc);
+}
+
+int lsm_bulk_load(
+  lsm_db *pDb,
+  int (*xNext)(void *, const void **, int *, const void **, int *),
+  void *pCtx
+){
+  int rc;                         /* Return code */
+  int nWrite = 0;                 /* Number of pages written */
+  Level *pNew = 0;                /* New level */
+
+  if( pDb->nTransOpen || pDb->pCsr ) return LSM_MISUSE_BKPT;
+  lsmFsPurgeCache(pDb->pFS);
+
+  /* Take the WORKER lock and check that the database is empty - that
+  ** there are no segments on disk and no data in the in-memory tree. The
+  ** new level is written to the worker snapshot, which is not visible to 
+  ** other connections until lsmFinishWork() is called.  */
+  rc = lsmBeginWork(pDb);
+  if( rc!=LSM_OK ) return rc;
+  rc = lsmTreeLoadHeader(pDb, 0);
+  if( rc==LSM_OK ){
+    if( lsmDbSnapshotLevel(pDb->pWorker) 
+     || lsmTreeSize(pDb)>0 
+     || sortedTreeHasOld(pDb, &rc) 
+    ){
+      rc = LSM_MISUSE_BKPT;
+    }
+  }
+
+  if( rc==LSM_OK ){
+    pNew = (Level *)lsmMallocZeroRc(pDb->pEnv, sizeof(Level), &rc);
+  }
+  if( rc==LSM_OK ){
+    pNew->iAge = SORTED_BULK_LEVEL_AGE;
+    lsmDbSnapshotSetLevel(pDb->pWorker, pNew);
+    rc = sortedBulkWrite(pDb, pNew, xNext, pCtx, &nWrite);
+    if( rc!=LSM_OK || pNew->lhs.iFirst==0 ){
+      lsmDbSnapshotSetLevel(pDb->pWorker, 0);
+      sortedFreeLevel(pDb->pEnv, pNew);
+    }else{
+#if LSM_LOG_STRUCTURE
+      lsmSortedDumpStructure(pDb, pDb->pWorker, LSM_LOG_DATA, 0, "bulk-load");
+#endif
+      assertBtreeOk(pDb, &pNew->lhs);
+      pDb->pWorker->nWrite += nWrite;
+      sortedInvokeWorkHook(pDb);
+    }
+  }
+
+  /* If successful, publish the new level to other connections and then 
+  ** checkpoint it. If an error has occurred, lsmFinishWork() discards the
+  ** worker snapshot, and with it any blocks allocated to the new level. */
+  lsmFinishWork(pDb, 0, &rc);
+  if( rc==LSM_OK && nWrite>0 ){
+    rc = lsm_checkpoint(pDb, 0);
+  }
+  return rc;
+}
+
 /*
 ** This function is called in auto-work mode to perform merging work on
 ** the data structure. It performs enough merging work to prevent the
@@ -5364,6 +8017,18 @@ int lsmSortedAutoWork(
     /* nDepth += LSM_MAX(1, pLevel->nRight); */
     nDepth += 1;
   }
+
+  /* If background worker threads are running (LSM_CONFIG_BACKGROUND_WORKERS),
+  ** leave the work to them unless they have fallen behind. That is, unless
+  ** there are more than LSM_CONFIG_THROTTLE_LEVELS levels in the database,
+  ** or the current in-memory tree is full while the old one is still
+  ** waiting to be flushed.  */
+  if( pDb->pBgWork && nDepth<=pDb->nThrottleLevels
+   && (lsmTreeHasOld(pDb)==0 || lsmTreeSize(pDb)<=pDb->nTreeLimit)
+  ){
+    return LSM_OK;
+  }
+
   if( lsmTreeHasOld(pDb) ){
     nDepth += 1;
     bRestore = 1;
@@ -5412,6 +8077,13 @@ int lsmFlushTreeToDisk(lsm_db *pDb){
     rc = sortedWork(pDb, 256, pDb->nMerge, 1, 0);
   }
 
+  /* The current tree is flushed along with the old. So if it rewrote all
+  ** live values from the part of the value log being reclaimed, so has 
+  ** the flush (see ckptExportSnapshot()).  */
+  if( pDb->treehdr.iVlogGc ){
+    pDb->treehdr.iOldVlogGc = pDb->treehdr.iVlogGc;
+  }
+
   if( rc==LSM_OK ){
     rc = sortedNewToplevel(pDb, TREE_BOTH, 0);
   }
@@ -5526,9 +8198,11 @@ void sortedDumpPage(lsm_db *pDb, Segment *pRun, Page *pPg, int bVals){
       lsmFsDbPageGet(pDb->pFS, pRun, iRef, &pRef);
       aKey = pageGetKey(pRun, pRef, 0, &iTopic, &nKey, &blob);
     }else{
+      int iOff;
       aCell += lsmVarintGet32(aCell, &nKey);
       if( rtIsWrite(eType) ) aCell += lsmVarintGet32(aCell, &nVal);
-      sortedReadData(0, pPg, (aCell-aData), nKey+nVal, (void **)&aKey, &blob);
+      iOff = (aCell-aData);
+      sortedReadKey(0, pPg, i, &iOff, nKey, nVal, (void **)&aKey, &blob);
       aVal = &aKey[nKey];
       iTopic = eType;
     }
@@ -5596,9 +8270,11 @@ static void infoCellDump(
       nKey = 11;
     }
   }else{
+    int iOff;
     aCell += lsmVarintGet32(aCell, &nKey);
     if( rtIsWrite(eType) ) aCell += lsmVarintGet32(aCell, &nVal);
-    sortedReadData(pSeg, pPg, (aCell-aData), nKey+nVal, (void **)&aKey, pBlob);
+    iOff = (aCell-aData);
+    sortedReadKey(pSeg, pPg, iCell, &iOff, nKey, nVal, (void **)&aKey, pBlob);
     aVal = &aKey[nKey];
   }
 
@@ -12,17 +12,18 @@
 **
 ** This file contains the implementation of an in-memory tree structure.
 **
-** Technically the tree is a B-tree of order 4 (in the Knuth sense - each 
-** node may have up to 4 children). Keys are stored within B-tree nodes by
-** reference. This may be slightly slower than a conventional red-black
-** tree, but it is simpler. It is also an easier structure to modify to 
-** create a version that supports nested transaction rollback.
+** Technically the tree is a B+-tree - all keys are stored on leaf nodes,
+** and interior nodes contain copies of some of them as separators. Each
+** node holds up to TREE_NSLOT keys, so that a lookup visits only a few
+** nodes. Keys are stored within B-tree nodes by reference, along with
+** a 4-byte prefix of each key so that most comparisons made while searching
+** a node do not have to follow the reference. 
 **
-** This tree does not currently support a delete operation. One is not 
+** The tree does not support a conventional delete operation. One is not 
 ** required. When LSM deletes a key from a database, it inserts a DELETE
-** marker into the data structure. As a result, although the value associated
-** with a key stored in the in-memory tree structure may be modified, no
-** keys are ever removed. 
+** marker into the data structure. Keys are only removed by delete-range
+** operations (lsm_delete_range()), and then only from leaf nodes. Leaves 
+** left empty remain part of the tree until it is flushed to disk.
 */
 
 /*
@@ -79,6 +80,67 @@
 **   since X, the linked list is traversed from the first node added following
 **   X onwards.
 **
+** SKIPLIST TREES
+**
+**   In single process mode, the in-memory tree may instead be a skiplist
+**   (see LSM_CONFIG_SKIPLIST). The structure used for a given database is
+**   recorded in the tree-header (TreeHeader.eTree) when the database is
+**   recovered, and code outside of this file accesses either through the
+**   same lsmTreeXXX() functions. Internally, each lsmTreeXXX() function
+**   that depends on the structure calls a method from the TreeMethods
+**   object associated with the tree - see the "Start of skiplist methods"
+**   section below for the skiplist implementation.
+**
+**   Skiplist nodes are never modified in a way that affects readers using
+**   older snapshots. Each node is tagged with the id of the transaction
+**   that inserted it and, once it has been superseded by a newer version
+**   of the same key or removed by a delete-range operation, the id of the
+**   transaction that did so. Readers skip over nodes that are not part of
+**   their snapshot. Rollback restores the links modified since the
+**   savepoint, but does not free the nodes unlinked, as a reader may
+**   still be positioned on one of them.
+**
+** TREE IMAGES
+**
+**   If LSM_CONFIG_TREE_IMAGE is set, the last connection to close a 
+**   database does not flush the in-memory tree to disk. Instead, an image
+**   of the tree - the tree-header and shared-memory chunks 1 to (nChunk-1)
+**   - is saved by lsmTreeSaveImage(). The next connection to open the
+**   database restores it using lsmTreeLoadImage() instead of running log
+**   recovery. Since tree nodes refer to each other using shared-memory
+**   offsets, no translation is required. 
+**
+**   In single-process mode, the chunks are written to the tree image file
+**   following the tree-header. In multi-process mode, the shared-memory
+**   file is not deleted when the database is closed. The chunks are left
+**   where they are and mapped directly by the next connection, so that 
+**   the tree image file contains only the tree-header.
+**
+**   The tree image file begins with a header of 10 32-bit integers, stored
+**   in native byte order (as is the rest of the file):
+**
+**     0: TREE_IMAGE_MAGIC,
+**     1: The size of a TreeHeader structure in bytes,
+**     2: The number of shared-memory chunks (TreeHeader.nChunk),
+**     3: The log checksum algorithm (ShmHeader.eLogCksum),
+**     4: The most significant 32 bits of the checkpoint id,
+**     5: The least significant 32 bits of the checkpoint id,
+**     6: 1 if the chunks are in the shared-memory file, or 0 otherwise,
+**     7: The number of slots in each b-tree node (TREE_NSLOT).
+**     8: Checksum value 0,
+**     9: Checksum value 1.
+**
+**   The header is followed by the tree-header and, in single-process mode,
+**   the shared-memory chunks. The checksum covers fields 0 to 7 of the
+**   header, the tree-header and the chunks. It is computed using the log
+**   checksum algorithm. The checkpoint id is that of the checkpoint written
+**   to the database file immediately before the image was saved. An image
+**   is only loaded if its checksum is correct and the checkpoint recovered
+**   from the database file has the same id. Otherwise, the log file (which
+**   is retained when an image is saved) is used to recover the tree as 
+**   usual. The tree image file is deleted once recovery is complete, so
+**   that an image cannot be loaded after further transactions have been
+**   written to the log.
 */
 
 #ifndef _LSM_INT_H
@@ -91,7 +153,9 @@
 
 typedef struct TreeKey TreeKey;
 typedef struct TreeNode TreeNode;
-typedef struct TreeLeaf TreeLeaf;
+typedef struct TreeEdit TreeEdit;
+typedef struct TreeMethods TreeMethods;
+typedef struct TreeSkip TreeSkip;
 typedef struct NodeVersion NodeVersion;
 
 struct TreeOld {
@@ -125,7 +189,6 @@ static int lsmAssertFlagsOk(u8 keyflags){
 }
 
 static int assert_delete_ranges_match(lsm_db *);
-static int treeCountEntries(lsm_db *db);
 #else
 # define lsmAssertFlagsOk(x)
 #endif
@@ -147,52 +210,153 @@ struct TreeKey {
 #define TKV_VAL(p) ((void *)(((u8 *)&(p)[1]) + (p)->nKey))
 
 /*
-** A single tree node. A node structure may contain up to 3 key/value
-** pairs. Internal (non-leaf) nodes have up to 4 children.
+** A single b-tree node. A node has TREE_NSLOT slots, each of which may hold
+** a pointer to a TreeKey object and, in an interior node, a pointer to the
+** child sub-tree containing keys greater than or equal to that key. Interior
+** nodes also have a left-most child pointer, for the sub-tree containing
+** keys smaller than all those on the node.
 **
-** TODO: Update the format of this to be more compact. Get it working
-** first though...
+** The slots are not kept in key order. Instead, the aaOrder[] arrays store
+** slot numbers in key order for each of the (up to) two versions of the 
+** node. Version 1 is anKey[0] keys ordered by aaOrder[0], with left-most 
+** child aiLeftPtr[0]. Version 2, which is only present if iV2 is non-zero,
+** is defined by anKey[1], aaOrder[1] and aiLeftPtr[1]. Version 2 of a node
+** may use any slot not used by version 1. See "MVCC NOTES" above.
+**
+** So that most key comparisons made while searching a node do not have to
+** load the TreeKey object, aiPrefix[] holds the 4 bytes following the first
+** nSkip bytes of the key in each slot (see treePrefix()). The nSkip value
+** is chosen so that all keys that may ever be stored in the sub-tree headed
+** by the node share their first nSkip bytes.
+**
+** Leaf nodes are allocated without the fields that follow aiKeyPtr[].
+**
+** Since a write usually copies a leaf and some of its ancestors (see 
+** "MVCC NOTES" above), most of the shared memory used by the tree is taken
+** up by node copies, and the amount grows with the size of a node. With 8
+** slots, a leaf is 88 bytes and an interior node 128 bytes, and searches 
+** are as fast as with 16 slots, which uses around 40% more memory per key.
+** Changing TREE_NSLOT changes the format of tree images (see TREE IMAGES).
 */
+#define TREE_NSLOT 8
+
 struct TreeNode {
-  u32 aiKeyPtr[3];                /* Array of pointers to TreeKey objects */
+  u32 iV2;                        /* Transaction number of v2 */
+  u16 nSkip;                      /* Key bytes that precede aiPrefix[] */
+  u8 anKey[2];                    /* Number of keys in v1 and v2 */
+  u8 aaOrder[2][TREE_NSLOT];      /* Slots in key order for v1 and v2 */
+  u32 aiPrefix[TREE_NSLOT];       /* Key prefix for each slot */
+  u32 aiKeyPtr[TREE_NSLOT];       /* Array of pointers to TreeKey objects */
 
   /* The following fields are present for interior nodes only, not leaves. */
-  u32 aiChildPtr[4];              /* Array of pointers to child nodes */
-
-  /* The extra child pointer slot. */
-  u32 iV2;                        /* Transaction number of v2 */
-  u8 iV2Child;                    /* apChild[] entry replaced by pV2Ptr */
-  u32 iV2Ptr;                     /* Substitute pointer */
+  u32 aiLeftPtr[2];               /* Left-most child pointer of v1 and v2 */
+  u32 aiChildPtr[TREE_NSLOT];     /* Child pointer to the right of each key */
 };
 
-struct TreeLeaf {
-  u32 aiKeyPtr[3];                /* Array of pointers to TreeKey objects */
+#define TREE_LEAF_SIZE ((int)offsetof(TreeNode, aiLeftPtr))
+
+/*
+** A single skiplist node. The node is allocated with space for nLevel
+** entries in the aiNext[] array. Level 0 is also linked in the reverse
+** direction, via the iPrev fields.
+**
+** The first node in each skiplist is a "head" node with iKey set to 0
+** and TREE_SKIP_MAXLEVEL levels. TreeRoot.iRoot points to it, and
+** TreeRoot.nHeight is set to the number of levels in use.
+*/
+struct TreeSkip {
+  u32 iKey;                       /* Pointer to TreeKey object */
+  u32 iTransId;                   /* Transaction that inserted this node */
+  u32 iDead;                      /* Transaction that superseded it, or 0 */
+  u32 iPrev;                      /* Previous node on level 0 */
+  u32 nLevel;                     /* Number of entries in aiNext[] */
+  u32 aiNext[1];                  /* Next node on each level */
 };
 
+#define TREE_SKIP_MAXLEVEL 16
+
 typedef struct TreeBlob TreeBlob;
 struct TreeBlob {
   int n;
   u8 *a;
 };
 
+/*
+** Methods used to access and modify an in-memory tree. There is one
+** instance of this structure for each type of tree (TREE_BTREE and
+** TREE_SKIPLIST). The cursor methods are invoked by the lsmTreeCursorXXX()
+** function of the same name, after any saved cursor position has been
+** restored. Other methods are:
+**
+** xKeyPtr:
+**   Return a pointer to the TreeKey that the (valid) cursor points to.
+**
+** xPrevIsStartDelete, xNextIsEndDelete:
+**   Return true if the entry immediately before (or after) the entry the
+**   cursor points to has the START_DELETE (or END_DELETE) flag set. Only
+**   used after an unsuccessful seek by a writer.
+**
+** xInsert:
+**   Cursor pCsr has been positioned by a writer seeking for the key of
+**   TreeKey iTreeKey, with the results of the seek in res. Add the key to
+**   the tree, replacing the entry the cursor points to if res is 0. If
+**   the tree is empty the cursor is zeroed and res is -1.
+**
+** xDelete:
+**   Remove all entries with keys greater than pKey1 and smaller than
+**   pKey2 from the tree.
+**
+** xRollback:
+**   Roll back to a mark populated by lsmTreeMark().
+**
+** xRepair:
+**   Remove any changes made by a writer that failed mid-transaction from
+**   the tree structure. Called by lsmTreeRepair().
+*/
+struct TreeMethods {
+  int (*xSeek)(TreeCursor *pCsr, void *pKey, int nKey, int *pRes);
+  int (*xNext)(TreeCursor *pCsr);
+  int (*xPrev)(TreeCursor *pCsr);
+  int (*xEnd)(TreeCursor *pCsr, int bLast);
+  u32 (*xKeyPtr)(TreeCursor *pCsr);
+  int (*xPrevIsStartDelete)(lsm_db *db, TreeCursor *pCsr);
+  int (*xNextIsEndDelete)(lsm_db *db, TreeCursor *pCsr);
+  int (*xInsert)(lsm_db *db, TreeCursor *pCsr, int res, u32 iTreeKey);
+  int (*xDelete)(lsm_db *db, void *pKey1, int nKey1, void *pKey2, int nKey2);
+  void (*xRollback)(lsm_db *db, TreeMark *pMark);
+  int (*xRepair)(lsm_db *db);
+};
+
+static const TreeMethods *treeMethods(lsm_db *pDb);
+
 /*
 ** Cursor for searching a tree structure.
 **
 ** If a cursor does not point to any element (a.k.a. EOF), then the
 ** TreeCursor.iNode variable is set to a negative value. Otherwise, the
-** cursor currently points to key aiCell[iNode] on node apTreeNode[iNode].
+** cursor currently points to key aiCell[iNode] on leaf apTreeNode[iNode].
+**
+** Entries in the apTreeNode[] and aiCell[] arrays above iNode contain the
+** node and index of the child pointer followed to descend to the current
+** element. Hence apTreeNode[0] always contains the root node of the tree.
+** If the most recent seek descended to an empty leaf, and so left the 
+** cursor pointing to an entry on some other leaf, bSeekEmpty is set.
 **
-** Entries in the apTreeNode[] and aiCell[] arrays contain the node and
-** index of the TreeNode.apChild[] pointer followed to descend to the 
-** current element. Hence apTreeNode[0] always contains the root node of
-** the tree.
+** If the tree is a skiplist, iNode is 0 when the cursor points to an
+** element, and iSkip is the node it points to. The aiSkipPred[] array
+** contains, for each level, the last node with a key smaller than that
+** passed to the most recent seek.
 */
 struct TreeCursor {
   lsm_db *pDb;                    /* Database handle for this cursor */
   TreeRoot *pRoot;                /* Root node and height of tree to access */
+  const TreeMethods *pMethods;    /* Methods for tree type */
   int iNode;                      /* Cursor points at apTreeNode[iNode] */
   TreeNode *apTreeNode[MAX_DEPTH];/* Current position in tree */
   u8 aiCell[MAX_DEPTH];           /* Current position in tree */
+  u8 bSeekEmpty;                  /* Last seek found an empty b-tree leaf */
+  u32 iSkip;                      /* Current skiplist node */
+  u32 aiSkipPred[TREE_SKIP_MAXLEVEL];   /* Skiplist seek path */
   TreeKey *pSave;                 /* Saved key */
   TreeBlob blob;                  /* Dynamic storage for a key */
 };
@@ -275,15 +439,56 @@ static int treeKeycmp(void *p1, int n1, void *p2, int n2){
   return res;
 }
 
+/*
+** Return the index of the version of node p (0 for v1, or 1 for v2) that
+** is part of the tree with transaction id iVersion.
+*/
+static int treeNodeVersion(TreeNode *p, u32 iVersion){
+  return (p->iV2 && p->iV2<=iVersion);
+}
+
+/*
+** Return the number of keys in version iVersion of node p.
+*/
+static int treeNodeKeys(TreeNode *p, u32 iVersion){
+  return p->anKey[treeNodeVersion(p, iVersion)];
+}
+
+/*
+** Return the offset of the TreeKey object for the iCell'th smallest key
+** in version iVersion of node p.
+*/
+static u32 getKeyPtr(TreeNode *p, u32 iVersion, int iCell){
+  int v = treeNodeVersion(p, iVersion);
+  assert( iCell>=0 && iCell<p->anKey[v] );
+  return p->aiKeyPtr[p->aaOrder[v][iCell]];
+}
+
 /*
 ** The pointer passed as the first argument points to an interior node,
 ** not a leaf. This function returns the offset of the iCell'th child
 ** sub-tree of the node.
 */
-static u32 getChildPtr(TreeNode *p, int iVersion, int iCell){
-  assert( iCell>=0 && iCell<=array_size(p->aiChildPtr) );
-  if( p->iV2 && p->iV2<=iVersion && iCell==p->iV2Child ) return p->iV2Ptr;
-  return p->aiChildPtr[iCell];
+static u32 getChildPtr(TreeNode *p, u32 iVersion, int iCell){
+  int v = treeNodeVersion(p, iVersion);
+  assert( iCell>=0 && iCell<=p->anKey[v] );
+  if( iCell==0 ) return p->aiLeftPtr[v];
+  return p->aiChildPtr[p->aaOrder[v][iCell-1]];
+}
+
+/*
+** Return the 4 bytes of key (aKey/nKey) that follow the first nSkip as a
+** big-endian integer. Bytes past the end of the key are taken to be 0x00.
+** If two keys share their first nSkip bytes and have different prefixes,
+** then the prefixes compare in the same order as the keys themselves.
+*/
+static u32 treePrefix(const u8 *aKey, int nKey, int nSkip){
+  u32 iRet = 0;
+  int i;
+  for(i=nSkip; i<nSkip+4; i++){
+    iRet = (iRet << 8) + (i<nKey ? aKey[i] : 0);
+  }
+  return iRet;
 }
 
 /*
@@ -322,22 +527,6 @@ static ShmChunk * treeShmChunkRc(lsm_db *pDb, int iChunk, int *pRc){
 }
 
 
-#ifndef NDEBUG
-static void assertIsWorkingChild(
-  lsm_db *db, 
-  TreeNode *pNode, 
-  TreeNode *pParent, 
-  int iCell
-){
-  TreeNode *p;
-  u32 iPtr = getChildPtr(pParent, WORKING_VERSION, iCell);
-  p = treeShmptr(db, iPtr);
-  assert( p==pNode );
-}
-#else
-# define assertIsWorkingChild(w,x,y,z)
-#endif
-
 /* Values for the third argument to treeShmkey(). */
 #define TKV_LOADKEY  1
 #define TKV_LOADVAL  2
@@ -389,6 +578,68 @@ static TreeKey *treeShmkey(
   return pRet;
 }
 
+/*
+** Return a pointer to the TreeKey object at offset iPtr, with its key
+** loaded into contiguous memory. The key is only copied into pBlob if it
+** spans more than one chunk, which happens only for keys too large to fit
+** in a single chunk (see newTreeKey()).
+*/
+static TreeKey *treeKeyLoad(lsm_db *pDb, u32 iPtr, TreeBlob *pBlob, int *pRc){
+  TreeKey *pRet = (TreeKey *)treeShmptrUnsafe(pDb, iPtr);
+  if( !(pRet->flags & LSM_CONTIGUOUS) ){
+    pRet = treeShmkey(pDb, iPtr, TKV_LOADKEY, pBlob, pRc);
+  }
+  return pRet;
+}
+
+/*
+** Search version iVersion of node pNode for key (pKey/nKey). If bLeaf is
+** true, return the number of keys on the node smaller than (pKey/nKey), and
+** set *pbEq if the next key is equal to it. Or, if bLeaf is false, return
+** the number of keys smaller than or equal to (pKey/nKey) - the index of 
+** the child sub-tree that the key belongs in.
+*/
+static int treeNodeSearch(
+  lsm_db *pDb,                    /* Database handle */
+  TreeNode *pNode,                /* Node to search */
+  u32 iVersion,                   /* Version of node to search */
+  void *pKey, int nKey,           /* Key to search for */
+  int bLeaf,                      /* True if pNode is a leaf */
+  int *pbEq,                      /* OUT: Set to true if key is found */
+  TreeBlob *pBlob,                /* Used if dynamic memory is required */
+  int *pRc                        /* IN/OUT: Error code */
+){
+  int v = treeNodeVersion(pNode, iVersion);
+  const u8 *aOrder = pNode->aaOrder[v];
+  u32 iPrefix = treePrefix((u8 *)pKey, nKey, pNode->nSkip);
+  int iLo = 0;
+  int iHi = pNode->anKey[v];
+
+  while( iLo<iHi ){
+    int iMid = (iLo+iHi) / 2;
+    int iSlot = aOrder[iMid];
+    int res;
+
+    if( pNode->aiPrefix[iSlot]!=iPrefix ){
+      res = (pNode->aiPrefix[iSlot]<iPrefix ? -1 : +1);
+    }else{
+      TreeKey *p = treeKeyLoad(pDb, pNode->aiKeyPtr[iSlot], pBlob, pRc);
+      if( *pRc!=LSM_OK ) break;
+      res = treeKeycmp(TKV_KEY(p), p->nKey, pKey, nKey);
+      if( res==0 && bLeaf ){
+        *pbEq = 1;
+        return iMid;
+      }
+    }
+    if( res<0 || (res==0 && bLeaf==0) ){
+      iLo = iMid+1;
+    }else{
+      iHi = iMid;
+    }
+  }
+  return iLo;
+}
+
 #if defined(LSM_DEBUG) && defined(LSM_EXPENSIVE_ASSERT)
 void assert_leaf_looks_ok(TreeNode *pNode){
   assert( pNode->apKey[1] );
@@ -490,27 +741,28 @@ void dump_node_contents(
   int nHeight                     /* Height: (0==leaf) (1==parent-of-leaf) */
 ){
   const char *zSpace = "                                           ";
+  u32 iVersion = pDb->treehdr.root.iTransId;
   int i;
   int rc = LSM_OK;
+  int nKey;
   LsmString s;
   TreeNode *pNode;
   TreeBlob b = {0, 0};
 
   pNode = (TreeNode *)treeShmptr(pDb, iNode);
+  nKey = treeNodeKeys(pNode, iVersion);
 
   if( nHeight==0 ){
     /* Append the nIndent bytes of space to string s. */
     lsmStringInit(&s, pDb->pEnv);
 
     /* Append each key to string s. */
-    for(i=0; i<3; i++){
-      u32 iPtr = pNode->aiKeyPtr[i];
-      if( iPtr ){
-        TreeKey *pKey = treeShmkey(pDb, pNode->aiKeyPtr[i],TKV_LOADKEY, &b,&rc);
-        strAppendFlags(&s, pKey->flags);
-        lsmAppendStrBlob(&s, TKV_KEY(pKey), pKey->nKey);
-        lsmStringAppend(&s, "     ", -1);
-      }
+    for(i=0; i<nKey; i++){
+      u32 iPtr = getKeyPtr(pNode, iVersion, i);
+      TreeKey *pKey = treeShmkey(pDb, iPtr, TKV_LOADKEY, &b, &rc);
+      strAppendFlags(&s, pKey->flags);
+      lsmAppendStrBlob(&s, TKV_KEY(pKey), pKey->nKey);
+      lsmStringAppend(&s, "     ", -1);
     }
 
     printf("% 6d %.*sleaf%.*s: %s\n", 
@@ -518,16 +770,16 @@ void dump_node_contents(
     );
     lsmStringClear(&s);
   }else{
-    for(i=0; i<4 && nHeight>0; i++){
-      u32 iPtr = getChildPtr(pNode, pDb->treehdr.root.iTransId, i);
-      zPath[nPath] = i+'0';
+    for(i=0; i<=nKey; i++){
+      u32 iPtr = getChildPtr(pNode, iVersion, i);
+      zPath[nPath] = "0123456789abcdefghij"[i];
       zPath[nPath+1] = '/';
 
-      if( iPtr ){
-        dump_node_contents(pDb, iPtr, zPath, nPath+2, nHeight-1);
-      }
-      if( i!=3 && pNode->aiKeyPtr[i] ){
-        TreeKey *pKey = treeShmkey(pDb, pNode->aiKeyPtr[i], TKV_LOADKEY,&b,&rc);
+      dump_node_contents(pDb, iPtr, zPath, nPath+2, nHeight-1);
+      if( i<nKey ){
+        TreeKey *pKey = treeShmkey(pDb, getKeyPtr(pNode, iVersion, i), 
+            TKV_LOADKEY, &b, &rc
+        );
         lsmStringInit(&s, pDb->pEnv);
         strAppendFlags(&s, pKey->flags);
         lsmAppendStrBlob(&s, TKV_KEY(pKey), pKey->nKey);
@@ -566,17 +818,32 @@ static void treeCursorInit(lsm_db *pDb, int bOld, TreeCursor *pCsr){
   }else{
     pCsr->pRoot = &pDb->treehdr.root;
   }
+  pCsr->pMethods = treeMethods(pDb);
   pCsr->iNode = -1;
 }
 
 /*
 ** Return a pointer to the mapping of the TreeKey object that the cursor
-** is pointing to. 
+** is pointing to. Only the key is guaranteed to be loaded into contiguous
+** memory - use csrGetEntry() if the value is required as well. Since 
+** newTreeKey() never splits a key across chunks unless it is too large to
+** fit in a single chunk, this is almost always a pointer into the *-shm
+** mapping.
 */
 static TreeKey *csrGetKey(TreeCursor *pCsr, TreeBlob *pBlob, int *pRc){
+  u32 iPtr = pCsr->pMethods->xKeyPtr(pCsr);
+  assert( iPtr );
+  return treeKeyLoad(pCsr->pDb, iPtr, pBlob, pRc);
+}
+
+/*
+** Return a pointer to the mapping of the TreeKey object that the cursor
+** is pointing to, with both key and value loaded into contiguous memory.
+*/
+static TreeKey *csrGetEntry(TreeCursor *pCsr, TreeBlob *pBlob, int *pRc){
   TreeKey *pRet;
   lsm_db *pDb = pCsr->pDb;
-  u32 iPtr = pCsr->apTreeNode[pCsr->iNode]->aiKeyPtr[pCsr->aiCell[pCsr->iNode]];
+  u32 iPtr = pCsr->pMethods->xKeyPtr(pCsr);
 
   assert( iPtr );
   pRet = (TreeKey*)treeShmptrUnsafe(pDb, iPtr);
@@ -690,7 +957,10 @@ static u32 treeShmalloc(lsm_db *pDb, int bAlign, int nByte, int *pRc){
       pHdr = (ShmChunk *)treeShmptr(pDb, iChunk*CHUNK_SIZE);
       pHdr->iNext = iNext;
 
-      /* Advance to the next chunk */
+      /* Advance to the next chunk. The space left unused at the end of
+      ** the chunk just finished is counted as part of the tree, so that 
+      ** TreeRoot.nByte reflects the amount of shared-memory consumed.  */
+      pDb->treehdr.root.nByte += (iEof - iWrite);
       iWrite = iNext * CHUNK_SIZE + CHUNK_HDR;
     }
 
@@ -718,14 +988,27 @@ static void *treeShmallocZero(lsm_db *pDb, int nByte, u32 *piPtr, int *pRc){
   return p;
 }
 
-static TreeNode *newTreeNode(lsm_db *pDb, u32 *piPtr, int *pRc){
-  return treeShmallocZero(pDb, sizeof(TreeNode), piPtr, pRc);
-}
-
-static TreeLeaf *newTreeLeaf(lsm_db *pDb, u32 *piPtr, int *pRc){
-  return treeShmallocZero(pDb, sizeof(TreeLeaf), piPtr, pRc);
+/*
+** Allocate a new b-tree node. The new node is zeroed, except that leaf 
+** nodes (bLeaf!=0) are allocated without the interior node fields.
+*/
+static TreeNode *newTreeNode(lsm_db *pDb, int bLeaf, u32 *piPtr, int *pRc){
+  int nByte = (bLeaf ? TREE_LEAF_SIZE : (int)sizeof(TreeNode));
+  return treeShmallocZero(pDb, nByte, piPtr, pRc);
 }
 
+/*
+** Allocate a new TreeKey object and populate it with the key and value
+** passed as arguments. Set *piPtr to its offset within the *-shm file.
+**
+** The TreeKey, key and value are stored in a single allocation within one
+** chunk unless they are too large to fit in any chunk. In that case, the
+** TreeKey and key are still stored within a single chunk if possible, and
+** the value is split across as many more chunks as required. This way 
+** readers can nearly always use pointers to the shared-memory mapping 
+** directly, instead of assembling copies of keys and values in heap 
+** memory (see treeShmkey()).
+*/
 static TreeKey *newTreeKey(
   lsm_db *pDb, 
   u32 *piPtr, 
@@ -733,22 +1016,39 @@ static TreeKey *newTreeKey(
   void *pVal, int nVal,           /* Value data (or nVal<0 for delete) */
   int *pRc
 ){
+  const int nMax = LSM_SHM_CHUNK_SIZE - LSM_SHM_CHUNK_HDR;
+  const int nEntry = sizeof(TreeKey) + nKey + LSM_MAX(0, nVal);
   TreeKey *p;
   u32 iPtr;
   u32 iEnd;
+  int nFirst;                     /* Size of first allocation */
   int nRem;
   u8 *a;
   int n;
 
-  /* Allocate space for the TreeKey structure itself */
-  *piPtr = iPtr = treeShmalloc(pDb, 1, sizeof(TreeKey), pRc);
+  /* Allocate space for the TreeKey structure itself, along with the key
+  ** and value if possible. */
+  if( nEntry<=nMax ){
+    nFirst = nEntry;
+  }else if( (int)sizeof(TreeKey)+nKey<=nMax ){
+    nFirst = sizeof(TreeKey) + nKey;
+  }else{
+    nFirst = sizeof(TreeKey);
+  }
+  *piPtr = iPtr = treeShmalloc(pDb, 1, nFirst, pRc);
   p = treeShmptr(pDb, iPtr);
   if( *pRc ) return 0;
   p->nKey = nKey;
   p->nValue = nVal;
+  if( nFirst>(int)sizeof(TreeKey) ){
+    memcpy(TKV_KEY(p), pKey, nKey);
+    if( nFirst==nEntry && nVal>0 ) memcpy(TKV_VAL(p), pVal, nVal);
+  }
 
-  /* Allocate and populate the space required for the key and value. */
-  n = nRem = nKey;
+  /* Allocate and populate the space required for any parts of the key and
+  ** value that did not fit in the first allocation. */
+  n = nKey;
+  nRem = (nFirst>(int)sizeof(TreeKey) ? 0 : nKey);
   a = (u8 *)pKey;
   while( a ){
     while( nRem>0 ){
@@ -766,11 +1066,12 @@ static TreeKey *newTreeKey(
       nRem -= nAlloc;
     }
     a = pVal;
-    n = nRem = nVal;
+    n = nVal;
+    nRem = (nFirst==nEntry ? 0 : nVal);
     pVal = 0;
   }
 
-  iEnd = iPtr + sizeof(TreeKey) + nKey + LSM_MAX(0, nVal);
+  iEnd = iPtr + nEntry - 1;
   if( (iPtr & ~(LSM_SHM_CHUNK_SIZE-1))!=(iEnd & ~(LSM_SHM_CHUNK_SIZE-1)) ){
     p->flags = 0;
   }else{
@@ -784,291 +1085,502 @@ static TreeKey *newTreeKey(
   return p;
 }
 
-static TreeNode *copyTreeNode(
-  lsm_db *pDb, 
-  TreeNode *pOld, 
-  u32 *piNew, 
-  int *pRc
-){
-  TreeNode *pNew;
-
-  pNew = newTreeNode(pDb, piNew, pRc);
-  if( pNew ){
-    memcpy(pNew->aiKeyPtr, pOld->aiKeyPtr, sizeof(pNew->aiKeyPtr));
-    memcpy(pNew->aiChildPtr, pOld->aiChildPtr, sizeof(pNew->aiChildPtr));
-    if( pOld->iV2 ) pNew->aiChildPtr[pOld->iV2Child] = pOld->iV2Ptr;
+/*
+** Descend from the root of the tree to the leaf that key (pKey/nKey)
+** belongs on. Leave the cursor pointing to the first key on that leaf that
+** is greater than or equal to (pKey/nKey) - which may be one past the last
+** key on the leaf - and set *pbEq to true if that key is an exact match.
+*/
+static int btreeSeekLeaf(TreeCursor *pCsr, void *pKey, int nKey, int *pbEq){
+  lsm_db *pDb = pCsr->pDb;
+  TreeRoot *pRoot = pCsr->pRoot;
+  const int iLeaf = pRoot->nHeight-1;
+  TreeBlob b = {0, 0};
+  u32 iNodePtr = pRoot->iRoot;
+  int rc = LSM_OK;
+  int iNode;
+
+  assert( iNodePtr );
+  *pbEq = 0;
+  for(iNode=0; iNode<=iLeaf; iNode++){
+    TreeNode *pNode = (TreeNode *)treeShmptrUnsafe(pDb, iNodePtr);
+    int iCell = treeNodeSearch(
+        pDb, pNode, pRoot->iTransId, pKey, nKey, iNode==iLeaf, pbEq, &b, &rc
+    );
+    if( rc!=LSM_OK ) break;
+    pCsr->apTreeNode[iNode] = pNode;
+    pCsr->aiCell[iNode] = (u8)iCell;
+    if( iNode<iLeaf ) iNodePtr = getChildPtr(pNode, pRoot->iTransId, iCell);
   }
-  return pNew;
-}
+  pCsr->iNode = (rc==LSM_OK ? iLeaf : -1);
 
-static TreeNode *copyTreeLeaf(
-  lsm_db *pDb, 
-  TreeLeaf *pOld, 
-  u32 *piNew, 
-  int *pRc
-){
-  TreeLeaf *pNew;
-  pNew = newTreeLeaf(pDb, piNew, pRc);
-  if( pNew ){
-    memcpy(pNew, pOld, sizeof(TreeLeaf));
-  }
-  return (TreeNode *)pNew;
+  tblobFree(pDb, &b);
+  return rc;
 }
 
 /*
-** The tree cursor passed as the second argument currently points to an 
-** internal node (not a leaf). Specifically, to a sub-tree pointer. This
-** function replaces the sub-tree that the cursor currently points to
-** with sub-tree pNew.
-**
-** The sub-tree may be replaced either by writing the "v2 data" on the
-** internal node, or by allocating a new TreeNode structure and then 
-** calling this function on the parent of the internal node.
+** The b-tree cursor passed as the first argument points to a leaf node.
+** Move it to the first key of the next leaf (if bNext is true) or to the
+** last key of the previous leaf (if bNext is false), skipping over any
+** empty leaves. If there is no such key, leave the cursor at EOF.
 */
-static int treeUpdatePtr(lsm_db *pDb, TreeCursor *pCsr, u32 iNew){
-  int rc = LSM_OK;
-  if( pCsr->iNode<0 ){
-    /* iNew is the new root node */
-    pDb->treehdr.root.iRoot = iNew;
-  }else{
-    /* If this node already has version 2 content, allocate a copy and
-    ** update the copy with the new pointer value. Otherwise, store the
-    ** new pointer as v2 data within the current node structure.  */
-
-    TreeNode *p;                  /* The node to be modified */
-    int iChildPtr;                /* apChild[] entry to modify */
-
-    p = pCsr->apTreeNode[pCsr->iNode];
-    iChildPtr = pCsr->aiCell[pCsr->iNode];
-
-    if( p->iV2 ){
-      /* The "allocate new TreeNode" option */
-      u32 iCopy;
-      TreeNode *pCopy;
-      pCopy = copyTreeNode(pDb, p, &iCopy, &rc);
-      if( pCopy ){
-        assert( rc==LSM_OK );
-        pCopy->aiChildPtr[iChildPtr] = iNew;
-        pCsr->iNode--;
-        rc = treeUpdatePtr(pDb, pCsr, iCopy);
-      }
-    }else{
-      /* The "v2 data" option */
-      u32 iPtr;
-      assert( pDb->treehdr.root.iTransId>0 );
+static void btreeStepLeaf(TreeCursor *pCsr, int bNext){
+  lsm_db *pDb = pCsr->pDb;
+  TreeRoot *pRoot = pCsr->pRoot;
+  const int iLeaf = pRoot->nHeight-1;
+  int iNode = iLeaf;
+  int nKey = 0;
 
-      if( pCsr->iNode ){
-        iPtr = getChildPtr(
-            pCsr->apTreeNode[pCsr->iNode-1], 
-            pDb->treehdr.root.iTransId, pCsr->aiCell[pCsr->iNode-1]
-        );
+  assert( pCsr->iNode==iLeaf );
+  do {
+    TreeNode *pNode;
+
+    /* Ascend to the nearest ancestor with a sub-tree to the right of (or 
+    ** to the left of) the one followed to reach the current leaf.  */
+    do {
+      if( (--iNode)<0 ){
+        pCsr->iNode = -1;
+        return;
+      }
+      pNode = pCsr->apTreeNode[iNode];
+    }while( bNext ? pCsr->aiCell[iNode]>=treeNodeKeys(pNode, pRoot->iTransId)
+                  : pCsr->aiCell[iNode]==0 
+    );
+    pCsr->aiCell[iNode] += (bNext ? 1 : -1);
+
+    /* Descend to the left-most (or right-most) leaf of that sub-tree. */
+    for(/* no-op */; iNode<iLeaf; iNode++){
+      u32 iPtr = getChildPtr(pNode, pRoot->iTransId, pCsr->aiCell[iNode]);
+      pNode = (TreeNode *)treeShmptr(pDb, iPtr);
+      nKey = treeNodeKeys(pNode, pRoot->iTransId);
+      pCsr->apTreeNode[iNode+1] = pNode;
+      if( bNext ){
+        pCsr->aiCell[iNode+1] = 0;
       }else{
-        iPtr = pDb->treehdr.root.iRoot;
+        pCsr->aiCell[iNode+1] = (u8)(nKey - (iNode+1==iLeaf));
       }
-      rc = intArrayAppend(pDb->pEnv, &pDb->rollback, iPtr);
+    }
+  }while( nKey==0 );
+}
 
-      if( rc==LSM_OK ){
-        p->iV2 = pDb->treehdr.root.iTransId;
-        p->iV2Child = (u8)iChildPtr;
-        p->iV2Ptr = iNew;
-      }
+/*
+** Move the b-tree cursor passed as the first argument to the next (if 
+** bNext is true) or previous (if bNext is false) entry in the tree.
+*/
+static void btreeStep(TreeCursor *pCsr, int bNext){
+  const int iLeaf = pCsr->iNode;
+  TreeNode *pLeaf = pCsr->apTreeNode[iLeaf];
+  int iCell = pCsr->aiCell[iLeaf];
+
+  assert( iLeaf==pCsr->pRoot->nHeight-1 );
+  if( bNext ){
+    if( iCell+1<treeNodeKeys(pLeaf, pCsr->pRoot->iTransId) ){
+      pCsr->aiCell[iLeaf] = (u8)(iCell+1);
+      return;
     }
+  }else if( iCell>0 ){
+    pCsr->aiCell[iLeaf] = (u8)(iCell-1);
+    return;
   }
+  btreeStepLeaf(pCsr, bNext);
+}
 
-  return rc;
+/*
+** The working version of a b-tree node, unpacked so that it may be
+** modified. Entry i consists of key aiKey[i], the prefix of that key
+** (aiPrefix[i]) and, for interior nodes, the child pointer to the right of
+** the key (aiChild[i]). aiSlot[i] is the slot that contains the entry in
+** the node being modified, or TREE_SLOT_NEW if the entry is new or has
+** been modified. TreeEdit structures are populated by treeEditInit() and
+** written back to the tree by treeEditWrite().
+*/
+struct TreeEdit {
+  int nKey;                       /* Number of entries */
+  u32 iLeft;                      /* Left-most child (interior nodes only) */
+  u8 aiSlot[TREE_NSLOT+1];        /* Slot containing entry, or SLOT_NEW */
+  u32 aiKey[TREE_NSLOT+1];        /* Pointer to TreeKey object */
+  u32 aiPrefix[TREE_NSLOT+1];     /* Prefix of key */
+  u32 aiChild[TREE_NSLOT+1];      /* Child to the right of key */
+};
+
+#define TREE_SLOT_NEW 0xFF
+
+static int treeEditWrite(lsm_db *, TreeCursor *, int, TreeEdit *);
+
+static void treeEditInit(TreeEdit *p, TreeNode *pNode, int bLeaf){
+  int v = treeNodeVersion(pNode, WORKING_VERSION);
+  int i;
+
+  p->nKey = pNode->anKey[v];
+  p->iLeft = (bLeaf ? 0 : pNode->aiLeftPtr[v]);
+  for(i=0; i<p->nKey; i++){
+    int iSlot = pNode->aaOrder[v][i];
+    p->aiSlot[i] = (u8)iSlot;
+    p->aiKey[i] = pNode->aiKeyPtr[iSlot];
+    p->aiPrefix[i] = pNode->aiPrefix[iSlot];
+    p->aiChild[i] = (bLeaf ? 0 : pNode->aiChildPtr[iSlot]);
+  }
 }
 
 /*
-** Cursor pCsr points at a node that is part of pTree. This function
-** inserts a new key and optionally child node pointer into that node.
-**
-** The position into which the new key and pointer are inserted is
-** determined by the iSlot parameter. The new key will be inserted to
-** the left of the key currently stored in apKey[iSlot]. Or, if iSlot is
-** greater than the index of the rightmost key in the node.
-**
-** Pointer pLeftPtr points to a child tree that contains keys that are
-** smaller than pTreeKey.
+** Insert a new entry at position iPos of the node being edited.
 */
-static int treeInsert(
-  lsm_db *pDb,                    /* Database handle */
-  TreeCursor *pCsr,               /* Cursor indicating path to insert at */
-  u32 iLeftPtr,                   /* Left child pointer */
-  u32 iTreeKey,                   /* Location of key to insert */
-  u32 iRightPtr,                  /* Right child pointer */
-  int iSlot                       /* Position to insert key into */
+static void treeEditInsert(
+  TreeEdit *p, 
+  int iPos, 
+  u32 iKey, 
+  u32 iPrefix, 
+  u32 iChild
 ){
-  int rc = LSM_OK;
-  TreeNode *pNode = pCsr->apTreeNode[pCsr->iNode];
-
-  /* Check if the node is currently full. If so, split pNode in two and
-  ** call this function recursively to add a key to the parent. Otherwise, 
-  ** insert the new key directly into pNode.  */
-  assert( pNode->aiKeyPtr[1] );
-  if( pNode->aiKeyPtr[0] && pNode->aiKeyPtr[2] ){
-    u32 iLeft; TreeNode *pLeft;   /* New left-hand sibling node */
-    u32 iRight; TreeNode *pRight; /* New right-hand sibling node */
-
-    pLeft = newTreeNode(pDb, &iLeft, &rc);
-    pRight = newTreeNode(pDb, &iRight, &rc);
-    if( rc ) return rc;
-
-    pLeft->aiChildPtr[1] = getChildPtr(pNode, WORKING_VERSION, 0);
-    pLeft->aiKeyPtr[1] = pNode->aiKeyPtr[0];
-    pLeft->aiChildPtr[2] = getChildPtr(pNode, WORKING_VERSION, 1);
-
-    pRight->aiChildPtr[1] = getChildPtr(pNode, WORKING_VERSION, 2);
-    pRight->aiKeyPtr[1] = pNode->aiKeyPtr[2];
-    pRight->aiChildPtr[2] = getChildPtr(pNode, WORKING_VERSION, 3);
-
-    if( pCsr->iNode==0 ){
-      /* pNode is the root of the tree. Grow the tree by one level. */
-      u32 iRoot; TreeNode *pRoot; /* New root node */
-
-      pRoot = newTreeNode(pDb, &iRoot, &rc);
-      pRoot->aiKeyPtr[1] = pNode->aiKeyPtr[1];
-      pRoot->aiChildPtr[1] = iLeft;
-      pRoot->aiChildPtr[2] = iRight;
-
-      pDb->treehdr.root.iRoot = iRoot;
-      pDb->treehdr.root.nHeight++;
-    }else{
-
-      pCsr->iNode--;
-      rc = treeInsert(pDb, pCsr, 
-          iLeft, pNode->aiKeyPtr[1], iRight, pCsr->aiCell[pCsr->iNode]
-      );
-    }
+  int nMove = p->nKey - iPos;
+  assert( p->nKey<=TREE_NSLOT && iPos>=0 && iPos<=p->nKey );
+  memmove(&p->aiSlot[iPos+1], &p->aiSlot[iPos], nMove * sizeof(u8));
+  memmove(&p->aiKey[iPos+1], &p->aiKey[iPos], nMove * sizeof(u32));
+  memmove(&p->aiPrefix[iPos+1], &p->aiPrefix[iPos], nMove * sizeof(u32));
+  memmove(&p->aiChild[iPos+1], &p->aiChild[iPos], nMove * sizeof(u32));
+  p->aiSlot[iPos] = TREE_SLOT_NEW;
+  p->aiKey[iPos] = iKey;
+  p->aiPrefix[iPos] = iPrefix;
+  p->aiChild[iPos] = iChild;
+  p->nKey++;
+}
 
-    assert( pLeft->iV2==0 );
-    assert( pRight->iV2==0 );
-    switch( iSlot ){
-      case 0:
-        pLeft->aiKeyPtr[0] = iTreeKey;
-        pLeft->aiChildPtr[0] = iLeftPtr;
-        if( iRightPtr ) pLeft->aiChildPtr[1] = iRightPtr;
-        break;
-      case 1:
-        pLeft->aiChildPtr[3] = (iRightPtr ? iRightPtr : pLeft->aiChildPtr[2]);
-        pLeft->aiKeyPtr[2] = iTreeKey;
-        pLeft->aiChildPtr[2] = iLeftPtr;
-        break;
-      case 2:
-        pRight->aiKeyPtr[0] = iTreeKey;
-        pRight->aiChildPtr[0] = iLeftPtr;
-        if( iRightPtr ) pRight->aiChildPtr[1] = iRightPtr;
-        break;
-      case 3:
-        pRight->aiChildPtr[3] = (iRightPtr ? iRightPtr : pRight->aiChildPtr[2]);
-        pRight->aiKeyPtr[2] = iTreeKey;
-        pRight->aiChildPtr[2] = iLeftPtr;
-        break;
-    }
+/*
+** Remove the nDel entries starting at position iPos from the node being
+** edited.
+*/
+static void treeEditRemove(TreeEdit *p, int iPos, int nDel){
+  int nMove = p->nKey - iPos - nDel;
+  assert( nMove>=0 );
+  memmove(&p->aiSlot[iPos], &p->aiSlot[iPos+nDel], nMove * sizeof(u8));
+  memmove(&p->aiKey[iPos], &p->aiKey[iPos+nDel], nMove * sizeof(u32));
+  memmove(&p->aiPrefix[iPos], &p->aiPrefix[iPos+nDel], nMove * sizeof(u32));
+  memmove(&p->aiChild[iPos], &p->aiChild[iPos+nDel], nMove * sizeof(u32));
+  p->nKey -= nDel;
+}
 
+/*
+** Set the iCell'th child pointer of the interior node being edited.
+*/
+static void treeEditSetChild(TreeEdit *p, int iCell, u32 iChild){
+  if( iCell==0 ){
+    p->iLeft = iChild;
   }else{
-    TreeNode *pNew;
-    u32 *piKey;
-    u32 *piChild;
-    u32 iStore = 0;
-    u32 iNew = 0;
-    int i;
-
-    /* Allocate a new version of node pNode. */
-    pNew = newTreeNode(pDb, &iNew, &rc);
-    if( rc ) return rc;
+    p->aiSlot[iCell-1] = TREE_SLOT_NEW;
+    p->aiChild[iCell-1] = iChild;
+  }
+}
 
-    piKey = pNew->aiKeyPtr;
-    piChild = pNew->aiChildPtr;
+/*
+** Copy entries iFirst to (iFirst+nEntry-1) of the edit into the first
+** nEntry slots of new node pNew, in order.
+*/
+static void treeEditFill(
+  TreeNode *pNew, 
+  int bLeaf, 
+  TreeEdit *p, 
+  int iFirst, 
+  int nEntry
+){
+  int i;
+  assert( pNew->iV2==0 && nEntry<=TREE_NSLOT );
+  for(i=0; i<nEntry; i++){
+    pNew->aaOrder[0][i] = (u8)i;
+    pNew->aiKeyPtr[i] = p->aiKey[iFirst+i];
+    pNew->aiPrefix[i] = p->aiPrefix[iFirst+i];
+    if( bLeaf==0 ) pNew->aiChildPtr[i] = p->aiChild[iFirst+i];
+  }
+  pNew->anKey[0] = (u8)nEntry;
+}
 
-    for(i=0; i<iSlot; i++){
-      if( pNode->aiKeyPtr[i] ){
-        *(piKey++) = pNode->aiKeyPtr[i];
-        *(piChild++) = getChildPtr(pNode, WORKING_VERSION, i);
-      }
+/*
+** Recompute the prefixes of entries iFirst to (iFirst+nEntry-1) of the 
+** edit for a node with the nSkip value passed as the fourth argument.
+*/
+static void treeEditPrefix(
+  lsm_db *pDb, 
+  TreeEdit *p, 
+  int iFirst, 
+  int nEntry, 
+  int nSkip,
+  int *pRc
+){
+  TreeBlob b = {0, 0};
+  int i;
+  for(i=iFirst; *pRc==LSM_OK && i<iFirst+nEntry; i++){
+    TreeKey *pKey = treeKeyLoad(pDb, p->aiKey[i], &b, pRc);
+    if( *pRc==LSM_OK ){
+      p->aiPrefix[i] = treePrefix(TKV_KEY(pKey), pKey->nKey, nSkip);
     }
+  }
+  tblobFree(pDb, &b);
+}
 
-    *piKey++ = iTreeKey;
-    *piChild++ = iLeftPtr;
+/*
+** Return the prefix of the key stored in TreeKey iKey for a node with the
+** nSkip value passed as the third argument.
+*/
+static u32 treeKeyPrefix(lsm_db *pDb, u32 iKey, int nSkip, int *pRc){
+  u32 iRet = 0;
+  TreeBlob b = {0, 0};
+  TreeKey *pKey = treeKeyLoad(pDb, iKey, &b, pRc);
+  if( *pRc==LSM_OK ){
+    iRet = treePrefix(TKV_KEY(pKey), pKey->nKey, nSkip);
+  }
+  tblobFree(pDb, &b);
+  return iRet;
+}
 
-    iStore = iRightPtr;
-    for(i=iSlot; i<3; i++){
-      if( pNode->aiKeyPtr[i] ){
-        *(piKey++) = pNode->aiKeyPtr[i];
-        *(piChild++) = iStore ? iStore : getChildPtr(pNode, WORKING_VERSION, i);
-        iStore = 0;
-      }
+/*
+** Return the number of leading bytes shared by the keys stored in TreeKey
+** objects iKey1 and iKey2, to a maximum of 0xFFFF. If either iKey1 or iKey2
+** is zero, return zero.
+*/
+static int treeKeyCommon(lsm_db *pDb, u32 iKey1, u32 iKey2, int *pRc){
+  int nRet = 0;
+  if( iKey1 && iKey2 ){
+    TreeBlob b1 = {0, 0};
+    TreeBlob b2 = {0, 0};
+    TreeKey *p1 = treeKeyLoad(pDb, iKey1, &b1, pRc);
+    TreeKey *p2 = treeKeyLoad(pDb, iKey2, &b2, pRc);
+    if( *pRc==LSM_OK ){
+      const u8 *a1 = (const u8 *)TKV_KEY(p1);
+      const u8 *a2 = (const u8 *)TKV_KEY(p2);
+      int nMax = LSM_MIN(LSM_MIN(p1->nKey, p2->nKey), 0xFFFF);
+      while( nRet<nMax && a1[nRet]==a2[nRet] ) nRet++;
     }
+    tblobFree(pDb, &b1);
+    tblobFree(pDb, &b2);
+  }
+  return nRet;
+}
 
-    if( iStore ){
-      *piChild = iStore;
-    }else{
-      *piChild = getChildPtr(pNode, WORKING_VERSION, 
-          (pNode->aiKeyPtr[2] ? 3 : 2)
-      );
+/*
+** Set *piLo and *piHi to the separator keys that bound the set of keys 
+** that may be stored in the sub-tree headed by node apTreeNode[iNode] of
+** the cursor. All such keys are greater than or equal to *piLo and smaller
+** than *piHi. Either value is set to 0 if there is no such bound.
+*/
+static void treeNodeBounds(TreeCursor *pCsr, int iNode, u32 *piLo, u32 *piHi){
+  u32 iLo = 0;
+  u32 iHi = 0;
+  int i;
+  for(i=iNode-1; i>=0 && (iLo==0 || iHi==0); i--){
+    TreeNode *p = pCsr->apTreeNode[i];
+    int iCell = pCsr->aiCell[i];
+    if( iLo==0 && iCell>0 ){
+      iLo = getKeyPtr(p, WORKING_VERSION, iCell-1);
+    }
+    if( iHi==0 && iCell<treeNodeKeys(p, WORKING_VERSION) ){
+      iHi = getKeyPtr(p, WORKING_VERSION, iCell);
     }
-    pCsr->iNode--;
-    rc = treeUpdatePtr(pDb, pCsr, iNew);
   }
+  *piLo = iLo;
+  *piHi = iHi;
+}
+
+/*
+** Return the offset of node apTreeNode[iNode] of the cursor.
+*/
+static u32 treeNodeOffset(lsm_db *pDb, TreeCursor *pCsr, int iNode){
+  if( iNode==0 ) return pDb->treehdr.root.iRoot;
+  return getChildPtr(
+      pCsr->apTreeNode[iNode-1], WORKING_VERSION, pCsr->aiCell[iNode-1]
+  );
+}
 
+/*
+** Replace the child sub-tree of node apTreeNode[iNode] that the cursor 
+** points to with sub-tree iNew. Or, if iNode is negative, make iNew the
+** root of the tree.
+*/
+static int treeUpdatePtr(lsm_db *pDb, TreeCursor *pCsr, int iNode, u32 iNew){
+  int rc = LSM_OK;
+  if( iNode<0 ){
+    pDb->treehdr.root.iRoot = iNew;
+  }else{
+    TreeEdit edit;
+    treeEditInit(&edit, pCsr->apTreeNode[iNode], 0);
+    treeEditSetChild(&edit, pCsr->aiCell[iNode], iNew);
+    rc = treeEditWrite(pDb, pCsr, iNode, &edit);
+  }
   return rc;
 }
 
-static int treeInsertLeaf(
-  lsm_db *pDb,                    /* Database handle */
-  TreeCursor *pCsr,               /* Cursor structure */
-  u32 iTreeKey,                   /* Key pointer to insert */
-  int iSlot                       /* Insert key to the left of this */
-){
-  int rc = LSM_OK;                /* Return code */
-  TreeNode *pLeaf = pCsr->apTreeNode[pCsr->iNode];
-  TreeLeaf *pNew;
-  u32 iNew;
+/*
+** Node apTreeNode[iNode] of the cursor is to be replaced by the contents
+** of *p, which are too large for a single node. Split the entries between
+** two new nodes and add a separator key and pointer to the second of them
+** to the parent node.
+*/
+static int treeEditSplit(lsm_db *pDb, TreeCursor *pCsr, int iNode, TreeEdit *p){
+  TreeRoot *pRoot = &pDb->treehdr.root;
+  TreeNode *pNode = pCsr->apTreeNode[iNode];
+  const int bLeaf = (iNode==pRoot->nHeight-1);
+  int rc = LSM_OK;
+  int iMid;                       /* Entry to use as separator */
+  u32 iSep;                       /* Separator key */
+  u32 iLo, iHi;                   /* Bounds of node being split */
+  u32 iLeft; TreeNode *pLeft;     /* New left-hand node */
+  u32 iRight; TreeNode *pRight;   /* New right-hand node */
+
+  assert( p->nKey==TREE_NSLOT+1 );
+  treeNodeBounds(pCsr, iNode, &iLo, &iHi);
+
+  /* Usually the entries are divided evenly between the two new nodes. But
+  ** if the new entry is the last on the right-most node of its level, 
+  ** assume that keys are being inserted in order and leave the left-hand
+  ** node as full as possible.  */
+  if( iHi==0 && p->aiSlot[p->nKey-1]==TREE_SLOT_NEW ){
+    iMid = p->nKey - 1 - (bLeaf==0);
+  }else{
+    iMid = p->nKey / 2;
+  }
+  iSep = p->aiKey[iMid];
 
-  assert( iSlot>=0 && iSlot<=4 );
-  assert( pCsr->iNode>0 );
-  assert( pLeaf->aiKeyPtr[1] );
+  pLeft = newTreeNode(pDb, bLeaf, &iLeft, &rc);
+  pRight = newTreeNode(pDb, bLeaf, &iRight, &rc);
+  if( rc!=LSM_OK ) return rc;
 
-  pCsr->iNode--;
+  pLeft->nSkip = (u16)treeKeyCommon(pDb, iLo, iSep, &rc);
+  pRight->nSkip = (u16)treeKeyCommon(pDb, iSep, iHi, &rc);
+  if( pLeft->nSkip!=pNode->nSkip ){
+    treeEditPrefix(pDb, p, 0, iMid, pLeft->nSkip, &rc);
+  }
+  if( pRight->nSkip!=pNode->nSkip ){
+    treeEditPrefix(pDb, p, iMid, p->nKey-iMid, pRight->nSkip, &rc);
+  }
+  if( rc!=LSM_OK ) return rc;
 
-  pNew = newTreeLeaf(pDb, &iNew, &rc);
-  if( pNew ){
-    if( pLeaf->aiKeyPtr[0] && pLeaf->aiKeyPtr[2] ){
-      /* The leaf is full. Split it in two. */
-      TreeLeaf *pRight;
-      u32 iRight;
-      pRight = newTreeLeaf(pDb, &iRight, &rc);
-      if( pRight ){
-        assert( rc==LSM_OK );
-        pNew->aiKeyPtr[1] = pLeaf->aiKeyPtr[0];
-        pRight->aiKeyPtr[1] = pLeaf->aiKeyPtr[2];
-        switch( iSlot ){
-          case 0: pNew->aiKeyPtr[0] = iTreeKey; break;
-          case 1: pNew->aiKeyPtr[2] = iTreeKey; break;
-          case 2: pRight->aiKeyPtr[0] = iTreeKey; break;
-          case 3: pRight->aiKeyPtr[2] = iTreeKey; break;
-        }
+  treeEditFill(pLeft, bLeaf, p, 0, iMid);
+  if( bLeaf ){
+    treeEditFill(pRight, bLeaf, p, iMid, p->nKey-iMid);
+  }else{
+    treeEditFill(pRight, bLeaf, p, iMid+1, p->nKey-iMid-1);
+    pLeft->aiLeftPtr[0] = p->iLeft;
+    pRight->aiLeftPtr[0] = p->aiChild[iMid];
+  }
 
-        rc = treeInsert(pDb, pCsr, iNew, pLeaf->aiKeyPtr[1], iRight, 
-            pCsr->aiCell[pCsr->iNode]
-        );
-      }
-    }else{
-      int iOut = 0;
-      int i;
-      for(i=0; i<4; i++){
-        if( i==iSlot ) pNew->aiKeyPtr[iOut++] = iTreeKey;
-        if( i<3 && pLeaf->aiKeyPtr[i] ){
-          pNew->aiKeyPtr[iOut++] = pLeaf->aiKeyPtr[i];
-        }
-      }
-      rc = treeUpdatePtr(pDb, pCsr, iNew);
+  if( iNode==0 ){
+    /* The node being split is the root of the tree. Grow the tree by one
+    ** level. */
+    u32 iNew;
+    TreeNode *pNew = newTreeNode(pDb, 0, &iNew, &rc);
+    if( pNew ){
+      pNew->aiKeyPtr[0] = iSep;
+      pNew->aiPrefix[0] = treeKeyPrefix(pDb, iSep, 0, &rc);
+      pNew->aiChildPtr[0] = iRight;
+      pNew->aiLeftPtr[0] = iLeft;
+      pNew->anKey[0] = 1;
+      pRoot->iRoot = iNew;
+      pRoot->nHeight++;
+    }
+  }else{
+    TreeEdit edit;
+    TreeNode *pParent = pCsr->apTreeNode[iNode-1];
+    int iCell = pCsr->aiCell[iNode-1];
+    u32 iPrefix = treeKeyPrefix(pDb, iSep, pParent->nSkip, &rc);
+    if( rc==LSM_OK ){
+      treeEditInit(&edit, pParent, 0);
+      treeEditSetChild(&edit, iCell, iLeft);
+      treeEditInsert(&edit, iCell, iSep, iPrefix, iRight);
+      rc = treeEditWrite(pDb, pCsr, iNode-1, &edit);
     }
   }
 
   return rc;
 }
 
-void lsmTreeMakeOld(lsm_db *pDb){
+/*
+** Replace the working version of node apTreeNode[iNode] of the cursor 
+** with the entries in *p.
+**
+** If the node has no v2 data and there are enough slots not used by v1 for
+** all new and modified entries, the new version is written to the node as
+** its v2 data. Otherwise, a new node (or two, if the node must be split)
+** is allocated and the parent node modified to point to it.
+**
+** v2 data written by the current transaction is not visible to readers.
+** So, unless there is an open sub-transaction that may be rolled back to
+** a point where the v2 data was as it is now, it may be overwritten in
+** the same way.
+*/
+static int treeEditWrite(lsm_db *pDb, TreeCursor *pCsr, int iNode, TreeEdit *p){
+  TreeRoot *pRoot = &pDb->treehdr.root;
+  TreeNode *pNode = pCsr->apTreeNode[iNode];
+  const int bLeaf = (iNode==pRoot->nHeight-1);
+  const int bRewrite = (pNode->iV2==pRoot->iTransId && pDb->nTransOpen<=1);
+  int rc = LSM_OK;
+  int i;
+
+  if( p->nKey>TREE_NSLOT ){
+    return treeEditSplit(pDb, pCsr, iNode, p);
+  }
+
+  if( pNode->iV2==0 || bRewrite ){
+    u32 mUsed = 0;                /* Mask of slots that may not be written */
+    int nNew = 0;                 /* Number of new entries */
+    int nFree = 0;                /* Number of slots that may be written */
+
+    assert( TREE_NSLOT<=32 );
+    for(i=0; i<pNode->anKey[0]; i++){
+      mUsed |= ((u32)1 << pNode->aaOrder[0][i]);
+    }
+    for(i=0; i<p->nKey; i++){
+      if( p->aiSlot[i]==TREE_SLOT_NEW ){
+        nNew++;
+      }else{
+        mUsed |= ((u32)1 << p->aiSlot[i]);
+      }
+    }
+    for(i=0; i<TREE_NSLOT; i++){
+      if( (mUsed & ((u32)1 << i))==0 ) nFree++;
+    }
+
+    if( nNew<=nFree ){
+      /* The "v2 data" option */
+      int iSlot = 0;
+      assert( pRoot->iTransId>0 );
+      if( bRewrite==0 ){
+        rc = intArrayAppend(
+            pDb->pEnv, &pDb->rollback, treeNodeOffset(pDb, pCsr, iNode)
+        );
+        if( rc!=LSM_OK ) return rc;
+      }
+
+      for(i=0; i<p->nKey; i++){
+        if( p->aiSlot[i]==TREE_SLOT_NEW ){
+          while( mUsed & ((u32)1 << iSlot) ) iSlot++;
+          mUsed |= ((u32)1 << iSlot);
+          pNode->aiKeyPtr[iSlot] = p->aiKey[i];
+          pNode->aiPrefix[iSlot] = p->aiPrefix[i];
+          if( bLeaf==0 ) pNode->aiChildPtr[iSlot] = p->aiChild[i];
+          p->aiSlot[i] = (u8)iSlot;
+        }
+        pNode->aaOrder[1][i] = p->aiSlot[i];
+      }
+      pNode->anKey[1] = (u8)p->nKey;
+      if( bLeaf==0 ) pNode->aiLeftPtr[1] = p->iLeft;
+      pNode->iV2 = pRoot->iTransId;
+      return LSM_OK;
+    }
+  }
+
+  /* The "allocate new node" option */
+  {
+    u32 iNew;
+    TreeNode *pNew = newTreeNode(pDb, bLeaf, &iNew, &rc);
+    if( pNew ){
+      pNew->nSkip = pNode->nSkip;
+      treeEditFill(pNew, bLeaf, p, 0, p->nKey);
+      if( bLeaf==0 ) pNew->aiLeftPtr[0] = p->iLeft;
+      rc = treeUpdatePtr(pDb, pCsr, iNode-1, iNew);
+    }
+  }
+  return rc;
+}
+
+void lsmTreeMakeOld(lsm_db *pDb){
 
   /* A write transaction must be open. Otherwise the code below that
   ** assumes (pDb->pClient->iLogOff) is current may malfunction. 
@@ -1084,6 +1596,8 @@ void lsmTreeMakeOld(lsm_db *pDb){
 
     pDb->treehdr.oldcksum0 = pDb->treehdr.log.cksum0;
     pDb->treehdr.oldcksum1 = pDb->treehdr.log.cksum1;
+    pDb->treehdr.iOldVlogGc = pDb->treehdr.iVlogGc;
+    pDb->treehdr.iVlogGc = 0;
     pDb->treehdr.iOldShmid = pDb->treehdr.iNextShmid-1;
     memcpy(&pDb->treehdr.oldroot, &pDb->treehdr.root, sizeof(TreeRoot));
 
@@ -1118,6 +1632,9 @@ int lsmTreeInit(lsm_db *pDb){
 
   memset(&pDb->treehdr, 0, sizeof(TreeHeader));
   pDb->treehdr.root.iTransId = 1;
+  if( pDb->bSkiplist && lsmDbMultiProc(pDb)==0 ){
+    pDb->treehdr.eTree = TREE_SKIPLIST;
+  }
   pDb->treehdr.iFirst = 1;
   pDb->treehdr.nChunk = 2;
   pDb->treehdr.iWrite = LSM_SHM_CHUNK_SIZE + LSM_SHM_CHUNK_HDR;
@@ -1217,35 +1734,40 @@ static int treeCheckLinkedList(lsm_db *db){
 }
 
 /*
-** Iterate through the current in-memory tree. If there are any v2-pointers
-** with transaction ids larger than db->treehdr.iTransId, zero them.
+** Clear the v2 data of node iNode, and of all nodes in the sub-tree that
+** it heads, if it was written by a transaction with an id greater than
+** iTransId. Parameter nHeight is the height of the sub-tree (1 for a leaf).
+*/
+static void treeRepairNode(lsm_db *db, u32 iNode, int nHeight, u32 iTransId){
+  TreeNode *pNode = (TreeNode *)treeShmptr(db, iNode);
+  if( pNode->iV2>iTransId ){
+    pNode->iV2 = 0;
+  }
+  if( nHeight>1 ){
+    int i;
+    for(i=0; i<=treeNodeKeys(pNode, iTransId); i++){
+      u32 iChild = getChildPtr(pNode, iTransId, i);
+      treeRepairNode(db, iChild, nHeight-1, iTransId);
+    }
+  }
+}
+
+/*
+** The xRepair() method for b-tree structures.
+**
+** Iterate through the current in-memory tree. If there are any nodes with
+** v2 data written by transactions with ids larger than 
+** db->treehdr.iTransId, zero the iV2 field.
 */
 static int treeRepairPtrs(lsm_db *db){
+  TreeRoot *pRoot = &db->treehdr.root;
   int rc = LSM_OK;
 
-  if( db->treehdr.root.nHeight>1 ){
-    TreeCursor csr;               /* Cursor used to iterate through tree */
-    u32 iTransId = db->treehdr.root.iTransId;
-
-    /* Initialize the cursor structure. Also decrement the nHeight variable
-    ** in the tree-header. This will prevent the cursor from visiting any
-    ** leaf nodes.  */
-    db->treehdr.root.nHeight--;
-    treeCursorInit(db, 0, &csr);
-
-    rc = lsmTreeCursorEnd(&csr, 0);
-    while( rc==LSM_OK && lsmTreeCursorValid(&csr) ){
-      TreeNode *pNode = csr.apTreeNode[csr.iNode];
-      if( pNode->iV2>iTransId ){
-        pNode->iV2Child = 0;
-        pNode->iV2Ptr = 0;
-        pNode->iV2 = 0;
-      }
-      rc = lsmTreeCursorNext(&csr);
+  if( pRoot->iRoot ){
+    rc = lsmShmCacheChunks(db, db->treehdr.nChunk);
+    if( rc==LSM_OK ){
+      treeRepairNode(db, pRoot->iRoot, pRoot->nHeight, pRoot->iTransId);
     }
-    tblobFree(csr.pDb, &csr.blob);
-
-    db->treehdr.root.nHeight++;
   }
 
   return rc;
@@ -1354,9 +1876,9 @@ int lsmTreeRepair(lsm_db *db){
   ** restored before returning.  */
   memcpy(&hdr, &db->treehdr, sizeof(TreeHeader));
 
-  /* Walk the tree. Zero any v2 pointers with a transaction-id greater than
-  ** the transaction-id currently in the tree-headers.  */
-  rc = treeRepairPtrs(db);
+  /* Walk the tree. Remove any changes made by transactions with ids greater
+  ** than the transaction-id currently in the tree-headers.  */
+  rc = treeMethods(db)->xRepair(db);
 
   /* Repair the linked list of shared-memory chunks. */
   if( rc==LSM_OK ){
@@ -1367,77 +1889,6 @@ int lsmTreeRepair(lsm_db *db){
   return rc;
 }
 
-static void treeOverwriteKey(lsm_db *db, TreeCursor *pCsr, u32 iKey, int *pRc){
-  if( *pRc==LSM_OK ){
-    TreeRoot *p = &db->treehdr.root;
-    TreeNode *pNew;
-    u32 iNew;
-    TreeNode *pNode = pCsr->apTreeNode[pCsr->iNode];
-    int iCell = pCsr->aiCell[pCsr->iNode];
-
-    /* Create a copy of this node */
-    if( (pCsr->iNode>0 && pCsr->iNode==(p->nHeight-1)) ){
-      pNew = copyTreeLeaf(db, (TreeLeaf *)pNode, &iNew, pRc);
-    }else{
-      pNew = copyTreeNode(db, pNode, &iNew, pRc);
-    }
-
-    if( pNew ){
-      /* Modify the value in the new version */
-      pNew->aiKeyPtr[iCell] = iKey;
-
-      /* Change the pointer in the parent (if any) to point at the new 
-       ** TreeNode */
-      pCsr->iNode--;
-      treeUpdatePtr(db, pCsr, iNew);
-    }
-  }
-}
-
-static int treeNextIsEndDelete(lsm_db *db, TreeCursor *pCsr){
-  int iNode = pCsr->iNode;
-  int iCell = pCsr->aiCell[iNode]+1;
-
-  /* Cursor currently points to a leaf node. */
-  assert( pCsr->iNode==(db->treehdr.root.nHeight-1) );
-
-  while( iNode>=0 ){
-    TreeNode *pNode = pCsr->apTreeNode[iNode];
-    if( iCell<3 && pNode->aiKeyPtr[iCell] ){
-      int rc = LSM_OK;
-      TreeKey *pKey = treeShmptr(db, pNode->aiKeyPtr[iCell]);
-      assert( rc==LSM_OK );
-      return ((pKey->flags & LSM_END_DELETE) ? 1 : 0);
-    }
-    iNode--;
-    iCell = pCsr->aiCell[iNode];
-  }
-
-  return 0;
-}
-
-static int treePrevIsStartDelete(lsm_db *db, TreeCursor *pCsr){
-  int iNode = pCsr->iNode;
-
-  /* Cursor currently points to a leaf node. */
-  assert( pCsr->iNode==(db->treehdr.root.nHeight-1) );
-
-  while( iNode>=0 ){
-    TreeNode *pNode = pCsr->apTreeNode[iNode];
-    int iCell = pCsr->aiCell[iNode]-1;
-    if( iCell>=0 && pNode->aiKeyPtr[iCell] ){
-      int rc = LSM_OK;
-      TreeKey *pKey = treeShmptr(db, pNode->aiKeyPtr[iCell]);
-      assert( rc==LSM_OK );
-      return ((pKey->flags & LSM_START_DELETE) ? 1 : 0);
-    }
-    iNode--;
-  }
-
-  return 0;
-}
-
-
 static int treeInsertEntry(
   lsm_db *pDb,                    /* Database handle */
   int flags,                      /* Flags associated with entry */
@@ -1457,19 +1908,27 @@ static int treeInsertEntry(
   assert_tree_looks_ok(LSM_OK, pTree);
   assert( flags==LSM_INSERT       || flags==LSM_POINT_DELETE 
        || flags==LSM_START_DELETE || flags==LSM_END_DELETE 
+       || flags==(LSM_INSERT|LSM_VALUEPTR)
   );
   assert( (flags & LSM_CONTIGUOUS)==0 );
 #if 0
   dump_tree_contents(pDb, "before");
 #endif
 
+  /* Seek to the leaf (or internal node) that the new key belongs on */
+  treeCursorInit(pDb, 0, &csr);
+  res = -1;
   if( p->iRoot ){
-    TreeKey *pRes;                /* Key at end of seek operation */
-    treeCursorInit(pDb, 0, &csr);
-
-    /* Seek to the leaf (or internal node) that the new key belongs on */
     rc = lsmTreeCursorSeek(&csr, pKey, nKey, &res);
-    pRes = csrGetKey(&csr, &csr.blob, &rc);
+  }
+
+  /* The cursor is left pointing to an entry unless the tree contains no
+  ** entries visible to the writer, in which case it is left at EOF. This
+  ** may happen even if p->iRoot is non-zero - if all b-tree leaves are
+  ** empty or all skiplist nodes are dead.  */
+  if( rc==LSM_OK && lsmTreeCursorValid(&csr) ){
+    TreeKey *pRes;                /* Key at end of seek operation */
+    pRes = csrGetEntry(&csr, &csr.blob, &rc);
     if( rc!=LSM_OK ) return rc;
 
     if( flags==LSM_START_DELETE ){
@@ -1477,7 +1936,7 @@ static int treeInsertEntry(
       ** occurs immediately before the new entry is already a START_DELETE,
       ** then the new entry is not required.  */
       if( (res<=0 && (pRes->flags & LSM_START_DELETE))
-       || (res>0  && treePrevIsStartDelete(pDb, &csr))
+       || (res>0  && csr.pMethods->xPrevIsStartDelete(pDb, &csr))
       ){ 
         goto insert_entry_out;
       }
@@ -1485,7 +1944,7 @@ static int treeInsertEntry(
       /* When inserting an start-delete-range entry, if the key that
       ** occurs immediately after the new entry is already an END_DELETE,
       ** then the new entry is not required.  */
-      if( (res<0  && treeNextIsEndDelete(pDb, &csr))
+      if( (res<0  && csr.pMethods->xNextIsEndDelete(pDb, &csr))
        || (res>=0 && (pRes->flags & LSM_END_DELETE))
       ){
         goto insert_entry_out;
@@ -1509,9 +1968,8 @@ static int treeInsertEntry(
         flags = flags | (pRes->flags & (LSM_END_DELETE|LSM_START_DELETE));
       }
     }
-  }else{
-    memset(&csr, 0, sizeof(TreeCursor));
   }
+  if( rc!=LSM_OK ) goto insert_entry_out;
 
   /* Allocate and populate a new key-value pair structure */
   pTreeKey = newTreeKey(pDb, &iTreeKey, pKey, nKey, pVal, nVal, &rc);
@@ -1519,47 +1977,81 @@ static int treeInsertEntry(
   assert( pTreeKey->flags==0 || pTreeKey->flags==LSM_CONTIGUOUS );
   pTreeKey->flags |= flags;
 
+  rc = csr.pMethods->xInsert(pDb, &csr, res, iTreeKey);
+
+#if 0
+  dump_tree_contents(pDb, "after");
+#endif
+ insert_entry_out:
+  tblobFree(pDb, &csr.blob);
+  assert_tree_looks_ok(rc, pTree);
+  return rc;
+}
+
+/*
+** The xInsert() method for b-tree structures.
+*/
+static int btreeInsertKey(
+  lsm_db *pDb,                    /* Database handle */
+  TreeCursor *pCsr,               /* Cursor positioned by writer's seek */
+  int res,                        /* Result of seek on pCsr */
+  u32 iTreeKey                    /* Key to insert */
+){
+  int rc = LSM_OK;
+  TreeRoot *p = &pDb->treehdr.root;
+
   if( p->iRoot==0 ){
-    /* The tree is completely empty. Add a new root node and install
-    ** (pKey/nKey) as the middle entry. Even though it is a leaf at the
-    ** moment, use newTreeNode() to allocate the node (i.e. allocate enough
-    ** space for the fields used by interior nodes). This is because the
-    ** treeInsert() routine may convert this node to an interior node. */
-    TreeNode *pRoot = newTreeNode(pDb, &p->iRoot, &rc);
+    /* The tree is completely empty. Add a new root node containing the
+    ** new key only. */
+    TreeNode *pRoot = newTreeNode(pDb, 1, &p->iRoot, &rc);
     if( rc==LSM_OK ){
       assert( p->nHeight==0 );
-      pRoot->aiKeyPtr[1] = iTreeKey;
+      pRoot->aiKeyPtr[0] = iTreeKey;
+      pRoot->aiPrefix[0] = treeKeyPrefix(pDb, iTreeKey, 0, &rc);
+      pRoot->anKey[0] = 1;
       p->nHeight = 1;
     }
   }else{
+    TreeEdit edit;
+    TreeNode *pLeaf;
+    int iLeaf;
+    int iCell;
+
+    /* If the seek landed on an empty leaf, the cursor was moved to an
+    ** entry on some other leaf. Seek back to the leaf that the new key
+    ** belongs on.  */
+    if( pCsr->bSeekEmpty ){
+      TreeBlob b = {0, 0};
+      TreeKey *pKey = treeKeyLoad(pDb, iTreeKey, &b, &rc);
+      int bEq = 0;
+      if( rc==LSM_OK ){
+        rc = btreeSeekLeaf(pCsr, TKV_KEY(pKey), pKey->nKey, &bEq);
+      }
+      tblobFree(pDb, &b);
+      if( rc!=LSM_OK ) return rc;
+      res = (bEq ? 0 : 1);
+    }
+
+    /* The cursor now points to the leaf node into which the new entry 
+    ** should be inserted. iCell is set to the index of the key within the
+    ** leaf that the new key should be inserted to the left of (or that it
+    ** replaces, if res==0).  */
+    iLeaf = pCsr->iNode;
+    pLeaf = pCsr->apTreeNode[iLeaf];
+    iCell = pCsr->aiCell[iLeaf] + (res<0);
+    treeEditInit(&edit, pLeaf, 1);
     if( res==0 ){
-      /* The search found a match within the tree. */
-      treeOverwriteKey(pDb, &csr, iTreeKey, &rc);
+      edit.aiSlot[iCell] = TREE_SLOT_NEW;
+      edit.aiKey[iCell] = iTreeKey;
     }else{
-      /* The cursor now points to the leaf node into which the new entry should
-      ** be inserted. There may or may not be a free slot within the leaf for
-      ** the new key-value pair. 
-      **
-      ** iSlot is set to the index of the key within pLeaf that the new key
-      ** should be inserted to the left of (or to a value 1 greater than the
-      ** index of the rightmost key if the new key is larger than all keys
-      ** currently stored in the node).
-      */
-      int iSlot = csr.aiCell[csr.iNode] + (res<0);
-      if( csr.iNode==0 ){
-        rc = treeInsert(pDb, &csr, 0, iTreeKey, 0, iSlot);
-      }else{
-        rc = treeInsertLeaf(pDb, &csr, iTreeKey, iSlot);
-      }
+      u32 iPrefix = treeKeyPrefix(pDb, iTreeKey, pLeaf->nSkip, &rc);
+      treeEditInsert(&edit, iCell, iTreeKey, iPrefix, 0);
+    }
+    if( rc==LSM_OK ){
+      rc = treeEditWrite(pDb, pCsr, iLeaf, &edit);
     }
   }
 
-#if 0
-  dump_tree_contents(pDb, "after");
-#endif
- insert_entry_out:
-  tblobFree(pDb, &csr.blob);
-  assert_tree_looks_ok(rc, pTree);
   return rc;
 }
 
@@ -1587,190 +2079,95 @@ int lsmTreeInsert(
   return treeInsertEntry(pDb, flags, pKey, nKey, pVal, nVal);
 }
 
-static int treeDeleteEntry(lsm_db *db, TreeCursor *pCsr, u32 iNewptr){
-  TreeRoot *p = &db->treehdr.root;
-  TreeNode *pNode = pCsr->apTreeNode[pCsr->iNode];
-  int iSlot = pCsr->aiCell[pCsr->iNode];
-  int bLeaf;
-  int rc = LSM_OK;
-
-  assert( pNode->aiKeyPtr[1] );
-  assert( pNode->aiKeyPtr[iSlot] );
-  assert( iSlot==0 || iSlot==1 || iSlot==2 );
-  assert( (pCsr->iNode==(db->treehdr.root.nHeight-1))==(iNewptr==0) );
-
-  bLeaf = (pCsr->iNode==(p->nHeight-1) && p->nHeight>1);
-  
-  if( pNode->aiKeyPtr[0] || pNode->aiKeyPtr[2] ){
-    /* There are currently at least 2 keys on this node. So just create
-    ** a new copy of the node with one of the keys removed. If the node
-    ** happens to be the root node of the tree, allocate an entire 
-    ** TreeNode structure instead of just a TreeLeaf.  */
-    TreeNode *pNew;
-    u32 iNew;
+/*
+** Insert a new entry into the in-memory tree with the LSM_VALUEPTR flag
+** set. The value of the entry, pPtr/nPtr, is a pointer to the actual value
+** stored in the value log (see lsm_vlog.c).
+*/
+int lsmTreeInsertPtr(
+  lsm_db *pDb,                    /* Database handle */
+  void *pKey,                     /* Pointer to key data */
+  int nKey,                       /* Size of key data in bytes */
+  void *pPtr,                     /* Pointer to value log pointer */
+  int nPtr                        /* Bytes in value log pointer */
+){
+  return treeInsertEntry(pDb, LSM_INSERT|LSM_VALUEPTR, pKey, nKey, pPtr, nPtr);
+}
 
-    if( bLeaf ){
-      pNew = (TreeNode *)newTreeLeaf(db, &iNew, &rc);
-    }else{
-      pNew = newTreeNode(db, &iNew, &rc);
-    }
-    if( pNew ){
-      int i;
-      int iOut = 1;
-      for(i=0; i<4; i++){
-        if( i==iSlot ){
-          i++;
-          if( bLeaf==0 ) pNew->aiChildPtr[iOut] = iNewptr;
-          if( i<3 ) pNew->aiKeyPtr[iOut] = pNode->aiKeyPtr[i];
-          iOut++;
-        }else if( bLeaf || p->nHeight==1 ){
-          if( i<3 && pNode->aiKeyPtr[i] ){
-            pNew->aiKeyPtr[iOut++] = pNode->aiKeyPtr[i];
-          }
-        }else{
-          if( getChildPtr(pNode, WORKING_VERSION, i) ){
-            pNew->aiChildPtr[iOut] = getChildPtr(pNode, WORKING_VERSION, i);
-            if( i<3 ) pNew->aiKeyPtr[iOut] = pNode->aiKeyPtr[i];
-            iOut++;
-          }
-        }
-      }
-      assert( iOut<=4 );
-      assert( bLeaf || pNew->aiChildPtr[0]==0 );
-      pCsr->iNode--;
-      rc = treeUpdatePtr(db, pCsr, iNew);
-    }
+/*
+** The xDelete() method for b-tree structures.
+**
+** Each iteration of the loop below removes all keys within the range from
+** a single leaf. Leaves left empty are not removed from the tree, and no
+** separator keys are removed from interior nodes - keys are never removed
+** from the tree for long (see lsmTreeDelete()), so there is little point 
+** in rebalancing it.
+*/
+static int btreeDeleteRange(
+  lsm_db *db,
+  void *pKey1, int nKey1,         /* Start of range */
+  void *pKey2, int nKey2          /* End of range */
+){
+  int rc = LSM_OK;
+  int bDone = 0;
+  TreeRoot *p = &db->treehdr.root;
+  TreeBlob blob = {0, 0};
 
-  }else if( pCsr->iNode==0 ){
-    /* Removing the only key in the root node. iNewptr is the new root. */
-    assert( iSlot==1 );
-    db->treehdr.root.iRoot = iNewptr;
-    db->treehdr.root.nHeight--;
+  /* This loop runs until the tree contains no keys within the range being
+  ** deleted. Or until an error occurs. */
+  while( bDone==0 && rc==LSM_OK && p->iRoot ){
+    int bEq;
+    int iLeaf;
+    int iFirst;                   /* First key on leaf to remove */
+    int nDel = 0;                 /* Number of keys on leaf to remove */
+    int nKey;
+    TreeNode *pLeaf;
+    TreeCursor csr;               /* Cursor to seek to first key in range */
 
-  }else{
-    /* There is only one key on this node and the node is not the root
-    ** node. Find a peer for this node. Then redistribute the contents of
-    ** the peer and the parent cell between the parent and either one or
-    ** two new nodes.  */
-    TreeNode *pParent;            /* Parent tree node */
-    int iPSlot;
-    u32 iPeer;                    /* Pointer to peer leaf node */
-    int iDir;
-    TreeNode *pPeer;              /* The peer leaf node */
-    TreeNode *pNew1; u32 iNew1;   /* First new leaf node */
-
-    assert( iSlot==1 );
-
-    pParent = pCsr->apTreeNode[pCsr->iNode-1];
-    iPSlot = pCsr->aiCell[pCsr->iNode-1];
-
-    if( iPSlot>0 && getChildPtr(pParent, WORKING_VERSION, iPSlot-1) ){
-      iDir = -1;
-    }else{
-      iDir = +1;
+    /* Seek the cursor to the first entry in the tree greater than pKey1.
+    ** If the leaf has no such entry, try the next leaf. */
+    treeCursorInit(db, 0, &csr);
+    rc = btreeSeekLeaf(&csr, pKey1, nKey1, &bEq);
+    if( rc!=LSM_OK ) break;
+    iLeaf = csr.iNode;
+    if( bEq ) csr.aiCell[iLeaf]++;
+    pLeaf = csr.apTreeNode[iLeaf];
+    nKey = treeNodeKeys(pLeaf, WORKING_VERSION);
+    if( csr.aiCell[iLeaf]>=nKey ){
+      btreeStepLeaf(&csr, 1);
+      if( csr.iNode<0 ) break;
+      pLeaf = csr.apTreeNode[iLeaf];
+      nKey = treeNodeKeys(pLeaf, WORKING_VERSION);
     }
-    iPeer = getChildPtr(pParent, WORKING_VERSION, iPSlot+iDir);
-    pPeer = (TreeNode *)treeShmptr(db, iPeer);
-    assertIsWorkingChild(db, pNode, pParent, iPSlot);
 
-    /* Allocate the first new leaf node. This is always required. */
-    if( bLeaf ){
-      pNew1 = (TreeNode *)newTreeLeaf(db, &iNew1, &rc);
-    }else{
-      pNew1 = (TreeNode *)newTreeNode(db, &iNew1, &rc);
+    /* Count the keys on this leaf that are smaller than pKey2. If there
+    ** are keys on the leaf that are not, this is the last iteration.  */
+    iFirst = csr.aiCell[iLeaf];
+    bDone = 1;
+    while( iFirst+nDel<nKey ){
+      u32 iKey = getKeyPtr(pLeaf, WORKING_VERSION, iFirst+nDel);
+      TreeKey *pKey = treeKeyLoad(db, iKey, &blob, &rc);
+      if( rc!=LSM_OK ) break;
+      if( treeKeycmp(TKV_KEY(pKey), pKey->nKey, pKey2, nKey2)>=0 ) break;
+      nDel++;
     }
+    if( rc==LSM_OK && iFirst+nDel==nKey ) bDone = 0;
 
-    if( pPeer->aiKeyPtr[0] && pPeer->aiKeyPtr[2] ){
-      /* Peer node is completely full. This means that two new leaf nodes
-      ** and a new parent node are required. */
-
-      TreeNode *pNew2; u32 iNew2; /* Second new leaf node */
-      TreeNode *pNewP; u32 iNewP; /* New parent node */
-
-      if( bLeaf ){
-        pNew2 = (TreeNode *)newTreeLeaf(db, &iNew2, &rc);
-      }else{
-        pNew2 = (TreeNode *)newTreeNode(db, &iNew2, &rc);
-      }
-      pNewP = copyTreeNode(db, pParent, &iNewP, &rc);
-
-      if( iDir==-1 ){
-        pNew1->aiKeyPtr[1] = pPeer->aiKeyPtr[0];
-        if( bLeaf==0 ){
-          pNew1->aiChildPtr[1] = getChildPtr(pPeer, WORKING_VERSION, 0);
-          pNew1->aiChildPtr[2] = getChildPtr(pPeer, WORKING_VERSION, 1);
-        }
-
-        pNewP->aiChildPtr[iPSlot-1] = iNew1;
-        pNewP->aiKeyPtr[iPSlot-1] = pPeer->aiKeyPtr[1];
-        pNewP->aiChildPtr[iPSlot] = iNew2;
-
-        pNew2->aiKeyPtr[0] = pPeer->aiKeyPtr[2];
-        pNew2->aiKeyPtr[1] = pParent->aiKeyPtr[iPSlot-1];
-        if( bLeaf==0 ){
-          pNew2->aiChildPtr[0] = getChildPtr(pPeer, WORKING_VERSION, 2);
-          pNew2->aiChildPtr[1] = getChildPtr(pPeer, WORKING_VERSION, 3);
-          pNew2->aiChildPtr[2] = iNewptr;
-        }
+    if( rc==LSM_OK && nDel>0 ){
+      if( nDel==nKey && iLeaf==0 ){
+        /* The tree is now empty. */
+        p->iRoot = 0;
+        p->nHeight = 0;
       }else{
-        pNew1->aiKeyPtr[1] = pParent->aiKeyPtr[iPSlot];
-        if( bLeaf==0 ){
-          pNew1->aiChildPtr[1] = iNewptr;
-          pNew1->aiChildPtr[2] = getChildPtr(pPeer, WORKING_VERSION, 0);
-        }
-
-        pNewP->aiChildPtr[iPSlot] = iNew1;
-        pNewP->aiKeyPtr[iPSlot] = pPeer->aiKeyPtr[0];
-        pNewP->aiChildPtr[iPSlot+1] = iNew2;
-
-        pNew2->aiKeyPtr[0] = pPeer->aiKeyPtr[1];
-        pNew2->aiKeyPtr[1] = pPeer->aiKeyPtr[2];
-        if( bLeaf==0 ){
-          pNew2->aiChildPtr[0] = getChildPtr(pPeer, WORKING_VERSION, 1);
-          pNew2->aiChildPtr[1] = getChildPtr(pPeer, WORKING_VERSION, 2);
-          pNew2->aiChildPtr[2] = getChildPtr(pPeer, WORKING_VERSION, 3);
-        }
-      }
-      assert( pCsr->iNode>=1 );
-      pCsr->iNode -= 2;
-      if( rc==LSM_OK ){
-        assert( pNew1->aiKeyPtr[1] && pNew2->aiKeyPtr[1] );
-        rc = treeUpdatePtr(db, pCsr, iNewP);
-      }
-    }else{
-      int iKOut = 0;
-      int iPOut = 0;
-      int i;
-
-      pCsr->iNode--;
-
-      if( iDir==1 ){
-        pNew1->aiKeyPtr[iKOut++] = pParent->aiKeyPtr[iPSlot];
-        if( bLeaf==0 ) pNew1->aiChildPtr[iPOut++] = iNewptr;
+        TreeEdit edit;
+        treeEditInit(&edit, pLeaf, 1);
+        treeEditRemove(&edit, iFirst, nDel);
+        rc = treeEditWrite(db, &csr, iLeaf, &edit);
       }
-      for(i=0; i<3; i++){
-        if( pPeer->aiKeyPtr[i] ){
-          pNew1->aiKeyPtr[iKOut++] = pPeer->aiKeyPtr[i];
-        }
-      }
-      if( bLeaf==0 ){
-        for(i=0; i<4; i++){
-          if( getChildPtr(pPeer, WORKING_VERSION, i) ){
-            pNew1->aiChildPtr[iPOut++] = getChildPtr(pPeer, WORKING_VERSION, i);
-          }
-        }
-      }
-      if( iDir==-1 ){
-        iPSlot--;
-        pNew1->aiKeyPtr[iKOut++] = pParent->aiKeyPtr[iPSlot];
-        if( bLeaf==0 ) pNew1->aiChildPtr[iPOut++] = iNewptr;
-        pCsr->aiCell[pCsr->iNode] = iPSlot;
-      }
-
-      rc = treeDeleteEntry(db, pCsr, iNew1);
     }
   }
 
+  tblobFree(db, &blob);
   return rc;
 }
 
@@ -1781,11 +2178,7 @@ static int treeDeleteEntry(lsm_db *db, TreeCursor *pCsr, u32 iNewptr){
 ** This is a two step process: 
 **
 **     1) Remove all entries currently stored in the tree that have keys
-**        that fall into the deleted range.
-**
-**        TODO: There are surely good ways to optimize this step - removing 
-**        a range of keys from a b-tree. But for now, this function removes
-**        them one at a time using the usual approach.
+**        that fall into the deleted range (the xDelete method).
 **
 **     2) Unless the largest key smaller than or equal to (pKey1/nKey1) is
 **        already marked as START_DELETE, insert a START_DELETE key. 
@@ -1797,10 +2190,7 @@ int lsmTreeDelete(
   void *pKey1, int nKey1,         /* Start of range */
   void *pKey2, int nKey2          /* End of range */
 ){
-  int rc = LSM_OK;
-  int bDone = 0;
-  TreeRoot *p = &db->treehdr.root;
-  TreeBlob blob = {0, 0};
+  int rc;
 
   /* The range must be sensible - that (key1 < key2). */
   assert( treeKeycmp(pKey1, nKey1, pKey2, nKey2)<0 );
@@ -1814,73 +2204,8 @@ int lsmTreeDelete(
   dump_tree_contents(db, "before delete");
 #endif
 
-  /* Step 1. This loop runs until the tree contains no keys within the
-  ** range being deleted. Or until an error occurs. */
-  while( bDone==0 && rc==LSM_OK ){
-    int res;
-    TreeCursor csr;               /* Cursor to seek to first key in range */
-    void *pDel; int nDel;         /* Key to (possibly) delete this iteration */
-#ifndef NDEBUG
-    int nEntry = treeCountEntries(db);
-#endif
-
-    /* Seek the cursor to the first entry in the tree greater than pKey1. */
-    treeCursorInit(db, 0, &csr);
-    lsmTreeCursorSeek(&csr, pKey1, nKey1, &res);
-    if( res<=0 && lsmTreeCursorValid(&csr) ) lsmTreeCursorNext(&csr);
-
-    /* If there is no such entry, or if it is greater than pKey2, then the
-    ** tree now contains no keys in the range being deleted. In this case
-    ** break out of the loop.  */
-    bDone = 1;
-    if( lsmTreeCursorValid(&csr) ){
-      lsmTreeCursorKey(&csr, 0, &pDel, &nDel);
-      if( treeKeycmp(pDel, nDel, pKey2, nKey2)<0 ) bDone = 0;
-    }
-
-    if( bDone==0 ){
-      if( csr.iNode==(p->nHeight-1) ){
-        /* The element to delete already lies on a leaf node */
-        rc = treeDeleteEntry(db, &csr, 0);
-      }else{
-        /* 1. Overwrite the current key with a copy of the next key in the 
-        **    tree (key N).
-        **
-        ** 2. Seek to key N (cursor will stop at the internal node copy of
-        **    N). Move to the next key (original copy of N). Delete
-        **    this entry. 
-        */
-        u32 iKey;
-        TreeKey *pKey;
-        int iNode = csr.iNode;
-        lsmTreeCursorNext(&csr);
-        assert( csr.iNode==(p->nHeight-1) );
-
-        iKey = csr.apTreeNode[csr.iNode]->aiKeyPtr[csr.aiCell[csr.iNode]];
-        lsmTreeCursorPrev(&csr);
-
-        treeOverwriteKey(db, &csr, iKey, &rc);
-        pKey = treeShmkey(db, iKey, TKV_LOADKEY, &blob, &rc);
-        if( pKey ){
-          rc = lsmTreeCursorSeek(&csr, TKV_KEY(pKey), pKey->nKey, &res);
-        }
-        if( rc==LSM_OK ){
-          assert( res==0 && csr.iNode==iNode );
-          rc = lsmTreeCursorNext(&csr);
-          if( rc==LSM_OK ){
-            rc = treeDeleteEntry(db, &csr, 0);
-          }
-        }
-      }
-    }
-
-    /* Clean up any memory allocated by the cursor. */
-    tblobFree(db, &csr.blob);
-#if 0
-    dump_tree_contents(db, "ddd delete");
-#endif
-    assert( bDone || treeCountEntries(db)==(nEntry-1) );
-  }
+  /* Step 1. */
+  rc = treeMethods(db)->xDelete(db, pKey1, nKey1, pKey2, nKey2);
 
 #if 0
   dump_tree_contents(db, "during delete");
@@ -1901,7 +2226,6 @@ int lsmTreeDelete(
   dump_tree_contents(db, "after delete");
 #endif
 
-  tblobFree(db, &blob);
   assert( assert_delete_ranges_match(db) );
   return rc;
 }
@@ -1960,122 +2284,65 @@ static int treeCsrCompare(TreeCursor *pCsr, void *pKey, int nKey){
 
 
 /*
-** Attempt to seek the cursor passed as the first argument to key (pKey/nKey)
-** in the tree structure. If an exact match for the key is found, leave the
-** cursor pointing to it and set *pRes to zero before returning. If an
-** exact match cannot be found, do one of the following:
-**
-**   * Leave the cursor pointing to the smallest element in the tree that 
-**     is larger than the key and set *pRes to +1, or
+** The b-tree cursor methods. See lsmTreeCursorSeek() and the functions
+** that follow it for a description of each.
 **
-**   * Leave the cursor pointing to the largest element in the tree that 
-**     is smaller than the key and set *pRes to -1, or
-**
-**   * If the tree is empty, leave the cursor at EOF and set *pRes to -1.
+** A valid b-tree cursor always points to a key on a leaf node.
 */
-int lsmTreeCursorSeek(TreeCursor *pCsr, void *pKey, int nKey, int *pRes){
+static int btreeCursorSeek(
+  TreeCursor *pCsr, 
+  void *pKey, int nKey, 
+  int *pRes
+){
   int rc = LSM_OK;                /* Return code */
-  lsm_db *pDb = pCsr->pDb;
   TreeRoot *pRoot = pCsr->pRoot;
-  u32 iNodePtr;                   /* Location of current node in search */
-
-  /* Discard any saved position data */
-  treeCursorRestore(pCsr, 0);
 
-  iNodePtr = pRoot->iRoot;
-  if( iNodePtr==0 ){
-    /* Either an error occurred or the tree is completely empty. */
-    assert( rc!=LSM_OK || pRoot->iRoot==0 );
+  pCsr->bSeekEmpty = 0;
+  if( pRoot->iRoot==0 ){
+    /* The tree is completely empty. */
     *pRes = -1;
     pCsr->iNode = -1;
   }else{
-    TreeBlob b = {0, 0};
-    int res = 0;                  /* Result of comparison function */
-    int iNode = -1;
-    while( iNodePtr ){
-      TreeNode *pNode;            /* Node at location iNodePtr */
-      int iTest;                  /* Index of second key to test (0 or 2) */
-      u32 iTreeKey;
-      TreeKey *pTreeKey;          /* Key to compare against */
-
-      pNode = (TreeNode *)treeShmptrUnsafe(pDb, iNodePtr);
-      iNode++;
-      pCsr->apTreeNode[iNode] = pNode;
-
-      /* Compare (pKey/nKey) with the key in the middle slot of B-tree node
-      ** pNode. The middle slot is never empty. If the comparison is a match,
-      ** then the search is finished. Break out of the loop. */
-      pTreeKey = (TreeKey*)treeShmptrUnsafe(pDb, pNode->aiKeyPtr[1]);
-      if( !(pTreeKey->flags & LSM_CONTIGUOUS) ){
-        pTreeKey = treeShmkey(pDb, pNode->aiKeyPtr[1], TKV_LOADKEY, &b, &rc);
-        if( rc!=LSM_OK ) break;
-      }
-      res = treeKeycmp((void *)&pTreeKey[1], pTreeKey->nKey, pKey, nKey);
-      if( res==0 ){
-        pCsr->aiCell[iNode] = 1;
-        break;
-      }
-
-      /* Based on the results of the previous comparison, compare (pKey/nKey)
-      ** to either the left or right key of the B-tree node, if such a key
-      ** exists. */
-      iTest = (res>0 ? 0 : 2);
-      iTreeKey = pNode->aiKeyPtr[iTest];
-      if( iTreeKey ){
-        pTreeKey = (TreeKey*)treeShmptrUnsafe(pDb, iTreeKey);
-        if( !(pTreeKey->flags & LSM_CONTIGUOUS) ){
-          pTreeKey = treeShmkey(pDb, iTreeKey, TKV_LOADKEY, &b, &rc);
-          if( rc ) break;
-        }
-        res = treeKeycmp((void *)&pTreeKey[1], pTreeKey->nKey, pKey, nKey);
-        if( res==0 ){
-          pCsr->aiCell[iNode] = iTest;
-          break;
-        }
-      }else{
-        iTest = 1;
-      }
-
-      if( iNode<(pRoot->nHeight-1) ){
-        iNodePtr = getChildPtr(pNode, pRoot->iTransId, iTest + (res<0));
+    int bEq = 0;
+    rc = btreeSeekLeaf(pCsr, pKey, nKey, &bEq);
+    if( rc==LSM_OK ){
+      const int iLeaf = pCsr->iNode;
+      TreeNode *pLeaf = pCsr->apTreeNode[iLeaf];
+      int nCell = treeNodeKeys(pLeaf, pRoot->iTransId);
+      if( bEq ){
+        *pRes = 0;
+      }else if( pCsr->aiCell[iLeaf]<nCell ){
+        *pRes = 1;
+      }else if( nCell>0 ){
+        pCsr->aiCell[iLeaf]--;
+        *pRes = -1;
       }else{
-        iNodePtr = 0;
+        /* The leaf is empty. Move to the largest key in the tree smaller
+        ** than (pKey/nKey), or failing that the smallest key larger than 
+        ** it.  */
+        pCsr->bSeekEmpty = 1;
+        *pRes = -1;
+        btreeStepLeaf(pCsr, 0);
+        if( pCsr->iNode<0 ){
+          rc = btreeSeekLeaf(pCsr, pKey, nKey, &bEq);
+          if( rc==LSM_OK ){
+            *pRes = 1;
+            btreeStepLeaf(pCsr, 1);
+          }
+        }
       }
-      pCsr->aiCell[iNode] = iTest + (iNodePtr && (res<0));
     }
-
-    *pRes = res;
-    pCsr->iNode = iNode;
-    tblobFree(pDb, &b);
   }
 
-  /* assert() that *pRes has been set properly */
-#ifndef NDEBUG
-  if( rc==LSM_OK && lsmTreeCursorValid(pCsr) ){
-    int cmp = treeCsrCompare(pCsr, pKey, nKey);
-    assert( *pRes==cmp || (*pRes ^ cmp)>0 );
-  }
-#endif
-
   return rc;
 }
 
-int lsmTreeCursorNext(TreeCursor *pCsr){
+static int btreeCursorNext(TreeCursor *pCsr){
 #ifndef NDEBUG
   TreeKey *pK1;
   TreeBlob key1 = {0, 0};
 #endif
-  lsm_db *pDb = pCsr->pDb;
-  TreeRoot *pRoot = pCsr->pRoot;
-  const int iLeaf = pRoot->nHeight-1;
-  int iCell; 
   int rc = LSM_OK; 
-  TreeNode *pNode; 
-
-  /* Restore the cursor position, if required */
-  int iRestore = 0;
-  treeCursorRestore(pCsr, &iRestore);
-  if( iRestore>0 ) return LSM_OK;
 
   /* Save a pointer to the current key. This is used in an assert() at the
   ** end of this function - to check that the 'next' key really is larger
@@ -2086,62 +2353,25 @@ int lsmTreeCursorNext(TreeCursor *pCsr){
 #endif
 
   assert( lsmTreeCursorValid(pCsr) );
-  assert( pCsr->aiCell[pCsr->iNode]<3 );
-
-  pNode = pCsr->apTreeNode[pCsr->iNode];
-  iCell = ++pCsr->aiCell[pCsr->iNode];
-
-  /* If the current node is not a leaf, and the current cell has sub-tree
-  ** associated with it, descend to the left-most key on the left-most
-  ** leaf of the sub-tree.  */
-  if( pCsr->iNode<iLeaf && getChildPtr(pNode, pRoot->iTransId, iCell) ){
-    do {
-      u32 iNodePtr;
-      pCsr->iNode++;
-      iNodePtr = getChildPtr(pNode, pRoot->iTransId, iCell);
-      pNode = (TreeNode *)treeShmptr(pDb, iNodePtr);
-      pCsr->apTreeNode[pCsr->iNode] = pNode;
-      iCell = pCsr->aiCell[pCsr->iNode] = (pNode->aiKeyPtr[0]==0);
-    }while( pCsr->iNode < iLeaf );
-  }
-
-  /* Otherwise, the next key is found by following pointer up the tree 
-  ** until there is a key immediately to the right of the pointer followed 
-  ** to reach the sub-tree containing the current key. */
-  else if( iCell>=3 || pNode->aiKeyPtr[iCell]==0 ){
-    while( (--pCsr->iNode)>=0 ){
-      iCell = pCsr->aiCell[pCsr->iNode];
-      if( iCell<3 && pCsr->apTreeNode[pCsr->iNode]->aiKeyPtr[iCell] ) break;
-    }
-  }
+  btreeStep(pCsr, 1);
 
 #ifndef NDEBUG
   if( pCsr->iNode>=0 ){
     TreeKey *pK2 = csrGetKey(pCsr, &pCsr->blob, &rc);
     assert( rc||treeKeycmp(TKV_KEY(pK2),pK2->nKey,TKV_KEY(pK1),pK1->nKey)>=0 );
   }
-  tblobFree(pDb, &key1);
+  tblobFree(pCsr->pDb, &key1);
 #endif
 
   return rc;
 }
 
-int lsmTreeCursorPrev(TreeCursor *pCsr){
+static int btreeCursorPrev(TreeCursor *pCsr){
 #ifndef NDEBUG
   TreeKey *pK1;
   TreeBlob key1 = {0, 0};
 #endif
-  lsm_db *pDb = pCsr->pDb;
-  TreeRoot *pRoot = pCsr->pRoot;
-  const int iLeaf = pRoot->nHeight-1;
-  int iCell; 
   int rc = LSM_OK; 
-  TreeNode *pNode; 
-
-  /* Restore the cursor position, if required */
-  int iRestore = 0;
-  treeCursorRestore(pCsr, &iRestore);
-  if( iRestore<0 ) return LSM_OK;
 
   /* Save a pointer to the current key. This is used in an assert() at the
   ** end of this function - to check that the 'next' key really is smaller
@@ -2152,98 +2382,153 @@ int lsmTreeCursorPrev(TreeCursor *pCsr){
 #endif
 
   assert( lsmTreeCursorValid(pCsr) );
-  pNode = pCsr->apTreeNode[pCsr->iNode];
-  iCell = pCsr->aiCell[pCsr->iNode];
-  assert( iCell>=0 && iCell<3 );
-
-  /* If the current node is not a leaf, and the current cell has sub-tree
-  ** associated with it, descend to the right-most key on the right-most
-  ** leaf of the sub-tree.  */
-  if( pCsr->iNode<iLeaf && getChildPtr(pNode, pRoot->iTransId, iCell) ){
-    do {
-      u32 iNodePtr;
-      pCsr->iNode++;
-      iNodePtr = getChildPtr(pNode, pRoot->iTransId, iCell);
-      pNode = (TreeNode *)treeShmptr(pDb, iNodePtr);
-      if( rc!=LSM_OK ) break;
-      pCsr->apTreeNode[pCsr->iNode] = pNode;
-      iCell = 1 + (pNode->aiKeyPtr[2]!=0) + (pCsr->iNode < iLeaf);
-      pCsr->aiCell[pCsr->iNode] = iCell;
-    }while( pCsr->iNode < iLeaf );
-  }
-
-  /* Otherwise, the next key is found by following pointer up the tree until
-  ** there is a key immediately to the left of the pointer followed to reach
-  ** the sub-tree containing the current key. */
-  else{
-    do {
-      iCell = pCsr->aiCell[pCsr->iNode]-1;
-      if( iCell>=0 && pCsr->apTreeNode[pCsr->iNode]->aiKeyPtr[iCell] ) break;
-    }while( (--pCsr->iNode)>=0 );
-    pCsr->aiCell[pCsr->iNode] = iCell;
-  }
+  btreeStep(pCsr, 0);
 
 #ifndef NDEBUG
   if( pCsr->iNode>=0 ){
     TreeKey *pK2 = csrGetKey(pCsr, &pCsr->blob, &rc);
     assert( rc || treeKeycmp(TKV_KEY(pK2),pK2->nKey,TKV_KEY(pK1),pK1->nKey)<0 );
   }
-  tblobFree(pDb, &key1);
+  tblobFree(pCsr->pDb, &key1);
 #endif
 
   return rc;
 }
 
-/*
-** Move the cursor to the first (bLast==0) or last (bLast!=0) entry in the
-** in-memory tree.
-*/
-int lsmTreeCursorEnd(TreeCursor *pCsr, int bLast){
+static int btreeCursorEnd(TreeCursor *pCsr, int bLast){
   lsm_db *pDb = pCsr->pDb;
   TreeRoot *pRoot = pCsr->pRoot;
-  int rc = LSM_OK;
-
+  const int iLeaf = pRoot->nHeight-1;
+  int nKey = 0;
   u32 iNodePtr;
-  pCsr->iNode = -1;
-
-  /* Discard any saved position data */
-  treeCursorRestore(pCsr, 0);
 
+  pCsr->iNode = -1;
   iNodePtr = pRoot->iRoot;
-  while( iNodePtr ){
-    int iCell;
-    TreeNode *pNode;
-
-    pNode = (TreeNode *)treeShmptr(pDb, iNodePtr);
-    if( rc ) break;
+  if( iNodePtr==0 ) return LSM_OK;
 
-    if( bLast ){
-      iCell = ((pNode->aiKeyPtr[2]==0) ? 2 : 3);
+  for(pCsr->iNode=0; pCsr->iNode<=iLeaf; pCsr->iNode++){
+    int iCell;
+    TreeNode *pNode = (TreeNode *)treeShmptr(pDb, iNodePtr);
+    nKey = treeNodeKeys(pNode, pRoot->iTransId);
+    if( pCsr->iNode<iLeaf ){
+      iCell = (bLast ? nKey : 0);
+      iNodePtr = getChildPtr(pNode, pRoot->iTransId, iCell);
     }else{
-      iCell = ((pNode->aiKeyPtr[0]==0) ? 1 : 0);
+      iCell = (bLast ? nKey-1 : 0);
     }
-    pCsr->iNode++;
     pCsr->apTreeNode[pCsr->iNode] = pNode;
+    pCsr->aiCell[pCsr->iNode] = (u8)LSM_MAX(iCell, 0);
+  }
+  pCsr->iNode = iLeaf;
 
-    if( pCsr->iNode<pRoot->nHeight-1 ){
-      iNodePtr = getChildPtr(pNode, pRoot->iTransId, iCell);
-    }else{
-      iNodePtr = 0;
-    }
-    pCsr->aiCell[pCsr->iNode] = iCell - (iNodePtr==0 && bLast);
+  /* If the leaf is empty, move to the nearest non-empty one. */
+  if( nKey==0 ) btreeStepLeaf(pCsr, !bLast);
+  return LSM_OK;
+}
+
+/*
+** The xKeyPtr() method for b-tree structures.
+*/
+static u32 btreeKeyPtr(TreeCursor *pCsr){
+  const int iNode = pCsr->iNode;
+  return getKeyPtr(
+      pCsr->apTreeNode[iNode], pCsr->pRoot->iTransId, pCsr->aiCell[iNode]
+  );
+}
+
+/*
+** Return the flags of the entry that the b-tree cursor would point to 
+** after being moved to the next (if bNext is true) or previous entry. Or
+** 0 if there is no such entry. The cursor itself is not moved.
+*/
+static int btreeStepFlags(TreeCursor *pCsr, int bNext){
+  TreeCursor csr;
+  int flags = 0;
+  memcpy(&csr, pCsr, sizeof(TreeCursor));
+  btreeStep(&csr, bNext);
+  if( csr.iNode>=0 ){
+    TreeKey *pKey = (TreeKey *)treeShmptrUnsafe(csr.pDb, btreeKeyPtr(&csr));
+    flags = pKey->flags;
+  }
+  return flags;
+}
+
+static int treeNextIsEndDelete(lsm_db *db, TreeCursor *pCsr){
+  return ((btreeStepFlags(pCsr, 1) & LSM_END_DELETE) ? 1 : 0);
+}
+
+static int treePrevIsStartDelete(lsm_db *db, TreeCursor *pCsr){
+  return ((btreeStepFlags(pCsr, 0) & LSM_START_DELETE) ? 1 : 0);
+}
+
+/*
+** Attempt to seek the cursor passed as the first argument to key (pKey/nKey)
+** in the tree structure. If an exact match for the key is found, leave the
+** cursor pointing to it and set *pRes to zero before returning. If an
+** exact match cannot be found, do one of the following:
+**
+**   * Leave the cursor pointing to the smallest element in the tree that 
+**     is larger than the key and set *pRes to +1, or
+**
+**   * Leave the cursor pointing to the largest element in the tree that 
+**     is smaller than the key and set *pRes to -1, or
+**
+**   * If the tree is empty, leave the cursor at EOF and set *pRes to -1.
+*/
+int lsmTreeCursorSeek(TreeCursor *pCsr, void *pKey, int nKey, int *pRes){
+  int rc;
+
+  /* Discard any saved position data */
+  treeCursorRestore(pCsr, 0);
+
+  rc = pCsr->pMethods->xSeek(pCsr, pKey, nKey, pRes);
+
+  /* assert() that *pRes has been set properly */
+#ifndef NDEBUG
+  if( rc==LSM_OK && lsmTreeCursorValid(pCsr) ){
+    int cmp = treeCsrCompare(pCsr, pKey, nKey);
+    assert( *pRes==cmp || (*pRes ^ cmp)>0 );
   }
+#endif
 
   return rc;
 }
 
+int lsmTreeCursorNext(TreeCursor *pCsr){
+  /* Restore the cursor position, if required */
+  int iRestore = 0;
+  treeCursorRestore(pCsr, &iRestore);
+  if( iRestore>0 ) return LSM_OK;
+
+  return pCsr->pMethods->xNext(pCsr);
+}
+
+int lsmTreeCursorPrev(TreeCursor *pCsr){
+  /* Restore the cursor position, if required */
+  int iRestore = 0;
+  treeCursorRestore(pCsr, &iRestore);
+  if( iRestore<0 ) return LSM_OK;
+
+  return pCsr->pMethods->xPrev(pCsr);
+}
+
+/*
+** Move the cursor to the first (bLast==0) or last (bLast!=0) entry in the
+** in-memory tree.
+*/
+int lsmTreeCursorEnd(TreeCursor *pCsr, int bLast){
+  /* Discard any saved position data */
+  treeCursorRestore(pCsr, 0);
+
+  return pCsr->pMethods->xEnd(pCsr, bLast);
+}
+
 int lsmTreeCursorFlags(TreeCursor *pCsr){
   int flags = 0;
   if( pCsr && pCsr->iNode>=0 ){
-    int rc = LSM_OK;
     TreeKey *pKey = (TreeKey *)treeShmptrUnsafe(pCsr->pDb,
-        pCsr->apTreeNode[pCsr->iNode]->aiKeyPtr[pCsr->aiCell[pCsr->iNode]]
+        pCsr->pMethods->xKeyPtr(pCsr)
     );
-    assert( rc==LSM_OK );
     flags = (pKey->flags & ~LSM_CONTIGUOUS);
   }
   return flags;
@@ -2274,7 +2559,7 @@ int lsmTreeCursorValue(TreeCursor *pCsr, void **ppVal, int *pnVal){
 
   rc = treeCursorRestore(pCsr, &res);
   if( res==0 ){
-    TreeKey *pTreeKey = csrGetKey(pCsr, &pCsr->blob, &rc);
+    TreeKey *pTreeKey = csrGetEntry(pCsr, &pCsr->blob, &rc);
     if( rc==LSM_OK ){
       if( pTreeKey->flags & LSM_INSERT ){
         *pnVal = pTreeKey->nValue;
@@ -2318,6 +2603,13 @@ void lsmTreeMark(lsm_db *pDb, TreeMark *pMark){
 ** populated by a call to lsmTreeMark().
 */
 void lsmTreeRollback(lsm_db *pDb, TreeMark *pMark){
+  treeMethods(pDb)->xRollback(pDb, pMark);
+}
+
+/*
+** The xRollback() method for b-tree structures.
+*/
+static void btreeRollback(lsm_db *pDb, TreeMark *pMark){
   int iIdx;
   int nIdx;
   u32 iNext;
@@ -2332,8 +2624,6 @@ void lsmTreeRollback(lsm_db *pDb, TreeMark *pMark){
     pNode = treeShmptr(pDb, intArrayEntry(&pDb->rollback, iIdx));
     assert( pNode );
     pNode->iV2 = 0;
-    pNode->iV2Child = 0;
-    pNode->iV2Ptr = 0;
   }
   intArrayTruncate(&pDb->rollback, pMark->iRollback);
 
@@ -2369,6 +2659,529 @@ void lsmTreeRollback(lsm_db *pDb, TreeMark *pMark){
   pDb->treehdr.iNextShmid = pMark->iNextShmid;
 }
 
+/***********************************************************************
+** Start of skiplist methods.
+**
+** The following functions implement the TreeMethods interface for trees
+** of type TREE_SKIPLIST.
+*/
+
+/*
+** Return the offset within the *-shm file of the aiNext[iLevel] field of
+** skiplist node iNode.
+*/
+#define skipNextPtr(iNode, iLevel) \
+  ((iNode) + (u32)offsetof(TreeSkip, aiNext) + (u32)(iLevel)*sizeof(u32))
+
+/*
+** Return a pointer to skiplist node iPtr.
+**
+** A b-tree reader only ever follows pointers to nodes that are part of
+** its snapshot, all of which lie within the shared-memory chunks mapped
+** when the read transaction was opened. But a skiplist reader may step
+** over nodes added by a concurrent writer, so this function maps any
+** chunk not already mapped. If an error occurs, *pRc is set to an error
+** code and NULL returned.
+*/
+static TreeSkip *skipNode(lsm_db *pDb, u32 iPtr, int *pRc){
+  if( *pRc==LSM_OK ){
+    int iChunk = treeOffsetToChunk(iPtr);
+    if( iChunk<pDb->nShm || treeShmChunkRc(pDb, iChunk, pRc) ){
+      return (TreeSkip *)treeShmptrUnsafe(pDb, iPtr);
+    }
+  }
+  return 0;
+}
+
+/*
+** Compare the key of TreeKey iKey with (pKey/nKey). As for skipNode(),
+** the TreeKey may have been written by a concurrent writer, so map any
+** chunks the key occupies before reading it.
+*/
+static int skipKeycmp(
+  lsm_db *pDb,                    /* Database handle */
+  u32 iKey,                       /* Pointer to TreeKey object */
+  void *pKey, int nKey,           /* Key to compare with */
+  TreeBlob *pBlob,                /* Used if dynamic memory is required */
+  int *pRc                        /* IN/OUT: Error code */
+){
+  TreeKey *p = (TreeKey *)skipNode(pDb, iKey, pRc);
+  if( p && (p->flags & LSM_CONTIGUOUS)==0 ){
+    int iChunk = treeOffsetToChunk(iKey);
+    int nReq = sizeof(TreeKey) + p->nKey;
+    int nAvail = LSM_SHM_CHUNK_SIZE - (iKey & (LSM_SHM_CHUNK_SIZE-1));
+    while( nAvail<nReq && *pRc==LSM_OK ){
+      iChunk = treeShmChunk(pDb, iChunk)->iNext;
+      if( iChunk>=pDb->nShm ) treeShmChunkRc(pDb, iChunk, pRc);
+      nReq -= nAvail;
+      nAvail = LSM_SHM_CHUNK_SIZE - LSM_SHM_CHUNK_HDR;
+    }
+    p = (*pRc==LSM_OK ? treeShmkey(pDb, iKey, TKV_LOADKEY, pBlob, pRc) : 0);
+  }
+  if( p==0 || *pRc!=LSM_OK ) return 0;
+  return treeKeycmp(TKV_KEY(p), p->nKey, pKey, nKey);
+}
+
+/*
+** Return true if skiplist node p is part of the snapshot with transaction
+** id iTransId.
+*/
+static int skipVisible(TreeSkip *p, u32 iTransId){
+  return p->iTransId<=iTransId && (p->iDead==0 || p->iDead>iTransId);
+}
+
+/*
+** Return the first node on level 0 of the skiplist, starting with node
+** iPtr itself, that is part of snapshot iTransId. Or 0 if there is no
+** such node or an error occurs.
+*/
+static u32 skipNextVisible(lsm_db *pDb, u32 iPtr, u32 iTransId, int *pRc){
+  while( iPtr ){
+    TreeSkip *p = skipNode(pDb, iPtr, pRc);
+    if( p==0 ) return 0;
+    if( skipVisible(p, iTransId) ) break;
+    iPtr = p->aiNext[0];
+  }
+  return iPtr;
+}
+
+/*
+** Return the last node on level 0 of the skiplist, starting with node
+** iPtr itself and moving towards the head node, that is part of snapshot
+** iTransId. Or 0 if there is no such node or an error occurs.
+*/
+static u32 skipPrevVisible(lsm_db *pDb, u32 iPtr, u32 iTransId, int *pRc){
+  while( iPtr ){
+    TreeSkip *p = skipNode(pDb, iPtr, pRc);
+    if( p==0 || p->iKey==0 ) return 0;
+    if( skipVisible(p, iTransId) ) break;
+    iPtr = p->iPrev;
+  }
+  return iPtr;
+}
+
+/*
+** Allocate and zero a new skiplist node with nLevel levels.
+*/
+static TreeSkip *skipNewNode(lsm_db *pDb, int nLevel, u32 *piPtr, int *pRc){
+  TreeSkip *pNew;
+  int nByte = sizeof(TreeSkip) + (nLevel-1)*sizeof(u32);
+  pNew = (TreeSkip *)treeShmallocZero(pDb, nByte, piPtr, pRc);
+  if( pNew ) pNew->nLevel = nLevel;
+  return pNew;
+}
+
+/*
+** Return the number of levels for the node that will hold TreeKey iTreeKey.
+** Each node has one level, plus one more with probability 1/4, plus one
+** more with probability 1/16, and so on. Since each TreeKey is allocated
+** at a unique offset, a hash of the offset is used as the source of
+** randomness.
+*/
+static int skipRandomLevel(u32 iTreeKey){
+  u32 h = iTreeKey;
+  int nLevel = 1;
+
+  h ^= (h >> 16);
+  h *= 0x85EBCA6B;
+  h ^= (h >> 13);
+  h *= 0xC2B2AE35;
+  h ^= (h >> 16);
+  while( nLevel<TREE_SKIP_MAXLEVEL && (h & 0x03)==0 ){
+    nLevel++;
+    h = h >> 2;
+  }
+  return nLevel;
+}
+
+/*
+** Set the u32 value at offset iPtr of the *-shm file to iVal. Unless it
+** is part of skiplist node iNode, which cannot be visible once the tree
+** is rolled back, first append the offset and its current value to the
+** lsm_db.rollback array so that skipRollback() may restore it.
+**
+** A node cannot be visible after a rollback if it was inserted by the
+** current transaction and the only mark that may be rolled back to is
+** the one taken when the transaction was opened.
+*/
+static void skipWrite(
+  lsm_db *pDb,                    /* Database handle */
+  TreeSkip *pNode,                /* Node containing value to modify */
+  u32 iPtr,                       /* Offset of value to modify */
+  u32 iVal,                       /* New value */
+  int *pRc                        /* IN/OUT: Error code */
+){
+  if( *pRc==LSM_OK ){
+    u32 *p = (u32 *)treeShmptr(pDb, iPtr);
+    if( pNode->iTransId!=pDb->treehdr.root.iTransId || pDb->nTransOpen>1 ){
+      int nOrig = intArraySize(&pDb->rollback);
+      int rc = intArrayAppend(pDb->pEnv, &pDb->rollback, iPtr);
+      if( rc==LSM_OK ){
+        rc = intArrayAppend(pDb->pEnv, &pDb->rollback, *p);
+      }
+      if( rc!=LSM_OK ){
+        intArrayTruncate(&pDb->rollback, nOrig);
+        *pRc = rc;
+        return;
+      }
+    }
+    *p = iVal;
+  }
+}
+
+static int skipCursorSeek(
+  TreeCursor *pCsr,
+  void *pKey, int nKey,
+  int *pRes
+){
+  lsm_db *pDb = pCsr->pDb;
+  TreeRoot *pRoot = pCsr->pRoot;
+  int rc = LSM_OK;
+  int res = -1;
+
+  pCsr->iNode = -1;
+  if( pRoot->iRoot ){
+    TreeBlob b = {0, 0};
+    u32 iPred = pRoot->iRoot;     /* Last node smaller than pKey/nKey */
+    TreeSkip *pPred;
+    u32 iNext = 0;
+    int i;
+
+    /* Search the skiplist from the top level down. Any node may be stepped
+    ** over, whether or not it is part of the cursor's snapshot, as all
+    ** nodes are linked in key order.  */
+    pPred = skipNode(pDb, iPred, &rc);
+    for(i=TREE_SKIP_MAXLEVEL-1; i>=(int)pRoot->nHeight; i--){
+      pCsr->aiSkipPred[i] = iPred;
+    }
+    for(/* no-op */; i>=0 && rc==LSM_OK; i--){
+      while( (iNext = pPred->aiNext[i]) ){
+        TreeSkip *pNext = skipNode(pDb, iNext, &rc);
+        if( pNext==0 || skipKeycmp(pDb, pNext->iKey, pKey, nKey, &b, &rc)>=0 ){
+          break;
+        }
+        iPred = iNext;
+        pPred = pNext;
+      }
+      pCsr->aiSkipPred[i] = iPred;
+    }
+
+    /* iNext is now the first node with a key greater than or equal to
+    ** (pKey/nKey), if any. Point the cursor at the first such node that
+    ** is visible. Or, if there is no such node, at the last visible node
+    ** with a smaller key.  */
+    iNext = skipNextVisible(pDb, iNext, pRoot->iTransId, &rc);
+    if( iNext ){
+      TreeSkip *pNext = skipNode(pDb, iNext, &rc);
+      if( pNext ) res = skipKeycmp(pDb, pNext->iKey, pKey, nKey, &b, &rc);
+    }else{
+      iNext = skipPrevVisible(pDb, iPred, pRoot->iTransId, &rc);
+    }
+    if( iNext && rc==LSM_OK ){
+      pCsr->iSkip = iNext;
+      pCsr->iNode = 0;
+    }
+    tblobFree(pDb, &b);
+  }
+
+  *pRes = res;
+  return rc;
+}
+
+static int skipCursorNext(TreeCursor *pCsr){
+  int rc = LSM_OK;
+  TreeSkip *p = skipNode(pCsr->pDb, pCsr->iSkip, &rc);
+  u32 iNext;
+
+  assert( lsmTreeCursorValid(pCsr) );
+  iNext = skipNextVisible(pCsr->pDb, p->aiNext[0], pCsr->pRoot->iTransId, &rc);
+  if( iNext ){
+    pCsr->iSkip = iNext;
+  }else{
+    pCsr->iNode = -1;
+  }
+  return rc;
+}
+
+static int skipCursorPrev(TreeCursor *pCsr){
+  int rc = LSM_OK;
+  TreeSkip *p = skipNode(pCsr->pDb, pCsr->iSkip, &rc);
+  u32 iPrev;
+
+  assert( lsmTreeCursorValid(pCsr) );
+  iPrev = skipPrevVisible(pCsr->pDb, p->iPrev, pCsr->pRoot->iTransId, &rc);
+  if( iPrev ){
+    pCsr->iSkip = iPrev;
+  }else{
+    pCsr->iNode = -1;
+  }
+  return rc;
+}
+
+static int skipCursorEnd(TreeCursor *pCsr, int bLast){
+  lsm_db *pDb = pCsr->pDb;
+  TreeRoot *pRoot = pCsr->pRoot;
+  int rc = LSM_OK;
+  u32 iPtr = 0;
+
+  pCsr->iNode = -1;
+  if( pRoot->iRoot ){
+    TreeSkip *p = skipNode(pDb, pRoot->iRoot, &rc);
+    if( bLast==0 ){
+      iPtr = skipNextVisible(pDb, p->aiNext[0], pRoot->iTransId, &rc);
+    }else{
+      int i;
+      iPtr = pRoot->iRoot;
+      for(i=pRoot->nHeight-1; i>=0 && rc==LSM_OK; i--){
+        u32 iNext;
+        while( (iNext = p->aiNext[i]) ){
+          TreeSkip *pNext = skipNode(pDb, iNext, &rc);
+          if( pNext==0 ) break;
+          iPtr = iNext;
+          p = pNext;
+        }
+      }
+      iPtr = skipPrevVisible(pDb, iPtr, pRoot->iTransId, &rc);
+    }
+  }
+
+  if( iPtr && rc==LSM_OK ){
+    pCsr->iSkip = iPtr;
+    pCsr->iNode = 0;
+  }
+  return rc;
+}
+
+static u32 skipKeyPtr(TreeCursor *pCsr){
+  return ((TreeSkip *)treeShmptrUnsafe(pCsr->pDb, pCsr->iSkip))->iKey;
+}
+
+/*
+** Return the flags of the TreeKey associated with skiplist node iPtr. Or
+** 0 if iPtr is 0.
+*/
+static int skipNodeFlags(lsm_db *db, u32 iPtr){
+  if( iPtr ){
+    TreeSkip *p = (TreeSkip *)treeShmptr(db, iPtr);
+    return ((TreeKey *)treeShmptr(db, p->iKey))->flags;
+  }
+  return 0;
+}
+
+static int skipPrevIsStartDelete(lsm_db *db, TreeCursor *pCsr){
+  int rc = LSM_OK;
+  TreeSkip *p = (TreeSkip *)treeShmptr(db, pCsr->iSkip);
+  u32 iPrev = skipPrevVisible(db, p->iPrev, pCsr->pRoot->iTransId, &rc);
+  return ((skipNodeFlags(db, iPrev) & LSM_START_DELETE) ? 1 : 0);
+}
+
+static int skipNextIsEndDelete(lsm_db *db, TreeCursor *pCsr){
+  int rc = LSM_OK;
+  TreeSkip *p = (TreeSkip *)treeShmptr(db, pCsr->iSkip);
+  u32 iNext = skipNextVisible(db, p->aiNext[0], pCsr->pRoot->iTransId, &rc);
+  return ((skipNodeFlags(db, iNext) & LSM_END_DELETE) ? 1 : 0);
+}
+
+/*
+** The xInsert() method for skiplist structures.
+**
+** A new node is linked in immediately after the nodes in pCsr->aiSkipPred[]
+** (the last node on each level with a key smaller than the new key).
+** Since nodes are never removed, if res is 0, the new node is inserted
+** before the node that the cursor points to, which is then marked as
+** superseded.
+*/
+static int skipInsertKey(
+  lsm_db *pDb,                    /* Database handle */
+  TreeCursor *pCsr,               /* Cursor positioned by writer's seek */
+  int res,                        /* Result of seek on pCsr */
+  u32 iTreeKey                    /* Key to insert */
+){
+  TreeRoot *p = &pDb->treehdr.root;
+  int nLevel = skipRandomLevel(iTreeKey);
+  int rc = LSM_OK;
+  TreeSkip *pNew;
+  u32 iNew;
+
+  if( p->iRoot==0 ){
+    /* The tree is completely empty. Allocate the head node. */
+    int i;
+    if( skipNewNode(pDb, TREE_SKIP_MAXLEVEL, &p->iRoot, &rc)==0 ) return rc;
+    p->nHeight = 1;
+    for(i=0; i<TREE_SKIP_MAXLEVEL; i++) pCsr->aiSkipPred[i] = p->iRoot;
+  }
+
+  pNew = skipNewNode(pDb, nLevel, &iNew, &rc);
+  if( pNew ){
+    TreeSkip *pPred;
+    u32 iNext;
+    int i;
+
+    /* Populate the new node. Then link it into the skiplist, level 0 first.
+    ** A barrier is required so that a reader that finds the new node sees
+    ** its contents.  */
+    pNew->iKey = iTreeKey;
+    pNew->iTransId = p->iTransId;
+    pNew->iPrev = pCsr->aiSkipPred[0];
+    for(i=0; i<nLevel; i++){
+      pPred = (TreeSkip *)treeShmptr(pDb, pCsr->aiSkipPred[i]);
+      pNew->aiNext[i] = pPred->aiNext[i];
+    }
+    lsmShmBarrier(pDb);
+
+    for(i=0; i<nLevel; i++){
+      u32 iPred = pCsr->aiSkipPred[i];
+      pPred = (TreeSkip *)treeShmptr(pDb, iPred);
+      skipWrite(pDb, pPred, skipNextPtr(iPred, i), iNew, &rc);
+    }
+    iNext = pNew->aiNext[0];
+    if( iNext ){
+      TreeSkip *pNext = (TreeSkip *)treeShmptr(pDb, iNext);
+      skipWrite(pDb, pNext, iNext + offsetof(TreeSkip, iPrev), iNew, &rc);
+    }
+    if( res==0 ){
+      TreeSkip *pOld = (TreeSkip *)treeShmptr(pDb, pCsr->iSkip);
+      assert( lsmTreeCursorValid(pCsr) );
+      skipWrite(pDb, pOld,
+          pCsr->iSkip + offsetof(TreeSkip, iDead), p->iTransId, &rc
+      );
+    }
+    if( nLevel>(int)p->nHeight ) p->nHeight = nLevel;
+  }
+
+  return rc;
+}
+
+/*
+** The xDelete() method for skiplist structures. Each entry in the range
+** is marked as removed by the current transaction.
+*/
+static int skipDeleteRange(
+  lsm_db *db,
+  void *pKey1, int nKey1,         /* Start of range */
+  void *pKey2, int nKey2          /* End of range */
+){
+  u32 iTransId = db->treehdr.root.iTransId;
+  TreeCursor csr;
+  int res;
+  int rc;
+
+  /* Seek the cursor to the first entry in the tree greater than pKey1. */
+  treeCursorInit(db, 0, &csr);
+  rc = skipCursorSeek(&csr, pKey1, nKey1, &res);
+  if( rc==LSM_OK && res<=0 && lsmTreeCursorValid(&csr) ){
+    rc = skipCursorNext(&csr);
+  }
+
+  while( rc==LSM_OK && lsmTreeCursorValid(&csr) ){
+    TreeSkip *p;
+    TreeKey *pKey = csrGetKey(&csr, &csr.blob, &rc);
+    if( pKey==0 || treeKeycmp(TKV_KEY(pKey), pKey->nKey, pKey2, nKey2)>=0 ){
+      break;
+    }
+    p = (TreeSkip *)treeShmptr(db, csr.iSkip);
+    skipWrite(db, p, csr.iSkip + offsetof(TreeSkip, iDead), iTransId, &rc);
+    if( rc==LSM_OK ) rc = skipCursorNext(&csr);
+  }
+
+  tblobFree(db, &csr.blob);
+  return rc;
+}
+
+/*
+** The xRollback() method for skiplist structures.
+**
+** Restore each value modified since the mark was taken, most recent
+** first. Space allocated since the mark is not reclaimed, as a reader
+** with an older snapshot may be stepping over the nodes being unlinked.
+*/
+static void skipRollback(lsm_db *pDb, TreeMark *pMark){
+  int iIdx;
+
+  assert( (intArraySize(&pDb->rollback) - pMark->iRollback) % 2==0 );
+  for(iIdx=intArraySize(&pDb->rollback)-2; iIdx>=pMark->iRollback; iIdx-=2){
+    u32 *p = (u32 *)treeShmptr(pDb, intArrayEntry(&pDb->rollback, iIdx));
+    *p = intArrayEntry(&pDb->rollback, iIdx+1);
+  }
+  intArrayTruncate(&pDb->rollback, pMark->iRollback);
+}
+
+/*
+** The xRepair() method for skiplist structures.
+**
+** Unlink all nodes inserted by transactions with ids greater than that in
+** the tree-header, and clear the iDead field of any node superseded or
+** removed by such a transaction.
+*/
+static int skipRepair(lsm_db *db){
+  TreeRoot *pRoot = &db->treehdr.root;
+  int rc = LSM_OK;
+
+  if( pRoot->iRoot ){
+    u32 iTransId = pRoot->iTransId;
+    int i;
+
+    for(i=0; rc==LSM_OK && i<TREE_SKIP_MAXLEVEL; i++){
+      u32 iPrev = pRoot->iRoot;
+      TreeSkip *pPrev = skipNode(db, iPrev, &rc);
+      while( pPrev && pPrev->aiNext[i] ){
+        u32 iNext = pPrev->aiNext[i];
+        TreeSkip *pNext = skipNode(db, iNext, &rc);
+        if( pNext==0 ) break;
+        if( pNext->iTransId>iTransId ){
+          pPrev->aiNext[i] = pNext->aiNext[i];
+        }else{
+          if( i==0 ){
+            pNext->iPrev = iPrev;
+            if( pNext->iDead>iTransId ) pNext->iDead = 0;
+          }
+          iPrev = iNext;
+          pPrev = pNext;
+        }
+      }
+    }
+  }
+
+  return rc;
+}
+/* End of skiplist methods.
+***********************************************************************/
+
+static const TreeMethods btreeMethods = {
+  btreeCursorSeek,
+  btreeCursorNext,
+  btreeCursorPrev,
+  btreeCursorEnd,
+  btreeKeyPtr,
+  treePrevIsStartDelete,
+  treeNextIsEndDelete,
+  btreeInsertKey,
+  btreeDeleteRange,
+  btreeRollback,
+  treeRepairPtrs
+};
+
+static const TreeMethods skipMethods = {
+  skipCursorSeek,
+  skipCursorNext,
+  skipCursorPrev,
+  skipCursorEnd,
+  skipKeyPtr,
+  skipPrevIsStartDelete,
+  skipNextIsEndDelete,
+  skipInsertKey,
+  skipDeleteRange,
+  skipRollback,
+  skipRepair
+};
+
+/*
+** Return the methods object for the in-memory tree of connection pDb.
+*/
+static const TreeMethods *treeMethods(lsm_db *pDb){
+  return (pDb->treehdr.eTree==TREE_SKIPLIST ? &skipMethods : &btreeMethods);
+}
+
 /*
 ** Load the in-memory tree header from shared-memory into pDb->treehdr.
 ** If the header cannot be loaded, return LSM_PROTOCOL.
@@ -2421,6 +3234,174 @@ int lsmTreeEndTransaction(lsm_db *pDb, int bCommit){
   return LSM_OK;
 }
 
+/*
+** This function is called by log recovery each time a COMMIT record is
+** read from the log. The records of the transaction have already been
+** inserted into the tree. Discard the rollback information accumulated 
+** while doing so and begin a new transaction, so that the tree may be
+** rolled back to the current state if the log ends before the next
+** transaction is complete.
+*/
+void lsmTreeRecoverCommit(lsm_db *pDb){
+  intArrayFree(pDb->pEnv, &pDb->rollback);
+  pDb->treehdr.root.iTransId++;
+}
+
+#define TREE_IMAGE_MAGIC   0x4C534D54
+#define TREE_IMAGE_NHDR    10
+#define TREE_IMAGE_HDRSIZE (TREE_IMAGE_NHDR*sizeof(u32))
+
+/*
+** Save an image of the in-memory tree. This is called by the last 
+** connection to close the database, after it has written a checkpoint to
+** the database file, instead of flushing the tree to disk. See the "TREE
+** IMAGES" section at the top of this file for details.
+*/
+int lsmTreeSaveImage(lsm_db *pDb){
+  FileSystem *pFS = pDb->pFS;
+  TreeHeader *pHdr = &pDb->treehdr;
+  u32 eCksum = pDb->pShmhdr->eLogCksum;
+  i64 iCkpt = lsmCheckpointId(pDb->aSnapshot, 0);
+  int bShm = lsmDbMultiProc(pDb);
+  u32 aHdr[TREE_IMAGE_NHDR];
+  i64 iOff;
+  int rc = LSM_OK;
+  int i;
+
+  assert( lsmTreeHasOld(pDb)==0 );
+
+  /* The image may only be used if the log and value log contain everything
+  ** that it does. Otherwise, after it is loaded, new transactions would be
+  ** appended to a log that ends before the point the image expects.  */
+  if( pDb->eSafety!=LSM_SAFETY_OFF ){
+    if( pDb->bUseLog ){
+      rc = lsmFsOpenLog(pDb, 0);
+      if( rc==LSM_OK ) rc = lsmFsSyncLog(pFS);
+    }
+    if( rc==LSM_OK ) rc = lsmVlogSync(pDb, pHdr->iVlogOff);
+  }
+
+  memset(aHdr, 0, sizeof(aHdr));
+  aHdr[0] = TREE_IMAGE_MAGIC;
+  aHdr[1] = sizeof(TreeHeader);
+  aHdr[2] = pHdr->nChunk;
+  aHdr[3] = eCksum;
+  aHdr[4] = (u32)(iCkpt >> 32);
+  aHdr[5] = (u32)(iCkpt & 0xFFFFFFFF);
+  aHdr[6] = (u32)bShm;
+  aHdr[7] = TREE_NSLOT;
+  lsmLogChecksum(eCksum, aHdr, 8*sizeof(u32), &aHdr[8]);
+
+  /* Write the tree-header and, in single-process mode, the shared-memory
+  ** chunks. Then the image header.  */
+  treeHeaderChecksum(pHdr, pHdr->aCksum);
+  lsmLogChecksum(eCksum, pHdr, sizeof(TreeHeader), &aHdr[8]);
+  iOff = TREE_IMAGE_HDRSIZE;
+  if( rc==LSM_OK ){
+    rc = lsmFsWriteTreeImage(pFS, iOff, pHdr, sizeof(TreeHeader));
+    iOff += sizeof(TreeHeader);
+  }
+  if( rc==LSM_OK ){
+    rc = lsmShmCacheChunks(pDb, pHdr->nChunk);
+  }
+  for(i=1; rc==LSM_OK && i<pHdr->nChunk; i++){
+    lsmLogChecksum(eCksum, pDb->apShm[i], LSM_SHM_CHUNK_SIZE, &aHdr[8]);
+    if( bShm==0 ){
+      rc = lsmFsWriteTreeImage(pFS, iOff, pDb->apShm[i], LSM_SHM_CHUNK_SIZE);
+      iOff += LSM_SHM_CHUNK_SIZE;
+    }
+  }
+  if( rc==LSM_OK ){
+    rc = lsmFsWriteTreeImage(pFS, 0, aHdr, TREE_IMAGE_HDRSIZE);
+  }
+  if( rc==LSM_OK && pDb->eSafety!=LSM_SAFETY_OFF ){
+    rc = lsmFsSyncTreeImage(pFS);
+  }
+  return rc;
+}
+
+/*
+** This function is called during recovery, after the checkpoint has been
+** loaded from the database file, if LSM_CONFIG_TREE_IMAGE is set. If a
+** tree image that matches the checkpoint was saved, restore it, finish
+** recovery and set *pbLoaded to true. The image is invalidated before 
+** returning, so that it is not used again. Otherwise, set *pbLoaded to 
+** false - the caller should run log recovery instead.
+**
+** Either way, the caller deletes the tree image file once recovery is 
+** complete.
+*/
+int lsmTreeLoadImage(lsm_db *pDb, int *pbLoaded){
+  FileSystem *pFS = pDb->pFS;
+  ShmHeader *pShm = pDb->pShmhdr;
+  u32 eCkptCksum = lsmCheckpointLogCksum(pShm->aSnap2);
+  i64 iCkpt = lsmCheckpointId(pShm->aSnap2, 0);
+  int bShm = lsmDbMultiProc(pDb);
+  TreeHeader hdr;
+  u32 aHdr[TREE_IMAGE_NHDR];
+  u32 aCksum[2] = {0, 0};
+  i64 iOff;
+  int rc;
+  int i;
+
+  *pbLoaded = 0;
+  rc = lsmFsReadTreeImage(pFS, 0, aHdr, TREE_IMAGE_HDRSIZE);
+  if( rc==LSM_OK ){
+    rc = lsmFsReadTreeImage(pFS, TREE_IMAGE_HDRSIZE, &hdr, sizeof(hdr));
+  }
+  if( rc!=LSM_OK ) return rc;
+
+  /* Check that the image header is well-formed and matches both the 
+  ** checkpoint and the current mode, and that the tree-header is intact. 
+  ** Skiplists may not be used in multi-process mode.  */
+  if( aHdr[0]!=TREE_IMAGE_MAGIC 
+   || aHdr[1]!=sizeof(TreeHeader)
+   || (aHdr[3]!=LSM_LOG_CKSUM_FLETCHER && aHdr[3]!=LSM_LOG_CKSUM_CRC32C)
+   || (eCkptCksum!=LSM_LOG_CKSUM_UNKNOWN && eCkptCksum!=aHdr[3])
+   || aHdr[4]!=(u32)(iCkpt >> 32)
+   || aHdr[5]!=(u32)(iCkpt & 0xFFFFFFFF)
+   || aHdr[6]!=(u32)bShm
+   || aHdr[7]!=TREE_NSLOT
+   || treeHeaderChecksumOk(&hdr)==0
+   || hdr.nChunk!=aHdr[2] || hdr.nChunk<2
+   || hdr.iOldShmid!=0
+   || (hdr.eTree==TREE_SKIPLIST && bShm)
+  ){
+    return LSM_OK;
+  }
+
+  /* Load or map the shared-memory chunks and verify the checksum. */
+  lsmLogChecksum(aHdr[3], aHdr, 8*sizeof(u32), aCksum);
+  lsmLogChecksum(aHdr[3], &hdr, sizeof(TreeHeader), aCksum);
+  rc = lsmShmCacheChunks(pDb, hdr.nChunk);
+  iOff = TREE_IMAGE_HDRSIZE + sizeof(TreeHeader);
+  for(i=1; rc==LSM_OK && i<hdr.nChunk; i++){
+    if( bShm==0 ){
+      rc = lsmFsReadTreeImage(pFS, iOff, pDb->apShm[i], LSM_SHM_CHUNK_SIZE);
+      iOff += LSM_SHM_CHUNK_SIZE;
+    }
+    lsmLogChecksum(aHdr[3], pDb->apShm[i], LSM_SHM_CHUNK_SIZE, aCksum);
+  }
+  if( rc!=LSM_OK || aCksum[0]!=aHdr[8] || aCksum[1]!=aHdr[9] ) return rc;
+
+  /* Invalidate the image. With safety=OFF there is no need to sync this
+  ** before new transactions are written to the log, as they may be lost
+  ** in a system failure anyway.  */
+  aHdr[0] = 0;
+  rc = lsmFsWriteTreeImage(pFS, 0, aHdr, sizeof(u32));
+  if( rc==LSM_OK && pDb->eSafety!=LSM_SAFETY_OFF ){
+    rc = lsmFsSyncTreeImage(pFS);
+  }
+
+  if( rc==LSM_OK ){
+    memcpy(&pDb->treehdr, &hdr, sizeof(TreeHeader));
+    pShm->eLogCksum = aHdr[3];
+    *pbLoaded = 1;
+    rc = lsmFinishRecovery(pDb);
+  }
+  return rc;
+}
+
 #ifndef NDEBUG
 static int assert_delete_ranges_match(lsm_db *db){
   int prev = 0;
@@ -2444,22 +3425,4 @@ static int assert_delete_ranges_match(lsm_db *db){
 
   return 1;
 }
-
-static int treeCountEntries(lsm_db *db){
-  TreeCursor csr;               /* Cursor used to iterate through tree */
-  int rc;
-  int nEntry = 0;
-
-  treeCursorInit(db, 0, &csr);
-  for( rc = lsmTreeCursorEnd(&csr, 0);
-       rc==LSM_OK && lsmTreeCursorValid(&csr);
-       rc = lsmTreeCursorNext(&csr)
-  ){
-    nEntry++;
-  }
-
-  tblobFree(csr.pDb, &csr.blob);
-
-  return nEntry;
-}
 #endif
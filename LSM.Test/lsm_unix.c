@@ -0,0 +1,867 @@
+/*
+** 2011-12-03
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+**
+** Unix-specific run-time environment implementation for LSM.
+**
+** All file i/o is positional (pread()/pwrite()), so that multiple threads
+** may read and write the same file descriptor concurrently without
+** contending for a shared file offset. Locks are fcntl() byte-range locks
+** on the same bytes used by the Windows environment (4096-iLock), and
+** shared-memory is an mmap()ed "<db>-shm" file.
+*/
+#ifndef _WIN32
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* Required for the declaration of mremap() */
+# define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "lsmInt.h"
+
+/* fdatasync() is not available on all systems */
+#if !defined(__linux__)
+# define fdatasync(x) fsync(x)
+#endif
+
+/*
+** If the database file is between 0 and 2MB in size, it is extended in
+** chunks of 256K when it is remapped. Thereafter, in chunks of 1MB at a
+** time.
+*/
+#define POSIX_MAP_INCR_SMALL (256*1024)
+#define POSIX_MAP_INCR_LARGE (1024*1024)
+
+/*
+** An open file is an instance of the following object
+*/
+typedef struct PosixFile PosixFile;
+struct PosixFile {
+  lsm_env *pEnv;                  /* The run-time environment */
+  char *zName;                    /* Full path to file */
+  int fd;                         /* The open file descriptor */
+  int bReadonly;                  /* True if fd is open read-only */
+  int shmfd;                      /* Shared memory file-descriptor (or -1) */
+  void *pMap;                     /* Pointer to mapping of file fd */
+  off_t nMap;                     /* Size of mapping at pMap in bytes */
+  int nShm;                       /* Number of entries in array apShm[] */
+  void **apShm;                   /* Array of mapped shared memory chunks */
+};
+
+/*
+** Return a buffer containing the name of the shared-memory file associated
+** with file p. It is the responsibility of the caller to eventually free
+** the buffer using lsmFree(). If an OOM error occurs, NULL is returned.
+*/
+static char *posixShmFile(PosixFile *p){
+  char *zShm;
+  int nName = strlen(p->zName);
+  zShm = (char *)lsmMalloc(p->pEnv, nName+4+1);
+  if( zShm ){
+    memcpy(zShm, p->zName, nName);
+    memcpy(&zShm[nName], "-shm", 5);
+  }
+  return zShm;
+}
+
+static int lsmPosixOsOpen(
+  lsm_env *pEnv,
+  const char *zFile,
+  int flags,
+  lsm_file **ppFile
+){
+  int rc = LSM_OK;
+  PosixFile *p;
+
+  p = (PosixFile *)lsmMallocZero(pEnv, sizeof(PosixFile));
+  if( p==0 ){
+    rc = LSM_NOMEM_BKPT;
+  }else{
+    int bReadonly = (flags & LSM_OPEN_READONLY);
+    int oflags = (bReadonly ? O_RDONLY : (O_RDWR|O_CREAT));
+    p->pEnv = pEnv;
+    p->bReadonly = bReadonly;
+    p->shmfd = -1;
+    p->zName = lsmMallocStrdup(pEnv, zFile);
+    if( p->zName==0 ){
+      rc = LSM_NOMEM_BKPT;
+    }else{
+      p->fd = open(zFile, oflags, 0644);
+      if( p->fd<0 ){
+        if( errno==ENOENT ){
+          rc = lsmErrorBkpt(LSM_IOERR_NOENT);
+        }else{
+          rc = LSM_IOERR_BKPT;
+        }
+      }
+    }
+
+    if( rc!=LSM_OK ){
+      lsmFree(pEnv, p->zName);
+      lsmFree(pEnv, p);
+      p = 0;
+    }
+  }
+
+  *ppFile = (lsm_file *)p;
+  return rc;
+}
+
+static int lsmPosixOsWrite(
+  lsm_file *pFile,                /* File to write to */
+  lsm_i64 iOff,                   /* Offset to write to */
+  void *pData,                    /* Write data from this buffer */
+  int nData                       /* Bytes of data to write */
+){
+  PosixFile *p = (PosixFile *)pFile;
+  u8 *aData = (u8 *)pData;
+
+  while( nData>0 ){
+    ssize_t prc = pwrite(p->fd, aData, (size_t)nData, (off_t)iOff);
+    if( prc<0 ){
+      if( errno==EINTR ) continue;
+      return LSM_IOERR_BKPT;
+    }
+    if( prc==0 ) return LSM_IOERR_BKPT;
+    aData += prc;
+    iOff += prc;
+    nData -= (int)prc;
+  }
+
+  return LSM_OK;
+}
+
+static int lsmPosixOsTruncate(
+  lsm_file *pFile,                /* File to write to */
+  lsm_i64 nSize                   /* Size to truncate file to */
+){
+  PosixFile *p = (PosixFile *)pFile;
+  int prc = ftruncate(p->fd, (off_t)nSize);
+  return prc ? LSM_IOERR_BKPT : LSM_OK;
+}
+
+/*
+** Release the storage used by nByte bytes of the file starting at offset
+** iOff, without changing the size of the file. Where hole punching is not
+** supported, this is a no-op.
+*/
+static int lsmPosixOsPunch(
+  lsm_file *pFile,                /* File to punch a hole in */
+  lsm_i64 iOff,                   /* Offset of first byte to release */
+  lsm_i64 nByte                   /* Number of bytes to release */
+){
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+  PosixFile *p = (PosixFile *)pFile;
+  int prc = fallocate(
+      p->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t)iOff, (off_t)nByte
+  );
+  if( prc && errno!=EOPNOTSUPP && errno!=ENOSYS ) return LSM_IOERR_BKPT;
+#endif
+  return LSM_OK;
+}
+
+static int lsmPosixOsRead(
+  lsm_file *pFile,                /* File to read from */
+  lsm_i64 iOff,                   /* Offset to read from */
+  void *pData,                    /* Read data into this buffer */
+  int nData                       /* Bytes of data to read */
+){
+  PosixFile *p = (PosixFile *)pFile;
+  u8 *aData = (u8 *)pData;
+
+  while( nData>0 ){
+    ssize_t prc = pread(p->fd, aData, (size_t)nData, (off_t)iOff);
+    if( prc<0 ){
+      if( errno==EINTR ) continue;
+      return LSM_IOERR_BKPT;
+    }
+    if( prc==0 ){
+      /* Short read. Zero the remainder of the buffer. */
+      memset(aData, 0, nData);
+      break;
+    }
+    aData += prc;
+    iOff += prc;
+    nData -= (int)prc;
+  }
+
+  return LSM_OK;
+}
+
+static int lsmPosixOsSync(lsm_file *pFile){
+  int rc = LSM_OK;
+
+#ifndef LSM_NO_SYNC
+  PosixFile *p = (PosixFile *)pFile;
+  int prc = 0;
+
+  if( p->pMap ){
+    prc = msync(p->pMap, p->nMap, MS_SYNC);
+  }
+  if( prc==0 ) prc = fdatasync(p->fd);
+  if( prc<0 ) rc = LSM_IOERR_BKPT;
+#else
+  (void)pFile;
+#endif
+
+  return rc;
+}
+
+static int lsmPosixOsSectorSize(lsm_file *pFile){
+  (void)pFile;
+  return 512;
+}
+
+/*
+** Mutex used to serialize extending database files in lsmPosixOsRemap().
+*/
+static pthread_mutex_t sRemapMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int lsmPosixOsRemap(
+  lsm_file *pFile,
+  lsm_i64 iMin,
+  void **ppOut,
+  lsm_i64 *pnOut
+){
+  PosixFile *p = (PosixFile *)pFile;
+  const int nIncrSz = (iMin>(2*1024*1024)) ?
+    POSIX_MAP_INCR_LARGE : POSIX_MAP_INCR_SMALL;
+  const int prot = (p->bReadonly ? PROT_READ : (PROT_READ|PROT_WRITE));
+  struct stat sStat;
+  off_t iSz;
+
+  *ppOut = 0;
+  *pnOut = 0;
+
+  /* A negative iMin is a request to unmap the file. */
+  if( iMin<0 ){
+    if( p->pMap ){
+      munmap(p->pMap, p->nMap);
+      p->pMap = 0;
+      p->nMap = 0;
+    }
+    return LSM_OK;
+  }
+
+  /* The fstat() and ftruncate() calls are made while holding a static
+  ** mutex. Otherwise, if two connections in this process were extending
+  ** the file at the same time (e.g. a merge run by a background worker
+  ** and a flush), the smaller of the two ftruncate() calls might be made
+  ** second and truncate pages already mapped by the other connection.  */
+  pthread_mutex_lock(&sRemapMutex);
+  if( fstat(p->fd, &sStat) ){
+    pthread_mutex_unlock(&sRemapMutex);
+    return LSM_IOERR_BKPT;
+  }
+  iSz = sStat.st_size;
+  if( iSz<iMin ){
+    iSz = ((iMin + nIncrSz-1) / nIncrSz) * nIncrSz;
+    if( p->bReadonly==0 && ftruncate(p->fd, iSz) ){
+      pthread_mutex_unlock(&sRemapMutex);
+      return LSM_IOERR_BKPT;
+    }
+  }
+  pthread_mutex_unlock(&sRemapMutex);
+
+  if( p->pMap && iSz!=p->nMap ){
+#ifdef __linux__
+    /* Grow the existing mapping in place if possible. The caller fixes up
+    ** any pointers into the old mapping if it is moved.  */
+    void *pNew = mremap(p->pMap, p->nMap, iSz, MREMAP_MAYMOVE);
+    if( pNew==MAP_FAILED ){
+      munmap(p->pMap, p->nMap);
+      p->pMap = 0;
+      p->nMap = 0;
+      return LSM_IOERR_BKPT;
+    }
+    p->pMap = pNew;
+    p->nMap = iSz;
+#else
+    munmap(p->pMap, p->nMap);
+    p->pMap = 0;
+    p->nMap = 0;
+#endif
+  }
+
+  if( p->pMap==0 ){
+    p->pMap = mmap(0, iSz, prot, MAP_SHARED, p->fd, 0);
+    if( p->pMap==MAP_FAILED ){
+      p->pMap = 0;
+      return LSM_IOERR_BKPT;
+    }
+    p->nMap = iSz;
+  }
+
+  *ppOut = p->pMap;
+  *pnOut = p->nMap;
+  return LSM_OK;
+}
+
+static int lsmPosixOsFullpath(
+  lsm_env *pEnv,
+  const char *zName,
+  char *zOut,
+  int *pnOut
+){
+  int nBuf = *pnOut;
+  int nName = strlen(zName);
+  int nReq;
+
+  if( zName[0]!='/' ){
+    char *z = 0;
+    char *zTmp;
+    int nTmp = 512;
+    zTmp = lsmMalloc(pEnv, nTmp);
+    while( zTmp ){
+      z = getcwd(zTmp, nTmp);
+      if( z || errno!=ERANGE ) break;
+      nTmp = nTmp*2;
+      zTmp = lsmReallocOrFree(pEnv, zTmp, nTmp);
+    }
+    if( zTmp==0 ) return LSM_NOMEM_BKPT;
+    if( z==0 ){
+      lsmFree(pEnv, zTmp);
+      return LSM_IOERR_BKPT;
+    }
+    assert( z==zTmp );
+
+    nTmp = strlen(zTmp);
+    nReq = nTmp + 1 + nName + 1;
+    if( zOut && nReq<=nBuf ){
+      memcpy(zOut, zTmp, nTmp);
+      zOut[nTmp] = '/';
+      memcpy(&zOut[nTmp+1], zName, nName+1);
+    }
+    lsmFree(pEnv, zTmp);
+  }else{
+    nReq = nName+1;
+    if( zOut && nReq<=nBuf ){
+      memcpy(zOut, zName, nName+1);
+    }
+  }
+
+  *pnOut = nReq;
+  return LSM_OK;
+}
+
+static int lsmPosixOsFileid(
+  lsm_file *pFile,
+  void *pBuf,
+  int *pnBuf
+){
+  PosixFile *p = (PosixFile *)pFile;
+  int nBuf = *pnBuf;
+  int nReq;
+  struct stat buf;
+
+  memset(&buf, 0, sizeof(buf));
+  if( fstat(p->fd, &buf)!=0 ) return LSM_IOERR_BKPT;
+
+  nReq = (sizeof(buf.st_dev) + sizeof(buf.st_ino));
+  *pnBuf = nReq;
+  if( pBuf && nReq<=nBuf ){
+    memcpy(pBuf, &buf.st_dev, sizeof(buf.st_dev));
+    memcpy(&(((u8 *)pBuf)[sizeof(buf.st_dev)]), &buf.st_ino, sizeof(buf.st_ino));
+  }
+  return LSM_OK;
+}
+
+static int lsmPosixOsUnlink(lsm_env *pEnv, const char *zFile){
+  int prc = unlink(zFile);
+  (void)pEnv;
+  return prc ? LSM_IOERR_BKPT : LSM_OK;
+}
+
+/*
+** Note that fcntl() locks are held per-process, not per file-descriptor.
+** Closing any file-descriptor open on the database file releases all locks
+** held by the process. This is why lsm_shared.c defers closing database
+** file-descriptors (see dbDeferClose()) until the last connection to a
+** Database is closed.
+*/
+static int lsmPosixOsLock(lsm_file *pFile, int iLock, int eType){
+  int rc = LSM_OK;
+  PosixFile *p = (PosixFile *)pFile;
+  static const short aType[3] = { F_UNLCK, F_RDLCK, F_WRLCK };
+  struct flock lock;
+
+  assert( aType[LSM_LOCK_UNLOCK]==F_UNLCK );
+  assert( aType[LSM_LOCK_SHARED]==F_RDLCK );
+  assert( aType[LSM_LOCK_EXCL]==F_WRLCK );
+  assert( eType>=0 && eType<array_size(aType) );
+  assert( iLock>0 && iLock<=32 );
+
+  memset(&lock, 0, sizeof(lock));
+  lock.l_whence = SEEK_SET;
+  lock.l_len = 1;
+  lock.l_type = aType[eType];
+  lock.l_start = (4096-iLock);
+
+  if( fcntl(p->fd, F_SETLK, &lock) ){
+    int e = errno;
+    if( e==EACCES || e==EAGAIN ){
+      rc = LSM_BUSY;
+    }else{
+      rc = LSM_IOERR_BKPT;
+    }
+  }
+
+  return rc;
+}
+
+static int lsmPosixOsTestLock(lsm_file *pFile, int iLock, int nLock, int eType){
+  int rc = LSM_OK;
+  PosixFile *p = (PosixFile *)pFile;
+  static const short aType[3] = { 0, F_RDLCK, F_WRLCK };
+  struct flock lock;
+
+  assert( eType==LSM_LOCK_SHARED || eType==LSM_LOCK_EXCL );
+  assert( aType[LSM_LOCK_SHARED]==F_RDLCK );
+  assert( aType[LSM_LOCK_EXCL]==F_WRLCK );
+  assert( eType>=0 && eType<array_size(aType) );
+  assert( iLock>0 && iLock<=32 );
+
+  /* Locks iLock..(iLock+nLock-1) are bytes (4096-iLock-nLock+1)..(4096-iLock)
+  ** of the file. F_GETLK ignores locks held by this process, which are
+  ** tracked separately by lsmShmTestLock().  */
+  memset(&lock, 0, sizeof(lock));
+  lock.l_whence = SEEK_SET;
+  lock.l_len = nLock;
+  lock.l_type = aType[eType];
+  lock.l_start = (4096-iLock-nLock+1);
+  if( fcntl(p->fd, F_GETLK, &lock) ){
+    rc = LSM_IOERR_BKPT;
+  }else if( lock.l_type!=F_UNLCK ){
+    rc = LSM_BUSY;
+  }
+
+  return rc;
+}
+
+static int lsmPosixOsShmMap(lsm_file *pFile, int iChunk, int sz, void **ppShm){
+  PosixFile *p = (PosixFile *)pFile;
+
+  *ppShm = 0;
+  assert( sz==LSM_SHM_CHUNK_SIZE );
+  if( iChunk>=p->nShm ){
+    int i;
+    void **apNew;
+    int nNew = iChunk+1;
+    off_t nReq = (off_t)nNew * LSM_SHM_CHUNK_SIZE;
+    struct stat sStat;
+
+    /* If the shared-memory file has not been opened, open it now. */
+    if( p->shmfd<0 ){
+      char *zShm = posixShmFile(p);
+      if( !zShm ) return LSM_NOMEM_BKPT;
+      p->shmfd = open(zShm, O_RDWR|O_CREAT, 0644);
+      lsmFree(p->pEnv, zShm);
+      if( p->shmfd<0 ){
+        return LSM_IOERR_BKPT;
+      }
+    }
+
+    /* If the shared-memory file is not large enough to contain the
+    ** requested chunk, cause it to grow.  */
+    if( fstat(p->shmfd, &sStat) ){
+      return LSM_IOERR_BKPT;
+    }
+    if( sStat.st_size<nReq ){
+      if( ftruncate(p->shmfd, nReq) ){
+        return LSM_IOERR_BKPT;
+      }
+    }
+
+    apNew = (void **)lsmRealloc(p->pEnv, p->apShm, sizeof(void *) * nNew);
+    if( !apNew ) return LSM_NOMEM_BKPT;
+    for(i=p->nShm; i<nNew; i++){
+      apNew[i] = 0;
+    }
+    p->apShm = apNew;
+    p->nShm = nNew;
+  }
+
+  if( p->apShm[iChunk]==0 ){
+    p->apShm[iChunk] = mmap(0, LSM_SHM_CHUNK_SIZE,
+        PROT_READ|PROT_WRITE, MAP_SHARED, p->shmfd,
+        (off_t)iChunk*LSM_SHM_CHUNK_SIZE
+    );
+    if( p->apShm[iChunk]==MAP_FAILED ){
+      p->apShm[iChunk] = 0;
+      return LSM_IOERR_BKPT;
+    }
+  }
+
+  *ppShm = p->apShm[iChunk];
+  return LSM_OK;
+}
+
+static void lsmPosixOsShmBarrier(void){
+  __sync_synchronize();
+}
+
+static int lsmPosixOsShmUnmap(lsm_file *pFile, int bDelete){
+  int rc = LSM_OK;
+  PosixFile *p = (PosixFile *)pFile;
+  if( p->shmfd>=0 ){
+    int i;
+    for(i=0; i<p->nShm; i++){
+      if( p->apShm[i] ){
+        munmap(p->apShm[i], LSM_SHM_CHUNK_SIZE);
+        p->apShm[i] = 0;
+      }
+    }
+    close(p->shmfd);
+    p->shmfd = -1;
+    if( bDelete ){
+      char *zShm = posixShmFile(p);
+      if( zShm ){
+        unlink(zShm);
+      }else{
+        rc = LSM_NOMEM_BKPT;
+      }
+      lsmFree(p->pEnv, zShm);
+    }
+  }
+  return rc;
+}
+
+static int lsmPosixOsClose(lsm_file *pFile){
+  PosixFile *p = (PosixFile *)pFile;
+  lsmPosixOsShmUnmap(pFile, 0);
+  if( p->pMap ) munmap(p->pMap, p->nMap);
+  close(p->fd);
+  lsmFree(p->pEnv, p->apShm);
+  lsmFree(p->pEnv, p->zName);
+  lsmFree(p->pEnv, p);
+  return LSM_OK;
+}
+
+static int lsmPosixOsSleep(lsm_env *pEnv, int us){
+  (void)pEnv;
+  usleep(us);
+  return LSM_OK;
+}
+
+/****************************************************************************
+** Memory allocation routines.
+*/
+#define BLOCK_HDR_SIZE ROUND8( sizeof(sqlite4_size_t) )
+
+static void *lsmPosixOsMalloc(lsm_env *pEnv, int N){
+  unsigned char * m;
+  (void)pEnv;
+  m = (unsigned char *)malloc(N + BLOCK_HDR_SIZE);
+  if( m==0 ) return 0;
+  *((sqlite4_size_t*)m) = N;
+  return m + BLOCK_HDR_SIZE;
+}
+
+static void lsmPosixOsFree(lsm_env *pEnv, void *p){
+  (void)pEnv;
+  if( p ){
+    free(((unsigned char *)p) - BLOCK_HDR_SIZE);
+  }
+}
+
+static void *lsmPosixOsRealloc(lsm_env *pEnv, void *p, int N){
+  unsigned char * m = (unsigned char *)p;
+  if( 1>N ){
+    lsmPosixOsFree(pEnv, p);
+    return NULL;
+  }else if( NULL==p ){
+    return lsmPosixOsMalloc(pEnv, N);
+  }else{
+    void * re = NULL;
+    m -= BLOCK_HDR_SIZE;
+    re = realloc(m, N + BLOCK_HDR_SIZE);
+    if( re ){
+      m = (unsigned char *)re;
+      *((sqlite4_size_t*)m) = N;
+      return m + BLOCK_HDR_SIZE;
+    }else{
+      return NULL;
+    }
+  }
+}
+
+static sqlite4_size_t lsmPosixOsMSize(lsm_env *pEnv, void *p){
+  unsigned char * m = (unsigned char *)p;
+  (void)pEnv;
+  return *((sqlite4_size_t*)(m - BLOCK_HDR_SIZE));
+}
+#undef BLOCK_HDR_SIZE
+
+/****************************************************************************
+** Mutex methods for pthreads based systems. On Linux, pthread mutexes are
+** implemented on top of futexes, so an uncontended enter/leave pair does
+** not enter the kernel.
+*/
+typedef struct PthreadMutex PthreadMutex;
+struct PthreadMutex {
+  lsm_env *pEnv;
+  pthread_mutex_t mutex;
+#ifdef LSM_DEBUG
+  pthread_t owner;
+#endif
+};
+
+#ifdef LSM_DEBUG
+# define LSM_PTHREAD_STATIC_MUTEX { 0, PTHREAD_MUTEX_INITIALIZER, 0 }
+#else
+# define LSM_PTHREAD_STATIC_MUTEX { 0, PTHREAD_MUTEX_INITIALIZER }
+#endif
+
+static int lsmPosixOsMutexStatic(
+  lsm_env *pEnv,
+  int iMutex,
+  lsm_mutex **ppStatic
+){
+  static PthreadMutex sMutex[2] = {
+    LSM_PTHREAD_STATIC_MUTEX,
+    LSM_PTHREAD_STATIC_MUTEX
+  };
+
+  assert( iMutex==LSM_MUTEX_GLOBAL || iMutex==LSM_MUTEX_HEAP );
+  assert( LSM_MUTEX_GLOBAL==1 && LSM_MUTEX_HEAP==2 );
+
+  *ppStatic = (lsm_mutex *)&sMutex[iMutex-1];
+  return LSM_OK;
+}
+
+static int lsmPosixOsMutexNew(lsm_env *pEnv, lsm_mutex **ppNew){
+  PthreadMutex *pMutex;           /* Pointer to new mutex */
+
+  pMutex = (PthreadMutex *)lsmMallocZero(pEnv, sizeof(PthreadMutex));
+  if( !pMutex ) return LSM_NOMEM_BKPT;
+
+  pMutex->pEnv = pEnv;
+  pthread_mutex_init(&pMutex->mutex, 0);
+
+  *ppNew = (lsm_mutex *)pMutex;
+  return LSM_OK;
+}
+
+static void lsmPosixOsMutexDel(lsm_mutex *p){
+  PthreadMutex *pMutex = (PthreadMutex *)p;
+  pthread_mutex_destroy(&pMutex->mutex);
+  lsmFree(pMutex->pEnv, pMutex);
+}
+
+static void lsmPosixOsMutexEnter(lsm_mutex *p){
+  PthreadMutex *pMutex = (PthreadMutex *)p;
+  pthread_mutex_lock(&pMutex->mutex);
+
+#ifdef LSM_DEBUG
+  assert( !pthread_equal(pMutex->owner, pthread_self()) );
+  pMutex->owner = pthread_self();
+  assert( pthread_equal(pMutex->owner, pthread_self()) );
+#endif
+}
+
+static int lsmPosixOsMutexTry(lsm_mutex *p){
+  int ret;
+  PthreadMutex *pMutex = (PthreadMutex *)p;
+  ret = pthread_mutex_trylock(&pMutex->mutex);
+#ifdef LSM_DEBUG
+  if( ret==0 ){
+    assert( !pthread_equal(pMutex->owner, pthread_self()) );
+    pMutex->owner = pthread_self();
+    assert( pthread_equal(pMutex->owner, pthread_self()) );
+  }
+#endif
+  return ret ? LSM_BUSY : LSM_OK;
+}
+
+static void lsmPosixOsMutexLeave(lsm_mutex *p){
+  PthreadMutex *pMutex = (PthreadMutex *)p;
+#ifdef LSM_DEBUG
+  assert( pthread_equal(pMutex->owner, pthread_self()) );
+  pMutex->owner = 0;
+  assert( !pthread_equal(pMutex->owner, pthread_self()) );
+#endif
+  pthread_mutex_unlock(&pMutex->mutex);
+}
+
+#ifdef LSM_DEBUG
+static int lsmPosixOsMutexHeld(lsm_mutex *p){
+  PthreadMutex *pMutex = (PthreadMutex *)p;
+  return pMutex ? pthread_equal(pMutex->owner, pthread_self()) : 1;
+}
+static int lsmPosixOsMutexNotHeld(lsm_mutex *p){
+  PthreadMutex *pMutex = (PthreadMutex *)p;
+  return pMutex ? !pthread_equal(pMutex->owner, pthread_self()) : 1;
+}
+#endif
+
+/****************************************************************************
+** Thread methods for pthreads based systems.
+*/
+typedef struct PthreadThread PthreadThread;
+struct PthreadThread {
+  lsm_env *pEnv;
+  pthread_t thread;
+  void (*xMain)(void *);
+  void *pArg;
+};
+
+static void *lsmPosixOsThreadMain(void *p){
+  PthreadThread *pThread = (PthreadThread *)p;
+  pThread->xMain(pThread->pArg);
+  return 0;
+}
+
+static int lsmPosixOsThreadNew(
+  lsm_env *pEnv,
+  void (*xMain)(void *),
+  void *pArg,
+  lsm_thread **ppThread
+){
+  PthreadThread *pThread;         /* New thread object */
+
+  *ppThread = 0;
+  pThread = (PthreadThread *)lsmMallocZero(pEnv, sizeof(PthreadThread));
+  if( !pThread ) return LSM_NOMEM_BKPT;
+
+  pThread->pEnv = pEnv;
+  pThread->xMain = xMain;
+  pThread->pArg = pArg;
+  if( pthread_create(&pThread->thread, 0, lsmPosixOsThreadMain, pThread) ){
+    lsmFree(pEnv, pThread);
+    return LSM_ERROR;
+  }
+
+  *ppThread = (lsm_thread *)pThread;
+  return LSM_OK;
+}
+
+static void lsmPosixOsThreadJoin(lsm_thread *p){
+  PthreadThread *pThread = (PthreadThread *)p;
+  pthread_join(pThread->thread, 0);
+  lsmFree(pThread->pEnv, pThread);
+}
+
+/****************************************************************************
+** Condition variable methods for pthreads based systems. xCondWait() is
+** always passed a mutex allocated by lsmPosixOsMutexNew().
+*/
+typedef struct PthreadCond PthreadCond;
+struct PthreadCond {
+  lsm_env *pEnv;
+  pthread_cond_t cond;
+};
+
+static int lsmPosixOsCondNew(lsm_env *pEnv, lsm_cond **ppNew){
+  PthreadCond *pCond;             /* New condition variable */
+
+  pCond = (PthreadCond *)lsmMallocZero(pEnv, sizeof(PthreadCond));
+  if( !pCond ) return LSM_NOMEM_BKPT;
+
+  pCond->pEnv = pEnv;
+  pthread_cond_init(&pCond->cond, 0);
+
+  *ppNew = (lsm_cond *)pCond;
+  return LSM_OK;
+}
+
+static void lsmPosixOsCondDel(lsm_cond *p){
+  PthreadCond *pCond = (PthreadCond *)p;
+  pthread_cond_destroy(&pCond->cond);
+  lsmFree(pCond->pEnv, pCond);
+}
+
+static void lsmPosixOsCondWait(lsm_cond *p, lsm_mutex *pM){
+  PthreadCond *pCond = (PthreadCond *)p;
+  PthreadMutex *pMutex = (PthreadMutex *)pM;
+#ifdef LSM_DEBUG
+  assert( pthread_equal(pMutex->owner, pthread_self()) );
+  pMutex->owner = 0;
+#endif
+  pthread_cond_wait(&pCond->cond, &pMutex->mutex);
+#ifdef LSM_DEBUG
+  assert( !pthread_equal(pMutex->owner, pthread_self()) );
+  pMutex->owner = pthread_self();
+#endif
+}
+
+static void lsmPosixOsCondBroadcast(lsm_cond *p){
+  PthreadCond *pCond = (PthreadCond *)p;
+  pthread_cond_broadcast(&pCond->cond);
+}
+
+lsm_env *lsm_default_env(void){
+  static lsm_env posix_env = {
+    sizeof(lsm_env),         /* nByte */
+    4,                       /* iVersion */
+    /***** file i/o ******************/
+    0,                       /* pVfsCtx */
+    lsmPosixOsFullpath,      /* xFullpath */
+    lsmPosixOsOpen,          /* xOpen */
+    lsmPosixOsRead,          /* xRead */
+    lsmPosixOsWrite,         /* xWrite */
+    lsmPosixOsTruncate,      /* xTruncate */
+    lsmPosixOsSync,          /* xSync */
+    lsmPosixOsSectorSize,    /* xSectorSize */
+    lsmPosixOsRemap,         /* xRemap */
+    lsmPosixOsFileid,        /* xFileid */
+    lsmPosixOsClose,         /* xClose */
+    lsmPosixOsUnlink,        /* xUnlink */
+    lsmPosixOsLock,          /* xLock */
+    lsmPosixOsTestLock,      /* xTestLock */
+    lsmPosixOsShmMap,        /* xShmMap */
+    lsmPosixOsShmBarrier,    /* xShmBarrier */
+    lsmPosixOsShmUnmap,      /* xShmUnmap */
+    /***** memory allocation *********/
+    0,                       /* pMemCtx */
+    lsmPosixOsMalloc,        /* xMalloc */
+    lsmPosixOsRealloc,       /* xRealloc */
+    lsmPosixOsFree,          /* xFree */
+    lsmPosixOsMSize,         /* xSize */
+    /***** mutexes *********************/
+    0,                       /* pMutexCtx */
+    lsmPosixOsMutexStatic,   /* xMutexStatic */
+    lsmPosixOsMutexNew,      /* xMutexNew */
+    lsmPosixOsMutexDel,      /* xMutexDel */
+    lsmPosixOsMutexEnter,    /* xMutexEnter */
+    lsmPosixOsMutexTry,      /* xMutexTry */
+    lsmPosixOsMutexLeave,    /* xMutexLeave */
+#ifdef LSM_DEBUG
+    lsmPosixOsMutexHeld,     /* xMutexHeld */
+    lsmPosixOsMutexNotHeld,  /* xMutexNotHeld */
+#else
+    0,                       /* xMutexHeld */
+    0,                       /* xMutexNotHeld */
+#endif
+    /***** other *********************/
+    lsmPosixOsSleep,         /* xSleep */
+    /***** threads *******************/
+    lsmPosixOsThreadNew,     /* xThreadNew */
+    lsmPosixOsThreadJoin,    /* xThreadJoin */
+    /***** file i/o ******************/
+    lsmPosixOsPunch,         /* xPunch */
+    /***** condition variables *******/
+    lsmPosixOsCondNew,       /* xCondNew */
+    lsmPosixOsCondDel,       /* xCondDel */
+    lsmPosixOsCondWait,      /* xCondWait */
+    lsmPosixOsCondBroadcast, /* xCondBroadcast */
+  };
+  return &posix_env;
+}
+
+#endif /* ifndef _WIN32 */
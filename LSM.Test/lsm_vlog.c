@@ -0,0 +1,384 @@
+/*
+** 2026-10-16
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+**
+** The value log.
+**
+** If LSM_CONFIG_VALUE_LOG is set to a non-zero value, values of at least
+** that many bytes are not stored in the in-memory tree, the log file or
+** the sorted runs of the database file. Instead, each is appended to the
+** value log file (the database file name with "-vlog" appended), and the
+** entry stored in the database has the LSM_VALUEPTR flag set and a pointer
+** to the value in place of the value itself. A pointer is encoded as:
+**
+**   * The byte offset of the value within the value log, as a varint,
+**   * The size of the value in bytes, as a varint.
+**
+** Since pointers are only a few bytes in size, flushing the in-memory tree
+** and merging segments copies a pointer instead of each large value. Values
+** are only read from the value log when requested using lsm_csr_value().
+**
+** The value log is append-only. The offset at which the next value is
+** written is stored in the tree-header (TreeHeader.iVlogOff), which is
+** published when a write transaction is committed. Space used by values
+** written by a transaction that is rolled back is reused by the next
+** writer. When an in-memory tree is flushed to disk, the offset is copied
+** into the worker snapshot so that it is stored in the checkpoint. Log
+** recovery sets the offset to the larger of the value stored in the
+** checkpoint and the end of the last value pointed to by a recovered
+** log record.
+**
+** The value log is synced before each log commit record that is synced to
+** disk (safety=FULL) and before each checkpoint is synced to the database
+** file (safety=NORMAL or FULL). So that an entry that survives a crash
+** never points to a value that did not.
+**
+** Merges (including in-memory tree flushes) count the total size of the 
+** values that they discard because the key has been overwritten or 
+** deleted. The total is stored in the checkpoint (Snapshot.nVlogDead) and
+** reported by lsm_info(LSM_INFO_VALUE_LOG). It is a lower bound - values
+** overwritten within a single in-memory tree are not counted, for example.
+**
+** GARBAGE COLLECTION
+**
+** Space is reclaimed from the start of the value log. Everything before
+** offset Snapshot.iVlogFree has already been reclaimed. When the worker
+** finds that LSM_CONFIG_VALUE_LOG_GC percent of the rest of the value log
+** is dead, it starts a garbage collection pass by setting Snapshot.iVlogGc
+** to the size of the value log. Then:
+**
+**   1. Each writer that commits a transaction with auto-work enabled (and
+**      each call to lsm_work()) rewrites some of the live values stored
+**      before offset iVlogGc, by scanning the database and inserting each
+**      key that points there again with the same value. The new values are
+**      appended to the value log as usual (or, if the connection does not
+**      use a value log, stored in the database). Once the scan reaches the
+**      end of the database, TreeHeader.iVlogGc is set.
+**
+**   2. When the in-memory tree that TreeHeader.iVlogGc was set in is 
+**      flushed, no key in the flushed snapshot points to a value before
+**      iVlogGc. So the id of the snapshot is stored in Snapshot.iVlogGcId
+**      (see ckptExportSnapshot()).
+**
+**   3. Once that snapshot has been checkpointed, and no reader is using an
+**      older snapshot, no reader or recovery can read a value before 
+**      iVlogGc. The worker releases the space using the xPunch() method 
+**      of the lsm_env, sets iVlogFree to iVlogGc and ends the pass (see
+**      lsmVlogWork()).
+**
+** Older versions of a key that merges have not yet discarded may still 
+** point to values that have been reclaimed. This is harmless, as they are
+** never read. Merges do not count values that are (or are being) 
+** reclaimed as dead. Instead, the value that nVlogDead had when the pass
+** started is subtracted from it when it ends.
+**
+** A value may also be streamed into the value log in chunks using a blob
+** writer (see lsm_blob_open() in lsm_main.c). Such values are written to
+** the value log regardless of the LSM_CONFIG_VALUE_LOG setting. Since a
+** value must be stored contiguously, other writes that would append to 
+** the value log fail with LSM_MISUSE while a blob writer is open.
+**
+** Varints are as described in lsm_varint.c (SQLite 4 format).
+*/
+#include "lsmInt.h"
+
+/*
+** Append nData bytes from buffer pData to the value log as part of the
+** write transaction open on connection pDb. Return LSM_OK if successful,
+** or an LSM error code otherwise.
+*/
+int lsmVlogAppend(lsm_db *pDb, const void *pData, int nData){
+  i64 iOff = pDb->treehdr.iVlogOff;
+  int rc;
+
+  assert( pDb->nTransOpen>0 && nData>=0 );
+  rc = lsmFsWriteVlog(pDb->pFS, iOff, pData, nData);
+  if( rc==LSM_OK ){
+    pDb->treehdr.iVlogOff = iOff + nData;
+  }
+  return rc;
+}
+
+/*
+** Write the encoded pointer to the nVal byte value at offset iOff of the
+** value log into buffer aPtr[], which must be at least LSM_VLOG_MAXPTR
+** bytes in size. Return the number of bytes written.
+*/
+int lsmVlogPtrEncode(u8 *aPtr, i64 iOff, int nVal){
+  int n = lsmVarintPut64(aPtr, iOff);
+  n += lsmVarintPut32(&aPtr[n], nVal);
+  assert( n<=LSM_VLOG_MAXPTR );
+  return n;
+}
+
+/*
+** Append value pVal/nVal to the value log as part of the write transaction
+** open on connection pDb. If successful, write the encoded pointer to the
+** value into buffer aPtr[] (which must be at least LSM_VLOG_MAXPTR bytes
+** in size), set *pnPtr to its size in bytes and return LSM_OK. Otherwise,
+** return an LSM error code.
+**
+** LSM_MISUSE is returned if a blob writer is open on pDb, as values 
+** appended to the value log would be interleaved with the blob.
+*/
+int lsmVlogWrite(
+  lsm_db *pDb,                    /* Database handle */
+  const void *pVal, int nVal,     /* Value to append to the value log */
+  u8 *aPtr,                       /* OUT: Encoded pointer to value */
+  int *pnPtr                      /* OUT: Size of aPtr[] in bytes */
+){
+  i64 iOff = pDb->treehdr.iVlogOff;
+  int rc;
+
+  if( pDb->pBlob ) return LSM_MISUSE_BKPT;
+  rc = lsmVlogAppend(pDb, pVal, nVal);
+  if( rc==LSM_OK ){
+    *pnPtr = lsmVlogPtrEncode(aPtr, iOff, nVal);
+  }
+  return rc;
+}
+
+/*
+** Decode the value log pointer in buffer aPtr[] (size nPtr bytes). If
+** successful, set *piOff and *pnVal to the offset and size of the value
+** it points to and return LSM_OK. Or, if the buffer does not contain a
+** well-formed pointer, return LSM_CORRUPT.
+*/
+int lsmVlogPtrDecode(const u8 *aPtr, int nPtr, i64 *piOff, int *pnVal){
+  u8 aBuf[LSM_VLOG_MAXPTR];
+  int n;
+
+  if( nPtr<2 || nPtr>LSM_VLOG_MAXPTR ) return LSM_CORRUPT_BKPT;
+  memset(aBuf, 0, sizeof(aBuf));
+  memcpy(aBuf, aPtr, nPtr);
+  n = lsmVarintGet64(aBuf, piOff);
+  n += lsmVarintGet32(&aBuf[n], pnVal);
+  if( n!=nPtr || *piOff<0 || *pnVal<0 ) return LSM_CORRUPT_BKPT;
+  return LSM_OK;
+}
+
+/*
+** Sync the value log to disk before a log commit record or checkpoint
+** that may refer to the first iVlogOff bytes of it is synced. If iVlogOff
+** is zero, the database does not use a value log and this is a no-op.
+*/
+int lsmVlogSync(lsm_db *pDb, i64 iVlogOff){
+  if( iVlogOff==0 ) return LSM_OK;
+  return lsmFsSyncVlog(pDb->pFS);
+}
+
+/*
+** Set *pnSize to the number of bytes of the value log that are in use and
+** *pnDead to the number of those bytes known to belong to values that 
+** have been discarded by merges. See lsm_info(LSM_INFO_VALUE_LOG).
+**
+** Like infoTreeSize() in lsm_main.c, this reads shared memory without
+** verifying checksums. So the values returned may be slightly stale.
+*/
+int lsmInfoValueLog(lsm_db *pDb, i64 *pnSize, i64 *pnDead){
+  ShmHeader *pShm = pDb->pShmhdr;
+  i64 iCkpt = lsmCheckpointVlogOffset(pShm->aSnap1);
+  *pnSize = LSM_MAX(pShm->hdr1.iVlogOff, iCkpt);
+  *pnSize -= lsmCheckpointVlogFree(pShm->aSnap1);
+  *pnDead = lsmCheckpointVlogDead(pShm->aSnap1);
+  return LSM_OK;
+}
+
+/*
+** This is called by the worker (with the worker snapshot held) each time
+** it does some work. If a garbage collection pass has rewritten all live
+** values from the region being reclaimed and the region is no longer in
+** use, release it. Or, if there is no pass underway and enough of the
+** value log is dead, start one. If the worker snapshot is modified, set
+** *pbDirty to true.
+*/
+int lsmVlogWork(lsm_db *pDb, int *pbDirty){
+  Snapshot *p = pDb->pWorker;
+  int rc = LSM_OK;
+
+  if( p->iVlogGcId ){
+    i64 iInUse = 0;
+    int bRotrans = 0;
+    rc = lsmSnapshotInUse(pDb, &iInUse);
+    if( rc==LSM_OK ) rc = lsmDetectRoTrans(pDb, &bRotrans);
+    if( rc==LSM_OK && bRotrans==0 && iInUse>=p->iVlogGcId ){
+      rc = lsmFsPunchVlog(pDb->pFS, p->iVlogFree, p->iVlogGc - p->iVlogFree);
+      if( rc==LSM_OK ){
+        p->iVlogFree = p->iVlogGc;
+        p->nVlogDead = LSM_MAX(0, p->nVlogDead - p->nVlogGcDead);
+        p->iVlogGc = 0;
+        p->nVlogGcDead = 0;
+        p->iVlogGcId = 0;
+        *pbDirty = 1;
+      }
+    }
+  }else if( p->iVlogGc==0 && pDb->nVlogGc>0 && p->nVlogDead>0 ){
+    i64 nUsed = p->iVlogOff - p->iVlogFree;
+    if( p->nVlogDead*100 >= nUsed*pDb->nVlogGc ){
+      p->iVlogGc = p->iVlogOff;
+      p->nVlogGcDead = p->nVlogDead;
+      *pbDirty = 1;
+    }
+  }
+
+  return rc;
+}
+
+/*
+** Set the contents of string pStr to the n bytes of binary data at p. 
+** Return LSM_OK if successful, or LSM_NOMEM if an OOM error occurs.
+*/
+static int vlogStringSet(LsmString *pStr, const void *p, int n){
+  int rc;
+  if( pStr->n<0 ) lsmStringClear(pStr);
+  pStr->n = 0;
+  rc = lsmStringExtend(pStr, n+1);
+  if( rc==LSM_OK ){
+    if( n>0 ) memcpy(pStr->z, p, n);
+    pStr->n = n;
+  }
+  return rc;
+}
+
+/*
+** Scan the database from key pDb->vlogGcKey, inserting each key that 
+** points to a value before offset iGc of the value log again, until either
+** the end of the database is reached, or the keys visited and values
+** rewritten total nByte bytes. A write transaction must be open.
+**
+** If the end of the database is reached, set TreeHeader.iVlogGc to iGc.
+** Otherwise, set pDb->vlogGcKey to the key to continue from. Set *pbWrite
+** to true if the in-memory tree is modified.
+*/
+static int vlogRelocateKeys(lsm_db *pDb, i64 iGc, int nByte, int *pbWrite){
+  LsmString *pKey = &pDb->vlogGcKey;
+  LsmString val;
+  lsm_cursor *pCsr = 0;
+  int nDone = 0;
+  int rc = LSM_OK;
+
+  assert( pDb->nTransOpen>0 );
+  if( pDb->iVlogGcPass!=iGc ){
+    lsmStringClear(pKey);
+    pDb->iVlogGcPass = iGc;
+  }
+  lsmStringInit(&val, pDb->pEnv);
+
+  /* The smallest key is zero bytes in size. So seeking to the empty 
+  ** string at the start of a pass is the same as lsm_csr_first().  */
+  if( pKey->n<0 ) lsmStringClear(pKey);
+  if( pKey->z==0 ) rc = lsmStringExtend(pKey, 1);
+  if( rc==LSM_OK ) rc = lsm_csr_open(pDb, &pCsr);
+  if( rc==LSM_OK ){
+    rc = lsm_csr_seek(pCsr, pKey->z, pKey->n, LSM_SEEK_GE);
+  }
+
+  while( rc==LSM_OK && lsm_csr_valid(pCsr) && nDone<nByte ){
+    const void *pK; int nK;
+    const void *pV; int nV;
+    i64 iOff;
+
+    /* Copy the key and value. Writing to the in-memory tree may move the
+    ** buffers that the cursor returns pointers to.  */
+    rc = lsmMCursorVlogPtr((MultiCursor *)pCsr, &iOff);
+    if( rc==LSM_OK && iOff>=0 && iOff<iGc ){
+      rc = lsm_csr_key(pCsr, &pK, &nK);
+      if( rc==LSM_OK ) rc = vlogStringSet(pKey, pK, nK);
+      if( rc==LSM_OK ) rc = lsm_csr_value(pCsr, &pV, &nV);
+      if( rc==LSM_OK ) rc = vlogStringSet(&val, pV, nV);
+      if( rc==LSM_OK ){
+        rc = lsm_insert(pDb, pKey->z, pKey->n, val.z, val.n);
+        nDone += val.n;
+        *pbWrite = 1;
+      }
+    }
+    if( rc==LSM_OK ){
+      rc = lsm_csr_key(pCsr, &pK, &nK);
+      nDone += nK;
+    }
+    if( rc==LSM_OK ) rc = lsm_csr_next(pCsr);
+  }
+
+  if( rc==LSM_OK ){
+    if( lsm_csr_valid(pCsr) ){
+      const void *pK; int nK;
+      rc = lsm_csr_key(pCsr, &pK, &nK);
+      if( rc==LSM_OK ) rc = vlogStringSet(pKey, pK, nK);
+    }else{
+      pKey->n = 0;
+      pDb->treehdr.iVlogGc = iGc;
+      *pbWrite = 1;
+    }
+  }
+
+  lsm_csr_close(pCsr);
+  lsmStringClear(&val);
+  return rc;
+}
+
+/*
+** If a garbage collection pass is underway (see above) and live values 
+** from the region of the value log being reclaimed have not all been
+** rewritten, rewrite some of them. Approximately nByte bytes of keys and
+** values are visited and rewritten before this function returns. 
+**
+** This is called after committing a write transaction, or by lsm_work(). 
+** It does nothing if the connection has a transaction or blob writer open.
+** It opens and commits a write transaction of its own. If another 
+** connection holds the WRITER lock, it does nothing and returns LSM_OK.
+*/
+int lsmVlogRelocate(lsm_db *pDb, int nByte){
+  int rc = LSM_OK;
+  i64 iGc;
+
+  if( pDb->bInVlogGc || pDb->nTransOpen>0 || pDb->pBlob 
+   || pDb->bReadonly || pDb->pShmhdr==0 || nByte<=0 
+  ){
+    return LSM_OK;
+  }
+
+  /* Check whether or not there are values to rewrite without locking
+  ** anything. As for lsmInfoValueLog(), shared memory may be stale.  */
+  iGc = lsmCheckpointVlogGc(pDb->pShmhdr->aSnap1);
+  if( iGc==0 
+   || pDb->pShmhdr->hdr1.iVlogGc==iGc 
+   || pDb->pShmhdr->hdr1.iOldVlogGc==iGc 
+  ){
+    return LSM_OK;
+  }
+
+  pDb->bInVlogGc = 1;
+  rc = lsm_begin(pDb, 1);
+  if( rc==LSM_OK ){
+    Snapshot *pClient = pDb->pClient;
+    int bWrite = 0;
+    iGc = pClient->iVlogGc;
+    if( iGc && pClient->iVlogGcId==0
+     && pDb->treehdr.iVlogGc!=iGc && pDb->treehdr.iOldVlogGc!=iGc
+    ){
+      rc = vlogRelocateKeys(pDb, iGc, nByte, &bWrite);
+    }
+    if( rc==LSM_OK && bWrite ){
+      rc = lsm_commit(pDb, 0);
+    }else{
+      lsm_rollback(pDb, 0);
+    }
+
+    /* If the values rewritten were not committed, pDb->vlogGcKey may be
+    ** past keys that still point to values before iGc. So start the scan
+    ** again next time.  */
+    if( rc!=LSM_OK ) pDb->iVlogGcPass = 0;
+  }
+  pDb->bInVlogGc = 0;
+
+  if( rc==LSM_BUSY ) rc = LSM_OK;
+  return rc;
+}
@@ -1,6 +1,7 @@
 /*
 ** Windows-specific run-time environment implementation for LSM.
 */
+#ifdef _WIN32
 
 #include <Windows.h>
 #include "lsmInt.h"
@@ -327,6 +328,34 @@ static int lsmWindowsOsTruncate(
   return windowsSetFileSizeTo(p->hFile, nSize);
 }
 
+/*
+** Release the storage used by nByte bytes of the file starting at offset
+** iOff, without changing the size of the file. The file is marked as a
+** sparse file first. If the file system does not support sparse files, 
+** this is a no-op.
+*/
+static int lsmWindowsOsPunch(
+  lsm_file *pFile,                /* File to punch a hole in */
+  lsm_i64 iOff,                   /* Offset of first byte to release */
+  lsm_i64 nByte                   /* Number of bytes to release */
+  ) {
+  WindowsFile *p = (WindowsFile *)pFile;
+  FILE_ZERO_DATA_INFORMATION zero;
+  DWORD nRet;
+
+  if (DeviceIoControl(
+    p->hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &nRet, NULL) == FALSE) {
+    return LSM_OK;
+  }
+  zero.FileOffset.QuadPart = iOff;
+  zero.BeyondFinalZero.QuadPart = iOff + nByte;
+  if (DeviceIoControl(p->hFile, FSCTL_SET_ZERO_DATA, 
+    &zero, sizeof(zero), NULL, 0, &nRet, NULL) == FALSE) {
+    return LSM_IOERR_BKPT;
+  }
+  return LSM_OK;
+}
+
 static int lsmWindowsOsRead(
   lsm_file *pFile,                /* File to read from */
   lsm_i64 iOff,                   /* Offset to read from */
@@ -943,6 +972,92 @@ static int lsmWindowsOsMutexNotHeld(lsm_mutex *p) {
   return m->nOwner != GetCurrentThreadId();
 }
 
+typedef struct WindowsThread WindowsThread;
+struct WindowsThread {
+  lsm_env *pEnv;
+  HANDLE hThread;
+  void (*xMain)(void *);
+  void *pArg;
+};
+
+static DWORD WINAPI lsmWindowsOsThreadMain(LPVOID p) {
+  WindowsThread *t = (WindowsThread *)p;
+  t->xMain(t->pArg);
+  return 0;
+}
+
+static int lsmWindowsOsThreadNew(
+  lsm_env *pEnv, 
+  void (*xMain)(void *), 
+  void *pArg, 
+  lsm_thread **ppThread
+) {
+  WindowsThread *t = lsm_malloc(pEnv, sizeof(WindowsThread));
+  *ppThread = NULL;
+  if (t == NULL) {
+    return LSM_NOMEM_BKPT;
+  }
+
+  memset(t, 0, sizeof(WindowsThread));
+  t->pEnv = pEnv;
+  t->xMain = xMain;
+  t->pArg = pArg;
+  t->hThread = CreateThread(NULL, 0, lsmWindowsOsThreadMain, t, 0, NULL);
+  if (t->hThread == NULL) {
+    lsm_free(pEnv, t);
+    return LSM_ERROR;
+  }
+
+  *ppThread = (lsm_thread *)t;
+  return LSM_OK;
+}
+
+static void lsmWindowsOsThreadJoin(lsm_thread *p) {
+  WindowsThread *t = (WindowsThread *)p;
+  WaitForSingleObject(t->hThread, INFINITE);
+  CloseHandle(t->hThread);
+  lsm_free(t->pEnv, t);
+}
+
+typedef struct WindowsCond WindowsCond;
+struct WindowsCond {
+  lsm_env *pEnv;
+  CONDITION_VARIABLE cond;
+};
+
+static int lsmWindowsOsCondNew(lsm_env *pEnv, lsm_cond **ppNew) {
+  WindowsCond *c = lsm_malloc(pEnv, sizeof(WindowsCond));
+  if (c == NULL) {
+    return LSM_NOMEM_BKPT;
+  }
+
+  memset(c, 0, sizeof(WindowsCond));
+  c->pEnv = pEnv;
+  InitializeConditionVariable(&c->cond);
+
+  *ppNew = (lsm_cond *)c;
+  return LSM_OK;
+}
+
+static void lsmWindowsOsCondDel(lsm_cond *p) {
+  WindowsCond *c = (WindowsCond *)p;
+  lsm_free(c->pEnv, c);
+}
+
+static void lsmWindowsOsCondWait(lsm_cond *p, lsm_mutex *pMutex) {
+  WindowsCond *c = (WindowsCond *)p;
+  WindowsThreadMutex *m = (WindowsThreadMutex *)pMutex;
+
+  m->nOwner = 0;
+  SleepConditionVariableCS(&c->cond, &m->criticalSection, INFINITE);
+  m->nOwner = GetCurrentThreadId();
+}
+
+static void lsmWindowsOsCondBroadcast(lsm_cond *p) {
+  WindowsCond *c = (WindowsCond *)p;
+  WakeAllConditionVariable(&c->cond);
+}
+
 lsm_env *lsm_default_env(void) {
   if (csGlobal.pEnv == NULL) {
     csGlobal.pEnv = INVALID_LSM_ENV;
@@ -956,7 +1071,7 @@ lsm_env *lsm_default_env(void) {
 
   static lsm_env windows_env = {
     sizeof(lsm_env),         /* nByte */
-    1,                       /* iVersion */
+    4,                       /* iVersion */
     /***** file i/o ******************/
     0,                       /* pVfsCtx */
     lsmWindowsOsFullpath,      /* xFullpath */
@@ -993,8 +1108,20 @@ lsm_env *lsm_default_env(void) {
     lsmWindowsOsMutexNotHeld,  /* xMutexNotHeld */
     /***** other *********************/
     lsmWindowsOsSleep,         /* xSleep */
+    /***** threads *******************/
+    lsmWindowsOsThreadNew,     /* xThreadNew */
+    lsmWindowsOsThreadJoin,    /* xThreadJoin */
+    /***** file i/o ******************/
+    lsmWindowsOsPunch,         /* xPunch */
+    /***** condition variables *******/
+    lsmWindowsOsCondNew,       /* xCondNew */
+    lsmWindowsOsCondDel,       /* xCondDel */
+    lsmWindowsOsCondWait,      /* xCondWait */
+    lsmWindowsOsCondBroadcast, /* xCondBroadcast */
   };
   return &windows_env;
 }
 
 #undef INVALID_LSM_ENV
+
+#endif /* ifdef _WIN32 */